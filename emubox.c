@@ -25,19 +25,43 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <dirent.h>
+#include <ftw.h>
 #include <getopt.h>
+#include <limits.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #ifndef PATH_86BOX
 /* Define the path where 86box lives. */
@@ -45,6 +69,80 @@
 // #  error PATH_86BOX variable must be set.
 #endif
 
+/* Name of the config index, inside the emubox directory. Every name
+   starting with a "." is private to emubox and never listed. */
+#define EMU_INDEX_NAME     ".index"
+/* What emubox keeps for itself, the files that change along the
+   way. They're in a directory of their own, writing them in the
+   config directory would change it's mtime, and the index with it. */
+#define EMU_STATE_DIR      ".state"
+/* Every launch, as a "<time> <name>" line. */
+#define EMU_HISTORY_NAME   "history"
+/* The launches folded out of the history, as "<time> <count> <name>"
+   lines, a single one per config. */
+#define EMU_FRECENCY_NAME  "frecency"
+/* More directories to look for VMs in, one per line. */
+#define EMU_ROOTS_NAME     ".roots"
+/* "EMBX", bump the version whenever the layout changes. */
+#define EMU_INDEX_MAGIC    0x58424d45U
+#define EMU_INDEX_VERSION  3U
+
+/* Config of a VM in a directory of it's own, like 86box lays it out
+   (with it's nvr/ and disks next to it). Below the config directory
+   and the roots, every directory with one is a VM, and every other
+   directory is walked for them, up to EMU_WALK_DEPTH levels down. */
+#define EMU_VM_CONFIG      "86box.cfg"
+#define EMU_WALK_DEPTH     8
+
+/* Workers of the walk, it's mostly waiting on the file system (which
+   can be far away), and the entries a worker collects before it hands
+   them over. */
+#define EMU_WALK_THREADS   16
+#define EMU_WALK_BATCH     256
+
+/* Size of the history that gets it folded, what a single launch
+   counts for, and the total count beyond which every count is aged. */
+#define EMU_HISTORY_COMPACT  4096
+#define EMU_FRECENCY_LAUNCH  100
+#define EMU_FRECENCY_AGE     ((uint64_t)EMU_FRECENCY_LAUNCH * 1000)
+
+/* Extractions of the AppImage, inside the emubox directory. */
+#define EMU_APPIMAGE_CACHE  ".cache"
+
+/* Launch properties of the configs, inside the emubox directory.
+   Every config can have one of the same name, with an [emubox]
+   section, which 86box never gets to rewrite. */
+#define EMU_PROPS_DIR  ".props"
+
+/* What "prewarm = boot" reads ahead of every disk image, enough for
+   the partition table, the boot sector and the start of the first
+   file system. */
+#define EMU_PREWARM_BOOT  ((uint64_t)8 << 20)
+
+/* A read ahead is cut down to the readahead window of the device by
+   the kernel (read_ahead_kb, often 128K), so it's asked for a piece of
+   that size at a time. */
+#define EMU_PREWARM_CHUNK  ((uint64_t)128 << 10)
+
+/* ioprio_set(2), which glibc doesn't wrap. */
+#ifndef IOPRIO_WHO_PROCESS
+#  define IOPRIO_WHO_PROCESS  1
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#  define IOPRIO_CLASS_SHIFT  13
+#endif
+#define EMU_IOPRIO(class, level)  (((class) << IOPRIO_CLASS_SHIFT) | (level))
+
+/* Leaf cgroup of emubox itself, next to the cgroups of the VMs (which
+   are "vm-<config>"), inside the cgroup it has been started in. */
+#define EMU_CGROUP_SELF  "emubox"
+
+/* Socket of emuboxd and the lock held by it, inside EMU_STATE_DIR,
+   and the largest request it reads. */
+#define EMU_DAEMON_SOCK     "emuboxd.sock"
+#define EMU_DAEMON_LOCK     "emuboxd.lock"
+#define EMU_DAEMON_REQ_MAX  ((size_t)1 << 16)
+
 /* Constants. */
 enum {
 	OPT_INIT        = 1,
@@ -56,6 +154,23 @@ enum {
 	OPT_FULLSCREEN  = 7,
 	OPT_LANGUAGE    = 8,
 	OPT_HELP        = 9,
+	OPT_RECLAIM     = 10,
+	OPT_VERBOSE     = 11,
+	OPT_EXTRACT     = 12,
+	OPT_STATS       = 13,
+	OPT_SORT        = 14,
+	OPT_CGROUP      = 15,
+	OPT_CLONE       = 16,
+	OPT_TEMPLATE    = 17,
+	OPT_LIST        = 18,
+	OPT_FORMAT      = 19,
+	OPT_FIELDS      = 20,
+	OPT_DAEMON      = 21,
+	OPT_VMS         = 22,
+	OPT_CHECK       = 23,
+	OPT_MONITOR     = 24,
+	OPT_EMULATORS   = 25,
+	OPT_LAUNCH      = 26,
 };
 
 /* Structure for emubox options. */
@@ -66,6 +181,10 @@ struct emubox_opts {
 	int new_opt;
 	/* Arg: --delete */
 	int delete_opt;
+	/* Arg: --clone */
+	int clone_opt;
+	/* Arg: --template=preset|file */
+	const char *template_opt;
 	/* Arg: --purge */
 	int purge_opt;
 	/* Arg: --select */
@@ -74,6 +193,38 @@ struct emubox_opts {
 	int settings_opt;
 	/* Arg: --fullscreen */
 	int fullscreen_opt;
+	/* Arg: --reclaim */
+	int reclaim_opt;
+	/* Arg: --verbose */
+	int verbose_opt;
+	/* Arg: --extract */
+	int extract_opt;
+	/* Arg: --stats[=json] */
+	int stats_opt;
+	/* Arg: --sort=name|mtime|launched|frecency, -1 if it's not given */
+	int sort_opt;
+	/* Arg: --list */
+	int list_opt;
+	/* Arg: --format=tsv|json */
+	int format_opt;
+	/* Arg: --fields=name,machine,cpu,mem,mtime,size */
+	const char *fields_opt;
+	/* Arg: --cgroup[=seconds] */
+	int cgroup_opt;
+	int cgroup_period;
+	/* Arg: --daemon */
+	int daemon_opt;
+	/* Arg: --vms */
+	int vms_opt;
+	/* Arg: --check [NAME...] */
+	int check_opt;
+	/* Arg: --monitor[=seconds] */
+	int monitor_opt;
+	int monitor_period;
+	/* Arg: --emulators */
+	int emulators_opt;
+	/* Arg: --launch NAME */
+	const char *launch_opt;
 };
 
 /* Structure for emu_content_len(...) */
@@ -86,48 +237,1366 @@ struct content_len_info {
 
 	/* Length of the largest row. */
 	size_t row_sz;
+
+	/* Number of digits of the largest index. */
+	size_t num_sz;
+};
+
+/* A single config entry. The name is kept as an offset into the
+   scanner's arena, so the arena is free to grow while scanning. */
+struct emu_entry {
+	/* Offset of the name inside the arena. */
+	size_t name_off;
+
+	/* Length of the name, without the NUL terminator. */
+	size_t name_len;
+
+	/* Last modification time of the config file. */
+	struct timespec mtime;
+};
+
+/* Structure for emu_scan_directory(...) */
+struct emu_scan {
+	/* All names, each one NUL terminated, back to back. */
+	char *arena;
+	size_t arena_sz;
+	size_t arena_cap;
+
+	/* Compact table of entries, one per config file. */
+	struct emu_entry *ents;
+	size_t nents;
+	size_t ents_cap;
+
+	/* Length of the largest name. */
+	size_t row_sz;
+
+	/* Length of all names combined. */
+	size_t name_sz;
+
+	/* Directories that have been walked for VMs (and the roots file),
+	   with their mtime. The names are in the arena as well. */
+	struct emu_entry *dirs;
+	size_t ndirs;
+	size_t dirs_cap;
+
+	/* Whether the entries come from the index. Their mtimes are the
+	   ones it was written with then, a config rewritten in place
+	   (86Box does that) doesn't change the directory. */
+	int indexed;
+
+	/* mtime of the config directory right before it was read, 0 if
+	   it hasn't been. What the index is stamped with. */
+	struct timespec stamp;
+};
+
+/* A directory to walk, relative to the config directory (or absolute,
+   for a root), and how deep it is. */
+struct emu_walk_job {
+	char *path;
+	int depth;
+};
+
+/* Queue of directories of a worker of the walk. It takes from the
+   back of it's own and, once that's empty, steals from the front of
+   the others, so every worker stays busy until the tree is done. */
+struct emu_walk_queue {
+	pthread_mutex_t lock;
+	struct emu_walk_job *jobs;
+	size_t head;
+	size_t tail;
+	size_t cap;
+};
+
+/* State of emu_scan_walk(...) Whatever the workers find is handed to
+   flush, a single call at a time. */
+struct emu_walk {
+	int dirfd;
+	struct emu_walk_queue queues[EMU_WALK_THREADS];
+	size_t nqueues;
+
+	/* Directories queued or being walked, the walk is done at 0. */
+	size_t pending;
+
+	pthread_mutex_t lock;
+	int (*flush)(void *arg, struct emu_scan *found);
+	void *arg;
+	int stop;
+};
+
+/* A worker of the walk. */
+struct emu_walk_worker {
+	struct emu_walk *walk;
+	size_t id;
+};
+
+/* Longest possible sort key of a name (a walked one is a path), and
+   the size of buckets that are sorted without looking at the keys
+   byte by byte. */
+#define EMU_KEY_MAX    (PATH_MAX * 3 + 2)
+#define EMU_RADIX_MIN  24
+
+/* Sort key of an entry, for emu_scan_sort(...) */
+struct emu_sort_ent {
+	const unsigned char *key;
+	uint32_t len;
+	uint32_t idx;
+};
+
+/* Sort key of an entry, in another order than the natural one. */
+struct emu_rank_ent {
+	uint64_t key;
+	size_t idx;
+};
+
+/* Launches of every config that has been launched, as read from
+   EMU_STATE_DIR. The names are sorted, last and count go along. */
+struct emu_history {
+	struct emu_scan names;
+	uint64_t *last;
+	uint64_t *count;
+	size_t cap;
+
+	/* When it was read, the frecency is counted from there. */
+	uint64_t now;
+};
+
+/* Orders of the menu. */
+enum {
+	EMU_SORT_NAME      = 0,
+	EMU_SORT_MTIME     = 1,
+	EMU_SORT_LAUNCHED  = 2,
+	EMU_SORT_FRECENCY  = 3,
+	EMU_SORT_MODES     = 4,
+};
+
+/* Number of entries shown on a single page of the menu. */
+#define EMU_MENU_PAGE  10
+
+/* Number of buckets of the trigram index, must be a power of two. */
+#define EMU_TRI_BUCKETS  65536U
+
+/* Maximum length of the type-ahead filter. */
+#define EMU_QUERY_MAX    128
+
+/* Search index over the entry table, built once when the user starts
+   typing in the menu. Queries shorter than a trigram only match the
+   beginning of names, through a binary search over the entries sorted
+   by their lowercase name. Longer queries also match anywhere else in
+   a name, through the posting list of the rarest trigram of the query. */
+struct emu_search {
+	/* Lowercase copy of the arena, same offsets as the names. */
+	char *folded;
+
+	/* Entries, sorted by their lowercase name. */
+	uint32_t *byname;
+
+	/* Posting lists, per trigram bucket. Entries of the bucket h
+	   are tri_ents[tri_start[h]] to tri_ents[tri_start[h + 1]],
+	   in the order of the entry table. */
+	uint32_t *tri_start;
+	uint32_t *tri_ents;
+};
+
+/* Context of emu_search_compare(...) */
+struct emu_search_ctx {
+	const struct emu_search *search;
+	const struct emu_scan *scan;
+};
+
+/* A directory below the config directory that's watched. */
+struct emu_watch_dir {
+	int wd;
+	char *name;
+};
+
+/* inotify watch of the config directory, and of the directories
+   below it (and the roots) the walk has been through or that are made
+   while it's watched, for the VMs that are put in them. They're in
+   the order of their wd, the kernel hands them out in order. fd is -1
+   without a watch. */
+struct emu_watch {
+	int fd;
+	int wd;
+	uint32_t mask;
+	char *path;
+
+	struct emu_watch_dir *dirs;
+	size_t ndirs;
+	size_t dirs_cap;
+};
+
+/* What an event of a watch is about, for the entry table. */
+enum {
+	EMU_WATCH_NONE   = 0,
+	EMU_WATCH_ENTRY  = 1,
+	EMU_WATCH_DIR    = 2,
+	EMU_WATCH_RESCAN = 3,
+};
+
+/* State of the selection menu. Only the rows of the current page
+   are ever drawn, so the cost of a frame doesn't depend on the
+   amount of entries. */
+struct emu_menu {
+	WINDOW *win;
+	struct emu_scan *scan;
+
+	/* Entries matching the filter. Without a filter, every entry
+	   is shown in order and the view isn't used, unless the menu is
+	   in another order than by name. */
+	size_t *view;
+	size_t nview;
+	size_t view_cap;
+
+	/* Order of the menu, and the position of every entry in it.
+	   NULL when it's ordered by name. */
+	int sort;
+	size_t *rank;
+
+	/* Every entry in that order with it's key, and the name of every
+	   entry, as they were when it was last ranked. Names beyond
+	   ranked_sz in the arena have been added since. */
+	struct emu_rank_ent *order;
+	size_t *ranked;
+	size_t nranked;
+	size_t ranked_sz;
+
+	/* Launches, read on the first order that needs them. */
+	struct emu_history history;
+	int history_read;
+
+	/* Config directory, and the watch of it, to follow the changes
+	   made while the menu is open. */
+	int dirfd;
+	struct emu_watch watch;
+
+	/* Search index, NULL until the first query. */
+	struct emu_search *search;
+
+	/* Scan that's still running, or NULL. */
+	struct emu_stream *stream;
+
+	/* Preview pane, and it's window. NULL if the terminal is too
+	   narrow or the workers couldn't be started. */
+	struct emu_preview *preview;
+	WINDOW *pane;
+	int pane_cols;
+
+	/* Last direction of the scroll, -1 or 1, and whether the user
+	   has moved the selection at all. */
+	int dir;
+	int moved;
+
+	/* Type-ahead filter, as typed by the user. */
+	char query[EMU_QUERY_MAX];
+	size_t qlen;
+
+	/* Names of the marked entries, sorted. They are kept by name,
+	   so they survive the filter and the changes of the directory. */
+	struct emu_scan marks;
+
+	/* Size of the window. */
+	int rows;
+	int cols;
+
+	/* Width of the index column, in digits. */
+	int num_w;
+
+	/* First entry of the current page, in the view. */
+	size_t xs;
+
+	/* Currently selected entry, in the view. */
+	size_t run_idx;
+
+	/* Timings, NULL without --stats. */
+	struct emu_stats *stats;
+};
+
+/* A single "key = value" line of a config. Everything is an offset
+   into the mapped file, nothing is copied out of it. */
+struct emu_conf_key {
+	uint32_t sec_off;
+	uint32_t sec_len;
+	uint32_t key_off;
+	uint32_t key_len;
+	uint32_t val_off;
+	uint32_t val_len;
+	uint32_t hash;
+};
+
+/* Structure for emu_read_conf(...) */
+struct emu_conf {
+	/* The whole config file, mapped read-only. */
+	const char *map;
+	size_t len;
+
+	/* Every key, in the order of the file. */
+	struct emu_conf_key *keys;
+	size_t nkeys;
+
+	/* Open addressing hash table of section and key pairs. Each slot
+	   holds an index into keys plus one, 0 is an empty slot. */
+	uint32_t *slots;
+	size_t nslots;
+};
+
+/* Kind of a disk image of a config, from the key of it's path. */
+enum {
+	EMU_IMAGE_HDD       = 0,
+	EMU_IMAGE_FDD       = 1,
+	EMU_IMAGE_CDROM     = 2,
+	EMU_IMAGE_ZIP       = 3,
+	EMU_IMAGE_MO        = 4,
+};
+
+/* Amount of disks shown for a single config. */
+#define EMU_META_DISKS  4
+
+/* Metadata of a config, as shown in the preview pane. Everything is
+   copied (and cut, if needed) out of the config. */
+struct emu_meta {
+	char machine[64];
+	char cpu[64];
+	char mem[32];
+	char disks[EMU_META_DISKS][128];
+
+	/* Amount of disks in the config, even the ones not stored. */
+	int ndisks;
+
+	/* If the config couldn't be read, errno of it. */
+	int errnum;
+};
+
+/* Workers and cached entries of the preview pane, and the
+   amount of entries looked at beyond the current page. */
+#define EMU_PREVIEW_THREADS  2
+#define EMU_PREVIEW_CACHE    256
+#define EMU_PREVIEW_AHEAD    EMU_MENU_PAGE
+
+/* States of a preview slot. */
+enum {
+	EMU_SLOT_FREE    = 0,
+	EMU_SLOT_QUEUED  = 1,
+	EMU_SLOT_BUSY    = 2,
+	EMU_SLOT_READY   = 3,
+};
+
+/* A cached entry of the preview pane. */
+struct emu_preview_slot {
+	char name[PATH_MAX];
+	uint32_t hash;
+	int state;
+
+	/* Last time the slot has been asked for, for the LRU eviction. */
+	uint64_t tick;
+
+	struct emu_meta meta;
+};
+
+/* Metadata of the configs around the selection is read by a small
+   pool of workers, so the menu never waits for the file system. The
+   menu tells what it wants to show, the workers fill in the cache
+   and wake up the menu through the notify pipe. It's shared with the
+   workers, the last one to go away frees it. */
+struct emu_preview {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int alive;
+	int quit;
+
+	/* Config directory, and the notify pipe. */
+	int dirfd;
+	int notify[2];
+
+	/* Queued slots, in the order they should be read. */
+	int want[EMU_PREVIEW_CACHE];
+	int whead;
+	int wtail;
+
+	uint64_t tick;
+	struct emu_preview_slot slots[EMU_PREVIEW_CACHE];
+};
+
+/* How long the scanner collects entries before the menu gets them. */
+#define EMU_STREAM_NS  (50 * 1000000ULL)
+
+/* Scan of the config directory behind the menu, when the index can't
+   be trusted. The scanner collects entries into found and wakes up
+   the menu through the notify pipe, the menu takes them from there.
+   Whichever of the two is left last frees it. */
+struct emu_stream {
+	pthread_mutex_t lock;
+	int done;
+	int quit;
+
+	/* Config directory, the locked index (or -1) and the notify
+	   pipe. */
+	int dirfd;
+	int index;
+	int notify[2];
+
+	/* Entries found since the menu has taken them, unsorted. */
+	struct emu_scan found;
+
+	/* mtime of the config directory before it was read, for the
+	   index. */
+	struct timespec stamp;
+};
+
+/* Header of the on-disk config index. It is followed by the entry
+   table, the walked directories and the name arena, exactly as they
+   are in memory. */
+struct emu_index_hdr {
+	uint32_t magic;
+	uint32_t version;
+
+	/* Size of a single struct emu_entry, in case of a different build. */
+	uint64_t ent_sz;
+
+	/* Identity of the config directory, when the index was written.
+	   Adding, removing or renaming a config changes it's mtime. */
+	uint64_t dev;
+	uint64_t ino;
+	struct timespec mtime;
+
+	uint64_t nents;
+	uint64_t arena_sz;
+	uint64_t row_sz;
+	uint64_t name_sz;
+
+	/* Directories walked for VMs, after the entries. The index is
+	   only valid while none of them has changed either. */
+	uint64_t ndirs;
+};
+
+/* Upper bound of the workers of emu_pool_run(...) */
+#define EMU_POOL_THREADS  8
+
+/* Structure for emu_pool_run(...) Every index below n is handed
+   out exactly once, to whichever worker asks first. */
+struct emu_pool {
+	void (*fn)(void *arg, size_t idx);
+	void *arg;
+	size_t n;
+	size_t next;
+};
+
+/* Depth of the ring of emu_statx_run(...), the most statx(2) calls
+   in flight at a time. */
+#define EMU_STATX_DEPTH  256
+
+/* Fewer names than this aren't worth a ring, or threads. */
+#define EMU_STATX_MIN    16
+
+/* Structure for emu_statx_run(...) name gives the name of an index,
+   relative to dirfd. done gets what statx(2) has found for it, and
+   isn't called for one that failed. It may be called from more than
+   a single thread at a time, but never twice for the same index. */
+struct emu_statx {
+	int dirfd;
+	unsigned int mask;
+	size_t n;
+	const char *(*name)(void *arg, size_t idx);
+	void (*done)(void *arg, size_t idx, const struct statx *stx);
+	void *arg;
+};
+
+/* The mapped rings of an io_uring(7) instance. */
+struct emu_uring {
+	int fd;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_sz;
+	size_t cq_sz;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+	unsigned int entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/* Kinds of files removed by --purge. */
+enum {
+	EMU_PURGE_CONFIG  = 0,
+	EMU_PURGE_DISK    = 1,
+	EMU_PURGE_NVR     = 2,
+	/* Disk images outside of the config directory, never deleted. */
+	EMU_PURGE_KEPT    = 3,
+	EMU_PURGE_KINDS   = 4,
+};
+
+/* A disk image to copy for --clone, for one of the new configs. */
+struct emu_clone_disk {
+	/* Resolved path of the image, and of it's copy. */
+	char src[PATH_MAX];
+	char dst[PATH_MAX];
+
+	/* The new config, and the key of the image in the source. */
+	size_t clone;
+	size_t key;
+
+	/* Result of the copy, it's -1 until it's done. */
+	int ret;
+	int created;
+	int reflinked;
+	uint64_t copied;
+};
+
+/* Fields and formats of --list. */
+enum {
+	EMU_FIELD_NAME     = 0,
+	EMU_FIELD_MACHINE  = 1,
+	EMU_FIELD_CPU      = 2,
+	EMU_FIELD_MEM      = 3,
+	EMU_FIELD_MTIME    = 4,
+	EMU_FIELD_SIZE     = 5,
+	EMU_FIELDS         = 6,
+};
+
+enum {
+	EMU_LIST_TSV   = 0,
+	EMU_LIST_JSON  = 1,
+};
+
+static const char *emu_list_names[EMU_FIELDS] = {
+	"name", "machine", "cpu", "mem", "mtime", "size",
+};
+
+/* Entries read by a single round of --list, and the size of it's
+   output buffer. */
+#define EMU_LIST_BATCH   1024
+#define EMU_LIST_BUFSZ   ((size_t)1 << 20)
+
+/* An entry of --list, and what has been read of it. */
+struct emu_list_ent {
+	char name[PATH_MAX];
+	struct timespec mtime;
+	uint64_t size;
+	struct emu_meta meta;
+};
+
+/* State of --list. */
+struct emu_list {
+	int dirfd;
+	int format;
+	FILE *out;
+
+	/* Fields to show, in their order. */
+	int fields[EMU_FIELDS];
+	int nfields;
+
+	/* Whether the configs have to be read, or stat(2)ed, and if
+	   it's for their size. */
+	int need_conf;
+	int need_stat;
+	int need_size;
+
+	struct emu_list_ent *ents;
+	size_t nents;
+};
+
+/* State of emuboxd. The entry table is kept sorted and up to date
+   through inotify, with what --list shows of every entry right next
+   to it, so a client never makes it touch the config directory. The
+   VMs it has started are watched through their pidfds. */
+struct emu_daemon {
+	char *path;
+	const char *bin;
+	int dirfd;
+	struct emu_watch watch;
+	int lfd;
+	int ep;
+
+	struct emu_scan scan;
+
+	/* Machine, cpu and memory of every entry, back to back (each one
+	   NUL terminated), or NULL while it hasn't been read. */
+	char **meta;
+	size_t meta_cap;
+
+	/* A round of entries being read. */
+	struct emu_list_ent *batch;
+
+	struct emu_vm *vms;
+	size_t nvms;
+	size_t vms_cap;
+};
+
+/* What's behind an event of emuboxd, anything else is the pid of a
+   VM (which is never any of these), with EMU_DAEMON_LOG for it's
+   output. */
+enum {
+	EMU_DAEMON_LISTEN   = 0,
+	EMU_DAEMON_INOTIFY  = 1,
+	EMU_DAEMON_WAKE     = 2,
+};
+#define EMU_DAEMON_LOG      (1ULL << 32)
+
+/* Sections of 86box itself and the keys each one is known to have,
+   space separated, a trailing "*" matches anything after it. */
+static const struct emu_check_sec {
+	const char *name;
+	const char *keys;
+} emu_check_secs[] = {
+	{ "General", "vid_* video_* window_* force_43 scale dpi_scale "
+	  "enable_overscan rctrl_is_lalt update_icons inhibit_multimedia_keys "
+	  "sound_gain confirm_* language open_dir_usr_path mouse_sensitivity "
+	  "do_auto_pause uuid icon_set kbd_req_capture hide_status_bar "
+	  "hide_tool_bar color_scheme fdd_sounds* vsync" },
+	{ "Machine", "machine cpu* fpu_* mem_size time_sync pit_mode "
+	  "enable_external_fpu" },
+	{ "Video", "gfxcard* voodoo ibm8514 xga da2 show_second_monitors" },
+	{ "Input devices", "mouse_type joystick_* keyboard_type "
+	  "tablet_tool_type" },
+	{ "Sound", "sndcard* midi_device midi_in_device mpu401_standalone "
+	  "fm_driver sound_type sound_is_float" },
+	{ "Network", "net_*" },
+	{ "Ports (COM & LPT)", "serial* lpt* com*" },
+	{ "Storage controllers", "hdc* scsicard* fdc ide_ter ide_qua "
+	  "cassette_* cartridge_* cdrom_interface" },
+	{ "Hard disks", "hdd_*" },
+	{ "Floppy and CD-ROM drives", "fdd_* cdrom_*" },
+	{ "Other removable devices", "zip_* mo_* cdrom_*" },
+	{ "Other peripherals", "isartc_type isamem_* isa_rom_* bugger_enabled "
+	  "postcard_enabled unittester_enabled novell_keycard_enabled lpt*" },
+	{ NULL, NULL },
+};
+
+/* A writable image of a config, found by --check. */
+struct emu_check_disk {
+	uint64_t dev;
+	uint64_t ino;
+	size_t cfg;
+	char *path;
+};
+
+/* Report of a single config, written by a worker of the pool. */
+struct emu_check_ent {
+	FILE *out;
+	char *report;
+	size_t len;
+	size_t errors;
+	size_t warnings;
+
+	struct emu_check_disk *disks;
+	size_t ndisks;
+};
+
+/* State of --check. */
+struct emu_check {
+	int dirfd;
+	struct emu_scan scan;
+	struct emu_check_ent *ents;
+};
+
+/* A file owned by a config, relative to the config directory
+   (unless it's kept). */
+struct emu_purge_file {
+	char *path;
+	int kind;
+};
+
+/* State of a purge, shared by it's workers. The configs are read
+   first, to collect everything they own, then the owned files are
+   deleted and the configs only after them, so an interrupted purge
+   can be run again and still find every file. */
+struct emu_purge {
+	int dirfd;
+	int verbose;
+	int reclaim;
+
+	/* Resolved path of the config directory. */
+	char root[PATH_MAX];
+	size_t root_len;
+
+	struct emu_scan scan;
+
+	/* Owned files, found while reading the configs. */
+	pthread_mutex_t lock;
+	struct emu_purge_file *files;
+	size_t nfiles;
+	size_t files_cap;
+
+	/* Totals, updated atomically by the workers. */
+	size_t count[EMU_PURGE_KINDS];
+	size_t failed;
+	uint64_t freed;
+};
+
+/* Output of a VM is kept in a ring of it's last EMU_LOG_SIZE bytes,
+   read from a pipe as soon as it's there, so a chatty guest costs as
+   much as a quiet one and never blocks on a full pipe. */
+#define EMU_LOG_SIZE   (64 * 1024)
+#define EMU_LOG_PIPE   (64 * 1024)
+
+/* Most reads of a pipe at once, the rest is read on the next event. */
+#define EMU_LOG_READS  16
+
+/* The ring is saved to ".logs/<name>.log" when the VM goes away (or
+   when it's asked for), the earlier ones are kept as "<name>.log.1"
+   and so on, up to EMU_LOG_KEEP - 1. */
+#define EMU_LOG_DIR    ".logs"
+#define EMU_LOG_KEEP   4
+
+/* How long the pipes are waited on before looking for a VM that's
+   gone, without pidfds, in milliseconds. */
+#define EMU_LOG_POLL   100
+
+/* What a signal has asked for, through emu_wake. */
+enum {
+	EMU_WAKE_USR1  = 1,
+	EMU_WAKE_OTHER = 2,
+};
+
+/* Ring of a VM. */
+struct emu_log {
+	/* Read end of the pipe, non-blocking, or -1 once it's closed. */
+	int fd;
+
+	/* EMU_LOG_SIZE bytes, allocated with the first output. */
+	char *buf;
+
+	/* Every byte that's been read, and how many of them were when
+	   it was last saved. */
+	uint64_t len;
+	uint64_t saved;
+};
+
+/* A started 86box, and it's config. */
+struct emu_vm {
+	char name[PATH_MAX];
+	pid_t pid;
+	int pidfd;
+
+	/* It's own cgroup with --cgroup, or -1. */
+	int cgroup;
+
+	/* When emuboxd started it. */
+	time_t started;
+
+	/* It's output. */
+	struct emu_log log;
+};
+
+/* cgroup v2 tree of --cgroup, the cgroup emubox has been started in.
+   emubox moves itself into a leaf of it, since a cgroup with
+   processes of it's own can't give controllers to the cgroups below
+   it. */
+struct emu_cgroup {
+	int root;
+	int self;
+};
+
+/* Resource usage of a cgroup, in microseconds and bytes. The memory
+   and I/O are only known with their controllers. */
+struct emu_cgroup_usage {
+	uint64_t cpu_usec;
+	int has_mem;
+	uint64_t mem;
+	uint64_t mem_peak;
+	int has_io;
+	uint64_t rbytes;
+	uint64_t wbytes;
+};
+
+/* Registry of the builds of 86box, in the config directory. It's
+   [emulators] section has a build a key, like "dynarec = /opt/86Box". */
+#define EMU_EMULATORS_NAME   ".emulators"
+
+/* What's been found in the registry and in $PATH, with the versions,
+   for as long as none of them has changed, in EMU_STATE_DIR. */
+#define EMU_EMULATORS_CACHE  "emulators.cache"
+#define EMU_EMULATORS_MAGIC  "emubox emulators 1"
+
+/* Name of PATH_86BOX, the build of a config that doesn't name one. */
+#define EMU_EMULATOR_DEFAULT "default"
+
+/* Where a build of the registry comes from. */
+enum {
+	EMU_EMULATOR_BUILTIN = 0,
+	EMU_EMULATOR_CONFIG  = 1,
+	EMU_EMULATOR_PATH    = 2,
+	EMU_EMULATOR_SOURCES = 3,
+};
+
+/* A build of 86box. */
+struct emu_emulator {
+	char name[NAME_MAX + 1];
+	char path[PATH_MAX];
+	int source;
+
+	/* The file the version was read from, it's read again once any
+	   of this changes. */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	struct timespec mtime;
+	char version[32];
+};
+
+/* Every known build, the first one of a name wins. */
+struct emu_emulators {
+	struct emu_emulator *ents;
+	size_t n;
+	size_t cap;
+};
+
+/* Interval of --monitor, unless it's given, in seconds. */
+#define EMU_MONITOR_PERIOD  1
+
+/* Most often the output of a VM is redrawn, in milliseconds. */
+#define EMU_MONITOR_REDRAW  100
+
+/* A VM of the monitor. It's files of /proc are opened once and read
+   again on every sample, into a buffer on the stack. */
+struct emu_monitor_ent {
+	int stat;
+	int statm;
+	int io;
+
+	/* The last sample: CPU time in clock ticks, bytes read and
+	   written, and when it was taken. */
+	uint64_t ticks;
+	uint64_t rchar;
+	uint64_t wchar;
+	uint64_t at;
+
+	/* What's shown, from the last two samples. It's 1 with only
+	   the first one, there's no rate yet. */
+	int sampled;
+	double cpu;
+	uint64_t rss;
+	uint64_t rd;
+	uint64_t wr;
+
+	/* How it went away, it's told once the monitor is left. */
+	int exited;
+	int status;
+};
+
+/* Live view of the VMs of emu_supervise(...), with --monitor. */
+struct emu_monitor {
+	struct emu_monitor_ent *ents;
+	size_t n;
+	long hz;
+	long page;
+	int period;
+
+	/* The VM that's selected, and whether it's log is shown. */
+	size_t sel;
+	int show_log;
+};
+
+/* Launch properties of a config, applied to 86box before it starts.
+   Nothing is changed for a property that isn't set. */
+struct emu_props {
+	/* CPUs to pin it to. With "cpus = auto", a core that no other
+	   launched VM uses is picked instead. */
+	cpu_set_t cpus;
+	int has_cpus;
+	int auto_cpus;
+
+	/* Niceness, if has_nice is set. */
+	int has_nice;
+	int nice;
+
+	/* Scheduling policy (SCHED_*) and it's priority, or -1. */
+	int policy;
+	int sched_prio;
+
+	/* I/O class and level, as ioprio_set(2) takes it, or -1. */
+	int ioprio;
+
+	/* Limits of it's cgroup with --cgroup, written to the files of
+	   the same name as they are. Empty if they aren't set. */
+	char memory_max[32];
+	char cpu_max[32];
+	char io_max[256];
+
+	/* Build of 86box to run it with, from the registry. */
+	char emulator[NAME_MAX + 1];
+
+	/* Bytes of the disk images to read ahead while 86box starts, in
+	   the order of the config, with "prewarm = boot" it's the first
+	   EMU_PREWARM_BOOT of every image instead. 0 if it's not set. */
+	uint64_t prewarm;
+	int prewarm_boot;
+};
+
+/* A read ahead of the disk images of a config, by it's own thread. */
+struct emu_prewarm {
+	char conf[PATH_MAX];
+	uint64_t left;
+	int boot;
+};
+
+/* A launch, done by it's own thread for emu_spawn_box(...) */
+struct emu_spawn {
+	const char *bin;
+	char *const *argv;
+	const struct emu_props *props;
+	int out;
+	pid_t pid;
+};
+
+/* Identity and hash of the AppImage, of the last extraction. */
+struct emu_appimage_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	struct timespec mtime;
+	uint64_t hash;
+};
+
+/* Phases of a launch, as measured by --stats. */
+enum {
+	EMU_STAT_SCAN    = 0,
+	EMU_STAT_SORT    = 1,
+	EMU_STAT_LAYOUT  = 2,
+	EMU_STAT_CURSES  = 3,
+	EMU_STAT_PAINT   = 4,
+	EMU_STAT_SELECT  = 5,
+	EMU_STAT_PHASES  = 6,
+};
+
+/* Formats of --stats. */
+enum {
+	EMU_STATS_TEXT  = 1,
+	EMU_STATS_JSON  = 2,
+};
+
+/* Timings of a launch, every time is in nanoseconds of the
+   monotonic clock. */
+struct emu_stats {
+	int format;
+
+	/* When emubox has been started, the current phase has been
+	   started and the user has selected something. */
+	uint64_t start;
+	uint64_t last;
+	uint64_t selected;
+
+	/* Time spent in every phase. */
+	uint64_t ns[EMU_STAT_PHASES];
+
+	/* Amount of entries, and whether they came from the index. */
+	size_t nents;
+	int index;
+};
+
+/* Machine presets of --template, in 86Box's own config format (and
+   with it's internal names), so a new VM boots without going through
+   the settings first. Hard disks are left to the user. */
+struct emu_template {
+	const char *name;
+	const char *text;
 };
 
+static const struct emu_template emu_templates[] = {
+	{ "486-dos",
+	  "[Machine]\n"
+	  "machine = ami486\n"
+	  "cpu_family = i486dx2\n"
+	  "cpu_speed = 66666666\n"
+	  "cpu_multi = 2\n"
+	  "cpu_use_dynarec = 1\n"
+	  "mem_size = 16384\n"
+	  "\n"
+	  "[Video]\n"
+	  "gfxcard = et4000ax\n"
+	  "\n"
+	  "[Input devices]\n"
+	  "mouse_type = msserial\n"
+	  "\n"
+	  "[Sound]\n"
+	  "sndcard = sb16\n"
+	  "\n"
+	  "[Storage controllers]\n"
+	  "hdc = ide_isa\n"
+	  "\n"
+	  "[Floppy and CD-ROM drives]\n"
+	  "fdd_01_type = 35_2hd\n"
+	  "fdd_02_type = 525_2hd\n" },
+	{ "p2-win98",
+	  "[Machine]\n"
+	  "machine = p2bls\n"
+	  "cpu_family = pentium2_deschutes\n"
+	  "cpu_speed = 350000000\n"
+	  "cpu_multi = 3.5\n"
+	  "cpu_use_dynarec = 1\n"
+	  "mem_size = 131072\n"
+	  "\n"
+	  "[Video]\n"
+	  "gfxcard = voodoo3_3k_agp\n"
+	  "\n"
+	  "[Input devices]\n"
+	  "mouse_type = ps2\n"
+	  "\n"
+	  "[Sound]\n"
+	  "sndcard = es1371\n"
+	  "\n"
+	  "[Storage controllers]\n"
+	  "hdc = internal\n"
+	  "\n"
+	  "[Floppy and CD-ROM drives]\n"
+	  "fdd_01_type = 35_2hd\n"
+	  "fdd_02_type = none\n"
+	  "cdrom_01_parameters = 1, atapi\n"
+	  "cdrom_01_ide_channel = 0:1\n" },
+};
+
+#ifdef EMUBOX_BENCH
+/* Sizes of the generated directories of --bench, the runs of every
+   measurement (at most) and the frames rendered for every size. */
+#  define EMU_BENCH_SIZES   "1000,10000,100000,1000000"
+#  define EMU_BENCH_RUNS    20
+#  define EMU_BENCH_FRAMES  2000
+#endif
+
 /* Function prototypes. */
-static char *emu_basename(char *path);
-static int qsort_compare(const void *s0, const void *s1);
 static void emu_exec_shell(const char *args);
-static void emu_launch_box(const char *conf, const char *lang,
-			   int is_fullscreen);
-static char *emu_read_conf(const char *conf);
-static char *emu_get_valueof(char *conf_raw, const char *key);
+static int emu_props_cpus(const char *v, cpu_set_t *set);
+static void emu_props_invalid(const char *path, const char *key);
+static void emu_props_load(const char *path, const char *name,
+			   struct emu_props *props);
+static void emu_props_assign(struct emu_props *props, size_t n);
+static const struct emu_emulator *emu_emulators_find(
+	const struct emu_emulators *reg, const char *name);
+static struct emu_emulator *emu_emulators_add(struct emu_emulators *reg,
+					      const char *name,
+					      const char *path, int source);
+static int emu_emulator_same(const struct emu_emulator *e,
+			     const struct stat *st);
+static void emu_emulator_version(struct emu_emulator *e);
+static char *emu_emulators_header(int dirfd);
+static void emu_emulators_discover(struct emu_emulators *reg, int dirfd);
+static void emu_emulators_parse(struct emu_emulators *reg, char *buf);
+static void emu_emulators_write(int fd, const char *hdr,
+				const struct emu_emulators *reg);
+static int emu_emulators_load(struct emu_emulators *reg, int verify);
+static void emu_emulators_free(struct emu_emulators *reg);
+static const char *emu_emulator_bin(const struct emu_emulators *reg,
+				    const char *vm, const char *name,
+				    const char *bin);
+static int emu_emulators_list(int format);
+static void emu_props_apply(const struct emu_props *props);
+static int emu_cgroup_write(int fd, const char *file, const char *val);
+static int emu_cgroup_open(struct emu_cgroup *cg);
+static void emu_cgroup_close(struct emu_cgroup *cg);
+static void emu_vm_file(const char *name, const char *prefix,
+			const char *suffix, char *buf);
+static void emu_cgroup_name(const char *name, char *buf);
+static int emu_cgroup_create(const struct emu_cgroup *cg, const char *name,
+			     const struct emu_props *props);
+static void emu_cgroup_remove(const struct emu_cgroup *cg, struct emu_vm *vm);
+static void emu_cgroup_usage(int fd, struct emu_cgroup_usage *u);
+static void emu_cgroup_report(const struct emu_vm *vm);
+static pid_t emu_spawn_exec(const char *bin, char *const argv[], int out);
+static void *emu_spawn_thread(void *arg);
+static void *emu_prewarm_thread(void *arg);
+static void emu_prewarm_start(const char *conf, const struct emu_props *props);
+static pid_t emu_spawn_box(const char *bin, char *const argv[],
+			   const struct emu_props *props, int *log);
+static pid_t emu_launch_box(const char *bin, const char *conf,
+			    const char *lang, int is_fullscreen,
+			    const struct emu_props *props, int *log);
+static uint32_t emu_conf_hash(const char *sec, size_t sec_len,
+			      const char *key, size_t key_len);
+static int emu_conf_match(const struct emu_conf *cf,
+			  const struct emu_conf_key *k,
+			  const char *sec, size_t sec_len,
+			  const char *key, size_t key_len);
+static struct emu_conf *emu_read_conf(int dirfd, const char *conf);
+static const char *emu_get_valueof(const struct emu_conf *cf,
+				   const char *sec, const char *key,
+				   size_t *len);
+static void emu_free_conf(struct emu_conf *cf);
+static int emu_conf_copy(const struct emu_conf *cf, const char *sec,
+			 const char *key, char *buf, size_t sz);
+static int emu_conf_image(const char *key, size_t len);
+static void emu_conf_meta(const struct emu_conf *cf, struct emu_meta *meta);
 static void emu_init_directory(void);
 static char *emu_get_directory(void);
-static void emu_content_len(struct content_len_info *clinfo);
-static void emu_select_list(const char *lang, int is_fullscreen, int);
+static int emu_open_directory(void);
+static int emu_state_open(int dirfd, int create);
+static void emu_config_path(const char *path, const char *name, char *buf,
+			    size_t sz);
+static int emu_config_name(const char *name, char *buf, size_t sz);
+static int emu_config_resolve(const char *path, const char *name,
+			      char *cfg, size_t sz);
+static char *emu_scan_alloc(struct emu_scan *scan, size_t sz);
+static void emu_scan_push(struct emu_scan *scan, const char *name, size_t len);
+static int emu_scan_type(int dirfd, const struct dirent *den);
+static int emu_scan_level(struct emu_scan *scan, int dirfd,
+			  struct emu_scan *subdirs);
+static int emu_scan_directory(struct emu_scan *scan, int dirfd);
+static void emu_scan_dir(struct emu_scan *scan, const char *name,
+			 size_t len, const struct timespec *mtime);
+static void emu_scan_take(struct emu_scan *dst, struct emu_scan *src);
+static void emu_scan_roots(int dirfd, struct emu_scan *jobs,
+			   struct emu_scan *scan);
+static void emu_walk_push(struct emu_walk *w, size_t id, char *path,
+			  int depth);
+static int emu_walk_pop(struct emu_walk *w, size_t id, struct emu_walk_job *job);
+static void emu_walk_dir(struct emu_walk *w, size_t id,
+			 const struct emu_walk_job *job, struct emu_scan *found);
+static void emu_walk_flush(struct emu_walk *w, struct emu_scan *found);
+static void *emu_walk_worker(void *arg);
+static void emu_scan_walk(int dirfd, const struct emu_scan *jobs,
+			  int (*flush)(void *, struct emu_scan *), void *arg);
+static int emu_scan_collect(void *arg, struct emu_scan *found);
+static int emu_scan_tree(struct emu_scan *scan, int dirfd);
+static const char *emu_scan_name(const struct emu_scan *scan, size_t idx);
+static size_t emu_sort_key(const char *name, size_t len, unsigned char *key);
+static int emu_key_compare(const unsigned char *k0, size_t l0,
+			   const unsigned char *k1, size_t l1);
+static size_t emu_radix_byte(const struct emu_sort_ent *se, size_t depth);
+static void emu_radix_sort(struct emu_sort_ent *se, struct emu_sort_ent *tmp,
+			   size_t n, size_t depth);
+static void emu_scan_sort(struct emu_scan *scan);
+static int emu_scan_find(const struct emu_scan *scan, const char *name,
+			 size_t *pos);
+static void emu_scan_insert(struct emu_scan *scan, const char *name,
+			    const struct timespec *mtime);
+static void emu_scan_remove(struct emu_scan *scan, const char *name);
+static void emu_scan_remove_below(struct emu_scan *scan, const char *dir);
+static void emu_scan_merge(struct emu_scan *scan, struct emu_scan *add);
+static const char *emu_scan_stamp_name(void *arg, size_t idx);
+static void emu_scan_stamp_done(void *arg, size_t idx,
+				const struct statx *stx);
+static void emu_scan_stamp(struct emu_scan *scan, int dirfd);
+static void emu_scan_free(struct emu_scan *scan);
+static int emu_index_open(int dirfd);
+static int emu_index_racy(const struct timespec *stamp,
+			  const struct timespec *written);
+static int emu_index_name(const struct emu_scan *scan,
+			  const struct emu_entry *e);
+static int emu_index_read(int fd, int dirfd, struct emu_scan *scan);
+static void emu_index_write(int fd, int dirfd, const struct emu_scan *scan);
+static int emu_index_begin(int dirfd, struct emu_scan *scan);
+static void emu_index_end(int fd, int dirfd, struct emu_scan *scan);
+static uint64_t emu_stats_now(void);
+static void emu_stats_begin(struct emu_stats *stats);
+static void emu_stats_end(struct emu_stats *stats, int phase);
+static void emu_json_string(FILE *fp, const char *s);
+static void emu_stats_report(const struct emu_stats *stats);
+static void emu_stats_spawn(const struct emu_stats *stats,
+			    const struct emu_vm *vm, uint64_t begin);
+static void emu_history_add(const char *path, const char *name);
+static void emu_history_put(struct emu_history *h, const char *name,
+			    uint64_t ts, uint64_t n);
+static off_t emu_history_parse(int fd, struct emu_history *h, int folded);
+static void emu_history_compact(int sfd, int fd, int dirfd,
+				struct emu_history *h);
+static void emu_history_load(int dirfd, struct emu_history *h);
+static void emu_history_free(struct emu_history *h);
+static uint64_t emu_history_score(uint64_t last, uint64_t count,
+				  uint64_t now);
+static uint64_t emu_history_key(const struct emu_history *h, size_t pos,
+				int sort);
+static void emu_rank_sort(struct emu_rank_ent *re, struct emu_rank_ent *tmp,
+			  size_t n);
+static void emu_rank_keys(const struct emu_scan *scan, int sort,
+			  const struct emu_history *h, const size_t *idx,
+			  size_t n, struct emu_rank_ent *re);
+static size_t *emu_scan_rank(struct emu_scan *scan, int dirfd, int sort);
+static int emu_scan_load(struct emu_scan *scan, const char *path,
+			 struct emu_stats *stats);
+static int emu_scan_stream(struct emu_scan *scan, const char *path,
+			   struct emu_stats *stats, struct emu_stream **stream);
+static void emu_content_len(const struct emu_scan *scan,
+			    struct content_len_info *clinfo);
+static uint32_t emu_tri_hash(const char *p);
+static int emu_search_compare(const void *s0, const void *s1, void *arg);
+static int emu_search_position(const void *s0, const void *s1);
+static void emu_search_build(struct emu_search *search,
+			     const struct emu_scan *scan);
+static size_t emu_search_query(const struct emu_search *search,
+			       const struct emu_scan *scan, const char *q,
+			       size_t len, size_t *out, size_t *nprefix);
+static void emu_search_free(struct emu_search *search);
+static void *emu_preview_worker(void *arg);
+static struct emu_preview *emu_preview_start(int dirfd);
+static void emu_preview_want(struct emu_preview *pv, const char **names,
+			     size_t n);
+static int emu_preview_get(struct emu_preview *pv, const char *name,
+			   struct emu_meta *meta);
+static void emu_preview_forget(struct emu_preview *pv, const char *name);
+static void emu_preview_stop(struct emu_preview *pv);
+static void emu_stream_free(struct emu_stream *st);
+static int emu_stream_flush(void *arg, struct emu_scan *found);
+static void *emu_stream_worker(void *arg);
+static struct emu_stream *emu_stream_start(int dirfd, int index);
+static void emu_stream_stop(struct emu_stream *st);
+static size_t emu_menu_ent(const struct emu_menu *menu, size_t pos);
+static void emu_menu_pane(struct emu_menu *menu);
+static void emu_menu_prefetch(struct emu_menu *menu);
+static int emu_menu_getch(struct emu_menu *menu);
+static void emu_menu_view(struct emu_menu *menu);
+static int emu_menu_compare(const void *s0, const void *s1, void *rank);
+static void emu_menu_order(struct emu_menu *menu);
+static void emu_menu_filter(struct emu_menu *menu);
+static void emu_menu_layout(struct emu_menu *menu);
+static int emu_watch_open(struct emu_watch *w, const char *path,
+			  uint32_t mask);
+static void emu_watch_close(struct emu_watch *w);
+static int emu_watch_find(const struct emu_watch *w, int wd, size_t *pos);
+static void emu_watch_below(struct emu_watch *w, const char *name);
+static void emu_watch_dirs(struct emu_watch *w, const struct emu_scan *scan);
+static void emu_watch_gone(struct emu_watch *w, const char *name);
+static int emu_watch_event(struct emu_watch *w,
+			   const struct inotify_event *ev, char *buf);
+static void emu_watch_walk(struct emu_watch *w, int dirfd, const char *name,
+			   struct emu_scan *found);
+static void emu_menu_watch(struct emu_menu *menu);
+static int emu_menu_stream(struct emu_menu *menu);
+static void emu_menu_reload(struct emu_menu *menu, const char *sel);
+static void emu_menu_frame(struct emu_menu *menu);
+static void emu_menu_title(struct emu_menu *menu);
+static void emu_menu_status(struct emu_menu *menu);
+static void emu_menu_row(struct emu_menu *menu, size_t idx);
+static void emu_menu_page(struct emu_menu *menu);
+static int emu_menu_move(struct emu_menu *menu, size_t idx);
+static int emu_menu_run(struct emu_menu *menu, size_t *sel);
+static void emu_menu_mark(struct emu_menu *menu);
+static int emu_select_list(const char *bin, const char *lang,
+			   int is_fullscreen, int is_settings, int sort,
+			   int cgroup, int monitor, struct emu_stats *stats);
+static int emu_launch_configs(const char *path, const char **names,
+			      size_t n, const char *bin, const char *lang,
+			      int is_fullscreen, int is_settings, int cgroup,
+			      int monitor, struct emu_stats *stats);
+static int emu_launch_name(const char *bin, const char *name,
+			   const char *lang, int is_fullscreen, int cgroup,
+			   int monitor);
 static void emu_init_emubox(void);
-static void emu_bulk_purge_configs(void);
-static void emu_purge_config(const char *name);
-static void emu_launch_settings(const char *name);
-static void emu_create_new(const char *name);
+static void *emu_pool_worker(void *arg);
+static void emu_pool_run(size_t n, void (*fn)(void *, size_t), void *arg);
+static int emu_uring_open(struct emu_uring *u, unsigned int entries);
+static void emu_uring_close(struct emu_uring *u);
+static void emu_statx_worker(void *arg, size_t idx);
+static int emu_statx_uring(struct emu_statx *sx);
+static void emu_statx_run(struct emu_statx *sx);
+static void emu_format_size(uint64_t sz, char *buf, size_t len);
+static void emu_purge_add(struct emu_purge *pg, const char *path, int kind);
+static void emu_purge_disk(struct emu_purge *pg, const char *v, size_t len);
+static void emu_purge_collect(void *arg, size_t idx);
+static void emu_purge_unlink(struct emu_purge *pg, const char *path, int kind);
+static void emu_purge_file(void *arg, size_t idx);
+static void emu_purge_entry(void *arg, size_t idx);
+static int emu_purge_compare(const void *s0, const void *s1);
+static int emu_bulk_purge_configs(int reclaim, int verbose);
+static int emu_purge_config(int dirfd, const char *name,
+			    struct emu_scan *scan);
+static pid_t emu_launch_settings(const char *bin, const char *name, int *log);
+static uint64_t emu_appimage_hash(int fd, size_t len);
+static int emu_remove_entry(const char *path, const struct stat *st,
+			    int flag, struct FTW *ftw);
+static void emu_remove_tree(const char *path);
+static int emu_appimage_extract(const char *dir, const char *image);
+static int emu_appimage_cache(char *bin, size_t sz);
+static void emu_wake_signal(int sig);
+static int emu_wake_take(int fd);
+static void emu_log_read(struct emu_log *l);
+static size_t emu_log_tail(const struct emu_log *l, char *buf, size_t sz);
+static void emu_log_name(const char *name, int gen, char *buf);
+static int emu_log_save(struct emu_vm *vm, int exited, int status);
+static void emu_log_close(struct emu_log *l);
+static void emu_log_save_all(struct emu_vm *vms, size_t n);
+static size_t emu_log_poll(struct emu_vm *vms, size_t n, int wake);
+static int emu_supervise_report(const struct emu_vm *vm, int status);
+static int emu_monitor_read(int fd, char *buf, size_t sz);
+static uint64_t emu_monitor_field(const char *buf, const char *key);
+static void emu_monitor_sample(struct emu_monitor *mon, size_t i);
+static void emu_monitor_close(struct emu_monitor_ent *e);
+static int emu_monitor_start(struct emu_monitor *mon, const struct emu_vm *vms,
+			     size_t n, int period);
+static void emu_monitor_log(const struct emu_vm *vm, int y);
+static void emu_monitor_draw(const struct emu_monitor *mon,
+			     const struct emu_vm *vms, size_t left);
+static void emu_monitor_key(struct emu_monitor *mon, struct emu_vm *vms,
+			    int ch);
+static int emu_monitor_stop(struct emu_monitor *mon, const struct emu_vm *vms);
+static int emu_supervise(struct emu_vm *vms, size_t n, int period,
+			 int monitor);
+static int emu_create_new(int dirfd, const char *name,
+			  struct emu_scan *scan, const char *tmpl, size_t len);
+static const struct emu_template *emu_template_find(const char *name);
+static char *emu_template_load(const char *name, size_t *len);
+static int emu_batch_configs(int argc, char **argv, int is_delete,
+			     const char *tmpl);
+static int emu_clone_range(int in, int out, off_t off, off_t len);
+static int emu_clone_file(struct emu_clone_disk *d);
+static void emu_clone_worker(void *arg, size_t idx);
+static int emu_clone_disks(const struct emu_conf *cf, const char *root,
+			   size_t **keys, char ***reals);
+static int emu_clone_write(int fd, const struct emu_conf *cf,
+			   const struct emu_clone_disk *disks, size_t n,
+			   const char *root);
+static int emu_clone_configs(int argc, char **argv);
+static void emu_list_worker(void *arg, size_t idx);
+static void emu_list_string(const struct emu_list *ls, const char *s);
+static const char *emu_list_stat_name(void *arg, size_t idx);
+static void emu_list_stat_done(void *arg, size_t idx, const struct statx *stx);
+static void emu_list_flush(struct emu_list *ls);
+static int emu_list_collect(void *arg, struct emu_scan *found);
+static int emu_list_fields(struct emu_list *ls, const char *fields);
+static int emu_list_configs(int format, const char *fields, int sort);
+static int emu_daemon_path(char *buf, size_t sz, const char *name);
+static int emu_daemon_connect(void);
+static int emu_daemon_send(int fd, const char *buf, size_t len);
+static int emu_daemon_request(int fd, const char *const *args, size_t n);
+static char *emu_daemon_recv(int fd, size_t max, size_t *len);
+static int emu_daemon_copy(int fd);
+static int emu_daemon_names(struct emu_scan *scan);
+static int emu_daemon_start(const char **names, size_t n, const char *lang,
+			    int is_fullscreen);
+static int emu_daemon_vms(int format);
+static void emu_daemon_store(struct emu_daemon *d, struct emu_list *ls,
+			     const size_t *idx);
+static void emu_daemon_read(struct emu_daemon *d);
+static void emu_daemon_change(struct emu_daemon *d, const char *name,
+			      uint32_t mask);
+static void emu_daemon_gone(struct emu_daemon *d, const char *dir);
+static void emu_daemon_rescan(struct emu_daemon *d);
+static void emu_daemon_watch(struct emu_daemon *d);
+static void emu_daemon_list(struct emu_daemon *d, FILE *out, int format,
+			    const char *fields, int sort);
+static void emu_daemon_launch(struct emu_daemon *d, FILE *out, char **args,
+			      size_t n);
+static void emu_daemon_table(struct emu_daemon *d, FILE *out, int format);
+static void emu_daemon_reap(struct emu_daemon *d, size_t i, int status);
+static void emu_daemon_client(struct emu_daemon *d, int fd);
+static int emu_daemon_run(const char *bin);
+static int emu_check_match(const char *pats, const char *key, size_t len);
+static void emu_check_say(struct emu_check_ent *e, const char *name,
+			  int is_error, const char *fmt, ...);
+static int emu_check_ext(const char *path, const char *ext);
+static void emu_check_image(struct emu_check *c, struct emu_check_ent *e,
+			    int base, const struct emu_conf *cf,
+			    const struct emu_conf_key *k, int kind);
+static void emu_check_worker(void *arg, size_t idx);
+static int emu_check_compare(const void *s0, const void *s1);
+static int emu_check_configs(int argc, char **argv, int verbose);
+#ifdef EMUBOX_BENCH
+static uint64_t emu_bench_rand(uint64_t *seed);
+static int emu_bench_compare(const void *s0, const void *s1);
+static void emu_bench_report(const char *name, size_t nents, uint64_t *ns,
+			     size_t n, size_t items, const char *unit);
+static int emu_bench_generate(int dirfd, size_t n, uint64_t *seed);
+static int emu_bench_render(struct emu_scan *scan, uint64_t *ns, size_t n,
+			    uint64_t *seed);
+static int emu_bench_size(int rootfd, size_t n, uint64_t *seed);
+static int emu_bench(const char *sizes);
+#endif
 static void usage(int status);
 
-/* Consume everything before and after, until there's no "/". */
-static char *emu_basename(char *path)
-{
-	char *p;
-
-	p = path;
-	while (strchr(p, '/') != NULL)
-	        p++;
-
-	return (p);
-}
-
-/* qsort's internal function. */
-static int qsort_compare(const void *s0, const void *s1)
-{
-	/* See: https://man7.org/linux/man-pages/man3/qsort.3.html#EXAMPLES
-	   especially the commented part. Additionally drop the const qualifier
-	   as it will get stripped anyway. */
-	return (strcmp(*(char **)s0, *(char **)s1));
-}
-
 /* Execute the shell and let shell execute passed arguments. */
 static void emu_exec_shell(const char *args)
 {
@@ -163,663 +1632,9440 @@ static void emu_is_86box(void)
         }
 }
 
-/* Launch the 86box with or without arguments. */
-static void emu_launch_box(
-	const char *conf, const char *lang,
-	int is_fullscreen)
+/* Parse a list of CPUs, like "0,2-3". Returns -1 if it's not one. */
+static int emu_props_cpus(const char *v, cpu_set_t *set)
 {
-	int fd, ret;
-	pid_t pid;
-
-	pid = fork();
-	if (pid == (pid_t)0) {
-		fd = open("/dev/null", O_WRONLY);
-		if (fd == -1) {
-			/* A rather half-baked situation.
-			   Kill the forked process and exit,
-			   if this happened. */
-		        kill(pid, SIGKILL);
-			err(EXIT_FAILURE, "open");
-		}
-
-		dup2(fd, STDOUT_FILENO);
-		dup2(fd, STDERR_FILENO);
-		if (lang) {
-			if (is_fullscreen)
-				ret = execl(PATH_86BOX, PATH_86BOX,
-					    "-C", conf, "-G", lang,
-					    "-F", (char *)NULL);
-			else
-				ret = execl(PATH_86BOX, PATH_86BOX,
-					    "-C", conf, "-G", lang,
-					    (char *)NULL);
-		} else {
-			if (is_fullscreen)
-				ret = execl(PATH_86BOX, PATH_86BOX,
-					    "-C", conf, "-F",
-					    (char *)NULL);
-			else
-				ret = execl(PATH_86BOX, PATH_86BOX,
-					    "-C", conf, (char *)NULL);
-		}
-		if (ret == -1) {
-			close(fd);
-			/* May yield errors, we'll ignore them. */
-			kill(pid, SIGKILL);
-		        err(127, "execl");
+	unsigned long lo, hi;
+	char *end;
+
+	CPU_ZERO(set);
+	do {
+		if (!isdigit((unsigned char)*v))
+			return (-1);
+		lo = hi = strtoul(v, &end, 10);
+		if (*end == '-') {
+			if (!isdigit((unsigned char)end[1]))
+				return (-1);
+			hi = strtoul(end + 1, &end, 10);
 		}
+		if (lo > hi || hi >= CPU_SETSIZE)
+			return (-1);
+		for (; lo <= hi; lo++)
+			CPU_SET(lo, set);
+		v = end + (*end == ',');
+	} while (*end == ',');
+
+	return (*end == '\0' ? 0 : -1);
+}
 
-		close(fd);
-		while (waitpid(pid, NULL, 0) == 0);
-	}
+/* Warn about an invalid launch property, which is then ignored. */
+static void emu_props_invalid(const char *path, const char *key)
+{
+	fprintf(stderr, "emubox: %s: ignoring invalid \"%s\".\n", path, key);
 }
 
-/* Open 86box settings window of a configuration file. */
-static void emu_launch_settings(const char *conf)
+/* Read the launch properties of a config, from it's file inside
+   EMU_PROPS_DIR. A config without one is launched as it is, and
+   invalid values are ignored, with a warning. */
+static void emu_props_load(const char *path, const char *name,
+			   struct emu_props *props)
 {
-	int fd, ret;
-	pid_t pid;
+	static const struct {
+		const char *name;
+		int policy;
+	} policies[] = {
+		{ "other", SCHED_OTHER }, { "batch", SCHED_BATCH },
+		{ "idle", SCHED_IDLE }, { "fifo", SCHED_FIFO },
+		{ "rr", SCHED_RR },
+	};
+	static const char *classes[] = { "rt", "be", "idle" };
+	static const char units[] = "KMG";
+	struct emu_conf *cf;
+	const char *unit;
+	char p[PATH_MAX], v[64], *end;
+	long n;
+	size_t i;
+
+	memset(props, 0, sizeof(*props));
+	props->policy = -1;
+	props->ioprio = -1;
+
+	snprintf(p, sizeof(p), "%s/%s/%s", path, EMU_PROPS_DIR, name);
+	cf = emu_read_conf(AT_FDCWD, p);
+	if (cf == NULL) {
+		if (errno != ENOENT)
+			warn("%s", p);
+		return;
+	}
 
-	pid = fork();
-	if (pid == (pid_t)0) {
-		fd = open("/dev/null", O_WRONLY);
-		if (fd == -1) {
-			/* A rather half-baked situation.
-			   Kill the forked process and exit,
-			   if this happened. */
-		        kill(pid, SIGKILL);
-			err(EXIT_FAILURE, "open");
-		}
-
-		dup2(fd, STDOUT_FILENO);
-		dup2(fd, STDERR_FILENO);
-	        ret = execl(PATH_86BOX, PATH_86BOX,
-			    "-C", conf, "-S",
-			    (char *)NULL);
-		if (ret == -1) {
-			close(fd);
-			/* May yield errors, we'll ignore them. */
-			kill(pid, SIGKILL);
-		        err(127, "execl");
+	emu_conf_copy(cf, "emubox", "memory.max", props->memory_max,
+		      sizeof(props->memory_max));
+	emu_conf_copy(cf, "emubox", "cpu.max", props->cpu_max,
+		      sizeof(props->cpu_max));
+	emu_conf_copy(cf, "emubox", "io.max", props->io_max,
+		      sizeof(props->io_max));
+	emu_conf_copy(cf, "emubox", "emulator", props->emulator,
+		      sizeof(props->emulator));
+
+	/* "boot", "all" or an amount of bytes, like 512M. */
+	if (emu_conf_copy(cf, "emubox", "prewarm", v, sizeof(v))) {
+		if (strcmp(v, "boot") == 0) {
+			props->prewarm = UINT64_MAX;
+			props->prewarm_boot = 1;
+		} else if (strcmp(v, "all") == 0) {
+			props->prewarm = UINT64_MAX;
+		} else if (isdigit((unsigned char)v[0])) {
+			props->prewarm = strtoull(v, &end, 10);
+			unit = *end ? strchr(units, toupper((unsigned char)*end)) :
+				NULL;
+			if (unit && end[1] == '\0') {
+				props->prewarm <<= 10 * (unit - units + 1);
+			} else if (*end) {
+				props->prewarm = 0;
+				emu_props_invalid(p, "prewarm");
+			}
+		} else {
+			emu_props_invalid(p, "prewarm");
 		}
+	}
 
-		close(fd);
-		while (waitpid(pid, NULL, 0) == 0);
+	if (emu_conf_copy(cf, "emubox", "cpus", v, sizeof(v))) {
+		if (strcmp(v, "auto") == 0)
+			props->auto_cpus = 1;
+		else if (emu_props_cpus(v, &props->cpus) == 0)
+			props->has_cpus = 1;
+		else
+			emu_props_invalid(p, "cpus");
 	}
-}
 
-/* Creates ".emubox" directory, under your profile directory. */
-static void emu_init_directory(void)
-{
-	char *env, *p;
+	if (emu_conf_copy(cf, "emubox", "nice", v, sizeof(v))) {
+		n = strtol(v, &end, 10);
+		if (end == v || *end != '\0' || n < -20 || n > 19) {
+			emu_props_invalid(p, "nice");
+		} else {
+			props->has_nice = 1;
+			props->nice = (int)n;
+		}
+	}
+
+	if (emu_conf_copy(cf, "emubox", "policy", v, sizeof(v))) {
+		for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+			if (strcmp(v, policies[i].name) == 0)
+				props->policy = policies[i].policy;
+		if (props->policy == -1)
+			emu_props_invalid(p, "policy");
+	}
+
+	/* Only the realtime policies have a priority. */
+	if (props->policy == SCHED_FIFO || props->policy == SCHED_RR) {
+		props->sched_prio = 1;
+		if (emu_conf_copy(cf, "emubox", "priority", v, sizeof(v))) {
+			n = strtol(v, &end, 10);
+			if (end == v || *end != '\0' ||
+			    n < sched_get_priority_min(props->policy) ||
+			    n > sched_get_priority_max(props->policy))
+				emu_props_invalid(p, "priority");
+			else
+				props->sched_prio = (int)n;
+		}
+	}
+
+	if (emu_conf_copy(cf, "emubox", "ioclass", v, sizeof(v))) {
+		for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+			if (strcmp(v, classes[i]) == 0)
+				props->ioprio = EMU_IOPRIO((int)i + 1, 4);
+		if (props->ioprio == -1)
+			emu_props_invalid(p, "ioclass");
+	}
+
+	/* The idle class doesn't have levels. */
+	if (props->ioprio != -1 &&
+	    emu_conf_copy(cf, "emubox", "iolevel", v, sizeof(v))) {
+		n = strtol(v, &end, 10);
+		if (end == v || *end != '\0' || n < 0 || n > 7)
+			emu_props_invalid(p, "iolevel");
+		else
+			props->ioprio = EMU_IOPRIO(props->ioprio >>
+				IOPRIO_CLASS_SHIFT, (int)n);
+	}
+
+	emu_free_conf(cf);
+}
+
+/* Give every VM with "cpus = auto" a core of it's own. Cores pinned
+   by the other VMs are picked last, and cores are only shared if
+   there are more VMs than cores. */
+static void emu_props_assign(struct emu_props *props, size_t n)
+{
+	cpu_set_t allowed, used, left;
+	size_t i;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		warn("sched_getaffinity");
+		return;
+	}
+
+	CPU_ZERO(&used);
+	for (i = 0; i < n; i++)
+		if (props[i].has_cpus)
+			CPU_OR(&used, &used, &props[i].cpus);
+
+	CPU_ZERO(&left);
+	cpu = -1;
+	for (i = 0; i < n; i++) {
+		if (props[i].auto_cpus == 0)
+			continue;
+
+		/* Start over, once every core has been given. */
+		if (CPU_COUNT(&left) == 0) {
+			CPU_XOR(&left, &allowed, &used);
+			CPU_AND(&left, &left, &allowed);
+			if (CPU_COUNT(&left) == 0)
+				left = allowed;
+			cpu = -1;
+		}
+
+		while (!CPU_ISSET(++cpu, &left))
+			;
+		CPU_CLR(cpu, &left);
+		CPU_SET(cpu, &used);
+		CPU_ZERO(&props[i].cpus);
+		CPU_SET(cpu, &props[i].cpus);
+		props[i].has_cpus = 1;
+	}
+}
+
+/* Build of the registry with that name, or NULL. */
+static const struct emu_emulator *emu_emulators_find(
+	const struct emu_emulators *reg, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < reg->n; i++)
+		if (strcmp(reg->ents[i].name, name) == 0)
+			return (&reg->ents[i]);
+
+	return (NULL);
+}
+
+/* Add a build, unless there's one of that name already (or it can't
+   be kept in the cache). Returns NULL if it's not added. */
+static struct emu_emulator *emu_emulators_add(struct emu_emulators *reg,
+					      const char *name,
+					      const char *path, int source)
+{
+	struct emu_emulator *e;
+	size_t cap;
+
+	if (name[0] == '\0' || strlen(name) > NAME_MAX ||
+	    strlen(path) >= PATH_MAX || strpbrk(name, "\t\n") ||
+	    strpbrk(path, "\t\n") || emu_emulators_find(reg, name))
+		return (NULL);
+
+	if (reg->n == reg->cap) {
+		cap = reg->cap ? reg->cap * (size_t)2 : (size_t)8;
+		e = realloc(reg->ents, cap * sizeof(struct emu_emulator));
+		if (e == NULL)
+			err(EXIT_FAILURE, "realloc");
+		reg->ents = e;
+		reg->cap = cap;
+	}
+
+	e = &reg->ents[reg->n++];
+	memset(e, 0, sizeof(struct emu_emulator));
+	snprintf(e->name, sizeof(e->name), "%s", name);
+	snprintf(e->path, sizeof(e->path), "%s", path);
+	snprintf(e->version, sizeof(e->version), "-");
+	e->source = source;
+	return (e);
+}
+
+/* Whether the version of a build was read from that very file. */
+static int emu_emulator_same(const struct emu_emulator *e,
+			     const struct stat *st)
+{
+	return (e->dev == (uint64_t)st->st_dev &&
+		e->ino == (uint64_t)st->st_ino &&
+		e->size == (uint64_t)st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+/* Read the version of a build. 86box can't tell it without starting
+   up, so it's looked for in the file: a plain build has "86Box v"
+   and it's version in it. An AppImage is compressed, only a name
+   like "86Box-Linux-x86_64-b6130.AppImage" may tell (it's build).
+   That's a read of the whole file, which is why it's cached. */
+static void emu_emulator_version(struct emu_emulator *e)
+{
+	const char *map, *p, *end, *base;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	snprintf(e->version, sizeof(e->version), "-");
+	fd = open(e->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	e->dev = (uint64_t)st.st_dev;
+	e->ino = (uint64_t)st.st_ino;
+	e->size = (uint64_t)st.st_size;
+	e->mtime = st.st_mtim;
+	map = st.st_size > 16 ? mmap(NULL, (size_t)st.st_size, PROT_READ,
+				     MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	/* "AI" and 2 right after the ELF identification. */
+	if (map != MAP_FAILED && memcmp(map + 8, "AI\2", 3) != 0) {
+		madvise((void *)map, (size_t)st.st_size, MADV_SEQUENTIAL);
+		end = map + st.st_size;
+		for (p = map; (p = memmem(p, (size_t)(end - p), "86Box v",
+					  7)) != NULL; p += 7) {
+			if (p + 7 >= end || !isdigit((unsigned char)p[7]))
+				continue;
+			for (i = 0, p += 7; p < end && i < sizeof(e->version) - 1 &&
+			     (isalnum((unsigned char)*p) || *p == '.' ||
+			      *p == '-'); i++, p++)
+				e->version[i] = *p;
+			e->version[i] = '\0';
+			break;
+		}
+	}
+	if (map != MAP_FAILED)
+		munmap((void *)map, (size_t)st.st_size);
+	if (strcmp(e->version, "-") != 0)
+		return;
+
+	base = strrchr(e->path, '/');
+	base = base ? base + 1 : e->path;
+	for (p = base; (p = strstr(p, "-b")) != NULL; p += 2)
+		if (isdigit((unsigned char)p[2])) {
+			/* Kept as "b6130". */
+			for (i = 0, p++; i < sizeof(e->version) - 1 &&
+			     (i == 0 || isdigit((unsigned char)*p)); i++, p++)
+				e->version[i] = *p;
+			e->version[i] = '\0';
+			break;
+		}
+}
+
+/* What the builds that are found depend on: $PATH, the directories
+   in it and the registry, a line each. The cache is only used if it
+   starts with exactly this. */
+static char *emu_emulators_header(int dirfd)
+{
+	const char *env, *p, *end;
+	struct timespec mtime;
+	struct stat st;
+	char dir[PATH_MAX], *buf;
 	size_t sz;
+	FILE *fp;
+
+	env = getenv("PATH");
+	env = env ? env : "";
+	fp = open_memstream(&buf, &sz);
+	if (fp == NULL)
+		err(EXIT_FAILURE, "open_memstream");
+
+	fprintf(fp, "%s\npath\t%s\n", EMU_EMULATORS_MAGIC, env);
+	memset(&mtime, 0, sizeof(mtime));
+	if (fstatat(dirfd, EMU_EMULATORS_NAME, &st, 0) == 0)
+		mtime = st.st_mtim;
+	fprintf(fp, "stamp\t%s\t%lld.%09ld\n", EMU_EMULATORS_NAME,
+		(long long)mtime.tv_sec, mtime.tv_nsec);
+
+	for (p = env; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		snprintf(dir, sizeof(dir), "%.*s", end == p ? 1 :
+			 (int)(end - p), end == p ? "." : p);
+
+		memset(&mtime, 0, sizeof(mtime));
+		if (stat(dir, &st) == 0)
+			mtime = st.st_mtim;
+		fprintf(fp, "stamp\t%s\t%lld.%09ld\n", dir,
+			(long long)mtime.tv_sec, mtime.tv_nsec);
+	}
+
+	if (fclose(fp) == EOF)
+		err(EXIT_FAILURE, "fclose");
+	return (buf);
+}
+
+/* Find every build. The ones of the registry come first, then
+   PATH_86BOX (unless the registry has a "default" of it's own), then
+   every executable in $PATH named like "86Box...", by it's name. */
+static void emu_emulators_discover(struct emu_emulators *reg, int dirfd)
+{
+	const struct emu_conf_key *k;
+	const char *env, *p, *end, *home;
+	struct dirent *den;
+	struct emu_conf *cf;
+	struct stat st;
+	char name[NAME_MAX + 1], path[PATH_MAX], dir[PATH_MAX];
+	size_t i;
+	DIR *d;
+
+	cf = emu_read_conf(dirfd, EMU_EMULATORS_NAME);
+	home = getenv("HOME");
+	for (i = 0; cf && i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		if (k->sec_len != 9 ||
+		    memcmp(cf->map + k->sec_off, "emulators", 9) != 0 ||
+		    k->key_len > NAME_MAX || k->val_len == 0)
+			continue;
+
+		snprintf(name, sizeof(name), "%.*s", (int)k->key_len,
+			 cf->map + k->key_off);
+		if (k->val_len >= 2 && memcmp(cf->map + k->val_off, "~/", 2) == 0 &&
+		    home)
+			snprintf(path, sizeof(path), "%s/%.*s", home,
+				 (int)k->val_len - 2, cf->map + k->val_off + 2);
+		else
+			snprintf(path, sizeof(path), "%.*s", (int)k->val_len,
+				 cf->map + k->val_off);
+		emu_emulators_add(reg, name, path, EMU_EMULATOR_CONFIG);
+	}
+	if (cf)
+		emu_free_conf(cf);
+
+	emu_emulators_add(reg, EMU_EMULATOR_DEFAULT, PATH_86BOX,
+			  EMU_EMULATOR_BUILTIN);
+
+	env = getenv("PATH");
+	for (p = env ? env : ""; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ':');
+		if (end == NULL)
+			end = p + strlen(p);
+		snprintf(dir, sizeof(dir), "%.*s", end == p ? 1 :
+			 (int)(end - p), end == p ? "." : p);
+
+		d = opendir(dir);
+		if (d == NULL)
+			continue;
+		while ((den = readdir(d)) != NULL) {
+			if (strncmp(den->d_name, "86Box", 5) != 0)
+				continue;
+			if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir,
+					     den->d_name) >= sizeof(path))
+				continue;
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+			    access(path, X_OK) == 0)
+				emu_emulators_add(reg, den->d_name, path,
+						  EMU_EMULATOR_PATH);
+		}
+		closedir(d);
+	}
+}
+
+/* Read the builds of a cache back, a line each, like
+   "bin <name> <source> <path> <dev> <ino> <size> <mtime> <version>"
+   with tabs in between. */
+static void emu_emulators_parse(struct emu_emulators *reg, char *buf)
+{
+	struct emu_emulator *e;
+	char *line, *next, *f[9];
+	unsigned long long dev, ino, size;
+	long long sec;
+	long nsec;
+	int i;
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (strncmp(line, "bin\t", 4) != 0)
+			continue;
+
+		f[0] = line;
+		for (i = 1; i < 9 && (f[i] = strchr(f[i - 1], '\t')) != NULL;
+		     i++)
+			*f[i]++ = '\0';
+		if (i < 9 || sscanf(f[4], "%llu", &dev) != 1 ||
+		    sscanf(f[5], "%llu", &ino) != 1 ||
+		    sscanf(f[6], "%llu", &size) != 1 ||
+		    sscanf(f[7], "%lld.%ld", &sec, &nsec) != 2)
+			continue;
+
+		e = emu_emulators_add(reg, f[1], f[3], atoi(f[2]));
+		if (e == NULL || e->source < 0 ||
+		    e->source >= EMU_EMULATOR_SOURCES) {
+			if (e)
+				reg->n--;
+			continue;
+		}
+		e->dev = dev;
+		e->ino = ino;
+		e->size = size;
+		e->mtime.tv_sec = (time_t)sec;
+		e->mtime.tv_nsec = nsec;
+		snprintf(e->version, sizeof(e->version), "%s", f[8]);
+	}
+}
+
+/* Write the cache, it's locked and it already exists, so this
+   doesn't change the config directory (and it's index). */
+static void emu_emulators_write(int fd, const char *hdr,
+				const struct emu_emulators *reg)
+{
+	const struct emu_emulator *e;
+	char *buf;
+	size_t i, sz;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &sz);
+	if (fp == NULL)
+		err(EXIT_FAILURE, "open_memstream");
+	fputs(hdr, fp);
+	for (i = 0; i < reg->n; i++) {
+		e = &reg->ents[i];
+		fprintf(fp, "bin\t%s\t%d\t%s\t%llu\t%llu\t%llu\t%lld.%09ld\t%s\n",
+			e->name, e->source, e->path,
+			(unsigned long long)e->dev, (unsigned long long)e->ino,
+			(unsigned long long)e->size,
+			(long long)e->mtime.tv_sec, e->mtime.tv_nsec,
+			e->version);
+	}
+	fputs("end\n", fp);
+	if (fclose(fp) == EOF)
+		err(EXIT_FAILURE, "fclose");
+
+	/* Failing to write it isn't fatal, it's only a cache. */
+	if (pwrite(fd, buf, sz, 0) == (ssize_t)sz)
+		(void)!ftruncate(fd, (off_t)sz);
+	free(buf);
+}
+
+/* Get every known build. While the cache is valid, that's a read of
+   it and a stat of every directory in $PATH, nothing is looked for.
+   With verify, the version of every build is checked as well. A
+   version that's cached is kept as long as it's file is the same.
+   Returns -1 without a config directory. */
+static int emu_emulators_load(struct emu_emulators *reg, int verify)
+{
+	struct emu_emulators old;
+	const struct emu_emulator *o;
+	struct emu_emulator *e;
+	struct stat st;
+	char *hdr, *buf;
+	size_t i, len, sz, cap;
+	ssize_t n;
+	int dirfd, sfd, fd, valid, dirty;
+
+	memset(reg, 0, sizeof(struct emu_emulators));
+	memset(&old, 0, sizeof(old));
+	dirfd = emu_open_directory();
+	if (dirfd == -1)
+		return (-1);
+
+	hdr = emu_emulators_header(dirfd);
+	fd = -1;
+	sfd = emu_state_open(dirfd, 1);
+	if (sfd != -1) {
+		fd = openat(sfd, EMU_EMULATORS_CACHE, O_RDWR | O_CREAT |
+			    O_CLOEXEC, 0600);
+		close(sfd);
+	}
+	if (fd != -1 && flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		fd = -1;
+	}
+
+	/* The file ends with "end", anything else is a partial write. */
+	buf = NULL;
+	sz = cap = 0;
+	while (fd != -1) {
+		if (sz + 4096 + 1 > cap) {
+			cap = cap ? cap * 2 : (size_t)8192;
+			buf = realloc(buf, cap);
+			if (buf == NULL)
+				err(EXIT_FAILURE, "realloc");
+		}
+		n = pread(fd, buf + sz, cap - sz - 1, (off_t)sz);
+		if (n <= 0)
+			break;
+		sz += (size_t)n;
+	}
+	if (buf)
+		buf[sz] = '\0';
+	len = strlen(hdr);
+	valid = buf && sz >= (size_t)4 && strcmp(buf + sz - 4, "end\n") == 0;
+	if (valid)
+		emu_emulators_parse(&old, buf + (strncmp(buf, hdr, len) == 0 ?
+						 len : 0));
+	valid = valid && strncmp(buf, hdr, len) == 0;
+	free(buf);
+
+	dirty = 0;
+	if (valid) {
+		*reg = old;
+		memset(&old, 0, sizeof(old));
+	} else {
+		emu_emulators_discover(reg, dirfd);
+		dirty = 1;
+	}
+
+	for (i = 0; i < reg->n; i++) {
+		e = &reg->ents[i];
+		if (valid && verify == 0)
+			break;
+
+		/* Found again, the version may be known already. */
+		o = emu_emulators_find(&old, e->name);
+		if (o && strcmp(o->path, e->path) == 0) {
+			e->dev = o->dev;
+			e->ino = o->ino;
+			e->size = o->size;
+			e->mtime = o->mtime;
+			snprintf(e->version, sizeof(e->version), "%s",
+				 o->version);
+		}
+
+		if (stat(e->path, &st) == 0 && emu_emulator_same(e, &st))
+			continue;
+		emu_emulator_version(e);
+		dirty = 1;
+	}
+
+	if (fd != -1 && dirty)
+		emu_emulators_write(fd, hdr, reg);
+	if (fd != -1)
+		close(fd);
+	emu_emulators_free(&old);
+	free(hdr);
+	close(dirfd);
+	return (0);
+}
+
+/* Free every build. */
+static void emu_emulators_free(struct emu_emulators *reg)
+{
+	free(reg->ents);
+	memset(reg, 0, sizeof(struct emu_emulators));
+}
+
+/* Binary to run a VM with, for the build it names. PATH_86BOX is
+   bin, which may be it's extraction. Returns NULL (and tells why) if
+   there's no build of that name. */
+static const char *emu_emulator_bin(const struct emu_emulators *reg,
+				    const char *vm, const char *name,
+				    const char *bin)
+{
+	const struct emu_emulator *e;
+
+	e = emu_emulators_find(reg, name);
+	if (e == NULL) {
+		fprintf(stderr, "emubox: %s: unknown emulator \"%s\".\n",
+			vm, name);
+		return (NULL);
+	}
+
+	if (e->source == EMU_EMULATOR_BUILTIN &&
+	    strcmp(e->path, PATH_86BOX) == 0)
+		return (bin);
+	return (e->path);
+}
+
+/* List every known build, with where it comes from and it's version,
+   like --list does. */
+static int emu_emulators_list(int format)
+{
+	static const char *sources[EMU_EMULATOR_SOURCES] = {
+		"builtin", "config", "path",
+	};
+	const struct emu_emulator *e;
+	struct emu_emulators reg;
+	struct emu_list ls;
+	size_t i;
+
+	if (emu_emulators_load(&reg, 1) == -1)
+		return (EXIT_FAILURE);
+
+	memset(&ls, 0, sizeof(ls));
+	ls.format = format;
+	ls.out = stdout;
+	for (i = 0; i < reg.n; i++) {
+		e = &reg.ents[i];
+		if (format == EMU_LIST_JSON)
+			fputs("{\"name\":", stdout);
+		emu_list_string(&ls, e->name);
+		fputs(format == EMU_LIST_JSON ? ",\"source\":" : "\t", stdout);
+		emu_list_string(&ls, sources[e->source]);
+		fputs(format == EMU_LIST_JSON ? ",\"version\":" : "\t", stdout);
+		emu_list_string(&ls, e->version);
+		fputs(format == EMU_LIST_JSON ? ",\"path\":" : "\t", stdout);
+		emu_list_string(&ls, e->path);
+		fputs(format == EMU_LIST_JSON ? "}\n" : "\n", stdout);
+	}
+
+	emu_emulators_free(&reg);
+	return (EXIT_SUCCESS);
+}
+
+/* Apply launch properties to the calling thread. On Linux all of
+   them are per thread, and a child inherits them from the thread
+   that has started it. A property that can't be applied (most of
+   them need privileges to go up) is skipped, with a warning. */
+static void emu_props_apply(const struct emu_props *props)
+{
+	struct sched_param sp;
+
+	if (props->has_cpus &&
+	    sched_setaffinity(0, sizeof(props->cpus), &props->cpus) == -1)
+		warn("sched_setaffinity");
+
+	if (props->policy != -1) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = props->sched_prio;
+		if (sched_setscheduler(0, props->policy, &sp) == -1)
+			warn("sched_setscheduler");
+	}
+
+	if (props->has_nice &&
+	    setpriority(PRIO_PROCESS, 0, props->nice) == -1)
+		warn("setpriority");
+
+	if (props->ioprio != -1 &&
+	    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    props->ioprio) == -1)
+		warn("ioprio_set");
+}
+
+/* Write a value to a file of a cgroup. Returns -1 if it couldn't. */
+static int emu_cgroup_write(int fd, const char *file, const char *val)
+{
+	ssize_t n;
+	int f;
+
+	f = openat(fd, file, O_WRONLY | O_CLOEXEC);
+	if (f == -1)
+		return (-1);
+
+	n = write(f, val, strlen(val));
+	close(f);
+	return (n == (ssize_t)strlen(val) ? 0 : -1);
+}
+
+/* Set up the cgroup tree of --cgroup, in the cgroup emubox has been
+   started in. It has to be delegated to the user, for example with
+   "systemd-run --user --scope -p Delegate=yes emubox --select --cgroup".
+   Returns -1 if there's no usable cgroup v2 tree. */
+static int emu_cgroup_open(struct emu_cgroup *cg)
+{
+	static const char *ctls[] = { "+cpu", "+memory", "+io" };
+	char line[PATH_MAX], mnt[PATH_MAX], dir[PATH_MAX * 2];
+	char *p, *q;
+	size_t i;
+	FILE *fp;
+
+	cg->root = cg->self = -1;
+
+	/* Where the cgroup v2 hierarchy is mounted. */
+	mnt[0] = '\0';
+	fp = fopen("/proc/self/mountinfo", "re");
+	while (fp && fgets(line, sizeof(line), fp)) {
+		p = strstr(line, " - cgroup2 ");
+		if (p == NULL)
+			continue;
+		*p = '\0';
+		/* Mount point is the fifth field. */
+		for (q = line, i = 0; q && i < 4; i++)
+			q = strchr(q + 1, ' ');
+		if (q) {
+			snprintf(mnt, sizeof(mnt), "%s", q + 1);
+			mnt[strcspn(mnt, " ")] = '\0';
+		}
+		break;
+	}
+	if (fp)
+		fclose(fp);
+
+	/* And emubox's cgroup in it, the "0::" line. */
+	line[0] = '\0';
+	fp = fopen("/proc/self/cgroup", "re");
+	while (fp && fgets(line, sizeof(line), fp))
+		if (strncmp(line, "0::", 3) == 0)
+			break;
+	if (fp)
+		fclose(fp);
+
+	if (mnt[0] == '\0' || strncmp(line, "0::", 3) != 0) {
+		fputs("emubox: cgroup v2 is not available.\n", stderr);
+		return (-1);
+	}
+	line[strcspn(line, "\n")] = '\0';
+
+	/* Already inside of our own leaf, from an earlier launch. */
+	p = strrchr(line + 3, '/');
+	if (p && strcmp(p + 1, EMU_CGROUP_SELF) == 0)
+		*p = '\0';
+
+	snprintf(dir, sizeof(dir), "%s%s", mnt, line + 3);
+	cg->root = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cg->root == -1) {
+		warn("%s", dir);
+		return (-1);
+	}
+
+	if (mkdirat(cg->root, EMU_CGROUP_SELF, 0755) == -1 &&
+	    errno != EEXIST) {
+		warn("%s/%s", dir, EMU_CGROUP_SELF);
+		goto fail;
+	}
+	cg->self = openat(cg->root, EMU_CGROUP_SELF,
+			  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cg->self == -1 ||
+	    emu_cgroup_write(cg->self, "cgroup.procs", "0") == -1) {
+		warn("%s/%s", dir, EMU_CGROUP_SELF);
+		goto fail;
+	}
+
+	/* Whatever the parent lets us have, the limits that can't be
+	   set are warned about later on. */
+	for (i = 0; i < sizeof(ctls) / sizeof(ctls[0]); i++)
+		emu_cgroup_write(cg->root, "cgroup.subtree_control", ctls[i]);
+	return (0);
+
+fail:
+	emu_cgroup_close(cg);
+	return (-1);
+}
+
+/* Let go of the cgroup tree. emubox stays in it's leaf, it can't go
+   back with the controllers given away. */
+static void emu_cgroup_close(struct emu_cgroup *cg)
+{
+	if (cg->self != -1)
+		close(cg->self);
+	if (cg->root != -1)
+		close(cg->root);
+	cg->root = cg->self = -1;
+}
+
+/* File name of something a VM has of it's own, like it's cgroup or
+   it's log, between prefix and suffix. One below the config directory
+   (or a root) has every "/" of it's name turned into a "_". A name
+   too long for a file name (a walked one can be a full path) is cut,
+   with the hash of all of it, so two VMs never get the same one. buf
+   has room for NAME_MAX + 1. */
+static void emu_vm_file(const char *name, const char *prefix,
+			const char *suffix, char *buf)
+{
+	size_t len, fix;
+	char *p;
+
+	len = strlen(name);
+	fix = strlen(prefix) + strlen(suffix);
+	if (fix + len <= (size_t)NAME_MAX)
+		snprintf(buf, NAME_MAX + 1, "%s%s%s", prefix, name, suffix);
+	else
+		snprintf(buf, NAME_MAX + 1, "%s%.*s-%08x%s", prefix,
+			 (int)(NAME_MAX - fix - 9), name,
+			 emu_conf_hash(name, len, "", 0), suffix);
+
+	for (p = buf + strlen(prefix); *p; p++)
+		if (*p == '/')
+			*p = '_';
+}
+
+/* Name of the cgroup of a VM, buf has room for NAME_MAX + 1. */
+static void emu_cgroup_name(const char *name, char *buf)
+{
+	emu_vm_file(name, "vm-", "", buf);
+}
+
+/* Create the cgroup of a VM, with it's limits. One left behind by an
+   earlier launch is used again. Returns it's fd, or -1. */
+static int emu_cgroup_create(const struct emu_cgroup *cg, const char *name,
+			     const struct emu_props *props)
+{
+	char dir[NAME_MAX + 1];
+	int fd;
+
+	emu_cgroup_name(name, dir);
+	if (mkdirat(cg->root, dir, 0755) == -1 && errno != EEXIST) {
+		warn("cgroup %s", dir);
+		return (-1);
+	}
+
+	fd = openat(cg->root, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		warn("cgroup %s", dir);
+		return (-1);
+	}
+
+	/* Reset what isn't set, the cgroup may be an old one. */
+	if (emu_cgroup_write(fd, "memory.max", props->memory_max[0] ?
+			     props->memory_max : "max") == -1 &&
+	    props->memory_max[0])
+		warn("cgroup %s: memory.max", dir);
+	if (emu_cgroup_write(fd, "cpu.max", props->cpu_max[0] ?
+			     props->cpu_max : "max") == -1 &&
+	    props->cpu_max[0])
+		warn("cgroup %s: cpu.max", dir);
+	if (props->io_max[0] &&
+	    emu_cgroup_write(fd, "io.max", props->io_max) == -1)
+		warn("cgroup %s: io.max", dir);
+
+	return (fd);
+}
+
+/* Remove the cgroup of a VM that's gone. If anything it has started
+   is still around, the cgroup is left as it is. */
+static void emu_cgroup_remove(const struct emu_cgroup *cg, struct emu_vm *vm)
+{
+	char dir[NAME_MAX + 1];
+
+	if (vm->cgroup == -1)
+		return;
+
+	close(vm->cgroup);
+	vm->cgroup = -1;
+	emu_cgroup_name(vm->name, dir);
+	unlinkat(cg->root, dir, AT_REMOVEDIR);
+}
+
+/* Read the resource usage of a cgroup. What can't be read (without
+   it's controller, or before Linux 5.19 for the peak) is left at 0. */
+static void emu_cgroup_usage(int fd, struct emu_cgroup_usage *u)
+{
+	char buf[4096], *p;
+	unsigned long long v;
+	ssize_t n;
+	int f;
+
+	memset(u, 0, sizeof(*u));
+	f = openat(fd, "cpu.stat", O_RDONLY | O_CLOEXEC);
+	if (f != -1) {
+		n = read(f, buf, sizeof(buf) - 1);
+		close(f);
+		buf[n > 0 ? n : 0] = '\0';
+		if (sscanf(buf, "usage_usec %llu", &v) == 1)
+			u->cpu_usec = v;
+	}
+
+	f = openat(fd, "memory.current", O_RDONLY | O_CLOEXEC);
+	if (f != -1) {
+		n = read(f, buf, sizeof(buf) - 1);
+		close(f);
+		buf[n > 0 ? n : 0] = '\0';
+		u->mem = strtoull(buf, NULL, 10);
+		u->has_mem = 1;
+	}
+
+	f = openat(fd, "memory.peak", O_RDONLY | O_CLOEXEC);
+	if (f != -1) {
+		n = read(f, buf, sizeof(buf) - 1);
+		close(f);
+		buf[n > 0 ? n : 0] = '\0';
+		u->mem_peak = strtoull(buf, NULL, 10);
+	}
+
+	/* A line per device, "8:0 rbytes=... wbytes=... ...". */
+	f = openat(fd, "io.stat", O_RDONLY | O_CLOEXEC);
+	if (f != -1) {
+		n = read(f, buf, sizeof(buf) - 1);
+		close(f);
+		buf[n > 0 ? n : 0] = '\0';
+		u->has_io = 1;
+		for (p = buf; (p = strstr(p, "rbytes=")) != NULL; p += 7)
+			u->rbytes += strtoull(p + 7, NULL, 10);
+		for (p = buf; (p = strstr(p, "wbytes=")) != NULL; p += 7)
+			u->wbytes += strtoull(p + 7, NULL, 10);
+	}
+}
+
+/* Tell what a VM has used, from it's cgroup. */
+static void emu_cgroup_report(const struct emu_vm *vm)
+{
+	struct emu_cgroup_usage u;
+
+	if (vm->cgroup == -1)
+		return;
+
+	emu_cgroup_usage(vm->cgroup, &u);
+	fprintf(stdout, "emubox: %s: cpu %.1fs", vm->name,
+		(double)u.cpu_usec / 1e6);
+	if (u.has_mem)
+		fprintf(stdout, ", memory %.1f MiB (peak %.1f MiB)",
+			(double)u.mem / 1048576.0,
+			(double)u.mem_peak / 1048576.0);
+	if (u.has_io)
+		fprintf(stdout, ", read %.1f MiB, written %.1f MiB",
+			(double)u.rbytes / 1048576.0,
+			(double)u.wbytes / 1048576.0);
+	fputc('\n', stdout);
+	fflush(stdout);
+}
+
+/* Start 86box in the background, with it's output going to out (or
+   thrown away if it's -1). It's started through posix_spawn(3), which
+   doesn't copy emubox's memory (glibc uses a vfork-like clone).
+   Returns the pid, or -1. */
+static pid_t emu_spawn_exec(const char *bin, char *const argv[], int out)
+{
+	posix_spawn_file_actions_t fa;
+	pid_t pid;
+	int ret;
+
+	if ((ret = posix_spawn_file_actions_init(&fa)) != 0 ||
+	    (ret = out == -1 ?
+	     posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO,
+		    "/dev/null", O_WRONLY, 0) :
+	     posix_spawn_file_actions_adddup2(&fa, out,
+		    STDOUT_FILENO)) != 0 ||
+	    (ret = posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO,
+		    STDERR_FILENO)) != 0) {
+		errno = ret;
+		warn("posix_spawn");
+		return (-1);
+	}
+
+	ret = posix_spawn(&pid, bin, &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if (ret != 0) {
+		errno = ret;
+		warn("posix_spawn: %s", bin);
+		return (-1);
+	}
+
+	return (pid);
+}
+
+/* Thread of a launch with properties, it applies them to itself and
+   spawns 86box, which starts with them. */
+static void *emu_spawn_thread(void *arg)
+{
+	struct emu_spawn *sp;
+
+	sp = arg;
+	emu_props_apply(sp->props);
+	sp->pid = emu_spawn_exec(sp->bin, sp->argv, sp->out);
+	return (NULL);
+}
+
+/* Read ahead the disk images of a config, and drop it afterwards.
+   posix_fadvise(2) only starts the reads, the images are in the page
+   cache by the time the guest boots from them (instead of it waiting
+   on every miss, which is slow on network storage). */
+static void *emu_prewarm_thread(void *arg)
+{
+	const struct emu_conf_key *k;
+	struct emu_prewarm *pw;
+	struct emu_conf *cf;
+	struct stat st;
+	char *base, path[PATH_MAX];
+	uint64_t len, off;
+	size_t i;
+	int dirfd, fd;
+
+	pw = arg;
+	base = strrchr(pw->conf, '/');
+	if (base == NULL)
+		goto out;
+	*base++ = '\0';
+
+	/* Images are relative to the config directory. */
+	dirfd = open(pw->conf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		goto out;
+	cf = emu_read_conf(dirfd, base);
+	if (cf == NULL) {
+		close(dirfd);
+		goto out;
+	}
+
+	for (i = 0; i < cf->nkeys && pw->left; i++) {
+		k = &cf->keys[i];
+		if (k->val_len == 0 || k->val_len >= sizeof(path) ||
+		    emu_conf_image(cf->map + k->key_off, k->key_len) == -1)
+			continue;
+		memcpy(path, cf->map + k->val_off, k->val_len);
+		path[k->val_len] = '\0';
+		if (strncmp(path, "ioctl", 5) == 0)
+			continue;
+
+		fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			len = (uint64_t)st.st_size;
+			if (pw->boot && len > EMU_PREWARM_BOOT)
+				len = EMU_PREWARM_BOOT;
+			if (len > pw->left)
+				len = pw->left;
+			for (off = 0; off < len; off += EMU_PREWARM_CHUNK)
+				posix_fadvise(fd, (off_t)off, (off_t)(len - off <
+					      EMU_PREWARM_CHUNK ? len - off :
+					      EMU_PREWARM_CHUNK),
+					      POSIX_FADV_WILLNEED);
+			if (pw->boot == 0)
+				pw->left -= len;
+		}
+		close(fd);
+	}
+
+	emu_free_conf(cf);
+	close(dirfd);
+out:
+	free(pw);
+	return (NULL);
+}
+
+/* Start reading ahead the disk images of conf, as much of them as
+   props wants, while 86box starts. The thread is left on it's own,
+   emubox waits for the VM anyway. */
+static void emu_prewarm_start(const char *conf, const struct emu_props *props)
+{
+	struct emu_prewarm *pw;
+	pthread_attr_t attr;
+	pthread_t th;
+	int ret;
+
+	pw = malloc(sizeof(struct emu_prewarm));
+	if (pw == NULL)
+		err(EXIT_FAILURE, "malloc");
+	snprintf(pw->conf, sizeof(pw->conf), "%s", conf);
+	pw->left = props->prewarm;
+	pw->boot = props->prewarm_boot;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&th, &attr, emu_prewarm_thread, pw);
+	pthread_attr_destroy(&attr);
+	if (ret != 0) {
+		errno = ret;
+		warn("pthread_create");
+		free(pw);
+	}
+}
+
+/* Start 86box, with it's launch properties if there are any. The
+   properties are applied from a short lived thread, so they're set
+   before 86box starts (and before it starts any thread of it's own),
+   without changing anything of emubox itself. With log, it's output
+   goes into a pipe, and log is the (non-blocking) end it's read from,
+   or -1 if it's thrown away. Returns the pid, or -1. */
+static pid_t emu_spawn_box(const char *bin, char *const argv[],
+			   const struct emu_props *props, int *log)
+{
+	struct emu_spawn sp;
+	pthread_t th;
+	int ret, fds[2];
+
+	fds[0] = fds[1] = -1;
+	if (log) {
+		*log = -1;
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			warn("pipe2");
+			fds[0] = fds[1] = -1;
+		} else {
+			(void)fcntl(fds[0], F_SETFL, O_NONBLOCK);
+			(void)fcntl(fds[0], F_SETPIPE_SZ, EMU_LOG_PIPE);
+		}
+
+		/* Ignored stays ignored through exec, so once emubox is
+		   gone (emuboxd leaves it's VMs running) a write of 86box
+		   fails with EPIPE, instead of killing it. */
+		signal(SIGPIPE, SIG_IGN);
+	}
+
+	sp.bin = bin;
+	sp.argv = argv;
+	sp.props = props;
+	sp.out = fds[1];
+	sp.pid = -1;
+	if (props == NULL || (props->has_cpus == 0 && props->has_nice == 0 &&
+	    props->policy == -1 && props->ioprio == -1))
+		sp.pid = emu_spawn_exec(bin, argv, sp.out);
+	else if ((ret = pthread_create(&th, NULL, emu_spawn_thread,
+				       &sp)) != 0) {
+		errno = ret;
+		warn("pthread_create");
+	} else {
+		pthread_join(th, NULL);
+	}
+
+	if (fds[1] != -1)
+		close(fds[1]);
+	if (fds[0] != -1 && sp.pid == (pid_t)-1)
+		close(fds[0]);
+	else if (log)
+		*log = fds[0];
+	return (sp.pid);
+}
+
+/* Launch the 86box with or without arguments. */
+static pid_t emu_launch_box(
+	const char *bin, const char *conf,
+	const char *lang, int is_fullscreen,
+	const struct emu_props *props, int *log)
+{
+	char *argv[7];
+	int argc;
+
+	argc = 0;
+	argv[argc++] = (char *)bin;
+	argv[argc++] = (char *)"-C";
+	argv[argc++] = (char *)conf;
+	if (lang) {
+		argv[argc++] = (char *)"-G";
+		argv[argc++] = (char *)lang;
+	}
+	if (is_fullscreen)
+		argv[argc++] = (char *)"-F";
+	argv[argc] = NULL;
+
+	/* The AppImage takes a while to start, the images are read in
+	   the meantime. */
+	if (props && props->prewarm)
+		emu_prewarm_start(conf, props);
+
+	return (emu_spawn_box(bin, argv, props, log));
+}
+
+/* Open 86box settings window of a configuration file. */
+static pid_t emu_launch_settings(const char *bin, const char *conf, int *log)
+{
+	char *argv[5];
+
+	argv[0] = (char *)bin;
+	argv[1] = (char *)"-C";
+	argv[2] = (char *)conf;
+	argv[3] = (char *)"-S";
+	argv[4] = NULL;
+
+	return (emu_spawn_box(bin, argv, NULL, log));
+}
+
+/* Hash of the whole AppImage, a word at a time. It's only computed
+   again when the AppImage itself has changed. */
+static uint64_t emu_appimage_hash(int fd, size_t len)
+{
+	const unsigned char *map;
+	uint64_t h, w;
+	size_t i;
+
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return (0);
+
+	madvise((void *)map, len, MADV_SEQUENTIAL);
+	h = 0xcbf29ce484222325ULL ^ (uint64_t)len;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, map + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ map[i]) * 0x100000001b3ULL;
+
+	munmap((void *)map, len);
+	/* 0 means there's no hash. */
+	return (h ? h : 1);
+}
+
+/* nftw's internal function, for emu_remove_tree(...) */
+static int emu_remove_entry(const char *path, const struct stat *st,
+			    int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	remove(path);
+	return (0);
+}
+
+/* Remove a whole directory tree, as much as possible of it. */
+static void emu_remove_tree(const char *path)
+{
+	nftw(path, emu_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/* Extract the AppImage into dir, through it's own runtime, the same
+   way "./86Box.AppImage --appimage-extract" does. Returns -1 if it
+   couldn't be extracted. */
+static int emu_appimage_extract(const char *dir, const char *image)
+{
+	posix_spawn_file_actions_t fa;
+	char *argv[3];
+	int ret, status;
+	pid_t pid;
+
+	argv[0] = (char *)image;
+	argv[1] = (char *)"--appimage-extract";
+	argv[2] = NULL;
+	if ((ret = posix_spawn_file_actions_init(&fa)) != 0 ||
+	    (ret = posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO,
+		    "/dev/null", O_WRONLY, 0)) != 0 ||
+	    (ret = posix_spawn_file_actions_adddup2(&fa, STDOUT_FILENO,
+		    STDERR_FILENO)) != 0 ||
+	    (ret = posix_spawn_file_actions_addchdir_np(&fa, dir)) != 0 ||
+	    (ret = posix_spawn(&pid, image, &fa, NULL, argv, environ)) != 0) {
+		posix_spawn_file_actions_destroy(&fa);
+		errno = ret;
+		warn("posix_spawn: %s", image);
+		return (-1);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return (-1);
+
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1);
+}
+
+/* Get the path of the extracted 86box, extracting the AppImage into
+   the cache first, if it's not there yet. Every extraction is keyed
+   by the hash of the AppImage, so a new AppImage gets a new one and
+   the previous one is removed. The stamp file remembers the hash for
+   the identity of the AppImage, and serializes the extractions.
+   Returns -1 if it couldn't be extracted, bin is left untouched. */
+static int emu_appimage_cache(char *bin, size_t sz)
+{
+	/* Leave room for everything that goes after the cache. */
+	char image[PATH_MAX], cache[PATH_MAX - 64], dir[PATH_MAX - 32];
+	char tmp[PATH_MAX], src[PATH_MAX], *path;
+	struct emu_appimage_stamp stamp, old;
+	struct stat st;
+	int fd, lock, ret;
+
+	if (realpath(PATH_86BOX, image) == NULL) {
+		warn("realpath: %s", PATH_86BOX);
+		return (-1);
+	}
+
+	path = emu_get_directory();
+	if (path == NULL)
+		return (-1);
+	ret = snprintf(cache, sizeof(cache), "%s/%s", path, EMU_APPIMAGE_CACHE);
+	free(path);
+	if (ret < 0 || (size_t)ret >= sizeof(cache)) {
+		fputs("emubox: $HOME is too long.\n", stderr);
+		return (-1);
+	}
+	if (mkdir(cache, 0700) == -1 && errno != EEXIST) {
+		warn("mkdir: %s", cache);
+		return (-1);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s/stamp", cache);
+	lock = open(tmp, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lock == -1 || flock(lock, LOCK_EX) == -1) {
+		warn("open: %s", tmp);
+		if (lock != -1)
+			close(lock);
+		return (-1);
+	}
+
+	ret = -1;
+	fd = open(image, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		warn("open: %s", image);
+		goto out_close;
+	}
+
+	memset(&stamp, 0, sizeof(stamp));
+	stamp.dev = (uint64_t)st.st_dev;
+	stamp.ino = (uint64_t)st.st_ino;
+	stamp.size = (uint64_t)st.st_size;
+	stamp.mtime = st.st_mtim;
+	if (pread(lock, &old, sizeof(old), 0) != (ssize_t)sizeof(old))
+		memset(&old, 0, sizeof(old));
+	if (old.hash && old.dev == stamp.dev && old.ino == stamp.ino &&
+	    old.size == stamp.size && old.mtime.tv_sec == stamp.mtime.tv_sec &&
+	    old.mtime.tv_nsec == stamp.mtime.tv_nsec)
+		stamp.hash = old.hash;
+	else
+		stamp.hash = emu_appimage_hash(fd, (size_t)st.st_size);
+	if (stamp.hash == 0)
+		goto out_close;
+
+	snprintf(dir, sizeof(dir), "%s/%016llx", cache,
+		 (unsigned long long)stamp.hash);
+	snprintf(src, sizeof(src), "%s/AppRun", dir);
+	if (access(src, X_OK) == 0)
+		goto out_stamp;
+
+	/* What's left of an interrupted extraction is thrown away. */
+	fputs("emubox: extracting the AppImage, only this time.\n", stdout);
+	fflush(stdout);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dir);
+	emu_remove_tree(tmp);
+	emu_remove_tree(dir);
+	if (mkdir(tmp, 0700) == -1 ||
+	    emu_appimage_extract(tmp, image) == -1) {
+		fputs("emubox: couldn't extract the AppImage.\n", stderr);
+		emu_remove_tree(tmp);
+		goto out_close;
+	}
+
+	snprintf(src, sizeof(src), "%s.tmp/squashfs-root", dir);
+	if (rename(src, dir) == -1) {
+		warn("rename");
+		emu_remove_tree(tmp);
+		goto out_close;
+	}
+	emu_remove_tree(tmp);
+	snprintf(src, sizeof(src), "%s/AppRun", dir);
+
+	/* Running VMs keep the files of the previous one open. */
+	if (old.hash && old.hash != stamp.hash) {
+		snprintf(tmp, sizeof(tmp), "%s/%016llx", cache,
+			 (unsigned long long)old.hash);
+		emu_remove_tree(tmp);
+	}
+
+out_stamp:
+	if (memcmp(&old, &stamp, sizeof(stamp)) != 0)
+		(void)!pwrite(lock, &stamp, sizeof(stamp), 0);
+
+	snprintf(bin, sz, "%s", src);
+	ret = 0;
+
+out_close:
+	if (fd != -1)
+		close(fd);
+	close(lock);
+	return (ret);
+}
+
+/* Write end of the pipe emuboxd (or the supervisor) is woken up
+   through by a signal. */
+static int emu_wake = -1;
+
+/* A signal, let the loop know which one. */
+static void emu_wake_signal(int sig)
+{
+	char c;
+	int e;
+
+	e = errno;
+	c = (char)sig;
+	(void)!write(emu_wake, &c, 1);
+	errno = e;
+}
+
+/* Take every signal that's in the pipe. Returns EMU_WAKE_USR1 if
+   there's a SIGUSR1, and EMU_WAKE_OTHER if there's any other one. */
+static int emu_wake_take(int fd)
+{
+	char buf[64];
+	ssize_t i, n;
+	int got;
+
+	got = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			got |= buf[i] == (char)SIGUSR1 ? EMU_WAKE_USR1 :
+				EMU_WAKE_OTHER;
+
+	return (got);
+}
+
+/* Read what's in the pipe of a VM into it's ring, without ever waiting
+   for more. The pipe is closed once 86box (and everything it started)
+   has closed it's end. */
+static void emu_log_read(struct emu_log *l)
+{
+	size_t off;
+	ssize_t n;
+	int i;
+
+	for (i = 0; l->fd != -1 && i < EMU_LOG_READS; i++) {
+		if (l->buf == NULL) {
+			l->buf = malloc(EMU_LOG_SIZE);
+			if (l->buf == NULL)
+				err(EXIT_FAILURE, "malloc");
+		}
+
+		off = (size_t)(l->len % EMU_LOG_SIZE);
+		n = read(l->fd, l->buf + off, EMU_LOG_SIZE - off);
+		if (n > 0) {
+			l->len += (uint64_t)n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			return;
+
+		close(l->fd);
+		l->fd = -1;
+	}
+}
+
+/* Copy the last (up to) sz bytes of the ring into buf, in order.
+   Returns how many of them there are. */
+static size_t emu_log_tail(const struct emu_log *l, char *buf, size_t sz)
+{
+	size_t n, off, first;
+
+	if (l->buf == NULL)
+		return (0);
+
+	n = l->len < EMU_LOG_SIZE ? (size_t)l->len : (size_t)EMU_LOG_SIZE;
+	if (n > sz)
+		n = sz;
+	off = (size_t)((l->len - n) % EMU_LOG_SIZE);
+	first = EMU_LOG_SIZE - off < n ? EMU_LOG_SIZE - off : n;
+	memcpy(buf, l->buf + off, first);
+	memcpy(buf + first, l->buf, n - first);
+	return (n);
+}
+
+/* File name of the log of a VM, buf has room for NAME_MAX + 1. */
+static void emu_log_name(const char *name, int gen, char *buf)
+{
+	char suffix[32];
+
+	if (gen)
+		snprintf(suffix, sizeof(suffix), ".log.%d", gen);
+	else
+		snprintf(suffix, sizeof(suffix), ".log");
+	emu_vm_file(name, "", suffix, buf);
+}
+
+/* Save the ring of a VM to it's log, the earlier ones go one down (and
+   the oldest one away). With exited, it's gone as status tells, it's
+   still running otherwise. Nothing is saved if there's nothing new
+   since the last time. Returns -1 if it couldn't be saved. */
+static int emu_log_save(struct emu_vm *vm, int exited, int status)
+{
+	struct emu_log *l;
+	char from[NAME_MAX + 1], to[NAME_MAX + 1], *buf;
+	size_t n;
+	int dirfd, fd, gen;
+	FILE *fp;
+
+	l = &vm->log;
+	if (l->len == l->saved)
+		return (0);
+
+	dirfd = emu_open_directory();
+	if (dirfd == -1)
+		return (-1);
+	if (mkdirat(dirfd, EMU_LOG_DIR, 0700) == -1 && errno != EEXIST) {
+		warn("%s", EMU_LOG_DIR);
+		close(dirfd);
+		return (-1);
+	}
+	fd = openat(dirfd, EMU_LOG_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	close(dirfd);
+	if (fd == -1) {
+		fprintf(stderr, "emubox: %s: log couldn't be saved.\n",
+			vm->name);
+		return (-1);
+	}
+	dirfd = fd;
+
+	for (gen = EMU_LOG_KEEP - 1; gen > 0; gen--) {
+		emu_log_name(vm->name, gen - 1, from);
+		emu_log_name(vm->name, gen, to);
+		(void)renameat(dirfd, from, dirfd, to);
+	}
+	emu_log_name(vm->name, 0, to);
+
+	fd = openat(dirfd, to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0600);
+	close(dirfd);
+	fp = fd != -1 ? fdopen(fd, "w") : NULL;
+	if (fp == NULL) {
+		warn("%s/%s", EMU_LOG_DIR, to);
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+
+	if (exited == 0)
+		fprintf(fp, "emubox: %s: running as pid %d\n", vm->name,
+			(int)vm->pid);
+	else if (WIFSIGNALED(status))
+		fprintf(fp, "emubox: %s: killed by signal %d (%s)\n",
+			vm->name, WTERMSIG(status),
+			strsignal(WTERMSIG(status)));
+	else
+		fprintf(fp, "emubox: %s: exited with status %d\n", vm->name,
+			WEXITSTATUS(status));
+	if (l->len > EMU_LOG_SIZE)
+		fprintf(fp, "emubox: %llu bytes of output before this are "
+			"gone\n", (unsigned long long)(l->len - EMU_LOG_SIZE));
+
+	buf = malloc(EMU_LOG_SIZE);
+	if (buf == NULL)
+		err(EXIT_FAILURE, "malloc");
+	n = emu_log_tail(l, buf, EMU_LOG_SIZE);
+	fwrite(buf, 1, n, fp);
+	free(buf);
+	if (fclose(fp) == EOF) {
+		warn("%s/%s", EMU_LOG_DIR, to);
+		return (-1);
+	}
+
+	l->saved = l->len;
+	return (0);
+}
+
+/* Close the pipe of a VM, and free it's ring. */
+static void emu_log_close(struct emu_log *l)
+{
+	if (l->fd != -1)
+		close(l->fd);
+	free(l->buf);
+	l->fd = -1;
+	l->buf = NULL;
+}
+
+/* Save the logs of every VM that's still running, as SIGUSR1 asks. */
+static void emu_log_save_all(struct emu_vm *vms, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (vms[i].pid != (pid_t)-1) {
+			emu_log_read(&vms[i].log);
+			emu_log_save(&vms[i], 0, 0);
+		}
+}
+
+/* Without pidfds, wait up to EMU_LOG_POLL ms for output of the VMs
+   (or a signal through wake), and read it. Returns how many pipes are
+   still open, there's nothing to wait for without any. */
+static size_t emu_log_poll(struct emu_vm *vms, size_t n, int wake)
+{
+	struct pollfd *pfd;
+	size_t i, m;
+
+	pfd = malloc((n + 1) * sizeof(struct pollfd));
+	if (pfd == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (i = 0, m = 0; i < n; i++)
+		if (vms[i].log.fd != -1) {
+			pfd[m].fd = vms[i].log.fd;
+			pfd[m++].events = POLLIN;
+		}
+	if (m == 0) {
+		free(pfd);
+		return (0);
+	}
+
+	pfd[m].fd = wake;
+	pfd[m].events = POLLIN;
+	if (poll(pfd, m + 1, EMU_LOG_POLL) > 0) {
+		for (i = 0; i < n; i++)
+			if (vms[i].log.fd != -1)
+				emu_log_read(&vms[i].log);
+		if (pfd[m].revents & POLLIN &&
+		    emu_wake_take(wake) & EMU_WAKE_USR1)
+			emu_log_save_all(vms, n);
+	}
+
+	for (i = 0, m = 0; i < n; i++)
+		if (vms[i].log.fd != -1)
+			m++;
+	free(pfd);
+	return (m);
+}
+
+/* Tell how a VM went away, and where it's output is if it failed.
+   Returns -1 if it failed. */
+static int emu_supervise_report(const struct emu_vm *vm, int status)
+{
+	char log[NAME_MAX + 1];
+	FILE *out;
+	int ret;
+
+	ret = -1;
+	out = stderr;
+	if (WIFSIGNALED(status)) {
+		fprintf(stderr, "emubox: %s: killed by signal %d (%s)\n",
+			vm->name, WTERMSIG(status),
+			strsignal(WTERMSIG(status)));
+	} else if (WEXITSTATUS(status) == 127) {
+		fprintf(stderr, "emubox: %s: could not start 86box\n",
+			vm->name);
+	} else {
+		fprintf(stdout, "emubox: %s: exited with status %d\n",
+			vm->name, WEXITSTATUS(status));
+		ret = WEXITSTATUS(status) ? -1 : 0;
+		out = stdout;
+	}
+
+	if (ret == -1 && vm->log.saved) {
+		emu_log_name(vm->name, 0, log);
+		fprintf(out, "emubox: %s: it's output is in "
+			"~/.emubox/%s/%s\n", vm->name, EMU_LOG_DIR, log);
+	}
+	return (ret);
+}
+
+/* Read a file of /proc again, from the start. Returns -1 if it's
+   gone (or never could be read). */
+static int emu_monitor_read(int fd, char *buf, size_t sz)
+{
+	ssize_t n;
+
+	if (fd == -1)
+		return (-1);
+	n = pread(fd, buf, sz - 1, 0);
+	if (n <= 0)
+		return (-1);
+	buf[n] = '\0';
+	return (0);
+}
+
+/* Value of a "key: value" line of /proc/<pid>/io, 0 without one. */
+static uint64_t emu_monitor_field(const char *buf, const char *key)
+{
+	const char *p;
+	size_t len;
+
+	len = strlen(key);
+	for (p = buf; p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+		if (strncmp(p, key, len) == 0 && p[len] == ':')
+			return (strtoull(p + len + 1, NULL, 10));
+
+	return (0);
+}
+
+/* Take a sample of a VM, the rates are the ones since the last one.
+   The I/O is what 86box reads and writes through system calls, which
+   is close to what it's disk images see (read_bytes only counts what
+   isn't in the page cache already). */
+static void emu_monitor_sample(struct emu_monitor *mon, size_t i)
+{
+	struct emu_monitor_ent *e;
+	unsigned long long utime, stime, rss;
+	uint64_t now, ticks, rchar, wchar, dt;
+	char buf[1024], *p;
+	int field;
+
+	e = &mon->ents[i];
+	now = emu_stats_now();
+	dt = now - e->at;
+
+	/* The name is in parens and may have anything in it, the fields
+	   after the last one are what's counted from, utime is 14th. */
+	if (emu_monitor_read(e->stat, buf, sizeof(buf)) == 0 &&
+	    (p = strrchr(buf, ')')) != NULL) {
+		for (field = 2; field < 14 && p; field++)
+			p = strchr(p + 1, ' ');
+		if (p && sscanf(p, " %llu %llu", &utime, &stime) == 2) {
+			ticks = (uint64_t)(utime + stime);
+			if (e->sampled && dt)
+				e->cpu = (double)(ticks - e->ticks) * 100.0 *
+					1e9 / ((double)mon->hz * (double)dt);
+			e->ticks = ticks;
+		}
+	}
+
+	if (emu_monitor_read(e->statm, buf, sizeof(buf)) == 0 &&
+	    sscanf(buf, "%*u %llu", &rss) == 1)
+		e->rss = (uint64_t)rss * (uint64_t)mon->page;
+
+	if (emu_monitor_read(e->io, buf, sizeof(buf)) == 0) {
+		rchar = emu_monitor_field(buf, "rchar");
+		wchar = emu_monitor_field(buf, "wchar");
+		if (e->sampled && dt) {
+			e->rd = (uint64_t)((double)(rchar - e->rchar) * 1e9 /
+					   (double)dt);
+			e->wr = (uint64_t)((double)(wchar - e->wchar) * 1e9 /
+					   (double)dt);
+		}
+		e->rchar = rchar;
+		e->wchar = wchar;
+	}
+
+	if (e->sampled < 2)
+		e->sampled++;
+	e->at = now;
+}
+
+/* Close the files of a VM of the monitor. */
+static void emu_monitor_close(struct emu_monitor_ent *e)
+{
+	if (e->stat != -1)
+		close(e->stat);
+	if (e->statm != -1)
+		close(e->statm);
+	if (e->io != -1)
+		close(e->io);
+	e->stat = e->statm = e->io = -1;
+}
+
+/* Open the files of every VM and take the view over the terminal,
+   which the menu has left. Returns -1 if there's no terminal. */
+static int emu_monitor_start(struct emu_monitor *mon, const struct emu_vm *vms,
+			     size_t n, int period)
+{
+	struct emu_monitor_ent *e;
+	char proc[32];
+	size_t i;
+	int fd;
+
+	memset(mon, 0, sizeof(struct emu_monitor));
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+		return (-1);
+
+	/* --launch has no menu before, the terminal is taken here. */
+	if (stdscr == NULL) {
+		initscr();
+		raw();
+		noecho();
+		keypad(stdscr, TRUE);
+		curs_set(FALSE);
+	} else if (isendwin() == FALSE) {
+		return (-1);
+	}
+
+	mon->ents = calloc(n + 1, sizeof(struct emu_monitor_ent));
+	if (mon->ents == NULL)
+		err(EXIT_FAILURE, "calloc");
+	mon->n = n;
+	mon->period = period;
+	mon->hz = sysconf(_SC_CLK_TCK);
+	mon->page = sysconf(_SC_PAGESIZE);
+	if (mon->hz <= 0)
+		mon->hz = 100;
+
+	for (i = 0; i < n; i++) {
+		e = &mon->ents[i];
+		e->stat = e->statm = e->io = -1;
+		if (vms[i].pid == (pid_t)-1)
+			continue;
+
+		snprintf(proc, sizeof(proc), "/proc/%d", (int)vms[i].pid);
+		fd = open(proc, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			continue;
+		e->stat = openat(fd, "stat", O_RDONLY | O_CLOEXEC);
+		e->statm = openat(fd, "statm", O_RDONLY | O_CLOEXEC);
+		e->io = openat(fd, "io", O_RDONLY | O_CLOEXEC);
+		close(fd);
+		emu_monitor_sample(mon, i);
+	}
+
+	/* Back to the screen of the menu, in the same modes. */
+	refresh();
+	nodelay(stdscr, TRUE);
+	erase();
+	return (0);
+}
+
+/* Draw the last lines of the output of a VM, from line y on. */
+static void emu_monitor_log(const struct emu_vm *vm, int y)
+{
+	char buf[16384], *p, *eol, *end;
+	size_t n;
+	int rows, x;
+
+	attron(A_BOLD);
+	mvprintw(y++, 0, "Output of %s, %llu bytes", vm->name,
+		 (unsigned long long)vm->log.len);
+	attroff(A_BOLD);
+
+	/* Back from the end, as many lines as there's room for. */
+	n = emu_log_tail(&vm->log, buf, sizeof(buf));
+	end = buf + n;
+	if (n && end[-1] == '\n')
+		end--;
+	for (p = end, rows = LINES - y; p > buf && rows > 0; p--)
+		if (p[-1] == '\n' && --rows == 0)
+			break;
+
+	for (; p < end && y < LINES; p = eol + 1, y++) {
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (eol == NULL)
+			eol = end;
+		for (x = 0; p + x < eol && x < COLS; x++)
+			mvaddch(y, x, isprint((unsigned char)p[x]) ?
+				(chtype)(unsigned char)p[x] : (chtype)' ');
+	}
+}
+
+/* Draw every VM, one a line, and the output of the selected one if
+   it's asked for. */
+static void emu_monitor_draw(const struct emu_monitor *mon,
+			     const struct emu_vm *vms, size_t left)
+{
+	const struct emu_monitor_ent *e;
+	char rss[32], rd[32], wr[32];
+	size_t i;
+	int w, y;
+
+	erase();
+	mvprintw(0, 0, "emubox: %zu of %zu VMs running, every %ds, "
+		 "q leaves the monitor, l shows the output, s saves it",
+		 left, mon->n, mon->period);
+
+	/* Whatever's left of the line is for the name. */
+	w = COLS - 54;
+	if (w < 8)
+		w = 8;
+	attron(A_BOLD);
+	mvprintw(2, 0, "%-*s %7s %7s %10s %12s %12s", w, "NAME", "PID", "CPU%",
+		 "RSS", "READ/s", "WRITE/s");
+	attroff(A_BOLD);
+
+	/* With the output shown, the list leaves half of it for it. */
+	for (i = 0, y = 3; i < mon->n && y < (mon->show_log ? LINES / 2 :
+					     LINES); i++, y++) {
+		e = &mon->ents[i];
+		if (i == mon->sel)
+			attron(A_REVERSE);
+		else
+			attroff(A_REVERSE);
+
+		if (e->exited && WIFSIGNALED(e->status)) {
+			mvprintw(y, 0, "%-*.*s %7s killed by signal %d", w, w,
+				 vms[i].name, "-", WTERMSIG(e->status));
+			continue;
+		}
+		if (e->exited) {
+			mvprintw(y, 0, "%-*.*s %7s exited with status %d", w, w,
+				 vms[i].name, "-", WEXITSTATUS(e->status));
+			continue;
+		}
+		if (vms[i].pid == (pid_t)-1) {
+			mvprintw(y, 0, "%-*.*s %7s not started", w, w,
+				 vms[i].name, "-");
+			continue;
+		}
+
+		if (e->sampled < 2) {
+			mvprintw(y, 0, "%-*.*s %7d %7s %10s %12s %12s", w, w,
+				 vms[i].name, (int)vms[i].pid, "-", "-", "-",
+				 "-");
+			continue;
+		}
+
+		emu_format_size(e->rss, rss, sizeof(rss));
+		emu_format_size(e->rd, rd, sizeof(rd));
+		emu_format_size(e->wr, wr, sizeof(wr));
+		mvprintw(y, 0, "%-*.*s %7d %7.1f %10s %12s %12s", w, w,
+			 vms[i].name, (int)vms[i].pid, e->cpu, rss,
+			 e->io != -1 ? rd : "-", e->io != -1 ? wr : "-");
+	}
+	attroff(A_REVERSE);
+
+	if (mon->show_log && y + 2 < LINES)
+		emu_monitor_log(&vms[mon->sel], y + 1);
+	refresh();
+}
+
+/* A key of the monitor, besides the ones that leave it. The arrows
+   select a VM, "l" shows (or hides) it's output and "s" saves the
+   output of every VM that's still running. */
+static void emu_monitor_key(struct emu_monitor *mon, struct emu_vm *vms,
+			    int ch)
+{
+	switch (ch) {
+	case KEY_UP:
+	case 'k':
+		if (mon->sel > 0)
+			mon->sel--;
+		break;
+
+	case KEY_DOWN:
+	case 'j':
+		if (mon->sel + 1 < mon->n)
+			mon->sel++;
+		break;
+
+	case 'l':
+	case 'L':
+		mon->show_log = !mon->show_log;
+		break;
+
+	case 's':
+	case 'S':
+		emu_log_save_all(vms, mon->n);
+		break;
+	}
+}
+
+/* Leave the monitor, and tell how every VM that went away while it
+   was shown did. Returns -1 if any of them failed. */
+static int emu_monitor_stop(struct emu_monitor *mon, const struct emu_vm *vms)
+{
+	size_t i;
+	int ret;
+
+	endwin();
+	ret = 0;
+	for (i = 0; i < mon->n; i++) {
+		emu_monitor_close(&mon->ents[i]);
+		if (mon->ents[i].exited == 0)
+			continue;
+		if (emu_supervise_report(&vms[i], mon->ents[i].status) == -1)
+			ret = -1;
+		emu_cgroup_report(&vms[i]);
+	}
+	fflush(stdout);
+
+	free(mon->ents);
+	memset(mon, 0, sizeof(struct emu_monitor));
+	return (ret);
+}
+
+/* Wait for every started VM to go away, and reap each of them. Every
+   VM is watched through a pidfd, so the supervisor only sleeps in
+   epoll until one of them exits, and reaps exactly that one. Without
+   pidfds (before Linux 5.3), it sleeps in wait(2) for any child.
+   With a period, the usage of the VMs with a cgroup is told every
+   that many seconds. With monitor, they're shown live instead (every
+   that many seconds) until they're all gone or it's left with "q".
+   The output of every VM is read into it's ring as it comes, and
+   saved to it's log once it's gone (or on a SIGUSR1).
+   Returns EXIT_FAILURE if any of them failed. */
+static int emu_supervise(struct emu_vm *vms, size_t n, int period,
+			 int monitor)
+{
+	struct epoll_event ev, evs[16];
+	struct emu_monitor mon;
+	struct sigaction sig, osig;
+	size_t i, left;
+	int ep, nev, j, status, ret, timeout, shown, redraw, ldirty, ch;
+	int wake[2];
+	uint64_t now, next, mnext, lnext;
+	pid_t pid;
+
+	ret = EXIT_SUCCESS;
+	next = period > 0 ? emu_stats_now() +
+		(uint64_t)period * 1000000000ULL : 0;
+	left = 0;
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < n; i++) {
+		vms[i].pidfd = -1;
+		if (vms[i].pid == (pid_t)-1) {
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		left++;
+
+#ifdef SYS_pidfd_open
+		/* Even if it's already gone, it can't be reaped by anyone
+		   else, so the pid can't be reused in the meantime. */
+		if (ep != -1)
+			vms[i].pidfd = (int)syscall(SYS_pidfd_open,
+						    vms[i].pid, 0);
+#endif
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)i;
+		if (vms[i].pidfd == -1 ||
+		    epoll_ctl(ep, EPOLL_CTL_ADD, vms[i].pidfd, &ev) == -1) {
+			/* All or nothing, wait(2) would reap the others. */
+			if (ep != -1)
+				close(ep);
+			ep = -1;
+		}
+	}
+
+	if (ep == -1)
+		for (i = 0; i < n; i++)
+			if (vms[i].pidfd != -1) {
+				close(vms[i].pidfd);
+				vms[i].pidfd = -1;
+			}
+
+	/* The output of the VMs comes in as n + 2 on, without epoll it's
+	   polled for in between. */
+	for (i = 0; ep != -1 && i < n; i++) {
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)(n + 2 + i);
+		if (vms[i].log.fd != -1 &&
+		    epoll_ctl(ep, EPOLL_CTL_ADD, vms[i].log.fd, &ev) == -1)
+			emu_log_close(&vms[i].log);
+	}
+
+	/* A SIGUSR1 saves the output of every VM, as n + 1. The VMs are
+	   already started, they don't get the handler. */
+	wake[0] = wake[1] = -1;
+	if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) == 0) {
+		emu_wake = wake[1];
+		memset(&sig, 0, sizeof(sig));
+		sig.sa_handler = emu_wake_signal;
+		sigemptyset(&sig.sa_mask);
+		sigaction(SIGUSR1, &sig, &osig);
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)(n + 1);
+		if (ep != -1)
+			(void)epoll_ctl(ep, EPOLL_CTL_ADD, wake[0], &ev);
+	}
+
+	/* The keys of the monitor come in with the VMs, as index n. */
+	shown = redraw = ldirty = 0;
+	lnext = 0;
+	mnext = emu_stats_now() + (uint64_t)monitor * 1000000000ULL;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)n;
+	if (monitor > 0 && ep != -1 && left &&
+	    emu_monitor_start(&mon, vms, n, monitor) == 0) {
+		shown = redraw = 1;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == -1) {
+			emu_monitor_stop(&mon, vms);
+			shown = 0;
+		}
+	}
+
+	while (left) {
+		if (ep == -1) {
+			if (emu_log_poll(vms, n, wake[0]) > 0) {
+				pid = waitpid(-1, &status, WNOHANG);
+				if (pid == 0)
+					continue;
+			} else {
+				pid = wait(&status);
+			}
+			if (pid == (pid_t)-1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			for (i = 0; i < n; i++)
+				if (vms[i].pid == pid)
+					break;
+			if (i == n)
+				continue;
+
+			emu_log_read(&vms[i].log);
+			emu_log_save(&vms[i], 1, status);
+			emu_log_close(&vms[i].log);
+			vms[i].pid = (pid_t)-1;
+			if (emu_supervise_report(&vms[i], status) == -1)
+				ret = EXIT_FAILURE;
+			emu_cgroup_report(&vms[i]);
+			left--;
+			continue;
+		}
+
+		timeout = -1;
+		if (shown) {
+			now = emu_stats_now();
+			if (now >= mnext) {
+				for (i = 0; i < n; i++)
+					if (vms[i].pid != (pid_t)-1)
+						emu_monitor_sample(&mon, i);
+				mnext = now + (uint64_t)monitor * 1000000000ULL;
+				redraw = 1;
+			}
+
+			/* The output that's shown is redrawn as it comes,
+			   but not more often than EMU_MONITOR_REDRAW. */
+			if (ldirty && now >= lnext) {
+				lnext = now + EMU_MONITOR_REDRAW * 1000000ULL;
+				ldirty = 0;
+				redraw = 1;
+			}
+			if (redraw)
+				emu_monitor_draw(&mon, vms, left);
+			redraw = 0;
+			timeout = (int)((mnext - now + 999999) / 1000000);
+			if (ldirty && lnext < mnext)
+				timeout = (int)((lnext - now + 999999) /
+						1000000);
+		} else if (period > 0) {
+			now = emu_stats_now();
+			if (now >= next) {
+				for (i = 0; i < n; i++)
+					if (vms[i].pid != (pid_t)-1)
+						emu_cgroup_report(&vms[i]);
+				next = now + (uint64_t)period * 1000000000ULL;
+			}
+			timeout = (int)((next - now + 999999) / 1000000);
+		}
+
+		nev = epoll_wait(ep, evs, 16, timeout);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("epoll_wait");
+			break;
+		}
+
+		for (j = 0; j < nev; j++) {
+			i = (size_t)evs[j].data.u64;
+			if (i == n + 1) {
+				if (emu_wake_take(wake[0]) & EMU_WAKE_USR1)
+					emu_log_save_all(vms, n);
+				continue;
+			}
+			if (i >= n + 2) {
+				emu_log_read(&vms[i - n - 2].log);
+				if (shown && mon.show_log && mon.sel == i - n - 2)
+					ldirty = 1;
+				continue;
+			}
+
+			if (i == n) {
+				/* Every key redraws, a resize included. */
+				while ((ch = getch()) != ERR &&
+				       ch != 'q' && ch != 'Q' && ch != 3)
+					emu_monitor_key(&mon, vms, ch);
+				if (ch == ERR) {
+					redraw = 1;
+					continue;
+				}
+
+				epoll_ctl(ep, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+				shown = 0;
+				if (emu_monitor_stop(&mon, vms) == -1)
+					ret = EXIT_FAILURE;
+				continue;
+			}
+
+			/* Readable means gone, this never blocks. */
+			if (waitpid(vms[i].pid, &status, 0) == -1)
+				continue;
+
+			emu_log_read(&vms[i].log);
+			emu_log_save(&vms[i], 1, status);
+			emu_log_close(&vms[i].log);
+			close(vms[i].pidfd);
+			vms[i].pidfd = -1;
+			vms[i].pid = (pid_t)-1;
+			left--;
+			if (shown) {
+				mon.ents[i].exited = 1;
+				mon.ents[i].status = status;
+				emu_monitor_close(&mon.ents[i]);
+				redraw = 1;
+				continue;
+			}
+
+			if (emu_supervise_report(&vms[i], status) == -1)
+				ret = EXIT_FAILURE;
+			emu_cgroup_report(&vms[i]);
+		}
+	}
+
+	if (shown && emu_monitor_stop(&mon, vms) == -1)
+		ret = EXIT_FAILURE;
+
+	/* Only if it's left early, the others are saved already. */
+	emu_log_save_all(vms, n);
+	for (i = 0; i < n; i++)
+		emu_log_close(&vms[i].log);
+	if (wake[0] != -1) {
+		sigaction(SIGUSR1, &osig, NULL);
+		emu_wake = -1;
+		close(wake[0]);
+		close(wake[1]);
+	}
+	if (ep != -1)
+		close(ep);
+	return (ret);
+}
+
+/* FNV-1a hash of a section and key pair. */
+static uint32_t emu_conf_hash(const char *sec, size_t sec_len,
+			      const char *key, size_t key_len)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i = 0; i < sec_len; i++)
+		h = (h ^ (unsigned char)sec[i]) * 16777619U;
+
+	/* Keep "a" "bc" and "ab" "c" apart. */
+	h = (h ^ (unsigned char)'[') * 16777619U;
+	for (i = 0; i < key_len; i++)
+		h = (h ^ (unsigned char)key[i]) * 16777619U;
+
+	return (h);
+}
+
+/* Does the key k live in sec, under the name key? */
+static int emu_conf_match(const struct emu_conf *cf,
+			  const struct emu_conf_key *k,
+			  const char *sec, size_t sec_len,
+			  const char *key, size_t key_len)
+{
+	return (k->sec_len == sec_len && k->key_len == key_len &&
+		memcmp(cf->map + k->sec_off, sec, sec_len) == 0 &&
+		memcmp(cf->map + k->key_off, key, key_len) == 0);
+}
+
+/* Map a config file (relative to dirfd, unless it's absolute) and
+   index every key of it by it's section. Returns NULL, with errno
+   set, if the file couldn't be read. */
+static struct emu_conf *emu_read_conf(int dirfd, const char *conf)
+{
+	struct emu_conf *cf;
+	struct emu_conf_key *k;
+	const char *p, *end, *eol, *sec, *eq, *ks, *ke, *vs, *ve;
+	size_t sec_len, cap, i, j;
+	struct stat st;
+	int fd, errnum;
+	void *map;
+
+	fd = openat(dirfd, conf, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return (NULL);
+
+	if (fstat(fd, &st) == -1) {
+		errnum = errno;
+		close(fd);
+		errno = errnum;
+		return (NULL);
+	}
+	if ((uint64_t)st.st_size > UINT32_MAX) {
+		close(fd);
+		errno = EFBIG;
+		return (NULL);
+	}
+
+	cf = calloc(1, sizeof(struct emu_conf));
+	if (cf == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	/* An empty file can't be mapped, but it's a valid config. */
+	if (st.st_size > 0) {
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+			   fd, 0);
+		if (map == MAP_FAILED) {
+			errnum = errno;
+			close(fd);
+			free(cf);
+			errno = errnum;
+			return (NULL);
+		}
+
+		cf->map = map;
+		cf->len = (size_t)st.st_size;
+	}
+	close(fd);
+
+	/* Keys before the first section belong to an unnamed one. */
+	cap = 0;
+	sec = cf->map;
+	sec_len = 0;
+	end = cf->map + cf->len;
+	for (p = cf->map; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (eol == NULL)
+			eol = end;
+
+		while (p < eol && isspace((unsigned char)*p))
+			p++;
+		ve = eol;
+		while (ve > p && isspace((unsigned char)ve[-1]))
+			ve--;
+
+		/* Empty lines and comments. */
+		if (p == ve || *p == '#' || *p == ';')
+			continue;
+
+		/* A new section. */
+		if (*p == '[') {
+			if (ve[-1] == ']' && ve - p >= 2) {
+				sec = p + 1;
+				sec_len = (size_t)(ve - p - 2);
+			}
+			continue;
+		}
+
+		eq = memchr(p, '=', (size_t)(ve - p));
+		if (eq == NULL)
+			continue;
+
+		ks = p;
+		ke = eq;
+		while (ke > ks && isspace((unsigned char)ke[-1]))
+			ke--;
+		vs = eq + 1;
+		while (vs < ve && isspace((unsigned char)*vs))
+			vs++;
+
+		if (cf->nkeys == cap) {
+			cap = cap ? cap * (size_t)2 : (size_t)32;
+			k = realloc(cf->keys, cap * sizeof(struct emu_conf_key));
+			if (k == NULL)
+				err(EXIT_FAILURE, "realloc");
+			cf->keys = k;
+		}
+
+		k = &cf->keys[cf->nkeys++];
+		k->sec_off = (uint32_t)(sec - cf->map);
+		k->sec_len = (uint32_t)sec_len;
+		k->key_off = (uint32_t)(ks - cf->map);
+		k->key_len = (uint32_t)(ke - ks);
+		k->val_off = (uint32_t)(vs - cf->map);
+		k->val_len = (uint32_t)(ve - vs);
+		k->hash = emu_conf_hash(sec, sec_len, ks, (size_t)(ke - ks));
+	}
+
+	/* Keep the table at most half full. */
+	cf->nslots = (size_t)16;
+	while (cf->nslots < cf->nkeys * (size_t)2)
+		cf->nslots *= (size_t)2;
+
+	cf->slots = calloc(cf->nslots, sizeof(uint32_t));
+	if (cf->slots == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		for (j = k->hash & (cf->nslots - 1); cf->slots[j];
+		     j = (j + 1) & (cf->nslots - 1))
+			/* A duplicate key, the last one wins. */
+			if (emu_conf_match(cf, &cf->keys[cf->slots[j] - 1U],
+					   cf->map + k->sec_off, k->sec_len,
+					   cf->map + k->key_off, k->key_len))
+				break;
+		cf->slots[j] = (uint32_t)i + 1U;
+	}
+
+	return (cf);
+}
+
+/* Get the value of a key in a section, or NULL if there's no such key.
+   The value isn't NUL terminated, it's length is stored in len. */
+static const char *emu_get_valueof(const struct emu_conf *cf,
+				   const char *sec, const char *key,
+				   size_t *len)
+{
+	const struct emu_conf_key *k;
+	size_t sec_len, key_len, j;
+	uint32_t h;
+
+	sec_len = strlen(sec);
+	key_len = strlen(key);
+	h = emu_conf_hash(sec, sec_len, key, key_len);
+	for (j = h & (cf->nslots - 1); cf->slots[j];
+	     j = (j + 1) & (cf->nslots - 1)) {
+		k = &cf->keys[cf->slots[j] - 1U];
+		if (k->hash == h &&
+		    emu_conf_match(cf, k, sec, sec_len, key, key_len)) {
+			*len = k->val_len;
+			return (cf->map + k->val_off);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Unmap and free a config. */
+static void emu_free_conf(struct emu_conf *cf)
+{
+	if (cf->map)
+		munmap((void *)cf->map, cf->len);
+	free(cf->keys);
+	free(cf->slots);
+	free(cf);
+}
+
+/* Copy a value into buf, cutting it if it doesn't fit. Returns 0
+   if there's no such key. */
+static int emu_conf_copy(const struct emu_conf *cf, const char *sec,
+			 const char *key, char *buf, size_t sz)
+{
+	const char *v;
+	size_t len;
+
+	v = emu_get_valueof(cf, sec, key, &len);
+	if (v == NULL) {
+		buf[0] = '\0';
+		return (0);
+	}
+
+	if (len >= sz)
+		len = sz - (size_t)1;
+	memcpy(buf, v, len);
+	buf[len] = '\0';
+	return (1);
+}
+
+/* Kind of the disk image whose path is the value of key, which is
+   "<type>_<nn><suffix>", or -1 if it's not the path of an image. */
+static int emu_conf_image(const char *key, size_t len)
+{
+	static const struct {
+		const char *prefix;
+		const char *suffix;
+		int kind;
+	} images[] = {
+		{ "hdd_", "_fn", EMU_IMAGE_HDD },
+		{ "fdd_", "_fn", EMU_IMAGE_FDD },
+		{ "cdrom_", "_image_path", EMU_IMAGE_CDROM },
+		{ "zip_", "_image_path", EMU_IMAGE_ZIP },
+		{ "mo_", "_image_path", EMU_IMAGE_MO },
+	};
+	size_t i, pl, sl;
+
+	for (i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+		pl = strlen(images[i].prefix);
+		sl = strlen(images[i].suffix);
+		if (len == pl + 2 + sl &&
+		    memcmp(key, images[i].prefix, pl) == 0 &&
+		    isdigit((unsigned char)key[pl]) &&
+		    isdigit((unsigned char)key[pl + 1]) &&
+		    memcmp(key + pl + 2, images[i].suffix, sl) == 0)
+			return (images[i].kind);
+	}
+
+	return (-1);
+}
+
+/* Extract the machine, CPU, memory and disks of a config. */
+static void emu_conf_meta(const struct emu_conf *cf, struct emu_meta *meta)
+{
+	const struct emu_conf_key *k;
+	const char *key;
+	char family[40], speed[24];
+	unsigned long long v;
+	size_t i, len;
+
+	memset(meta, 0, sizeof(struct emu_meta));
+	emu_conf_copy(cf, "Machine", "machine", meta->machine,
+		      sizeof(meta->machine));
+
+	/* The speed is in Hz. */
+	emu_conf_copy(cf, "Machine", "cpu_family", family, sizeof(family));
+	if (emu_conf_copy(cf, "Machine", "cpu_speed", speed, sizeof(speed))) {
+		v = strtoull(speed, NULL, 10);
+		snprintf(meta->cpu, sizeof(meta->cpu), "%s @ %llu MHz",
+			 family, v / 1000000ULL);
+	} else {
+		snprintf(meta->cpu, sizeof(meta->cpu), "%s", family);
+	}
+
+	/* The memory is in KB. */
+	if (emu_conf_copy(cf, "Machine", "mem_size", speed, sizeof(speed))) {
+		v = strtoull(speed, NULL, 10);
+		if (v >= 1024ULL && v % 1024ULL == 0)
+			snprintf(meta->mem, sizeof(meta->mem), "%llu MB",
+				 v / 1024ULL);
+		else
+			snprintf(meta->mem, sizeof(meta->mem), "%llu KB", v);
+	}
+
+	/* Every drive with an image attached, the same ones --check
+	   looks at. */
+	for (i = 0; i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		key = cf->map + k->key_off;
+		if (k->val_len == 0 || emu_conf_image(key, k->key_len) == -1)
+			continue;
+
+		if (meta->ndisks < EMU_META_DISKS) {
+			len = k->val_len;
+			if (len >= sizeof(meta->disks[0]))
+				len = sizeof(meta->disks[0]) - (size_t)1;
+			memcpy(meta->disks[meta->ndisks], cf->map + k->val_off,
+			       len);
+			meta->disks[meta->ndisks][len] = '\0';
+		}
+		meta->ndisks++;
+	}
+}
+
+/* Creates ".emubox" directory, under your profile directory. */
+static void emu_init_directory(void)
+{
+	char *env, *p;
+	size_t sz;
+
+	env = getenv("HOME");
+	if (env == NULL) {
+	        fputs("emubox: "
+		      "$HOME environment variable is not set.\n",
+		      stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Length of $HOME and "/.emubox". */ 
+	sz = strlen(env) + (size_t)9;
+	p = calloc(sz, sizeof(char));
+	if (p == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	snprintf(p, sz, "%s/.emubox", env);
+
+	if (mkdir(p, 0700) == -1) {
+		if (errno == EEXIST)
+		        fputs("emubox: "
+			      "emubox config directory already exists.\n",
+			      stderr);
+		else
+		        warn("mkdir");
+		free(p);
+		exit(EXIT_FAILURE);
+	}
+
+	fputs("emubox: done: "
+	      "emubox directory has been created.\n",
+	      stdout);
+	free(p);
+}
+
+/* Get the absolute path of ".emubox" directory. */
+static char *emu_get_directory(void)
+{
+	char *env, *p;
+	struct stat st;
+	size_t sz;
+
+	env = getenv("HOME");
+	if (env == NULL) {
+	        fputs("emubox: "
+		      "$HOME environment variable is not set.\n",
+		      stderr);
+	        return (NULL);
+	}
+
+	/* Length of $HOME and "/.emubox". */ 
+	sz = strlen(env) + (size_t)9;
+	p = calloc(sz, sizeof(char));
+	if (p == NULL)
+	        err(EXIT_FAILURE, "calloc");
+
+	snprintf(p, sz, "%s/.emubox/", env);
+	if (stat(p, &st) == -1) {
+		fputs("emubox: config directory wasn't found.\n",
+		      stderr);
+		free(p);
+		return (NULL);
+	}
+
+        return (p);
+}
+
+/* Reserve sz bytes at the end of the scanner's arena. When it's
+   full, the arena grows to twice of it's size, so the number of
+   reallocations stays small, regardless of how many entries are there. */
+static char *emu_scan_alloc(struct emu_scan *scan, size_t sz)
+{
+	char *p;
+	size_t cap;
+
+	if (scan->arena_sz + sz > scan->arena_cap) {
+		cap = scan->arena_cap ? scan->arena_cap : (size_t)4096;
+		while (scan->arena_sz + sz > cap)
+			cap *= (size_t)2;
+
+		p = realloc(scan->arena, cap);
+		if (p == NULL)
+			err(EXIT_FAILURE, "realloc");
+
+		scan->arena = p;
+		scan->arena_cap = cap;
+	}
+
+	p = scan->arena + scan->arena_sz;
+	scan->arena_sz += sz;
+	return (p);
+}
+
+/* Append a name to the entry table. */
+static void emu_scan_push(struct emu_scan *scan, const char *name, size_t len)
+{
+	struct emu_entry *ent;
+	size_t cap;
+	char *p;
+
+	if (scan->nents == scan->ents_cap) {
+		cap = scan->ents_cap ? scan->ents_cap * (size_t)2 : (size_t)64;
+		ent = realloc(scan->ents, cap * sizeof(struct emu_entry));
+		if (ent == NULL)
+			err(EXIT_FAILURE, "realloc");
+
+		scan->ents = ent;
+		scan->ents_cap = cap;
+	}
+
+	p = emu_scan_alloc(scan, len + (size_t)1);
+	memcpy(p, name, len);
+	p[len] = '\0';
+
+	ent = &scan->ents[scan->nents++];
+	ent->name_off = (size_t)(p - scan->arena);
+	ent->name_len = len;
+
+	if (len > scan->row_sz)
+		scan->row_sz = len;
+	scan->name_sz += len;
+}
+
+/* Open the ".emubox" directory, everything else can be done relative
+   to it. Returns -1 if it's not there. */
+static int emu_open_directory(void)
+{
+	char path[PATH_MAX], *env;
+	int fd;
+
+	env = getenv("HOME");
+	if (env == NULL) {
+	        fputs("emubox: "
+		      "$HOME environment variable is not set.\n",
+		      stderr);
+	        return (-1);
+	}
+
+	if (snprintf(path, sizeof(path), "%s/.emubox", env) >=
+	    (int)sizeof(path)) {
+		fputs("emubox: $HOME is too long.\n", stderr);
+		return (-1);
+	}
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		fputs("emubox: config directory wasn't found.\n",
+		      stderr);
+
+	return (fd);
+}
+
+/* Open EMU_STATE_DIR, inside the config directory at dirfd, and
+   create it first with create. Returns -1 if it's not there. */
+static int emu_state_open(int dirfd, int create)
+{
+	if (create && mkdirat(dirfd, EMU_STATE_DIR, 0700) == -1 &&
+	    errno != EEXIST)
+		return (-1);
+
+	return (openat(dirfd, EMU_STATE_DIR, O_RDONLY | O_DIRECTORY |
+		       O_CLOEXEC));
+}
+
+/* Path of a config of the table, at path. A VM of a root already has
+   a full path as it's name. */
+static void emu_config_path(const char *path, const char *name, char *buf,
+			    size_t sz)
+{
+	if (name[0] == '/')
+		snprintf(buf, sz, "%s", name);
+	else
+		snprintf(buf, sz, "%s/%s", path, name);
+}
+
+/* File name of a config, with a ".cfg" file extension, unless it
+   already has one. Returns -1 if it's not a valid file name. */
+static int emu_config_name(const char *name, char *buf, size_t sz)
+{
+	int ret;
+
+	if (strchr(name, '/') != NULL)
+		return (-1);
+
+	if (strstr(name, ".cfg") == NULL)
+		ret = snprintf(buf, sz, "%s.cfg", name);
+	else
+		ret = snprintf(buf, sz, "%s", name);
+
+	return (ret < 0 || (size_t)ret >= sz ? -1 : 0);
+}
+
+/* Name in the table of a config given by the user, at path. It's the
+   one of --list, or of a config (with or without it's ".cfg") or of a
+   VM folder, which has it's 86box.cfg. Returns -1 if it isn't any. */
+static int emu_config_resolve(const char *path, const char *name,
+			      char *cfg, size_t sz)
+{
+	char p[PATH_MAX];
+	struct stat st;
+	size_t len;
+	int ret;
+
+	ret = -1;
+	if (emu_config_name(name, cfg, sz) == 0) {
+		emu_config_path(path, cfg, p, sizeof(p));
+		ret = stat(p, &st);
+	}
+	if (ret == -1 && (size_t)snprintf(cfg, sz, "%s", name) < sz) {
+		emu_config_path(path, cfg, p, sizeof(p));
+		ret = stat(p, &st);
+	}
+	if (ret == 0 && S_ISDIR(st.st_mode)) {
+		for (len = strlen(cfg); len > 1 && cfg[len - 1] == '/'; len--)
+			cfg[len - 1] = '\0';
+		ret = -1;
+		if ((size_t)snprintf(cfg + len, sz - len, "/%s",
+				     EMU_VM_CONFIG) < sz - len) {
+			emu_config_path(path, cfg, p, sizeof(p));
+			ret = stat(p, &st);
+		}
+	}
+
+	return (ret == -1 || !S_ISREG(st.st_mode) ? -1 : 0);
+}
+
+/* Type of a directory entry, DT_REG or DT_DIR (or anything else). File
+   systems that don't tell it in readdir(3) leave it to a stat. */
+static int emu_scan_type(int dirfd, const struct dirent *den)
+{
+	struct stat st;
+
+	if (den->d_type != DT_UNKNOWN)
+		return (den->d_type);
+	if (fstatat(dirfd, den->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+		return (DT_UNKNOWN);
+	if (S_ISREG(st.st_mode))
+		return (DT_REG);
+	return (S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN);
+}
+
+/* Collect the names of every config file in the config directory,
+   and the names of the directories in it into subdirs (unless it's
+   NULL). Returns -1 if the directory couldn't be opened. */
+static int emu_scan_level(struct emu_scan *scan, int dirfd,
+			  struct emu_scan *subdirs)
+{
+	DIR *dir;
+	struct dirent *den;
+	int fd, type;
+
+	memset(scan, 0, sizeof(struct emu_scan));
+	fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return (-1);
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return (-1);
+	}
+
+	while ((den = readdir(dir)) != NULL) {
+		/* Skip ".", ".." and emubox's own files. */
+		if (den->d_name[0] == '.')
+			continue;
+
+		/* Only normal files are allowed. */
+		type = emu_scan_type(fd, den);
+		if (type == DT_REG)
+			emu_scan_push(scan, den->d_name, strlen(den->d_name));
+		else if (type == DT_DIR && subdirs)
+			emu_scan_push(subdirs, den->d_name, strlen(den->d_name));
+	}
+
+	closedir(dir);
+	return (0);
+}
+
+/* Walk the config directory once and collect the names of every
+   config file in it, only the ones right inside of it. Returns -1 if
+   the directory couldn't be opened. */
+static int emu_scan_directory(struct emu_scan *scan, int dirfd)
+{
+	return (emu_scan_level(scan, dirfd, NULL));
+}
+
+/* Add a walked directory, for the index. */
+static void emu_scan_dir(struct emu_scan *scan, const char *name,
+			 size_t len, const struct timespec *mtime)
+{
+	struct emu_entry *ent;
+	size_t cap;
+	char *p;
+
+	if (scan->ndirs == scan->dirs_cap) {
+		cap = scan->dirs_cap ? scan->dirs_cap * (size_t)2 : (size_t)16;
+		ent = realloc(scan->dirs, cap * sizeof(struct emu_entry));
+		if (ent == NULL)
+			err(EXIT_FAILURE, "realloc");
+
+		scan->dirs = ent;
+		scan->dirs_cap = cap;
+	}
+
+	p = emu_scan_alloc(scan, len + (size_t)1);
+	memcpy(p, name, len);
+	p[len] = '\0';
+
+	ent = &scan->dirs[scan->ndirs++];
+	ent->name_off = (size_t)(p - scan->arena);
+	ent->name_len = len;
+	ent->mtime = *mtime;
+}
+
+/* Move every entry and directory of src to the end of dst. src is
+   left empty, to be filled again. */
+static void emu_scan_take(struct emu_scan *dst, struct emu_scan *src)
+{
+	size_t i;
+
+	for (i = 0; i < src->nents; i++) {
+		emu_scan_push(dst, emu_scan_name(src, i), src->ents[i].name_len);
+		dst->ents[dst->nents - 1].mtime = src->ents[i].mtime;
+	}
+	for (i = 0; i < src->ndirs; i++)
+		emu_scan_dir(dst, src->arena + src->dirs[i].name_off,
+			     src->dirs[i].name_len, &src->dirs[i].mtime);
+
+	src->nents = src->ndirs = src->arena_sz = 0;
+	src->row_sz = src->name_sz = 0;
+}
+
+/* Read the roots file into jobs, a directory per line, along with
+   it's own mtime (or 0, without one) into scan. Lines starting with
+   a "#" are left out. */
+static void emu_scan_roots(int dirfd, struct emu_scan *jobs,
+			   struct emu_scan *scan)
+{
+	struct timespec mtime;
+	struct stat st;
+	char *line, *p;
+	size_t cap, len;
+	FILE *fp;
+	int fd;
+
+	memset(&mtime, 0, sizeof(mtime));
+	fd = openat(dirfd, EMU_ROOTS_NAME, O_RDONLY | O_CLOEXEC);
+	if (fd != -1 && fstat(fd, &st) == 0)
+		mtime = st.st_mtim;
+	emu_scan_dir(scan, EMU_ROOTS_NAME, strlen(EMU_ROOTS_NAME), &mtime);
+
+	fp = fd != -1 ? fdopen(fd, "r") : NULL;
+	if (fp == NULL) {
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+
+	line = NULL;
+	cap = 0;
+	while (getline(&line, &cap, fp) != -1) {
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		len = strlen(p);
+		while (len && isspace((unsigned char)p[len - 1]))
+			len--;
+		while (len > (size_t)1 && p[len - 1] == '/')
+			len--;
+		if (len && p[0] != '#')
+			emu_scan_push(jobs, p, len);
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/* Queue a directory for the walk. */
+static void emu_walk_push(struct emu_walk *w, size_t id, char *path,
+			  int depth)
+{
+	struct emu_walk_queue *q;
+	struct emu_walk_job *jobs;
+
+	__atomic_add_fetch(&w->pending, (size_t)1, __ATOMIC_RELAXED);
+	q = &w->queues[id];
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head) {
+			memmove(q->jobs, q->jobs + q->head, (q->tail - q->head) *
+				sizeof(struct emu_walk_job));
+			q->tail -= q->head;
+			q->head = 0;
+		} else {
+			q->cap = q->cap ? q->cap * (size_t)2 : (size_t)64;
+			jobs = realloc(q->jobs, q->cap *
+				       sizeof(struct emu_walk_job));
+			if (jobs == NULL)
+				err(EXIT_FAILURE, "realloc");
+			q->jobs = jobs;
+		}
+	}
+	q->jobs[q->tail].path = path;
+	q->jobs[q->tail++].depth = depth;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Take the next directory of a worker, the latest one of it's own or
+   (if it has none left) the oldest one of another worker. Returns 0
+   if there's none at all right now. */
+static int emu_walk_pop(struct emu_walk *w, size_t id, struct emu_walk_job *job)
+{
+	struct emu_walk_queue *q;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < w->nqueues; i++) {
+		q = &w->queues[(id + i) % w->nqueues];
+		pthread_mutex_lock(&q->lock);
+		ret = q->head < q->tail;
+		if (ret && i == 0)
+			*job = q->jobs[--q->tail];
+		else if (ret)
+			*job = q->jobs[q->head++];
+		pthread_mutex_unlock(&q->lock);
+		if (ret)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Walk a single directory. A directory with a VM config is a VM, and
+   nothing below it is looked at. Every other one is remembered (for
+   the index) and it's directories are queued. */
+static void emu_walk_dir(struct emu_walk *w, size_t id,
+			 const struct emu_walk_job *job, struct emu_scan *found)
+{
+	struct dirent *den;
+	struct stat st;
+	char name[PATH_MAX], *path;
+	DIR *dir;
+	int fd, len;
+
+	fd = openat(w->dirfd, job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (fstatat(fd, EMU_VM_CONFIG, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+		len = snprintf(name, sizeof(name), "%s/%s", job->path,
+			       EMU_VM_CONFIG);
+		if (len > 0 && (size_t)len < sizeof(name)) {
+			emu_scan_push(found, name, (size_t)len);
+			found->ents[found->nents - 1].mtime = st.st_mtim;
+		} else {
+			fprintf(stderr, "emubox: %s: path is too long, "
+				"skipped.\n", job->path);
+		}
+		close(fd);
+		return;
+	}
+
+	if (fstat(fd, &st) == 0)
+		emu_scan_dir(found, job->path, strlen(job->path), &st.st_mtim);
+	dir = job->depth < EMU_WALK_DEPTH ? fdopendir(fd) : NULL;
+	if (dir == NULL) {
+		close(fd);
+		return;
+	}
+
+	while ((den = readdir(dir)) != NULL) {
+		if (den->d_name[0] == '.' || emu_scan_type(fd, den) != DT_DIR)
+			continue;
+
+		len = snprintf(name, sizeof(name), "%s/%s", job->path,
+			       den->d_name);
+		if (len < 0 || (size_t)len >= sizeof(name)) {
+			fprintf(stderr, "emubox: %s/%s: path is too long, "
+				"skipped.\n", job->path, den->d_name);
+			continue;
+		}
+		path = strdup(name);
+		if (path == NULL)
+			err(EXIT_FAILURE, "strdup");
+		emu_walk_push(w, id, path, job->depth + 1);
+	}
+
+	closedir(dir);
+}
+
+/* Hand what a worker has found to the caller of the walk. */
+static void emu_walk_flush(struct emu_walk *w, struct emu_scan *found)
+{
+	if (found->nents == 0 && found->ndirs == 0)
+		return;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->flush(w->arg, found) == -1)
+		__atomic_store_n(&w->stop, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+	found->nents = found->ndirs = found->arena_sz = 0;
+	found->row_sz = found->name_sz = 0;
+}
+
+/* A worker of the walk, until there's nothing left to walk. One that's
+   out of work waits for the others, they may queue more. */
+static void *emu_walk_worker(void *arg)
+{
+	struct emu_walk_worker *wk;
+	struct emu_walk_job job;
+	struct emu_scan found;
+	struct emu_walk *w;
+	struct timespec ts;
+	uint64_t next;
+
+	wk = arg;
+	w = wk->walk;
+	memset(&found, 0, sizeof(found));
+	ts.tv_sec = 0;
+	ts.tv_nsec = 200000;
+	next = emu_stats_now() + EMU_STREAM_NS;
+	for (;;) {
+		if (emu_walk_pop(w, wk->id, &job)) {
+			if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED) == 0)
+				emu_walk_dir(w, wk->id, &job, &found);
+			free(job.path);
+			__atomic_sub_fetch(&w->pending, (size_t)1,
+					   __ATOMIC_RELAXED);
+
+			/* A slow tree still shows up in a streaming menu. */
+			if (found.nents + found.ndirs >= (size_t)EMU_WALK_BATCH ||
+			    emu_stats_now() >= next) {
+				emu_walk_flush(w, &found);
+				next = emu_stats_now() + EMU_STREAM_NS;
+			}
+			continue;
+		}
+
+		if (__atomic_load_n(&w->pending, __ATOMIC_RELAXED) == 0)
+			break;
+		nanosleep(&ts, NULL);
+	}
+
+	emu_walk_flush(w, &found);
+	emu_scan_free(&found);
+	return (NULL);
+}
+
+/* Walk every directory of jobs (relative to dirfd, or absolute) and
+   everything below them for VMs, in parallel. Every worker queues the
+   directories it finds for itself, and steals from the others once
+   it's out of them, so a single large tree keeps all of them busy.
+   What's found is given to flush, which isn't called by more than a
+   single worker at a time, it stops the walk by returning -1. */
+static void emu_scan_walk(int dirfd, const struct emu_scan *jobs,
+			  int (*flush)(void *, struct emu_scan *), void *arg)
+{
+	struct emu_walk_worker wk[EMU_WALK_THREADS];
+	pthread_t th[EMU_WALK_THREADS];
+	struct emu_walk *w;
+	size_t i, nth;
+	char *path;
+
+	if (jobs->nents == 0)
+		return;
+
+	w = calloc(1, sizeof(struct emu_walk));
+	if (w == NULL)
+		err(EXIT_FAILURE, "calloc");
+	w->dirfd = dirfd;
+	w->flush = flush;
+	w->arg = arg;
+	w->nqueues = EMU_WALK_THREADS;
+	pthread_mutex_init(&w->lock, NULL);
+	for (i = 0; i < w->nqueues; i++)
+		pthread_mutex_init(&w->queues[i].lock, NULL);
+
+	for (i = 0; i < jobs->nents; i++) {
+		path = strdup(emu_scan_name(jobs, i));
+		if (path == NULL)
+			err(EXIT_FAILURE, "strdup");
+		emu_walk_push(w, i % w->nqueues, path, 1);
+	}
+
+	for (i = 0; i < w->nqueues; i++) {
+		wk[i].walk = w;
+		wk[i].id = i;
+	}
+	for (nth = 1; nth < w->nqueues; nth++)
+		if (pthread_create(&th[nth], NULL, emu_walk_worker,
+				   &wk[nth]) != 0)
+			break;
+
+	/* The caller is a worker too, the walk is done without threads. */
+	emu_walk_worker(&wk[0]);
+	for (i = 1; i < nth; i++)
+		pthread_join(th[i], NULL);
+
+	for (i = 0; i < w->nqueues; i++) {
+		pthread_mutex_destroy(&w->queues[i].lock);
+		free(w->queues[i].jobs);
+	}
+	pthread_mutex_destroy(&w->lock);
+	free(w);
+}
+
+/* flush of emu_scan_walk(...), into the scan itself. */
+static int emu_scan_collect(void *arg, struct emu_scan *found)
+{
+	emu_scan_take(arg, found);
+	return (0);
+}
+
+/* Collect the names of every config file in the config directory,
+   like emu_scan_directory(...), and of every VM below it and below
+   the roots. */
+static int emu_scan_tree(struct emu_scan *scan, int dirfd)
+{
+	struct emu_scan jobs;
+	struct stat st;
+
+	/* Anything created while it's read changes the mtime again. */
+	memset(&st, 0, sizeof(st));
+	(void)fstat(dirfd, &st);
+	memset(&jobs, 0, sizeof(jobs));
+	if (emu_scan_level(scan, dirfd, &jobs) == -1)
+		return (-1);
+	scan->stamp = st.st_mtim;
+
+	emu_scan_roots(dirfd, &jobs, scan);
+	emu_scan_walk(dirfd, &jobs, emu_scan_collect, scan);
+	emu_scan_free(&jobs);
+	return (0);
+}
+
+/* Get the name of the entry at idx. */
+static const char *emu_scan_name(const struct emu_scan *scan, size_t idx)
+{
+	return (scan->arena + scan->ents[idx].name_off);
+}
+
+/* Sort key of a name, for the natural order. Every run of digits
+   becomes a "0", the amount of it's significant digits and then the
+   digits themselves, so "2" comes before "10" and numbers sort where
+   their digits would. The name itself follows after a 0 byte, to
+   keep names like "a1" and "a01" apart. key must have room for
+   EMU_KEY_MAX bytes, the length of the key is returned. */
+static size_t emu_sort_key(const char *name, size_t len, unsigned char *key)
+{
+	size_t i, j, k;
+
+	if (len >= (size_t)PATH_MAX)
+		len = PATH_MAX - 1;
+
+	for (i = k = 0; i < len;) {
+		if (name[i] < '0' || name[i] > '9') {
+			key[k++] = (unsigned char)name[i++];
+			continue;
+		}
+
+		/* Leading zeros don't count. */
+		while (i < len && name[i] == '0')
+			i++;
+		for (j = i; j < len && name[j] >= '0' && name[j] <= '9'; j++)
+			;
+
+		key[k++] = '0';
+		key[k++] = (unsigned char)(j - i);
+		memcpy(key + k, name + i, j - i);
+		k += j - i;
+		i = j;
+	}
+
+	key[k++] = '\0';
+	memcpy(key + k, name, len);
+	return (k + len);
+}
+
+/* Compare two sort keys. */
+static int emu_key_compare(const unsigned char *k0, size_t l0,
+			   const unsigned char *k1, size_t l1)
+{
+	int ret;
+
+	ret = memcmp(k0, k1, l0 < l1 ? l0 : l1);
+	if (ret != 0)
+		return (ret);
+
+	return ((l0 > l1) - (l0 < l1));
+}
+
+/* Byte of a key at depth for the radix sort, 0 past it's end. */
+static size_t emu_radix_byte(const struct emu_sort_ent *se, size_t depth)
+{
+	return (depth < se->len ? (size_t)se->key[depth] + (size_t)1 : 0);
+}
+
+/* MSD radix sort over the sort keys, everything before depth is the
+   same already. Every pass only reads a single byte of every key, and
+   small buckets are done with an insertion sort. */
+static void emu_radix_sort(struct emu_sort_ent *se, struct emu_sort_ent *tmp,
+			   size_t n, size_t depth)
+{
+	struct emu_sort_ent t;
+	uint32_t count[257];
+	size_t i, j, b, start;
+
+	if (n <= (size_t)EMU_RADIX_MIN) {
+		for (i = 1; i < n; i++) {
+			t = se[i];
+			for (j = i; j > 0 &&
+			     emu_key_compare(se[j - 1].key + depth,
+					     se[j - 1].len - depth,
+					     t.key + depth,
+					     t.len - depth) > 0; j--)
+				se[j] = se[j - 1];
+			se[j] = t;
+		}
+		return;
+	}
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; i++)
+		count[emu_radix_byte(&se[i], depth)]++;
+
+	/* Where every bucket starts, and after the scatter, ends. */
+	for (b = 0, start = 0; b < 257; b++) {
+		i = count[b];
+		count[b] = (uint32_t)start;
+		start += i;
+	}
+	for (i = 0; i < n; i++)
+		tmp[count[emu_radix_byte(&se[i], depth)]++] = se[i];
+	memcpy(se, tmp, n * sizeof(struct emu_sort_ent));
+
+	/* Keys in the first bucket have ended, they are all the same. */
+	for (b = 1, start = count[0]; b < 257; b++) {
+		if (count[b] - start > 1)
+			emu_radix_sort(se + start, tmp + start,
+				       count[b] - start, depth + (size_t)1);
+		start = count[b];
+	}
+}
+
+/* Sort the entry table by name, in the natural order. The sort keys
+   are built once, stored back to back and then radix sorted. */
+static void emu_scan_sort(struct emu_scan *scan)
+{
+	struct emu_sort_ent *se, *tmp;
+	struct emu_entry *ents;
+	unsigned char *keys;
+	size_t i, sz;
+
+	if (scan->nents < (size_t)2)
+		return;
+
+	se = malloc(scan->nents * sizeof(struct emu_sort_ent));
+	tmp = malloc(scan->nents * sizeof(struct emu_sort_ent));
+	ents = malloc(scan->nents * sizeof(struct emu_entry));
+	/* No key is longer than 3 times the name, plus 2. */
+	keys = malloc(scan->name_sz * (size_t)3 + scan->nents * (size_t)2);
+	if (se == NULL || tmp == NULL || ents == NULL || keys == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0, sz = 0; i < scan->nents; i++) {
+		se[i].key = keys + sz;
+		se[i].len = (uint32_t)emu_sort_key(emu_scan_name(scan, i),
+						   scan->ents[i].name_len,
+						   keys + sz);
+		se[i].idx = (uint32_t)i;
+		sz += se[i].len;
+	}
+
+	emu_radix_sort(se, tmp, scan->nents, 0);
+	for (i = 0; i < scan->nents; i++)
+		ents[i] = scan->ents[se[i].idx];
+	memcpy(scan->ents, ents, scan->nents * sizeof(struct emu_entry));
+
+	free(keys);
+	free(ents);
+	free(tmp);
+	free(se);
+}
+
+/* Binary search for name in a sorted entry table. Returns 1 if the
+   name was found and 0 otherwise. In both cases, pos is set to the
+   index where the name is (or would be). */
+static int emu_scan_find(const struct emu_scan *scan, const char *name,
+			 size_t *pos)
+{
+	unsigned char key[EMU_KEY_MAX], mkey[EMU_KEY_MAX];
+	size_t lo, hi, mid, len, mlen;
+	int ret;
+
+	len = emu_sort_key(name, strlen(name), key);
+	lo = 0;
+	hi = scan->nents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / (size_t)2;
+		mlen = emu_sort_key(emu_scan_name(scan, mid),
+				    scan->ents[mid].name_len, mkey);
+		ret = emu_key_compare(mkey, mlen, key, len);
+		if (ret == 0) {
+			*pos = mid;
+			return (1);
+		}
+
+		if (ret < 0)
+			lo = mid + (size_t)1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+	return (0);
+}
+
+/* Insert a name into a sorted entry table, keeping it sorted. */
+static void emu_scan_insert(struct emu_scan *scan, const char *name,
+			    const struct timespec *mtime)
+{
+	struct emu_entry ent;
+	size_t pos;
+
+	if (emu_scan_find(scan, name, &pos))
+		return;
+
+	/* Push it at the end and move it to where it belongs. */
+	emu_scan_push(scan, name, strlen(name));
+	ent = scan->ents[scan->nents - 1];
+	if (mtime)
+		ent.mtime = *mtime;
+	memmove(&scan->ents[pos + 1], &scan->ents[pos],
+		(scan->nents - pos - 1) * sizeof(struct emu_entry));
+	scan->ents[pos] = ent;
+}
+
+/* Remove a name from a sorted entry table. Space of the name in
+   the arena isn't reclaimed. */
+static void emu_scan_remove(struct emu_scan *scan, const char *name)
+{
+	size_t pos;
+
+	if (emu_scan_find(scan, name, &pos) == 0)
+		return;
+
+	scan->name_sz -= scan->ents[pos].name_len;
+	scan->nents--;
+	memmove(&scan->ents[pos], &scan->ents[pos + 1],
+		(scan->nents - pos) * sizeof(struct emu_entry));
+}
+
+/* Remove every name below the directory dir (the VMs in it) from a
+   sorted entry table, like emu_scan_remove(...) does. */
+static void emu_scan_remove_below(struct emu_scan *scan, const char *dir)
+{
+	size_t i, j, len;
+	const char *name;
+
+	len = strlen(dir);
+	for (i = 0, j = 0; i < scan->nents; i++) {
+		name = emu_scan_name(scan, i);
+		if (scan->ents[i].name_len > len && name[len] == '/' &&
+		    memcmp(name, dir, len) == 0) {
+			scan->name_sz -= scan->ents[i].name_len;
+			continue;
+		}
+		scan->ents[j++] = scan->ents[i];
+	}
+	scan->nents = j;
+}
+
+/* Merge an unsorted table of entries into a sorted one, names that
+   it has already are left as they are. */
+static void emu_scan_merge(struct emu_scan *scan, struct emu_scan *add)
+{
+	unsigned char k0[EMU_KEY_MAX], k1[EMU_KEY_MAX];
+	struct emu_entry *ents, ent;
+	size_t i, j, n, l0, l1, cap;
+	char *p;
+	int ret;
+
+	if (add->nents == 0) {
+		for (i = 0; i < add->ndirs; i++)
+			emu_scan_dir(scan, add->arena + add->dirs[i].name_off,
+				     add->dirs[i].name_len, &add->dirs[i].mtime);
+		return;
+	}
+
+	emu_scan_sort(add);
+	cap = scan->nents + add->nents;
+	ents = malloc(cap * sizeof(struct emu_entry));
+	if (ents == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	l0 = l1 = 0;
+	if (scan->nents)
+		l0 = emu_sort_key(emu_scan_name(scan, 0),
+				  scan->ents[0].name_len, k0);
+	l1 = emu_sort_key(emu_scan_name(add, 0), add->ents[0].name_len, k1);
+	for (i = j = n = 0; j < add->nents;) {
+		ret = i < scan->nents ? emu_key_compare(k0, l0, k1, l1) : 1;
+		if (ret <= 0) {
+			ents[n++] = scan->ents[i++];
+			if (i < scan->nents)
+				l0 = emu_sort_key(emu_scan_name(scan, i),
+						  scan->ents[i].name_len, k0);
+			if (ret < 0)
+				continue;
+		} else {
+			/* The arena may move, the offset stays. */
+			ent = add->ents[j];
+			p = emu_scan_alloc(scan, ent.name_len + (size_t)1);
+			memcpy(p, emu_scan_name(add, j), ent.name_len + (size_t)1);
+			ent.name_off = (size_t)(p - scan->arena);
+			if (ent.name_len > scan->row_sz)
+				scan->row_sz = ent.name_len;
+			scan->name_sz += ent.name_len;
+			ents[n++] = ent;
+		}
+
+		if (++j < add->nents)
+			l1 = emu_sort_key(emu_scan_name(add, j),
+					  add->ents[j].name_len, k1);
+	}
+
+	for (; i < scan->nents; i++)
+		ents[n++] = scan->ents[i];
+
+	free(scan->ents);
+	scan->ents = ents;
+	scan->nents = n;
+	scan->ents_cap = cap;
+
+	for (i = 0; i < add->ndirs; i++)
+		emu_scan_dir(scan, add->arena + add->dirs[i].name_off,
+			     add->dirs[i].name_len, &add->dirs[i].mtime);
+}
+
+/* name of emu_statx_run(...), for emu_scan_stamp(...) */
+static const char *emu_scan_stamp_name(void *arg, size_t idx)
+{
+	return (emu_scan_name(arg, idx));
+}
+
+/* done of emu_statx_run(...), for emu_scan_stamp(...) */
+static void emu_scan_stamp_done(void *arg, size_t idx,
+				const struct statx *stx)
+{
+	struct emu_scan *scan;
+
+	scan = arg;
+	scan->ents[idx].mtime.tv_sec = stx->stx_mtime.tv_sec;
+	scan->ents[idx].mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+/* Fill in the modification time of every entry, in batches. */
+static void emu_scan_stamp(struct emu_scan *scan, int dirfd)
+{
+	struct emu_statx sx;
+
+	scan->indexed = 0;
+	sx.dirfd = dirfd;
+	sx.mask = STATX_MTIME;
+	sx.n = scan->nents;
+	sx.name = emu_scan_stamp_name;
+	sx.done = emu_scan_stamp_done;
+	sx.arg = scan;
+	emu_statx_run(&sx);
+}
+
+/* Free everything that the scanner has allocated. */
+static void emu_scan_free(struct emu_scan *scan)
+{
+	free(scan->arena);
+	free(scan->ents);
+	free(scan->dirs);
+	memset(scan, 0, sizeof(struct emu_scan));
+}
+
+/* Open and lock the config index. The lock is held until the
+   descriptor is closed, so updates from other emubox processes
+   can't interleave with ours. Returns -1 on any failure. */
+static int emu_index_open(int dirfd)
+{
+	int fd;
+
+	fd = openat(dirfd, EMU_INDEX_NAME, O_RDWR | O_CREAT | O_CLOEXEC,
+		    S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return (-1);
+
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* Was a directory stamped within a tick of the clock of the
+   timestamps, before the index was written? A change made in the
+   same tick (after the stamp was taken) leaves the mtime the same, so
+   such a stamp can't be trusted. The next scan writes the index again
+   a tick later, with the same stamp. */
+static int emu_index_racy(const struct timespec *stamp,
+			  const struct timespec *written)
+{
+	struct timespec res;
+	int64_t d, tick;
+
+	/* A filesystem with whole seconds only. */
+	if (stamp->tv_nsec == 0 && written->tv_nsec == 0)
+		tick = 1000000000LL;
+	else if (clock_getres(CLOCK_REALTIME_COARSE, &res) == 0)
+		tick = (int64_t)res.tv_sec * 1000000000LL + res.tv_nsec;
+	else
+		tick = 1000000000LL;
+
+	d = ((int64_t)written->tv_sec - stamp->tv_sec) * 1000000000LL +
+	    (written->tv_nsec - stamp->tv_nsec);
+	return (d < tick);
+}
+
+/* Check the name of an entry of the index, it has to be inside of the
+   arena (NUL terminated) and fit a path. Returns -1 if it doesn't. */
+static int emu_index_name(const struct emu_scan *scan,
+			  const struct emu_entry *e)
+{
+	if (e->name_off >= scan->arena_sz ||
+	    e->name_len >= scan->arena_sz - e->name_off ||
+	    e->name_len >= (size_t)PATH_MAX ||
+	    scan->arena[e->name_off + e->name_len] != '\0')
+		return (-1);
+	return (0);
+}
+
+/* Load the entry table from the index. It's only accepted if the
+   config directory hasn't changed since it was written, and wasn't
+   about to when it was. Returns -1 if the index is missing, broken
+   or stale. */
+static int emu_index_read(int fd, int dirfd, struct emu_scan *scan)
+{
+	struct emu_index_hdr hdr;
+	struct stat st, ist;
+	struct timespec mtime;
+	struct iovec iov[3];
+	size_t i, sz;
+
+	memset(scan, 0, sizeof(struct emu_scan));
+	if (fstat(dirfd, &st) == -1 || fstat(fd, &ist) == -1)
+		return (-1);
+
+	if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+		return (-1);
+
+	if (hdr.magic != EMU_INDEX_MAGIC ||
+	    hdr.version != EMU_INDEX_VERSION ||
+	    hdr.ent_sz != sizeof(struct emu_entry) ||
+	    hdr.dev != (uint64_t)st.st_dev ||
+	    hdr.ino != (uint64_t)st.st_ino ||
+	    hdr.mtime.tv_sec != st.st_mtim.tv_sec ||
+	    hdr.mtime.tv_nsec != st.st_mtim.tv_nsec ||
+	    emu_index_racy(&hdr.mtime, &ist.st_mtim))
+		return (-1);
+
+	/* The size must match exactly, anything else is a partial write. */
+	sz = (hdr.nents + hdr.ndirs) * sizeof(struct emu_entry) + hdr.arena_sz;
+	if ((uint64_t)ist.st_size != sizeof(hdr) + sz)
+		return (-1);
+
+	scan->nents = scan->ents_cap = hdr.nents;
+	scan->arena_sz = scan->arena_cap = hdr.arena_sz;
+	scan->row_sz = hdr.row_sz;
+	scan->name_sz = hdr.name_sz;
+	scan->ndirs = scan->dirs_cap = hdr.ndirs;
+	scan->ents = malloc(hdr.nents ? hdr.nents * sizeof(struct emu_entry) :
+			    sizeof(struct emu_entry));
+	scan->dirs = malloc(hdr.ndirs ? hdr.ndirs * sizeof(struct emu_entry) :
+			    sizeof(struct emu_entry));
+	scan->arena = malloc(hdr.arena_sz ? hdr.arena_sz : (size_t)1);
+	if (scan->ents == NULL || scan->dirs == NULL || scan->arena == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	iov[0].iov_base = scan->ents;
+	iov[0].iov_len = hdr.nents * sizeof(struct emu_entry);
+	iov[1].iov_base = scan->dirs;
+	iov[1].iov_len = hdr.ndirs * sizeof(struct emu_entry);
+	iov[2].iov_base = scan->arena;
+	iov[2].iov_len = hdr.arena_sz;
+	if (preadv(fd, iov, 3, sizeof(hdr)) != (ssize_t)sz) {
+		emu_scan_free(scan);
+		return (-1);
+	}
+
+	for (i = 0; i < scan->nents; i++)
+		if (emu_index_name(scan, &scan->ents[i]) == -1) {
+			emu_scan_free(scan);
+			return (-1);
+		}
+
+	/* VMs below the config directory (or a root) don't change it's
+	   mtime, only the one of the directory they're in. A directory
+	   that's gone (like a missing roots file) is stamped 0. */
+	for (i = 0; i < scan->ndirs; i++) {
+		memset(&mtime, 0, sizeof(mtime));
+		if (emu_index_name(scan, &scan->dirs[i]) == -1) {
+			emu_scan_free(scan);
+			return (-1);
+		}
+		if (fstatat(dirfd, scan->arena + scan->dirs[i].name_off,
+			    &st, 0) == 0)
+			mtime = st.st_mtim;
+		if (mtime.tv_sec != scan->dirs[i].mtime.tv_sec ||
+		    mtime.tv_nsec != scan->dirs[i].mtime.tv_nsec ||
+		    ((mtime.tv_sec || mtime.tv_nsec) &&
+		     emu_index_racy(&mtime, &ist.st_mtim))) {
+			emu_scan_free(scan);
+			return (-1);
+		}
+	}
+
+	scan->indexed = 1;
+	return (0);
+}
+
+/* Write the entry table to the index. The header is invalidated
+   first and only written (with the current state of the directory)
+   after everything else, so a partial write is never trusted.
+   Failing to write the index isn't fatal, it's only a cache. */
+static void emu_index_write(int fd, int dirfd, const struct emu_scan *scan)
+{
+	struct emu_index_hdr hdr;
+	struct stat st;
+	struct iovec iov[3];
+	size_t sz;
+
+	memset(&hdr, 0, sizeof(hdr));
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+		return;
+
+	iov[0].iov_base = scan->ents;
+	iov[0].iov_len = scan->nents * sizeof(struct emu_entry);
+	iov[1].iov_base = scan->dirs;
+	iov[1].iov_len = scan->ndirs * sizeof(struct emu_entry);
+	iov[2].iov_base = scan->arena;
+	iov[2].iov_len = scan->arena_sz;
+	sz = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+	if (pwritev(fd, iov, 3, sizeof(hdr)) != (ssize_t)sz ||
+	    ftruncate(fd, (off_t)(sizeof(hdr) + sz)) == -1)
+		return;
+
+	/* The index file itself already exists at this point, so writing
+	   to it doesn't change the mtime of the directory anymore. A scan
+	   goes by the mtime from before it, a change made in the middle
+	   of it is never taken for what's been read. */
+	if (fstat(dirfd, &st) == -1)
+		return;
+	if (scan->stamp.tv_sec || scan->stamp.tv_nsec)
+		st.st_mtim = scan->stamp;
+
+	hdr.magic = EMU_INDEX_MAGIC;
+	hdr.version = EMU_INDEX_VERSION;
+	hdr.ent_sz = sizeof(struct emu_entry);
+	hdr.dev = (uint64_t)st.st_dev;
+	hdr.ino = (uint64_t)st.st_ino;
+	hdr.mtime = st.st_mtim;
+	hdr.nents = scan->nents;
+	hdr.arena_sz = scan->arena_sz;
+	hdr.row_sz = scan->row_sz;
+	hdr.name_sz = scan->name_sz;
+	hdr.ndirs = scan->ndirs;
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+		return;
+}
+
+/* Start an in-place update of the index, before configs get created
+   or deleted. Returns the locked index, only if it's still valid, -1
+   otherwise. Either way, it must be passed to emu_index_end(...). */
+static int emu_index_begin(int dirfd, struct emu_scan *scan)
+{
+	int fd;
+
+	memset(scan, 0, sizeof(struct emu_scan));
+	fd = emu_index_open(dirfd);
+	if (fd == -1)
+		return (-1);
+
+	/* A stale index is rebuilt by the next scan anyway. */
+	if (emu_index_read(fd, dirfd, scan) == -1) {
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/* Finish an update started with emu_index_begin(...), writing
+   back the modified entry table, if there's one. */
+static void emu_index_end(int fd, int dirfd, struct emu_scan *scan)
+{
+	if (fd != -1) {
+		emu_index_write(fd, dirfd, scan);
+		close(fd);
+	}
+
+	emu_scan_free(scan);
+}
+
+/* Current time, in nanoseconds of the monotonic clock. */
+static uint64_t emu_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+/* Start measuring the next phase. Every stats function does nothing
+   without --stats, when stats is NULL. */
+static void emu_stats_begin(struct emu_stats *stats)
+{
+	if (stats)
+		stats->last = emu_stats_now();
+}
+
+/* The phase has ended, the next one starts right away. */
+static void emu_stats_end(struct emu_stats *stats, int phase)
+{
+	uint64_t now;
+
+	if (stats == NULL)
+		return;
+
+	now = emu_stats_now();
+	stats->ns[phase] += now - stats->last;
+	stats->last = now;
+}
+
+/* Write a JSON string, escaped. */
+static void emu_json_string(FILE *fp, const char *s)
+{
+	const unsigned char *p;
+
+	fputc('"', fp);
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+/* Show every phase up to the selection. */
+static void emu_stats_report(const struct emu_stats *stats)
+{
+	static const char *names[EMU_STAT_PHASES] = {
+		"scan", "sort", "layout", "curses", "paint", "select",
+	};
+	int i;
+
+	if (stats == NULL)
+		return;
+
+	for (i = 0; i < EMU_STAT_PHASES; i++) {
+		if (stats->format == EMU_STATS_JSON)
+			fprintf(stderr, "{\"event\":\"%s\",\"ms\":%.3f}\n",
+				names[i], (double)stats->ns[i] / 1e6);
+		else
+			fprintf(stderr, "emubox: %-8s %10.3f ms\n",
+				names[i], (double)stats->ns[i] / 1e6);
+	}
+
+	if (stats->format == EMU_STATS_JSON)
+		fprintf(stderr, "{\"event\":\"entries\",\"count\":%zu,"
+			"\"index\":%s}\n", stats->nents,
+			stats->index ? "true" : "false");
+	else
+		fprintf(stderr, "emubox: %zu entries, %s\n", stats->nents,
+			stats->index ? "from the index" : "scanned");
+}
+
+/* Show how long it took to get a VM running, since it's launch,
+   since the selection and since emubox itself has been started. */
+static void emu_stats_spawn(const struct emu_stats *stats,
+			    const struct emu_vm *vm, uint64_t begin)
+{
+	uint64_t now;
+
+	if (stats == NULL)
+		return;
+
+	now = emu_stats_now();
+	if (stats->format == EMU_STATS_JSON) {
+		fputs("{\"event\":\"spawn\",\"config\":", stderr);
+		emu_json_string(stderr, vm->name);
+		fprintf(stderr, ",\"pid\":%ld,\"ms\":%.3f,"
+			"\"since_select_ms\":%.3f,\"since_start_ms\":%.3f}\n",
+			(long)vm->pid, (double)(now - begin) / 1e6,
+			(double)(now - stats->selected) / 1e6,
+			(double)(now - stats->start) / 1e6);
+	} else {
+		fprintf(stderr, "emubox: spawn    %10.3f ms, %.3f ms since "
+			"the selection, %.3f ms since the start: %s\n",
+			(double)(now - begin) / 1e6,
+			(double)(now - stats->selected) / 1e6,
+			(double)(now - stats->start) / 1e6, vm->name);
+	}
+}
+
+/* Remember that a config has been launched, as a "<time> <name>"
+   line at the end of the launch history. A single write to a file
+   opened for appending, so concurrent launches don't mix up, and
+   under a shared lock, so it doesn't go away in a fold. */
+static void emu_history_add(const char *path, const char *name)
+{
+	char buf[PATH_MAX + 32];
+	int dirfd, sfd, fd, len;
+
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		return;
+	sfd = emu_state_open(dirfd, 1);
+	close(dirfd);
+	if (sfd == -1)
+		return;
+	fd = openat(sfd, EMU_HISTORY_NAME, O_WRONLY | O_APPEND | O_CREAT |
+		    O_CLOEXEC, 0600);
+	close(sfd);
+	if (fd == -1)
+		return;
+
+	(void)flock(fd, LOCK_SH);
+	len = snprintf(buf, sizeof(buf), "%lld %s\n",
+		       (long long)time(NULL), name);
+	if (len > 0 && (size_t)len < sizeof(buf))
+		(void)!write(fd, buf, (size_t)len);
+	close(fd);
+}
+
+/* Count n launches (in EMU_FRECENCY_LAUNCH units) of name, the last
+   one at ts. */
+static void emu_history_put(struct emu_history *h, const char *name,
+			    uint64_t ts, uint64_t n)
+{
+	size_t pos, cap;
+
+	if (emu_scan_find(&h->names, name, &pos) == 0) {
+		if (h->names.nents == h->cap) {
+			cap = h->cap ? h->cap * 2 : (size_t)64;
+			h->last = realloc(h->last, cap * sizeof(uint64_t));
+			h->count = realloc(h->count, cap * sizeof(uint64_t));
+			if (h->last == NULL || h->count == NULL)
+				err(EXIT_FAILURE, "realloc");
+			h->cap = cap;
+		}
+
+		emu_scan_insert(&h->names, name, NULL);
+		memmove(&h->last[pos + 1], &h->last[pos],
+			(h->names.nents - pos - 1) * sizeof(uint64_t));
+		memmove(&h->count[pos + 1], &h->count[pos],
+			(h->names.nents - pos - 1) * sizeof(uint64_t));
+		h->last[pos] = h->count[pos] = 0;
+	}
+
+	if (ts > h->last[pos])
+		h->last[pos] = ts;
+	h->count[pos] += n;
+}
+
+/* Read a history file, the launch log or (folded) the one with a
+   "<time> <count> <name>" line per config, into h. Returns the size
+   that has been read, or -1. */
+static off_t emu_history_parse(int fd, struct emu_history *h, int folded)
+{
+	const char *map, *p, *end, *eol;
+	char name[PATH_MAX];
+	struct stat st;
+	uint64_t ts, n;
+	size_t len;
+
+	if (fstat(fd, &st) == -1)
+		return (-1);
+	if (st.st_size == 0)
+		return (0);
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return (-1);
+
+	end = map + st.st_size;
+	for (p = map; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', (size_t)(end - p));
+		if (eol == NULL)
+			break;
+
+		for (ts = 0; p < eol && *p >= '0' && *p <= '9'; p++)
+			ts = ts * 10 + (uint64_t)(*p - '0');
+		if (p == eol || *p++ != ' ')
+			continue;
+
+		/* Every launch counts the same, until it's folded. */
+		n = EMU_FRECENCY_LAUNCH;
+		if (folded) {
+			for (n = 0; p < eol && *p >= '0' && *p <= '9'; p++)
+				n = n * 10 + (uint64_t)(*p - '0');
+			if (p == eol || *p++ != ' ')
+				continue;
+		}
+
+		len = (size_t)(eol - p);
+		if (len == 0 || len >= (size_t)PATH_MAX)
+			continue;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		emu_history_put(h, name, ts, n);
+	}
+
+	munmap((void *)map, (size_t)st.st_size);
+	return (st.st_size);
+}
+
+/* Fold the launch log into EMU_FRECENCY_NAME, a line per config that
+   (still) exists, and empty the log. Once the counts add up to more
+   than EMU_FRECENCY_AGE, all of them are cut by a tenth, so old
+   favourites slowly give way. The new file is complete before it
+   replaces the old one, if emubox dies before the log is emptied,
+   the log is only counted twice. Both are in EMU_STATE_DIR, at
+   sfd, the configs are at dirfd. */
+static void emu_history_compact(int sfd, int fd, int dirfd,
+				struct emu_history *h)
+{
+	const char *name;
+	struct stat st;
+	uint64_t total;
+	size_t i;
+	FILE *fp;
+	int wfd;
+
+	for (i = 0, total = 0; i < h->names.nents; i++)
+		total += h->count[i];
+	if (total > EMU_FRECENCY_AGE)
+		for (i = 0; i < h->names.nents; i++)
+			h->count[i] -= h->count[i] / 10;
+
+	wfd = openat(sfd, EMU_FRECENCY_NAME ".tmp", O_WRONLY | O_CREAT |
+		     O_TRUNC | O_CLOEXEC, 0600);
+	if (wfd == -1 || (fp = fdopen(wfd, "w")) == NULL) {
+		if (wfd != -1)
+			close(wfd);
+		return;
+	}
+
+	for (i = 0; i < h->names.nents; i++) {
+		name = emu_scan_name(&h->names, i);
+		if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+		fprintf(fp, "%llu %llu %s\n", (unsigned long long)h->last[i],
+			(unsigned long long)h->count[i], name);
+	}
+
+	if (fflush(fp) == EOF || fsync(wfd) == -1) {
+		fclose(fp);
+		unlinkat(sfd, EMU_FRECENCY_NAME ".tmp", 0);
+		return;
+	}
+	fclose(fp);
+
+	if (renameat(sfd, EMU_FRECENCY_NAME ".tmp", sfd,
+		     EMU_FRECENCY_NAME) == -1) {
+		unlinkat(sfd, EMU_FRECENCY_NAME ".tmp", 0);
+		return;
+	}
+	(void)!ftruncate(fd, 0);
+}
+
+/* Time of the last launch of every config in the directory at dirfd,
+   and how often it has been launched (in EMU_FRECENCY_LAUNCH units,
+   aged), from the folded history and the launches logged since, into
+   h. Only the log since the last fold is read line by line, once it
+   has grown beyond EMU_HISTORY_COMPACT, it's folded as well, so
+   neither file grows with the launches. h has to be freed with
+   emu_history_free(...), even if nothing is there. */
+static void emu_history_load(int dirfd, struct emu_history *h)
+{
+	struct stat st;
+	off_t sz;
+	int sfd, fd, ffd, rw;
+
+	memset(h, 0, sizeof(struct emu_history));
+	h->now = (uint64_t)time(NULL);
+
+	/* Nothing has been launched yet. */
+	sfd = emu_state_open(dirfd, 0);
+	if (sfd == -1)
+		return;
+
+	rw = 1;
+	fd = openat(sfd, EMU_HISTORY_NAME, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		rw = 0;
+		fd = openat(sfd, EMU_HISTORY_NAME, O_RDONLY | O_CLOEXEC);
+	}
+
+	/* A launch logged in the middle of a fold would be lost. */
+	if (fd != -1)
+		(void)flock(fd, LOCK_SH);
+
+	ffd = openat(sfd, EMU_FRECENCY_NAME, O_RDONLY | O_CLOEXEC);
+	if (ffd != -1) {
+		(void)emu_history_parse(ffd, h, 1);
+		close(ffd);
+	}
+	if (fd == -1) {
+		close(sfd);
+		return;
+	}
+
+	/* The lock isn't upgraded in place, anything logged while it's
+	   changed is left for the next time. */
+	sz = emu_history_parse(fd, h, 0);
+	if (rw && sz > (off_t)EMU_HISTORY_COMPACT &&
+	    flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+	    fstat(fd, &st) == 0 && st.st_size == sz)
+		emu_history_compact(sfd, fd, dirfd, h);
+	close(fd);
+	close(sfd);
+}
+
+/* Free everything that emu_history_load(...) has allocated. */
+static void emu_history_free(struct emu_history *h)
+{
+	emu_scan_free(&h->names);
+	free(h->last);
+	free(h->count);
+	memset(h, 0, sizeof(struct emu_history));
+}
+
+/* Frecency of an entry, how often it has been launched, weighted by
+   how long ago the last launch was. */
+static uint64_t emu_history_score(uint64_t last, uint64_t count,
+				  uint64_t now)
+{
+	uint64_t age;
+
+	if (last == 0)
+		return (0);
+
+	age = now > last ? now - last : 0;
+	if (age < (uint64_t)3600)
+		return (count * 8);
+	if (age < (uint64_t)86400)
+		return (count * 4);
+	if (age < (uint64_t)604800)
+		return (count * 2);
+	return (count);
+}
+
+/* What the config at pos of h is ranked by, in the order sort. */
+static uint64_t emu_history_key(const struct emu_history *h, size_t pos,
+				int sort)
+{
+	if (sort == EMU_SORT_FRECENCY)
+		return (emu_history_score(h->last[pos], h->count[pos],
+					  h->now));
+	return (h->last[pos]);
+}
+
+/* LSD radix sort over 64 bit keys, a byte per pass. It's stable, so
+   entries with the same key stay in the natural order. */
+static void emu_rank_sort(struct emu_rank_ent *re, struct emu_rank_ent *tmp,
+			  size_t n)
+{
+	struct emu_rank_ent *out, *t;
+	size_t count[256], i, b, start;
+	int shift;
+
+	if (n == 0)
+		return;
+
+	out = re;
+	for (shift = 0; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(re[i].key >> shift) & 0xff]++;
+
+		/* Every key has the same byte here, nothing to do. */
+		if (count[(re[0].key >> shift) & 0xff] == n)
+			continue;
+
+		for (b = 0, start = 0; b < 256; b++) {
+			i = count[b];
+			count[b] = start;
+			start += i;
+		}
+		for (i = 0; i < n; i++)
+			tmp[count[(re[i].key >> shift) & 0xff]++] = re[i];
+
+		t = re;
+		re = tmp;
+		tmp = t;
+	}
+
+	if (re != out)
+		memcpy(out, re, n * sizeof(struct emu_rank_ent));
+}
+
+/* Sort keys of the entries at idx (in the order of the table) into
+   re, or of every entry if it's NULL, the latest (or the most used)
+   ones first. The launches are taken from h, by looking up the names
+   of whichever side has fewer of them in the other one. */
+static void emu_rank_keys(const struct emu_scan *scan, int sort,
+			  const struct emu_history *h, const size_t *idx,
+			  size_t n, struct emu_rank_ent *re)
+{
+	const struct emu_entry *e;
+	size_t i, j, pos, lo, hi;
+
+	for (j = 0; j < n; j++) {
+		re[j].idx = idx ? idx[j] : j;
+		re[j].key = ~(uint64_t)0;
+		if (sort == EMU_SORT_MTIME) {
+			e = &scan->ents[re[j].idx];
+			re[j].key = ~((uint64_t)e->mtime.tv_sec *
+				      1000000000ULL +
+				      (uint64_t)e->mtime.tv_nsec);
+		}
+	}
+	if ((sort != EMU_SORT_LAUNCHED && sort != EMU_SORT_FRECENCY) ||
+	    h->names.nents == 0)
+		return;
+
+	if (n <= h->names.nents) {
+		for (j = 0; j < n; j++)
+			if (emu_scan_find(&h->names,
+					  emu_scan_name(scan, re[j].idx), &pos))
+				re[j].key = ~emu_history_key(h, pos, sort);
+		return;
+	}
+
+	for (pos = 0; pos < h->names.nents; pos++) {
+		if (emu_scan_find(scan, emu_scan_name(&h->names, pos),
+				  &i) == 0)
+			continue;
+
+		/* Where it is in idx, if it's there at all. */
+		j = i;
+		if (idx) {
+			for (lo = 0, hi = n; lo < hi;) {
+				j = lo + (hi - lo) / 2;
+				if (idx[j] < i)
+					lo = j + 1;
+				else
+					hi = j;
+			}
+			j = lo;
+			if (j == n || idx[j] != i)
+				continue;
+		}
+		re[j].key = ~emu_history_key(h, pos, sort);
+	}
+}
+
+/* Rank every entry in another order than by name, the latest (or
+   the most used) ones first. Returns the position of every entry in
+   that order, or NULL if it's the order by name. EMU_SORT_MTIME goes
+   by the mtimes the entries already have. The ones of a scan are
+   fresh, the ones of the index are stamped again first, in batches.
+   The history is read from dirfd. */
+static size_t *emu_scan_rank(struct emu_scan *scan, int dirfd, int sort)
+{
+	struct emu_rank_ent *re, *tmp;
+	struct emu_history h;
+	size_t *rank, i;
+
+	if (sort == EMU_SORT_NAME)
+		return (NULL);
+
+	re = malloc((scan->nents + 1) * sizeof(struct emu_rank_ent));
+	tmp = malloc((scan->nents + 1) * sizeof(struct emu_rank_ent));
+	rank = malloc((scan->nents + 1) * sizeof(size_t));
+	if (re == NULL || tmp == NULL || rank == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	if (sort == EMU_SORT_MTIME && scan->indexed && dirfd != -1)
+		emu_scan_stamp(scan, dirfd);
+	memset(&h, 0, sizeof(h));
+	if ((sort == EMU_SORT_LAUNCHED || sort == EMU_SORT_FRECENCY) &&
+	    dirfd != -1)
+		emu_history_load(dirfd, &h);
+	emu_rank_keys(scan, sort, &h, NULL, scan->nents, re);
+	emu_history_free(&h);
+
+	emu_rank_sort(re, tmp, scan->nents);
+	for (i = 0; i < scan->nents; i++)
+		rank[re[i].idx] = i;
+
+	free(tmp);
+	free(re);
+	return (rank);
+}
+
+/* Get a sorted entry table of the config directory. If the index
+   is still valid, that's a single read, otherwise the directory is
+   scanned, sorted and the index is rebuilt for the next time.
+   Returns -1 if the directory is missing. */
+static int emu_scan_load(struct emu_scan *scan, const char *path,
+			 struct emu_stats *stats)
+{
+	int dirfd, fd;
+
+	emu_stats_begin(stats);
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		return (-1);
+
+	fd = emu_index_open(dirfd);
+	if (fd != -1 && emu_index_read(fd, dirfd, scan) == 0) {
+		if (stats)
+			stats->index = 1;
+		goto out_close;
+	}
+
+	if (emu_scan_tree(scan, dirfd) == -1) {
+		if (fd != -1)
+			close(fd);
+		close(dirfd);
+		return (-1);
+	}
+
+	emu_stats_end(stats, EMU_STAT_SCAN);
+	emu_scan_sort(scan);
+	emu_stats_end(stats, EMU_STAT_SORT);
+	emu_scan_stamp(scan, dirfd);
+	if (fd != -1)
+		emu_index_write(fd, dirfd, scan);
+
+out_close:
+	if (fd != -1)
+		close(fd);
+	close(dirfd);
+	emu_stats_end(stats, EMU_STAT_SCAN);
+	if (stats)
+		stats->nents = scan->nents;
+	return (0);
+}
+
+/* Like emu_scan_load(...), but if the index can't be used, stream is
+   set to a scan of the directory that runs behind the menu, which
+   fills in the (empty) entry table as it goes. Returns -1 if the
+   directory couldn't be opened. */
+static int emu_scan_stream(struct emu_scan *scan, const char *path,
+			   struct emu_stats *stats, struct emu_stream **stream)
+{
+	int dirfd, fd;
+
+	*stream = NULL;
+	emu_stats_begin(stats);
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		return (-1);
+
+	fd = emu_index_open(dirfd);
+	if (fd != -1 && emu_index_read(fd, dirfd, scan) == 0) {
+		if (stats) {
+			stats->index = 1;
+			stats->nents = scan->nents;
+		}
+		close(fd);
+		close(dirfd);
+		emu_stats_end(stats, EMU_STAT_SCAN);
+		return (0);
+	}
+
+	/* The scanner keeps the index locked until it's written. */
+	*stream = emu_stream_start(dirfd, fd);
+	close(dirfd);
+	if (*stream == NULL) {
+		if (fd != -1)
+			close(fd);
+		return (emu_scan_load(scan, path, stats));
+	}
+
+	memset(scan, 0, sizeof(struct emu_scan));
+	emu_stats_end(stats, EMU_STAT_SCAN);
+	return (0);
+}
+
+/* Retrieve information about the file name, column,
+   and largest rows length, from an already scanned directory. */
+static void emu_content_len(const struct emu_scan *scan,
+			    struct content_len_info *clinfo)
+{
+	size_t n;
+
+	clinfo->name_sz = scan->name_sz;
+	clinfo->row_sz = scan->row_sz;
+
+	/* Column size, no bigger than a page. */
+	clinfo->column_sz = scan->nents < (size_t)EMU_MENU_PAGE ?
+		scan->nents : (size_t)EMU_MENU_PAGE;
+
+	/* The index column is as wide as the largest index. */
+	clinfo->num_sz = (size_t)1;
+	for (n = scan->nents; n >= (size_t)10; n /= (size_t)10)
+		clinfo->num_sz++;
+
+	clinfo->column_sz += (size_t)5;
+	/* Borders, margins and ". " around the index. */
+	clinfo->row_sz += clinfo->num_sz + (size_t)10;
+	/* Leave some room for the title and the position. */
+	n = clinfo->num_sz * (size_t)2 + (size_t)22;
+	if (clinfo->row_sz < n)
+		clinfo->row_sz = n;
+}
+
+/* Hash of a trigram, to it's bucket. */
+static uint32_t emu_tri_hash(const char *p)
+{
+	uint32_t g;
+
+	g = (uint32_t)(unsigned char)p[0] << 16 |
+		(uint32_t)(unsigned char)p[1] << 8 |
+		(uint32_t)(unsigned char)p[2];
+	return ((g * 2654435761U) >> 16 & (EMU_TRI_BUCKETS - 1U));
+}
+
+/* qsort_r's internal function, for the lowercase names. */
+static int emu_search_compare(const void *s0, const void *s1, void *arg)
+{
+	const struct emu_search_ctx *ctx;
+	uint32_t i0, i1;
+
+	ctx = arg;
+	i0 = *(const uint32_t *)s0;
+	i1 = *(const uint32_t *)s1;
+	return (strcmp(ctx->search->folded + ctx->scan->ents[i0].name_off,
+		       ctx->search->folded + ctx->scan->ents[i1].name_off));
+}
+
+/* Build the search index over a sorted entry table. */
+static void emu_search_build(struct emu_search *search,
+			     const struct emu_scan *scan)
+{
+	uint32_t *last, h, *pos;
+	struct emu_search_ctx ctx;
+	const char *name;
+	size_t i, j;
+
+	search->folded = malloc(scan->arena_sz ? scan->arena_sz : (size_t)1);
+	search->byname = malloc((scan->nents + 1) * sizeof(uint32_t));
+	search->tri_start = calloc(EMU_TRI_BUCKETS + 1U, sizeof(uint32_t));
+	last = malloc(EMU_TRI_BUCKETS * sizeof(uint32_t));
+	if (search->folded == NULL || search->byname == NULL ||
+	    search->tri_start == NULL || last == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	for (i = 0; i < scan->arena_sz; i++)
+		search->folded[i] = (char)tolower((unsigned char)scan->arena[i]);
+
+	/* Order the entries by their lowercase names. */
+	for (i = 0; i < scan->nents; i++)
+		search->byname[i] = (uint32_t)i;
+	ctx.search = search;
+	ctx.scan = scan;
+	if (scan->nents > (size_t)1)
+		qsort_r(search->byname, scan->nents, sizeof(uint32_t),
+			emu_search_compare, &ctx);
+
+	/* Count the entries of every trigram, a trigram that appears
+	   more than once in a name is only counted once. */
+	memset(last, 0xff, EMU_TRI_BUCKETS * sizeof(uint32_t));
+	for (i = 0; i < scan->nents; i++) {
+		name = search->folded + scan->ents[i].name_off;
+		for (j = 0; j + (size_t)2 < scan->ents[i].name_len; j++) {
+			h = emu_tri_hash(name + j);
+			if (last[h] != (uint32_t)i) {
+				last[h] = (uint32_t)i;
+				search->tri_start[h + 1U]++;
+			}
+		}
+	}
+
+	for (h = 0; h < EMU_TRI_BUCKETS; h++)
+		search->tri_start[h + 1U] += search->tri_start[h];
+
+	search->tri_ents = malloc(((size_t)search->tri_start[EMU_TRI_BUCKETS]
+				   + 1) * sizeof(uint32_t));
+	pos = malloc(EMU_TRI_BUCKETS * sizeof(uint32_t));
+	if (search->tri_ents == NULL || pos == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	/* And fill them in, in the order of the entry table. */
+	memcpy(pos, search->tri_start, EMU_TRI_BUCKETS * sizeof(uint32_t));
+	memset(last, 0xff, EMU_TRI_BUCKETS * sizeof(uint32_t));
+	for (i = 0; i < scan->nents; i++) {
+		name = search->folded + scan->ents[i].name_off;
+		for (j = 0; j + (size_t)2 < scan->ents[i].name_len; j++) {
+			h = emu_tri_hash(name + j);
+			if (last[h] != (uint32_t)i) {
+				last[h] = (uint32_t)i;
+				search->tri_ents[pos[h]++] = (uint32_t)i;
+			}
+		}
+	}
+
+	free(pos);
+	free(last);
+}
+
+/* qsort's internal function, the matches by their position in the
+   entry table. */
+static int emu_search_position(const void *s0, const void *s1)
+{
+	size_t i0, i1;
+
+	i0 = *(const size_t *)s0;
+	i1 = *(const size_t *)s1;
+	return ((i0 > i1) - (i0 < i1));
+}
+
+/* Find every entry matching a lowercase query. Names starting with
+   the query come first (nprefix of them), then the ones containing
+   it elsewhere, both in the order of the entry table. out must have
+   room for every entry. Returns the amount of matches. */
+static size_t emu_search_query(const struct emu_search *search,
+			       const struct emu_scan *scan, const char *q,
+			       size_t len, size_t *out, size_t *nprefix)
+{
+	size_t lo, hi, mid, n, i;
+	uint32_t h, best, cnt, e;
+	const char *name;
+
+	/* Find the range of names starting with the query. */
+	lo = 0;
+	hi = scan->nents;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / (size_t)2;
+		name = search->folded + scan->ents[search->byname[mid]].name_off;
+		if (strncmp(name, q, len) < 0)
+			lo = mid + (size_t)1;
+		else
+			hi = mid;
+	}
+
+	n = 0;
+	for (; lo < scan->nents; lo++) {
+		name = search->folded + scan->ents[search->byname[lo]].name_off;
+		if (strncmp(name, q, len) != 0)
+			break;
+		out[n++] = search->byname[lo];
+	}
+
+	/* They're found by their lowercase name, which isn't the order
+	   of emu_scan_sort(...), "vm10" would come before "vm2". */
+	if (n > (size_t)1)
+		qsort(out, n, sizeof(size_t), emu_search_position);
+
+	*nprefix = n;
+	if (len < (size_t)3)
+		return (n);
+
+	/* Every other match contains all trigrams of the query,
+	   so only the rarest one has to be looked at. */
+	best = emu_tri_hash(q);
+	for (i = 1; i + (size_t)2 < len; i++) {
+		h = emu_tri_hash(q + i);
+		cnt = search->tri_start[h + 1U] - search->tri_start[h];
+		if (cnt < search->tri_start[best + 1U] -
+		    search->tri_start[best])
+			best = h;
+	}
+
+	for (h = search->tri_start[best];
+	     h < search->tri_start[best + 1U]; h++) {
+		e = search->tri_ents[h];
+		name = search->folded + scan->ents[e].name_off;
+		/* Skip the ones which are already in the prefix range. */
+		if (strncmp(name, q, len) != 0 && strstr(name + 1, q))
+			out[n++] = e;
+	}
+
+	return (n);
+}
+
+/* Free the search index. */
+static void emu_search_free(struct emu_search *search)
+{
+	free(search->folded);
+	free(search->byname);
+	free(search->tri_start);
+	free(search->tri_ents);
+}
+
+/* Preview worker, reads the queued configs one by one. */
+static void *emu_preview_worker(void *arg)
+{
+	struct emu_preview *pv;
+	struct emu_preview_slot *slot;
+	struct emu_conf *cf;
+	struct emu_meta meta;
+	char name[PATH_MAX];
+	int last;
+
+	pv = arg;
+	pthread_mutex_lock(&pv->lock);
+	for (;;) {
+		while (!pv->quit && pv->whead == pv->wtail)
+			pthread_cond_wait(&pv->cond, &pv->lock);
+		if (pv->quit)
+			break;
+
+		/* A busy slot is never evicted, so it stays ours. */
+		slot = &pv->slots[pv->want[pv->whead++]];
+		slot->state = EMU_SLOT_BUSY;
+		memcpy(name, slot->name, sizeof(name));
+		pthread_mutex_unlock(&pv->lock);
+
+		cf = emu_read_conf(pv->dirfd, name);
+		if (cf) {
+			emu_conf_meta(cf, &meta);
+			emu_free_conf(cf);
+		} else {
+			memset(&meta, 0, sizeof(meta));
+			meta.errnum = errno;
+		}
+
+		pthread_mutex_lock(&pv->lock);
+		slot->meta = meta;
+		slot->state = EMU_SLOT_READY;
+		/* It doesn't matter if the pipe is full. */
+		(void)!write(pv->notify[1], "", 1);
+	}
+
+	last = --pv->alive == 0;
+	pthread_mutex_unlock(&pv->lock);
+	if (last) {
+		close(pv->dirfd);
+		close(pv->notify[0]);
+		close(pv->notify[1]);
+		pthread_mutex_destroy(&pv->lock);
+		pthread_cond_destroy(&pv->cond);
+		free(pv);
+	}
+
+	return (NULL);
+}
+
+/* Start the preview workers. Returns NULL if they couldn't be, the
+   menu works without a preview as well. */
+static struct emu_preview *emu_preview_start(int dirfd)
+{
+	struct emu_preview *pv;
+	pthread_t thread;
+	int i;
+
+	pv = calloc(1, sizeof(struct emu_preview));
+	if (pv == NULL)
+		return (NULL);
+
+	pv->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	if (pv->dirfd == -1) {
+		free(pv);
+		return (NULL);
+	}
+
+	if (pipe2(pv->notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+		close(pv->dirfd);
+		free(pv);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&pv->lock, NULL);
+	pthread_cond_init(&pv->cond, NULL);
+
+	pthread_mutex_lock(&pv->lock);
+	for (i = 0; i < EMU_PREVIEW_THREADS; i++) {
+		if (pthread_create(&thread, NULL, emu_preview_worker, pv) != 0)
+			break;
+		pthread_detach(thread);
+		pv->alive++;
+	}
+	pthread_mutex_unlock(&pv->lock);
+
+	if (pv->alive == 0) {
+		close(pv->dirfd);
+		close(pv->notify[0]);
+		close(pv->notify[1]);
+		free(pv);
+		return (NULL);
+	}
+
+	return (pv);
+}
+
+/* Tell the workers what should be read next, in the order of
+   importance. Whatever has been queued before, but not started
+   yet, is dropped. */
+static void emu_preview_want(struct emu_preview *pv, const char **names,
+			     size_t n)
+{
+	struct emu_preview_slot *slot;
+	size_t i, len;
+	uint32_t h;
+	int j, victim;
+
+	pthread_mutex_lock(&pv->lock);
+	for (j = pv->whead; j < pv->wtail; j++)
+		pv->slots[pv->want[j]].state = EMU_SLOT_FREE;
+	pv->whead = pv->wtail = 0;
+	pv->tick++;
+
+	for (i = 0; i < n; i++) {
+		len = strlen(names[i]);
+		if (len >= (size_t)PATH_MAX)
+			continue;
+
+		h = emu_conf_hash(names[i], len, "", 0);
+		victim = -1;
+		for (j = 0; j < EMU_PREVIEW_CACHE; j++) {
+			slot = &pv->slots[j];
+			if (slot->state != EMU_SLOT_FREE && slot->hash == h &&
+			    strcmp(slot->name, names[i]) == 0)
+				break;
+
+			/* Least recently asked one, never a busy one. */
+			if (slot->state == EMU_SLOT_BUSY)
+				continue;
+			if (victim == -1 || slot->state == EMU_SLOT_FREE ||
+			    (pv->slots[victim].state != EMU_SLOT_FREE &&
+			     slot->tick < pv->slots[victim].tick))
+				victim = j;
+		}
+
+		if (j < EMU_PREVIEW_CACHE) {
+			pv->slots[j].tick = pv->tick;
+			continue;
+		}
+
+		if (victim == -1)
+			break;
+
+		slot = &pv->slots[victim];
+		memcpy(slot->name, names[i], len + (size_t)1);
+		slot->hash = h;
+		slot->tick = pv->tick;
+		slot->state = EMU_SLOT_QUEUED;
+		pv->want[pv->wtail++] = victim;
+	}
+
+	pthread_cond_broadcast(&pv->cond);
+	pthread_mutex_unlock(&pv->lock);
+}
+
+/* Get the metadata of a config, if it's been read already. */
+static int emu_preview_get(struct emu_preview *pv, const char *name,
+			   struct emu_meta *meta)
+{
+	struct emu_preview_slot *slot;
+	uint32_t h;
+	int j, ret;
+
+	h = emu_conf_hash(name, strlen(name), "", 0);
+	ret = 0;
+	pthread_mutex_lock(&pv->lock);
+	for (j = 0; j < EMU_PREVIEW_CACHE; j++) {
+		slot = &pv->slots[j];
+		if (slot->state == EMU_SLOT_READY && slot->hash == h &&
+		    strcmp(slot->name, name) == 0) {
+			*meta = slot->meta;
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pv->lock);
+
+	return (ret);
+}
+
+/* Drop the cached metadata of a config, it has been changed. */
+static void emu_preview_forget(struct emu_preview *pv, const char *name)
+{
+	struct emu_preview_slot *slot;
+	uint32_t h;
+	int j;
+
+	h = emu_conf_hash(name, strlen(name), "", 0);
+	pthread_mutex_lock(&pv->lock);
+	for (j = 0; j < EMU_PREVIEW_CACHE; j++) {
+		slot = &pv->slots[j];
+		if (slot->state == EMU_SLOT_READY && slot->hash == h &&
+		    strcmp(slot->name, name) == 0)
+			slot->state = EMU_SLOT_FREE;
+	}
+	pthread_mutex_unlock(&pv->lock);
+}
+
+/* Stop the workers. The ones still reading a config finish that in
+   the background, the menu (or whatever comes after) doesn't wait. */
+static void emu_preview_stop(struct emu_preview *pv)
+{
+	pthread_mutex_lock(&pv->lock);
+	pv->quit = 1;
+	pthread_cond_broadcast(&pv->cond);
+	pthread_mutex_unlock(&pv->lock);
+}
+
+/* Free the scan, by the last one of the scanner and the menu. */
+static void emu_stream_free(struct emu_stream *st)
+{
+	if (st->index != -1)
+		close(st->index);
+	close(st->dirfd);
+	close(st->notify[0]);
+	close(st->notify[1]);
+	pthread_mutex_destroy(&st->lock);
+	emu_scan_free(&st->found);
+	free(st);
+}
+
+/* Give what has been found so far to the menu, arg is the scan (it's
+   the flush of emu_scan_walk(...) as well). Returns -1 once the menu
+   has no use for the rest. */
+static int emu_stream_flush(void *arg, struct emu_scan *found)
+{
+	struct emu_stream *st;
+	int quit;
+
+	st = arg;
+	pthread_mutex_lock(&st->lock);
+	if (st->found.nents == 0 && st->found.ndirs == 0) {
+		emu_scan_free(&st->found);
+		st->found = *found;
+		memset(found, 0, sizeof(struct emu_scan));
+	} else {
+		emu_scan_take(&st->found, found);
+	}
+	quit = st->quit;
+	pthread_mutex_unlock(&st->lock);
+
+	/* It doesn't matter if the pipe is full. */
+	(void)!write(st->notify[1], "", 1);
+	return (quit ? -1 : 0);
+}
+
+/* Thread of the scan, the same rules as emu_scan_tree(...), the
+   modification times are taken right away. */
+static void *emu_stream_worker(void *arg)
+{
+	struct emu_stream *st;
+	struct emu_scan found, jobs;
+	struct dirent *den;
+	struct stat sb;
+	uint64_t next;
+	DIR *dir;
+	int fd, quit, type;
+
+	st = arg;
+	memset(&found, 0, sizeof(found));
+	memset(&jobs, 0, sizeof(jobs));
+	if (fstat(st->dirfd, &sb) == 0)
+		st->stamp = sb.st_mtim;
+	fd = openat(st->dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd != -1 ? fdopendir(fd) : NULL;
+	if (dir == NULL && fd != -1)
+		close(fd);
+
+	next = emu_stats_now() + EMU_STREAM_NS;
+	quit = 0;
+	while (dir && quit == 0 && (den = readdir(dir)) != NULL) {
+		if (den->d_name[0] == '.')
+			continue;
+
+		type = emu_scan_type(st->dirfd, den);
+		if (type == DT_DIR)
+			emu_scan_push(&jobs, den->d_name, strlen(den->d_name));
+		if (type != DT_REG)
+			continue;
+
+		/* The modification times come in a batch, before every
+		   flush. */
+		emu_scan_push(&found, den->d_name, strlen(den->d_name));
+		if (emu_stats_now() >= next) {
+			emu_scan_stamp(&found, st->dirfd);
+			quit = emu_stream_flush(st, &found);
+			next = emu_stats_now() + EMU_STREAM_NS;
+		}
+	}
+	if (dir)
+		closedir(dir);
+	emu_scan_stamp(&found, st->dirfd);
+	if (quit == 0)
+		quit = emu_stream_flush(st, &found);
+
+	/* Then the VMs below it, and below the roots. */
+	if (dir && quit == 0) {
+		emu_scan_roots(st->dirfd, &jobs, &found);
+		emu_scan_walk(st->dirfd, &jobs, emu_stream_flush, st);
+	}
+
+	emu_stream_flush(st, &found);
+	emu_scan_free(&found);
+	emu_scan_free(&jobs);
+	pthread_mutex_lock(&st->lock);
+	st->done = 1;
+	quit = st->quit;
+	pthread_mutex_unlock(&st->lock);
+	if (quit)
+		emu_stream_free(st);
+
+	return (NULL);
+}
+
+/* Start scanning the config directory behind the menu, index is the
+   locked index, which is written once the scan is done. Returns NULL
+   if the scanner couldn't be started. */
+static struct emu_stream *emu_stream_start(int dirfd, int index)
+{
+	struct emu_stream *st;
+	pthread_t thread;
+
+	st = calloc(1, sizeof(struct emu_stream));
+	if (st == NULL)
+		return (NULL);
+
+	st->index = index;
+	st->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+	if (st->dirfd == -1) {
+		free(st);
+		return (NULL);
+	}
+
+	if (pipe2(st->notify, O_NONBLOCK | O_CLOEXEC) == -1) {
+		close(st->dirfd);
+		free(st);
+		return (NULL);
+	}
+
+	pthread_mutex_init(&st->lock, NULL);
+	if (pthread_create(&thread, NULL, emu_stream_worker, st) != 0) {
+		st->index = -1;
+		emu_stream_free(st);
+		return (NULL);
+	}
+	pthread_detach(thread);
+
+	return (st);
+}
+
+/* Stop the scan, if it's still running it's left to finish (and to
+   free itself) in the background. */
+static void emu_stream_stop(struct emu_stream *st)
+{
+	int done;
+
+	pthread_mutex_lock(&st->lock);
+	done = st->done;
+	st->quit = 1;
+	pthread_mutex_unlock(&st->lock);
+	if (done)
+		emu_stream_free(st);
+}
+
+/* Get the entry at pos of the current view. */
+static size_t emu_menu_ent(const struct emu_menu *menu, size_t pos)
+{
+	return (menu->qlen || menu->sort != EMU_SORT_NAME ?
+		menu->view[pos] : pos);
+}
+
+/* Draw the preview of the selected entry. */
+static void emu_menu_pane(struct emu_menu *menu)
+{
+	struct emu_meta meta;
+	const char *name;
+	int w, y, i;
+
+	if (menu->pane == NULL)
+		return;
+
+	werase(menu->pane);
+	box(menu->pane, 0, 0);
+	mvwaddch(menu->pane, 2, 0, ACS_LTEE);
+	mvwhline(menu->pane, 2, 1, ACS_HLINE, menu->pane_cols - 2);
+	mvwaddch(menu->pane, 2, menu->pane_cols - 1, ACS_RTEE);
+	if (menu->nview == 0)
+		return;
+
+	w = menu->pane_cols - 4;
+	name = emu_scan_name(menu->scan, emu_menu_ent(menu, menu->run_idx));
+	mvwprintw(menu->pane, 1, 2, "%.*s", w, name);
+	if (emu_preview_get(menu->preview, name, &meta) == 0) {
+		mvwprintw(menu->pane, 3, 2, "%.*s", w, "Loading...");
+		return;
+	}
+
+	if (meta.errnum) {
+		mvwprintw(menu->pane, 3, 2, "%.*s", w, strerror(meta.errnum));
+		return;
+	}
+
+	mvwprintw(menu->pane, 3, 2, "Machine: %.*s", w - 9,
+		  meta.machine[0] ? meta.machine : "-");
+	mvwprintw(menu->pane, 4, 2, "CPU:     %.*s", w - 9,
+		  meta.cpu[0] ? meta.cpu : "-");
+	mvwprintw(menu->pane, 5, 2, "Memory:  %.*s", w - 9,
+		  meta.mem[0] ? meta.mem : "-");
+	mvwprintw(menu->pane, 6, 2, "Disks:   %d", meta.ndisks);
+
+	/* As many disks as the pane can hold. */
+	for (i = 0, y = 7; i < meta.ndisks && i < EMU_META_DISKS &&
+		     y < menu->rows - 1; i++, y++)
+		mvwprintw(menu->pane, y, 4, "%.*s", w - 2, meta.disks[i]);
+}
+
+/* Ask for the metadata of the current page and of the page in the
+   direction of the scroll, the selected entry comes first. */
+static void emu_menu_prefetch(struct emu_menu *menu)
+{
+	const char *names[EMU_MENU_PAGE + EMU_PREVIEW_AHEAD + 1];
+	size_t n, idx, end;
+
+	if (menu->preview == NULL || menu->nview == 0)
+		return;
+
+	n = 0;
+	names[n++] = emu_scan_name(menu->scan,
+				   emu_menu_ent(menu, menu->run_idx));
+	end = menu->xs + (size_t)EMU_MENU_PAGE;
+	for (idx = menu->xs; idx < end && idx < menu->nview; idx++)
+		if (idx != menu->run_idx)
+			names[n++] = emu_scan_name(menu->scan,
+						   emu_menu_ent(menu, idx));
+
+	if (menu->dir < 0) {
+		idx = menu->xs > (size_t)EMU_PREVIEW_AHEAD ?
+			menu->xs - (size_t)EMU_PREVIEW_AHEAD : 0;
+		end = menu->xs;
+	} else {
+		idx = end;
+		end += (size_t)EMU_PREVIEW_AHEAD;
+	}
+
+	for (; idx < end && idx < menu->nview; idx++)
+		names[n++] = emu_scan_name(menu->scan, emu_menu_ent(menu, idx));
+
+	emu_preview_want(menu->preview, names, n);
+}
+
+/* Wait for a key. While waiting, the preview is redrawn whenever
+   the workers have read something new, and changes in the config
+   directory (or what the scan has found) are applied to the list. */
+static int emu_menu_getch(struct emu_menu *menu)
+{
+	struct pollfd pfd[4];
+	char buf[64];
+	int ch, n, pv, in, sc, eof;
+
+	for (eof = 0;;) {
+		/* Curses may have buffered some input already. */
+		ch = wgetch(menu->win);
+		if (ch != ERR)
+			return (ch);
+
+		/* The terminal was readable, but nothing came out of it,
+		   twice in a row. It's gone. */
+		if (eof > 1)
+			return (ERR);
+
+		n = pv = in = sc = 0;
+		pfd[n].fd = STDIN_FILENO;
+		pfd[n++].events = POLLIN;
+		if (menu->preview) {
+			pv = n;
+			pfd[n].fd = menu->preview->notify[0];
+			pfd[n++].events = POLLIN;
+		}
+		if (menu->watch.fd != -1) {
+			in = n;
+			pfd[n].fd = menu->watch.fd;
+			pfd[n++].events = POLLIN;
+		}
+		if (menu->stream) {
+			sc = n;
+			pfd[n].fd = menu->stream->notify[0];
+			pfd[n++].events = POLLIN;
+		}
+
+		if (poll(pfd, (nfds_t)n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (ERR);
+		}
+
+		if (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+			return (ERR);
+		eof = pfd[0].revents & POLLIN ? eof + 1 : 0;
+
+		if (in && (pfd[in].revents & POLLIN))
+			emu_menu_watch(menu);
+
+		/* Nothing to select from, the menu is no use. */
+		if (sc && (pfd[sc].revents & POLLIN) &&
+		    emu_menu_stream(menu) == -1)
+			return (ERR);
+
+		if (pv && (pfd[pv].revents & POLLIN)) {
+			while (read(pfd[pv].fd, buf, sizeof(buf)) > 0)
+				;
+			emu_menu_pane(menu);
+		}
+
+		wnoutrefresh(menu->win);
+		if (menu->pane)
+			wnoutrefresh(menu->pane);
+		doupdate();
+	}
+}
+
+/* Apply the current query to the view. */
+static void emu_menu_view(struct emu_menu *menu)
+{
+	const struct emu_scan *scan;
+	char q[EMU_QUERY_MAX];
+	size_t i, nprefix;
+
+	scan = menu->scan;
+	if (menu->qlen == 0 && menu->sort == EMU_SORT_NAME) {
+		menu->nview = scan->nents;
+		return;
+	}
+
+	if (menu->view_cap < scan->nents + 1) {
+		free(menu->view);
+		menu->view_cap = scan->nents + 1;
+		menu->view = malloc(menu->view_cap * sizeof(size_t));
+		if (menu->view == NULL)
+			err(EXIT_FAILURE, "malloc");
+	}
+
+	/* Every entry, in the order of the menu. */
+	if (menu->qlen == 0) {
+		for (i = 0; i < scan->nents; i++)
+			menu->view[menu->rank[i]] = i;
+		menu->nview = scan->nents;
+		return;
+	}
+
+	/* Build the index only once, on the first query. */
+	if (menu->search == NULL) {
+		menu->search = calloc(1, sizeof(struct emu_search));
+		if (menu->search == NULL)
+			err(EXIT_FAILURE, "calloc");
+		emu_search_build(menu->search, scan);
+	}
+
+	for (i = 0; i < menu->qlen; i++)
+		q[i] = (char)tolower((unsigned char)menu->query[i]);
+	q[i] = '\0';
+	menu->nview = emu_search_query(menu->search, scan, q, menu->qlen,
+				       menu->view, &nprefix);
+
+	/* Both kinds of matches, in the order of the menu. */
+	if (menu->rank) {
+		qsort_r(menu->view, nprefix, sizeof(size_t), emu_menu_compare,
+			menu->rank);
+		qsort_r(menu->view + nprefix, menu->nview - nprefix,
+			sizeof(size_t), emu_menu_compare, menu->rank);
+	}
+}
+
+/* qsort_r's internal function, for the view. Entries are ordered by
+   their rank, or by their position if there's none. */
+static int emu_menu_compare(const void *s0, const void *s1, void *rank)
+{
+	size_t i0, i1;
+
+	i0 = *(const size_t *)s0;
+	i1 = *(const size_t *)s1;
+	if (rank) {
+		i0 = ((const size_t *)rank)[i0];
+		i1 = ((const size_t *)rank)[i1];
+	}
+
+	return ((i0 > i1) - (i0 < i1));
+}
+
+/* Rank every entry in the order of the menu, the latest ones first.
+   Has to be done again whenever the entries change, only the ones
+   added since the last time are ranked then, and merged into the
+   order that's already there. Without anything from the last time
+   (menu->nranked as 0), it's every entry. */
+static void emu_menu_order(struct emu_menu *menu)
+{
+	struct emu_rank_ent *re, *add, *tmp, *o;
+	struct emu_scan *scan;
+	size_t *map, *idx, i, j, k, n, off;
+
+	scan = menu->scan;
+	free(menu->rank);
+	menu->rank = NULL;
+	if (menu->sort == EMU_SORT_NAME) {
+		menu->nranked = menu->ranked_sz = 0;
+		return;
+	}
+
+	/* Once for the whole menu, not on every change. */
+	if ((menu->sort == EMU_SORT_LAUNCHED ||
+	     menu->sort == EMU_SORT_FRECENCY) && menu->history_read == 0 &&
+	    menu->dirfd != -1) {
+		emu_history_load(menu->dirfd, &menu->history);
+		menu->history_read = 1;
+	}
+
+	/* Every key changes with a stamp, start over. */
+	if (menu->sort == EMU_SORT_MTIME && scan->indexed &&
+	    menu->dirfd != -1) {
+		emu_scan_stamp(scan, menu->dirfd);
+		menu->nranked = 0;
+	}
+
+	n = scan->nents;
+	map = malloc((menu->nranked + 1) * sizeof(size_t));
+	idx = malloc((n + 1) * sizeof(size_t));
+	add = malloc((n + 1) * sizeof(struct emu_rank_ent));
+	tmp = malloc((n + 1) * sizeof(struct emu_rank_ent));
+	re = malloc((n + 1) * sizeof(struct emu_rank_ent));
+	menu->rank = malloc((n + 1) * sizeof(size_t));
+	if (map == NULL || idx == NULL || add == NULL || tmp == NULL ||
+	    re == NULL || menu->rank == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	/* The names stay where they are in the arena and the entries
+	   in the same order, so the ones from the last time are found
+	   by walking both tables at once. map is where every one of
+	   them is now, SIZE_MAX if it's gone, idx the new ones. */
+	for (i = j = k = 0; i < n; i++) {
+		off = scan->ents[i].name_off;
+		while (off < menu->ranked_sz && j < menu->nranked &&
+		       menu->ranked[j] != off)
+			map[j++] = SIZE_MAX;
+		if (off < menu->ranked_sz && j < menu->nranked)
+			map[j++] = i;
+		else
+			idx[k++] = i;
+	}
+	for (; j < menu->nranked; j++)
+		map[j] = SIZE_MAX;
+
+	emu_rank_keys(scan, menu->sort, &menu->history, idx, k, add);
+	emu_rank_sort(add, tmp, k);
+
+	/* The old ones, still in order, go at the end first. Merging
+	   from the front never overtakes them. */
+	for (i = 0, j = k; i < menu->nranked; i++) {
+		o = &menu->order[i];
+		if (map[o->idx] != SIZE_MAX) {
+			re[j].key = o->key;
+			re[j++].idx = map[o->idx];
+		}
+	}
+	for (i = 0, j = k, o = add; i < n; i++) {
+		if (j < n && (o == add + k || re[j].key < o->key ||
+			      (re[j].key == o->key && re[j].idx < o->idx)))
+			re[i] = re[j++];
+		else
+			re[i] = *o++;
+	}
+	for (i = 0; i < n; i++)
+		menu->rank[re[i].idx] = i;
+
+	free(menu->order);
+	menu->order = re;
+	free(menu->ranked);
+	menu->ranked = idx;
+	for (i = 0; i < n; i++)
+		menu->ranked[i] = scan->ents[i].name_off;
+	menu->nranked = n;
+	menu->ranked_sz = scan->arena_sz;
+
+	free(tmp);
+	free(add);
+	free(map);
+}
+
+/* Apply the current query to the view and select it's first entry. */
+static void emu_menu_filter(struct emu_menu *menu)
+{
+	emu_menu_view(menu);
+	menu->xs = menu->run_idx = 0;
+	menu->dir = 1;
+	emu_menu_title(menu);
+	emu_menu_page(menu);
+	emu_menu_prefetch(menu);
+	emu_menu_pane(menu);
+}
+
+/* Fit the windows to the amount of entries and their names, as
+   far as the terminal allows. Everything is redrawn if anything
+   had to be changed. */
+static void emu_menu_layout(struct emu_menu *menu)
+{
+	struct content_len_info clinfo;
+	int rows, cols, num_w;
+
+	emu_content_len(menu->scan, &clinfo);
+	num_w = (int)clinfo.num_sz;
+	rows = (int)clinfo.column_sz;
+	cols = (int)clinfo.row_sz;
+	if (cols > COLS)
+		cols = COLS;
+
+	/* Never shrink, that only makes the menu jump around. */
+	if (rows < menu->rows)
+		rows = menu->rows;
+	if (cols < menu->cols)
+		cols = menu->cols;
+	if (num_w < menu->num_w)
+		num_w = menu->num_w;
+
+	if (rows == menu->rows && cols == menu->cols && num_w == menu->num_w)
+		return;
+
+	menu->rows = rows;
+	menu->num_w = num_w;
+	if (cols != menu->cols) {
+		menu->cols = cols;
+		menu->pane_cols = COLS - cols;
+		if (menu->pane_cols > 64)
+			menu->pane_cols = 64;
+	}
+
+	wresize(menu->win, menu->rows, menu->cols);
+	if (menu->pane) {
+		/* Out of room, the pane has to go. */
+		if (menu->pane_cols < 24) {
+			delwin(menu->pane);
+			menu->pane = NULL;
+		} else {
+			wresize(menu->pane, menu->rows, menu->pane_cols);
+			mvwin(menu->pane, 0, menu->cols);
+		}
+	}
+
+	erase();
+	wnoutrefresh(stdscr);
+	emu_menu_frame(menu);
+	emu_menu_page(menu);
+	emu_menu_pane(menu);
+}
+
+/* Watch the config directory at path for the events of mask, and
+   the directories that get watched below it later on. Returns -1 if
+   it can't be watched. */
+static int emu_watch_open(struct emu_watch *w, const char *path,
+			  uint32_t mask)
+{
+	memset(w, 0, sizeof(struct emu_watch));
+	w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w->fd == -1)
+		return (-1);
+
+	w->mask = mask | IN_ONLYDIR;
+	w->path = strdup(path);
+	if (w->path == NULL)
+		err(EXIT_FAILURE, "strdup");
+	w->wd = inotify_add_watch(w->fd, path, w->mask);
+	if (w->wd == -1) {
+		emu_watch_close(w);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Stop watching, w can be opened again. */
+static void emu_watch_close(struct emu_watch *w)
+{
+	size_t i;
+
+	if (w->fd != -1)
+		close(w->fd);
+	for (i = 0; i < w->ndirs; i++)
+		free(w->dirs[i].name);
+	free(w->dirs);
+	free(w->path);
+	memset(w, 0, sizeof(struct emu_watch));
+	w->fd = -1;
+}
+
+/* Binary search for the directory of wd. Returns 1 if it's watched
+   and 0 otherwise, pos is set to where it is (or would be). */
+static int emu_watch_find(const struct emu_watch *w, int wd, size_t *pos)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = w->ndirs;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / (size_t)2;
+		if (w->dirs[mid].wd == wd) {
+			*pos = mid;
+			return (1);
+		}
+
+		if (w->dirs[mid].wd < wd)
+			lo = mid + (size_t)1;
+		else
+			hi = mid;
+	}
+
+	*pos = lo;
+	return (0);
+}
+
+/* Watch a directory below the config directory (or a root), by it's
+   name in the entry table. One that's watched already keeps it's old
+   name. Without room for more watches, it's just not followed. */
+static void emu_watch_below(struct emu_watch *w, const char *name)
+{
+	struct emu_watch_dir *dirs;
+	char p[PATH_MAX];
+	size_t pos;
+	int wd;
+
+	emu_config_path(w->path, name, p, sizeof(p));
+	wd = inotify_add_watch(w->fd, p, w->mask);
+	if (wd == -1 || wd == w->wd || emu_watch_find(w, wd, &pos))
+		return;
+
+	if (w->ndirs == w->dirs_cap) {
+		w->dirs_cap = w->dirs_cap ? w->dirs_cap * 2 : (size_t)16;
+		dirs = realloc(w->dirs, w->dirs_cap *
+			       sizeof(struct emu_watch_dir));
+		if (dirs == NULL)
+			err(EXIT_FAILURE, "realloc");
+		w->dirs = dirs;
+	}
+	memmove(&w->dirs[pos + 1], &w->dirs[pos],
+		(w->ndirs - pos) * sizeof(struct emu_watch_dir));
+	w->dirs[pos].wd = wd;
+	w->dirs[pos].name = strdup(name);
+	if (w->dirs[pos].name == NULL)
+		err(EXIT_FAILURE, "strdup");
+	w->ndirs++;
+}
+
+/* Watch every directory a scan has walked through. */
+static void emu_watch_dirs(struct emu_watch *w, const struct emu_scan *scan)
+{
+	const char *name;
+	size_t i;
+
+	for (i = 0; i < scan->ndirs; i++) {
+		name = scan->arena + scan->dirs[i].name_off;
+		if (strcmp(name, EMU_ROOTS_NAME) != 0)
+			emu_watch_below(w, name);
+	}
+}
+
+/* Stop watching a directory that's gone (or moved away), and the
+   ones below it. */
+static void emu_watch_gone(struct emu_watch *w, const char *name)
+{
+	struct emu_watch_dir *d;
+	size_t i, j, len;
+
+	len = strlen(name);
+	for (i = 0, j = 0; i < w->ndirs; i++) {
+		d = &w->dirs[i];
+		if (strncmp(d->name, name, len) == 0 &&
+		    (d->name[len] == '\0' || d->name[len] == '/')) {
+			(void)inotify_rm_watch(w->fd, d->wd);
+			free(d->name);
+			continue;
+		}
+		w->dirs[j++] = *d;
+	}
+	w->ndirs = j;
+}
+
+/* Make sense of an event of the watch, the name of the config (or the
+   directory) it's about is put in buf, which has room for PATH_MAX,
+   as the name is in the entry table. A directory that's gone isn't
+   watched anymore, a new one is watched by emu_watch_walk(...). */
+static int emu_watch_event(struct emu_watch *w,
+			   const struct inotify_event *ev, char *buf)
+{
+	const char *base;
+	size_t i;
+	int ret;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+		return (EMU_WATCH_RESCAN);
+
+	base = NULL;
+	if (ev->wd != w->wd) {
+		if (emu_watch_find(w, ev->wd, &i) == 0)
+			return (EMU_WATCH_NONE);
+
+		/* It's gone, the kernel has dropped the watch. */
+		if (ev->mask & IN_IGNORED) {
+			free(w->dirs[i].name);
+			w->ndirs--;
+			memmove(&w->dirs[i], &w->dirs[i + 1],
+				(w->ndirs - i) * sizeof(struct emu_watch_dir));
+			return (EMU_WATCH_NONE);
+		}
+		base = w->dirs[i].name;
+	}
+
+	/* The same rules as the scanner, the roots can have anything. */
+	if (ev->len == 0)
+		return (EMU_WATCH_NONE);
+	if (ev->name[0] == '.')
+		return (base == NULL && strcmp(ev->name, EMU_ROOTS_NAME) == 0 ?
+			EMU_WATCH_RESCAN : EMU_WATCH_NONE);
+
+	if (base)
+		ret = snprintf(buf, PATH_MAX, "%s/%s", base, ev->name);
+	else
+		ret = snprintf(buf, PATH_MAX, "%s", ev->name);
+	if (ret < 0 || ret >= PATH_MAX)
+		return (EMU_WATCH_NONE);
+
+	/* Below the config directory, only a VM's config is an entry. */
+	if ((ev->mask & IN_ISDIR) == 0)
+		return (base == NULL || strcmp(ev->name, EMU_VM_CONFIG) == 0 ?
+			EMU_WATCH_ENTRY : EMU_WATCH_NONE);
+
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		emu_watch_gone(w, buf);
+		return (EMU_WATCH_DIR);
+	}
+	return (ev->mask & (IN_CREATE | IN_MOVED_TO) ? EMU_WATCH_DIR :
+		EMU_WATCH_NONE);
+}
+
+/* Walk a new directory below the config directory for it's VMs, into
+   found, and watch it (and what's below it) for the ones that come
+   later. It's watched first, so nothing made in between is missed. */
+static void emu_watch_walk(struct emu_watch *w, int dirfd, const char *name,
+			   struct emu_scan *found)
+{
+	struct emu_scan jobs;
+
+	emu_watch_below(w, name);
+	memset(found, 0, sizeof(struct emu_scan));
+	memset(&jobs, 0, sizeof(jobs));
+	emu_scan_push(&jobs, name, strlen(name));
+	emu_scan_walk(dirfd, &jobs, emu_scan_collect, found);
+	emu_scan_free(&jobs);
+	emu_watch_dirs(w, found);
+}
+
+/* Apply the changes in the config directory to the entry table. New
+   entries are put where they belong and removed ones are taken out,
+   the table is never scanned again or sorted. A new directory is
+   walked for it's VMs. If the kernel had to drop events (or the roots
+   have changed), there's no way around a rescan. */
+static void emu_menu_watch(struct emu_menu *menu)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char sel[PATH_MAX], name[PATH_MAX];
+	const struct inotify_event *ev;
+	struct emu_scan scan;
+	struct stat st;
+	ssize_t n;
+	size_t pos;
+	char *p;
+	int changed, rescan;
+
+	/* Remember the selection by name, the entries are going to move. */
+	sel[0] = '\0';
+	if (menu->nview)
+		snprintf(sel, sizeof(sel), "%s", emu_scan_name(menu->scan,
+			 emu_menu_ent(menu, menu->run_idx)));
+
+	changed = rescan = 0;
+	while ((n = read(menu->watch.fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			switch (emu_watch_event(&menu->watch, ev, name)) {
+			case EMU_WATCH_RESCAN:
+				rescan = 1;
+				continue;
+
+			case EMU_WATCH_DIR:
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					emu_scan_remove_below(menu->scan, name);
+					emu_scan_remove_below(&menu->marks,
+							      name);
+				} else {
+					emu_watch_walk(&menu->watch,
+						       menu->dirfd, name,
+						       &scan);
+					emu_scan_merge(menu->scan, &scan);
+					emu_scan_free(&scan);
+				}
+				changed = 1;
+				continue;
+
+			case EMU_WATCH_ENTRY:
+				break;
+
+			default:
+				continue;
+			}
+
+			if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				emu_scan_remove(menu->scan, name);
+				emu_scan_remove(&menu->marks, name);
+				changed = 1;
+			} else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+				if (fstatat(menu->dirfd, name, &st,
+					    AT_SYMLINK_NOFOLLOW) == -1 ||
+				    !S_ISREG(st.st_mode))
+					continue;
+				emu_scan_insert(menu->scan, name, &st.st_mtim);
+				changed = 1;
+			} else if (ev->mask & IN_CLOSE_WRITE) {
+				/* Same entry, different contents. */
+				if (emu_scan_find(menu->scan, name, &pos) &&
+				    fstatat(menu->dirfd, name, &st,
+					    AT_SYMLINK_NOFOLLOW) == 0) {
+					menu->scan->ents[pos].mtime =
+						st.st_mtim;
+
+					/* Put back as a new one, to be
+					   ranked again. */
+					if (menu->sort == EMU_SORT_MTIME) {
+						emu_scan_remove(menu->scan,
+								name);
+						emu_scan_insert(menu->scan,
+								name,
+								&st.st_mtim);
+						changed = 1;
+					}
+				}
+				if (menu->preview == NULL)
+					continue;
+				emu_preview_forget(menu->preview, name);
+				if (strcmp(name, sel) == 0)
+					emu_menu_pane(menu);
+			}
+		}
+	}
+
+	if (rescan && emu_scan_tree(&scan, menu->dirfd) == 0) {
+		emu_scan_sort(&scan);
+		emu_scan_stamp(&scan, menu->dirfd);
+		emu_scan_free(menu->scan);
+		*menu->scan = scan;
+		emu_watch_dirs(&menu->watch, menu->scan);
+
+		/* A whole new arena, nothing is where it was. */
+		menu->nranked = 0;
+	}
+	if (changed || rescan)
+		emu_menu_reload(menu, sel);
+}
+
+/* Take what the scan has found so far into the entry table. Returns
+   -1 if the scan is done and there's nothing at all. */
+static int emu_menu_stream(struct emu_menu *menu)
+{
+	struct emu_stream *st;
+	struct emu_scan found;
+	char sel[PATH_MAX], buf[64];
+	int done;
+
+	st = menu->stream;
+	while (read(st->notify[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&st->lock);
+	found = st->found;
+	memset(&st->found, 0, sizeof(struct emu_scan));
+	done = st->done;
+	pthread_mutex_unlock(&st->lock);
+
+	/* Until the user moves it, the selection stays at the top. */
+	sel[0] = '\0';
+	if (menu->nview && menu->moved)
+		snprintf(sel, sizeof(sel), "%s", emu_scan_name(menu->scan,
+			 emu_menu_ent(menu, menu->run_idx)));
+	emu_watch_dirs(&menu->watch, &found);
+	emu_scan_merge(menu->scan, &found);
+
+	/* Everything is there, the next start can use the index. */
+	if (done) {
+		if (st->index != -1) {
+			menu->scan->stamp = st->stamp;
+			emu_index_write(st->index, menu->dirfd, menu->scan);
+		}
+		emu_stream_stop(st);
+		menu->stream = NULL;
+		emu_menu_title(menu);
+		if (menu->scan->nents == 0) {
+			emu_scan_free(&found);
+			return (-1);
+		}
+	}
+
+	if (found.nents)
+		emu_menu_reload(menu, sel);
+	emu_scan_free(&found);
+	return (0);
+}
+
+/* Apply a change of the entry table to the menu. The selection stays
+   on sel, if it's still there. */
+static void emu_menu_reload(struct emu_menu *menu, const char *sel)
+{
+	size_t pos;
+
+	/* The search index refers to the old entries. */
+	if (menu->search) {
+		emu_search_free(menu->search);
+		free(menu->search);
+		menu->search = NULL;
+	}
+	emu_menu_order(menu);
+	emu_menu_view(menu);
+
+	/* Find the previous selection again, or stay where we were. */
+	if (menu->nview && sel[0]) {
+		if (menu->qlen == 0 && menu->sort == EMU_SORT_NAME) {
+			emu_scan_find(menu->scan, sel, &pos);
+		} else {
+			for (pos = 0; pos < menu->nview; pos++)
+				if (strcmp(emu_scan_name(menu->scan,
+					   menu->view[pos]), sel) == 0)
+					break;
+		}
+		menu->run_idx = pos;
+	}
+	if (menu->run_idx >= menu->nview)
+		menu->run_idx = menu->nview ? menu->nview - (size_t)1 : 0;
+	menu->xs = menu->run_idx - menu->run_idx % (size_t)EMU_MENU_PAGE;
+
+	emu_menu_layout(menu);
+	emu_menu_page(menu);
+	emu_menu_prefetch(menu);
+	emu_menu_pane(menu);
+}
+
+/* Draw everything that doesn't change between pages. */
+static void emu_menu_frame(struct emu_menu *menu)
+{
+	werase(menu->win);
+	box(menu->win, 0, 0);
+	emu_menu_title(menu);
+	mvwaddch(menu->win, 2, 0, ACS_LTEE);
+	mvwhline(menu->win, 2, 1, ACS_HLINE, menu->cols - 2);
+	mvwaddch(menu->win, 2, menu->cols - 1, ACS_RTEE);
+}
+
+/* Draw the title, or the filter when the user is typing. */
+static void emu_menu_title(struct emu_menu *menu)
+{
+	static const char *titles[EMU_SORT_MODES] = {
+		"Select a config", "Last changed", "Last launched",
+		"Most used",
+	};
+	char buf[32];
+	int w;
+
+	snprintf(buf, sizeof(buf), "%zu marked", menu->marks.nents);
+
+	/* Up to where the position starts. */
+	w = menu->cols - menu->num_w * 2 - 6;
+	if (menu->qlen == 0) {
+		if (menu->marks.nents)
+			mvwprintw(menu->win, 1, 2, "%-*.*s", w, w, buf);
+		else
+			mvwprintw(menu->win, 1, 2, "%-*s", w,
+				  menu->stream ? "Scanning..." :
+				  titles[menu->sort]);
+		return;
+	}
+
+	/* Show the end of the query, if it doesn't fit. */
+	if ((int)menu->qlen > w - 3)
+		mvwprintw(menu->win, 1, 2, "/ %-*.*s", w - 2, w - 2,
+			  menu->query + menu->qlen - (size_t)(w - 3));
+	else
+		mvwprintw(menu->win, 1, 2, "/ %-*.*s", w - 2,
+			  (int)menu->qlen, menu->query);
+}
+
+/* Draw the position of the selection, right next to the title. */
+static void emu_menu_status(struct emu_menu *menu)
+{
+	char buf[48];
+	int w;
+
+	/* Always as wide as the largest one, to cover the previous. */
+	w = menu->num_w * 2 + 1;
+	snprintf(buf, sizeof(buf), "%zu/%zu",
+		 menu->nview ? menu->run_idx + 1 : (size_t)0, menu->nview);
+	mvwprintw(menu->win, 1, menu->cols - w - 2, "%*s", w, buf);
+}
+
+/* Draw a single row, if it's visible in the current page. Every row
+   covers the whole width, so nothing has to be cleared beforehand. */
+static void emu_menu_row(struct emu_menu *menu, size_t idx)
+{
+	const char *name;
+	size_t pos;
+	int y, w;
+
+	if (idx < menu->xs || idx >= menu->xs + (size_t)EMU_MENU_PAGE)
+		return;
+
+	/* Short lists have a smaller window. */
+	y = (int)(idx - menu->xs) + 3;
+	if (y > menu->rows - 3)
+		return;
+
+	w = menu->cols - menu->num_w - 6;
+	if (w < 1)
+		w = 1;
+	if (idx >= menu->nview) {
+		mvwhline(menu->win, y, 1, ' ', menu->cols - 2);
+		return;
+	}
+
+	name = emu_scan_name(menu->scan, emu_menu_ent(menu, idx));
+	mvwaddch(menu->win, y, 1,
+		 emu_scan_find(&menu->marks, name, &pos) ? '*' : ' ');
+	if (idx == menu->run_idx)
+		wattron(menu->win, A_REVERSE);
+
+	mvwprintw(menu->win, y, 2, "%*zu. %-*.*s", menu->num_w, idx + 1,
+		  w, w, name);
+
+	if (idx == menu->run_idx)
+		wattroff(menu->win, A_REVERSE);
+}
+
+/* Draw all rows of the current page. */
+static void emu_menu_page(struct emu_menu *menu)
+{
+	size_t idx;
+
+	for (idx = menu->xs; idx < menu->xs + (size_t)EMU_MENU_PAGE; idx++)
+		emu_menu_row(menu, idx);
+	emu_menu_status(menu);
+}
+
+/* Move the selection to idx. If it stays in the same page, only
+   the previous and the new row are redrawn. Returns 1 if the page
+   has been changed. */
+static int emu_menu_move(struct emu_menu *menu, size_t idx)
+{
+	size_t pre_idx, xs;
+
+	if (menu->nview == 0)
+		return (0);
+
+	if (idx >= menu->nview)
+		idx = menu->nview - (size_t)1;
+
+	pre_idx = menu->run_idx;
+	menu->run_idx = idx;
+	if (idx != pre_idx) {
+		menu->dir = idx > pre_idx ? 1 : -1;
+		menu->moved = 1;
+	}
+
+	xs = idx - idx % (size_t)EMU_MENU_PAGE;
+	if (xs != menu->xs) {
+		menu->xs = xs;
+		emu_menu_page(menu);
+		emu_menu_prefetch(menu);
+		emu_menu_pane(menu);
+		return (1);
+	}
+
+	if (pre_idx != idx) {
+		emu_menu_row(menu, pre_idx);
+		emu_menu_row(menu, idx);
+		emu_menu_status(menu);
+		emu_menu_pane(menu);
+	}
+
+	return (0);
+}
+
+/* Mark the selected entry, or unmark it if it's already marked,
+   and move on to the next one. */
+static void emu_menu_mark(struct emu_menu *menu)
+{
+	const char *name;
+	size_t pos;
+
+	if (menu->nview == 0)
+		return;
+
+	name = emu_scan_name(menu->scan, emu_menu_ent(menu, menu->run_idx));
+	if (emu_scan_find(&menu->marks, name, &pos))
+		emu_scan_remove(&menu->marks, name);
+	else
+		emu_scan_insert(&menu->marks, name, NULL);
+
+	emu_menu_row(menu, menu->run_idx);
+	emu_menu_title(menu);
+	emu_menu_move(menu, menu->run_idx + (size_t)1);
+}
+
+/* Run the menu until the user selects an entry or leaves it. Returns
+   0 and sets sel to the selected entry, or -1 if the user left. The
+   marked entries, if any, are in menu->marks. */
+static int emu_menu_run(struct emu_menu *menu, size_t *sel)
+{
+	int ch, painted;
+
+	emu_menu_order(menu);
+	emu_menu_view(menu);
+	menu->dir = 1;
+	nodelay(menu->win, TRUE);
+	emu_menu_frame(menu);
+	emu_menu_page(menu);
+	emu_menu_prefetch(menu);
+	emu_menu_pane(menu);
+
+	for (painted = 0;; painted = 1) {
+		/* Curses only sends what has changed since the last
+		   refresh, as long as the window isn't cleared. */
+		wnoutrefresh(menu->win);
+		if (menu->pane)
+			wnoutrefresh(menu->pane);
+		doupdate();
+		if (painted == 0)
+			emu_stats_end(menu->stats, EMU_STAT_PAINT);
+		ch = emu_menu_getch(menu);
+		switch (ch) {
+		case ERR:
+			/* Lost the terminal. */
+			return (-1);
+
+		case KEY_UP:
+			if (menu->run_idx > 0)
+				emu_menu_move(menu, menu->run_idx - (size_t)1);
+			break;
+
+		case KEY_DOWN:
+			emu_menu_move(menu, menu->run_idx + (size_t)1);
+			break;
+
+		case KEY_RIGHT:
+			/* Go every page forward, as long as there's one. */
+			if (menu->xs + (size_t)EMU_MENU_PAGE < menu->nview)
+				emu_menu_move(menu, menu->xs +
+					      (size_t)EMU_MENU_PAGE);
+			break;
+
+		case KEY_LEFT:
+			/* Go every page back. */
+			if (menu->xs > 0)
+				emu_menu_move(menu, menu->xs -
+					      (size_t)EMU_MENU_PAGE);
+			break;
+
+		case KEY_HOME:
+			emu_menu_move(menu, 0);
+			break;
+
+		case KEY_END:
+			if (menu->nview)
+				emu_menu_move(menu, menu->nview - (size_t)1);
+			break;
+
+		case KEY_BACKSPACE:
+			/* Remove the last character of the filter, or leave
+			   the selection loop, if there's no filter. */
+			if (menu->qlen == 0)
+				return (-1);
+			menu->qlen--;
+			emu_menu_filter(menu);
+			break;
+
+		/* Space, marks the entry, to launch more than one. */
+		case ' ':
+			emu_menu_mark(menu);
+			break;
+
+		/* Tab, goes on to the next order of the menu. */
+		case '\t':
+			menu->sort = (menu->sort + 1) % EMU_SORT_MODES;
+			menu->nranked = 0;
+			emu_menu_order(menu);
+			emu_menu_filter(menu);
+			break;
+
+		/* Ctrl+U, clears the filter. */
+		case 21:
+			if (menu->qlen) {
+				menu->qlen = 0;
+				emu_menu_filter(menu);
+			}
+			break;
+
+		/* Break if this is a a new line or a new line is created.
+		   Apperently KEY_ENTER in ncurses is described as send.
+		   See: https://invisible-island.net/ncurses/man/curs_getch.3x.html#h2-NOTES */
+		case 10:
+			if (menu->nview == 0)
+				break;
+			*sel = emu_menu_ent(menu, menu->run_idx);
+			return (0);
+
+		default:
+			/* Everything printable narrows down the list. */
+			if (ch > ' ' && ch < 127 &&
+			    menu->qlen < (size_t)EMU_QUERY_MAX - 1) {
+				menu->query[menu->qlen++] = (char)ch;
+				emu_menu_filter(menu);
+			}
+			break;
+		}
+	}
+}
+
+/* Creates a (n)curses based menu to select the choice. Every marked
+   config (or the selected one) is launched, and emubox stays around
+   until all of them are gone. With cgroup at 0 or above, every VM gets
+   a cgroup of it's own, and it's usage is told every cgroup seconds.
+   With monitor above 0, they're shown live every monitor seconds.
+   With emuboxd running, the entries come from it, and so does the
+   launch (unless it's the settings, cgroups or the monitor are
+   wanted), emuboxd looks after the VMs then. Without a valid index,
+   the menu is drawn right away and the entries show up while the
+   directory is scanned.
+   Returns EXIT_FAILURE if any of them couldn't be launched or failed. */
+static int emu_select_list(const char *bin, const char *lang,
+			   int is_fullscreen, int is_settings, int sort,
+			   int cgroup, int monitor, struct emu_stats *stats)
+{
+	char *path;
+	const char **names;
+	size_t i, n, run_idx;
+	int ret, status, daemon;
+	struct emu_menu menu;
+	struct emu_scan scan;
+	struct emu_stream *stream;
+	struct content_len_info clinfo;
+
+	path = emu_get_directory();
+	if (path == NULL)
+		exit(EXIT_FAILURE);
+
+	stream = NULL;
+	daemon = emu_daemon_names(&scan) == 0;
+	if (daemon == 0 &&
+	    emu_scan_stream(&scan, path, stats, &stream) == -1) {
+	        fputs("emubox: missing config directory.\n",
+		      stderr);
+		free(path);
+	        exit(EXIT_FAILURE);
+	}
+	if (daemon && stats)
+		stats->nents = scan.nents;
+	emu_stats_begin(stats);
+        emu_content_len(&scan, &clinfo);
+	emu_stats_end(stats, EMU_STAT_LAYOUT);
+
+	/* There are no config files to list. */
+	status = EXIT_SUCCESS;
+	if (scan.nents == 0 && stream == NULL) {
+		fputs("emubox: no configs are available.\n",
+		      stderr);
+		goto out_cleanup;
+        }
+
+	/* Initialize ncurses and setup the window. */
+	emu_stats_begin(stats);
+	initscr();
+        raw();
+	noecho();
+	keypad(stdscr, TRUE);
+	curs_set(FALSE);
+	refresh();
+
+	memset(&menu, 0, sizeof(menu));
+	menu.stats = stats;
+	menu.scan = &scan;
+	menu.stream = stream;
+	menu.sort = sort;
+	menu.num_w = (int)clinfo.num_sz;
+	menu.rows = (int)clinfo.column_sz;
+	menu.cols = (int)clinfo.row_sz;
+	/* Don't go beyond the terminal, long names are cut. */
+	if (menu.cols > COLS)
+		menu.cols = COLS;
+	menu.win = newwin(menu.rows, menu.cols, 0, 0);
+	keypad(menu.win, TRUE);
+
+	/* Follow the changes of the config directory. */
+	menu.watch.fd = -1;
+	menu.dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (menu.dirfd != -1 &&
+	    emu_watch_open(&menu.watch, path, IN_CREATE | IN_DELETE |
+			   IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE) == 0)
+		emu_watch_dirs(&menu.watch, &scan);
+
+	/* The preview pane, right next to the menu, if there's room. */
+	menu.pane_cols = COLS - menu.cols;
+	if (menu.pane_cols > 64)
+		menu.pane_cols = 64;
+	if (menu.pane_cols >= 24 && menu.dirfd != -1) {
+		menu.preview = emu_preview_start(menu.dirfd);
+		if (menu.preview)
+			menu.pane = newwin(menu.rows, menu.pane_cols, 0,
+					   menu.cols);
+	}
+
+	emu_stats_end(stats, EMU_STAT_CURSES);
+	ret = emu_menu_run(&menu, &run_idx);
+	emu_stats_end(stats, EMU_STAT_SELECT);
+	if (stats)
+		stats->selected = stats->last;
+	if (menu.pane)
+		delwin(menu.pane);
+	if (menu.preview)
+		emu_preview_stop(menu.preview);
+	if (menu.stream)
+		emu_stream_stop(menu.stream);
+	emu_watch_close(&menu.watch);
+	if (menu.dirfd != -1)
+		close(menu.dirfd);
+	delwin(menu.win);
+        endwin();
+
+	if (menu.search) {
+		emu_search_free(menu.search);
+		free(menu.search);
+	}
+	free(menu.view);
+	free(menu.rank);
+	free(menu.order);
+	free(menu.ranked);
+	emu_history_free(&menu.history);
+	if (stream && stats)
+		stats->nents = scan.nents;
+	emu_stats_report(stats);
+
+	/* The scan has found nothing. */
+	if (ret == -1 && scan.nents == 0)
+		fputs("emubox: no configs are available.\n", stderr);
+
+	/* The user left without selecting anything. */
+	if (ret == -1)
+		goto out_marks;
+
+	n = menu.marks.nents ? menu.marks.nents : (size_t)1;
+	names = malloc(n * sizeof(char *));
+	if (names == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (i = 0; i < n; i++)
+		names[i] = menu.marks.nents ? emu_scan_name(&menu.marks, i) :
+			emu_scan_name(&scan, run_idx);
+
+	if (daemon && is_settings == 0 && cgroup < 0 && monitor <= 0) {
+		/* It went away in the meantime, do it ourselves. */
+		status = emu_daemon_start(names, n, lang, is_fullscreen);
+		if (status != -1)
+			goto out_names;
+		status = EXIT_SUCCESS;
+	}
+
+	if (emu_launch_configs(path, names, n, bin, lang, is_fullscreen,
+			       is_settings, cgroup, monitor, stats) ==
+	    EXIT_FAILURE)
+		status = EXIT_FAILURE;
+
+out_names:
+	free(names);
+
+out_marks:
+	emu_scan_free(&menu.marks);
+
+/* Free our older allocated resources. */
+out_cleanup:
+	emu_scan_free(&scan);
+	free(path);
+	return (status);
+}
+
+/* Start the configs, as --select does once they're selected (or with
+   --launch), and let them run. Returns EXIT_FAILURE if any of them
+   couldn't be started or has failed. */
+static int emu_launch_configs(const char *path, const char **names,
+			      size_t n, const char *bin, const char *lang,
+			      int is_fullscreen, int is_settings, int cgroup,
+			      int monitor, struct emu_stats *stats)
+{
+	char p[PATH_MAX];
+	const char *name, *vbin;
+	size_t i, nvms;
+	int status;
+	struct emu_vm *vms;
+	struct emu_props *props;
+	struct emu_cgroup cg;
+	struct emu_emulators reg;
+	struct stat st;
+	uint64_t begin;
+
+	status = EXIT_SUCCESS;
+	vms = calloc(n, sizeof(struct emu_vm));
+	props = calloc(n, sizeof(struct emu_props));
+	if (vms == NULL || props == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	/* All of them at once, the cores are given across them. */
+	for (i = 0; i < n && is_settings == 0; i++)
+		emu_props_load(path, names[i], &props[i]);
+	if (is_settings == 0)
+		emu_props_assign(props, n);
+
+	cg.root = cg.self = -1;
+	if (cgroup >= 0 && is_settings == 0 && emu_cgroup_open(&cg) == -1)
+		status = EXIT_FAILURE;
+
+	nvms = 0;
+	memset(&reg, 0, sizeof(reg));
+	for (i = 0; i < n; i++) {
+		name = names[i];
+		emu_config_path(path, name, p, sizeof(p));
+		if (stat(p, &st) == -1) {
+			if (errno == ENOENT)
+				fprintf(stderr,
+					"emubox: config \"%s\" does not exists.\n",
+					name);
+			else
+				warn("stat");
+			status = EXIT_FAILURE;
+			continue;
+		}
+
+		/* The registry is only read if some VM wants a build of
+		   it's own, the settings always use the default one. */
+		vbin = bin;
+		if (is_settings == 0 && props[i].emulator[0]) {
+			if (reg.ents == NULL)
+				emu_emulators_load(&reg, 0);
+			vbin = emu_emulator_bin(&reg, name,
+						props[i].emulator, bin);
+			if (vbin == NULL) {
+				status = EXIT_FAILURE;
+				continue;
+			}
+		}
+
+		fprintf(stdout, "emubox: using config: %s\n", name);
+		snprintf(vms[nvms].name, sizeof(vms[nvms].name), "%s", name);
+		vms[nvms].cgroup = cg.root != -1 ?
+			emu_cgroup_create(&cg, name, &props[i]) : -1;
+
+		/* emubox goes into the VM's cgroup to start it, so
+		   86box (and whatever the AppImage starts before it)
+		   is born there and nothing escapes the limits. */
+		if (vms[nvms].cgroup != -1 &&
+		    emu_cgroup_write(vms[nvms].cgroup, "cgroup.procs",
+				     "0") == -1) {
+			warn("cgroup vm-%s", name);
+			emu_cgroup_remove(&cg, &vms[nvms]);
+		}
+
+		begin = stats ? emu_stats_now() : 0;
+		if (is_settings)
+			vms[nvms].pid = emu_launch_settings(bin, p,
+							    &vms[nvms].log.fd);
+		else
+			vms[nvms].pid = emu_launch_box(vbin, p, lang,
+						       is_fullscreen,
+						       &props[i],
+						       &vms[nvms].log.fd);
+		if (vms[nvms].cgroup != -1 &&
+		    emu_cgroup_write(cg.self, "cgroup.procs", "0") == -1)
+			warn("cgroup %s", EMU_CGROUP_SELF);
+		if (vms[nvms].pid == (pid_t)-1)
+			emu_cgroup_remove(&cg, &vms[nvms]);
+		if (vms[nvms].pid != (pid_t)-1) {
+			emu_stats_spawn(stats, &vms[nvms], begin);
+			emu_history_add(path, name);
+		}
+		nvms++;
+	}
+
+	fflush(stdout);
+	if (emu_supervise(vms, nvms, cgroup, is_settings ? 0 : monitor) ==
+	    EXIT_FAILURE)
+		status = EXIT_FAILURE;
+	for (i = 0; i < nvms; i++)
+		emu_cgroup_remove(&cg, &vms[i]);
+	emu_cgroup_close(&cg);
+	emu_emulators_free(&reg);
+	free(props);
+	free(vms);
+	return (status);
+}
+
+/* --launch, start a config without a scan, the menu or the terminal.
+   The name is resolved by emu_config_resolve(...). */
+static int emu_launch_name(const char *bin, const char *name,
+			   const char *lang, int is_fullscreen, int cgroup,
+			   int monitor)
+{
+	char *path, cfg[PATH_MAX];
+	const char *names[1];
+	int status;
+
+	path = emu_get_directory();
+	if (path == NULL)
+		return (EXIT_FAILURE);
+
+	if (emu_config_resolve(path, name, cfg, sizeof(cfg)) == -1) {
+		fprintf(stderr, "emubox: config \"%s\" does not exists.\n",
+			name);
+		free(path);
+		return (EXIT_FAILURE);
+	}
+
+	names[0] = cfg;
+	status = emu_launch_configs(path, names, 1, bin, lang,
+				    is_fullscreen, 0, cgroup, monitor, NULL);
+	free(path);
+	return (status);
+}
+
+/* Initialize the emubox directory. */
+static void emu_init_emubox(void)
+{
+	char *path;
+
+	path = emu_get_directory();
+	if (path == NULL)
+		exit(EXIT_FAILURE);
+
+	if (mkdir(path, 0700) == -1) {
+		if (errno == EEXIST)
+			fputs("emubox: "
+			      "config directory: already exists.\n",
+			      stderr);
+		else
+			warn("mkdir");
+		free(path);
+		exit(EXIT_FAILURE);
+	}
+
+	free(path);
+}
+
+/* Worker of emu_pool_run(...) */
+static void *emu_pool_worker(void *arg)
+{
+	struct emu_pool *pool;
+	size_t i;
+
+	pool = arg;
+	while ((i = __atomic_fetch_add(&pool->next, (size_t)1,
+				       __ATOMIC_RELAXED)) < pool->n)
+		pool->fn(pool->arg, i);
+
+	return (NULL);
+}
+
+/* Call fn for every index below n, on a worker per CPU (but no more
+   than EMU_POOL_THREADS of them). The calling thread is a worker as
+   well, so everything still gets done if no thread could be started.
+   Returns once every index is done. */
+static void emu_pool_run(size_t n, void (*fn)(void *, size_t), void *arg)
+{
+	pthread_t th[EMU_POOL_THREADS];
+	struct emu_pool pool;
+	size_t i, nth;
+	long ncpu;
+
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nth = ncpu > 0 ? (size_t)ncpu : (size_t)1;
+	if (nth > (size_t)EMU_POOL_THREADS)
+		nth = (size_t)EMU_POOL_THREADS;
+	if (nth > n)
+		nth = n;
+
+	for (i = 1; i < nth; i++)
+		if (pthread_create(&th[i], NULL, emu_pool_worker, &pool) != 0)
+			break;
+	nth = i;
+
+	emu_pool_worker(&pool);
+	for (i = 1; i < nth; i++)
+		pthread_join(th[i], NULL);
+}
+
+/* Set up an io_uring(7) instance, with at least entries entries, and
+   map it's rings. Returns -1 if the kernel doesn't have one for us
+   (it's too old, or it's turned off). */
+static int emu_uring_open(struct emu_uring *u, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(u, 0, sizeof(struct emu_uring));
+	memset(&p, 0, sizeof(p));
+	u->sq_map = u->cq_map = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+	u->fd = (int)syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd == -1)
+		return (-1);
+
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_map = u->sq_map;
+	else
+		u->cq_map = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->fd,
+				 IORING_OFF_CQ_RING);
+	if (u->cq_map == MAP_FAILED)
+		goto fail;
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = u->sq_map;
+	cq = u->cq_map;
+	u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->entries = p.sq_entries;
+	return (0);
+
+fail:
+	emu_uring_close(u);
+	return (-1);
+}
+
+/* Unmap the rings and close the instance. */
+static void emu_uring_close(struct emu_uring *u)
+{
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_map != MAP_FAILED && u->cq_map != u->sq_map)
+		munmap(u->cq_map, u->cq_sz);
+	if (u->sq_map != MAP_FAILED)
+		munmap(u->sq_map, u->sq_sz);
+	if (u->fd != -1)
+		close(u->fd);
+	u->fd = -1;
+}
+
+/* Worker of emu_pool_run(...), a single statx(2) call. */
+static void emu_statx_worker(void *arg, size_t idx)
+{
+	struct emu_statx *sx;
+	struct statx stx;
+
+	sx = arg;
+	if (statx(sx->dirfd, sx->name(sx->arg, idx), AT_SYMLINK_NOFOLLOW,
+		  sx->mask, &stx) == 0)
+		sx->done(sx->arg, idx, &stx);
+}
+
+/* Every statx(2) call of emu_statx_run(...) through io_uring. The ring
+   is kept full, a slot is refilled as soon as it's call is done, and
+   every round of them is a single system call. Returns -1 (without
+   doing anything) if there's no io_uring. */
+static int emu_statx_uring(struct emu_statx *sx)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct emu_uring u;
+	struct statx *bufs;
+	size_t *slots, next, inflight;
+	unsigned int *free_slots, nfree, slot, tail, head, mask, depth;
+	int ret;
+
+	if (emu_uring_open(&u, EMU_STATX_DEPTH) == -1)
+		return (-1);
+
+	/* The completion ring is twice as large, it can't overflow. */
+	depth = u.entries;
+	bufs = malloc(depth * sizeof(struct statx));
+	slots = malloc(depth * sizeof(size_t));
+	free_slots = malloc(depth * sizeof(unsigned int));
+	if (bufs == NULL || slots == NULL || free_slots == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (nfree = 0; nfree < depth; nfree++)
+		free_slots[nfree] = depth - nfree - 1;
+
+	next = inflight = 0;
+	mask = *u.sq_mask;
+	while (next < sx->n || inflight) {
+		tail = *u.sq_tail;
+		for (; next < sx->n && nfree; next++, inflight++) {
+			slot = free_slots[--nfree];
+			slots[slot] = next;
+			sqe = &u.sqes[tail & mask];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = sx->dirfd;
+			sqe->addr = (uint64_t)(uintptr_t)sx->name(sx->arg, next);
+			sqe->len = sx->mask;
+			sqe->off = (uint64_t)(uintptr_t)&bufs[slot];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+			sqe->user_data = slot;
+			u.sq_array[tail & mask] = tail & mask;
+			tail++;
+		}
+		__atomic_store_n(u.sq_tail, tail, __ATOMIC_RELEASE);
+
+		/* What the kernel hasn't taken yet, an interrupted call
+		   may have left some behind. */
+		ret = (int)syscall(SYS_io_uring_enter, u.fd,
+				   tail - __atomic_load_n(u.sq_head,
+							  __ATOMIC_ACQUIRE),
+				   1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret == -1 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			err(EXIT_FAILURE, "io_uring_enter");
+
+		head = *u.cq_head;
+		while (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &u.cqes[head & *u.cq_mask];
+			slot = (unsigned int)cqe->user_data;
+
+			/* Kernels before 5.6 don't know of statx here. */
+			if (cqe->res == 0)
+				sx->done(sx->arg, slots[slot], &bufs[slot]);
+			else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)
+				emu_statx_worker(sx, slots[slot]);
+
+			free_slots[nfree++] = slot;
+			inflight--;
+			head++;
+		}
+		__atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	free(free_slots);
+	free(slots);
+	free(bufs);
+	emu_uring_close(&u);
+	return (0);
+}
+
+/* Metadata of every name of sx. A round trip to a slow (network) file
+   system is the price of every one of them, so they're all sent off
+   at once: in batches through io_uring, or without it from a pool of
+   workers. */
+static void emu_statx_run(struct emu_statx *sx)
+{
+	size_t i;
+
+	if (sx->n < (size_t)EMU_STATX_MIN) {
+		for (i = 0; i < sx->n; i++)
+			emu_statx_worker(sx, i);
+		return;
+	}
+
+	if (emu_statx_uring(sx) == -1)
+		emu_pool_run(sx->n, emu_statx_worker, sx);
+}
+
+/* Format a size in bytes, for humans. */
+static void emu_format_size(uint64_t sz, char *buf, size_t len)
+{
+	static const char *units[] = { "KiB", "MiB", "GiB", "TiB" };
+	double v;
+	int i;
+
+	if (sz < 1024ULL) {
+		snprintf(buf, len, "%llu B", (unsigned long long)sz);
+		return;
+	}
+
+	v = (double)sz / 1024.0;
+	for (i = 0; i < 3 && v >= 1024.0; i++)
+		v /= 1024.0;
+	snprintf(buf, len, "%.1f %s", v, units[i]);
+}
+
+/* Remember a file owned by a config, to delete it later. */
+static void emu_purge_add(struct emu_purge *pg, const char *path, int kind)
+{
+	struct emu_purge_file *f;
+	size_t cap;
+	char *p;
+
+	p = strdup(path);
+	if (p == NULL)
+		err(EXIT_FAILURE, "strdup");
+
+	pthread_mutex_lock(&pg->lock);
+	if (pg->nfiles == pg->files_cap) {
+		cap = pg->files_cap ? pg->files_cap * (size_t)2 : (size_t)64;
+		f = realloc(pg->files, cap * sizeof(struct emu_purge_file));
+		if (f == NULL)
+			err(EXIT_FAILURE, "realloc");
+
+		pg->files = f;
+		pg->files_cap = cap;
+	}
+
+	pg->files[pg->nfiles].path = p;
+	pg->files[pg->nfiles].kind = kind;
+	pg->nfiles++;
+	pthread_mutex_unlock(&pg->lock);
+}
+
+/* Remember a disk image of a config, but only if it really lives
+   inside of the config directory, symbolic links out of it are kept.
+   Relative paths are relative to the config directory, as 86Box
+   writes them. */
+static void emu_purge_disk(struct emu_purge *pg, const char *v, size_t len)
+{
+	char path[PATH_MAX], real[PATH_MAX];
+	int ret;
+
+	if (v[0] == '/')
+		ret = snprintf(path, sizeof(path), "%.*s", (int)len, v);
+	else
+		ret = snprintf(path, sizeof(path), "%s/%.*s",
+			       pg->root, (int)len, v);
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return;
+
+	/* Already gone, there's nothing to reclaim. */
+	if (realpath(path, real) == NULL)
+		return;
+
+	/* Names starting with a "." are emubox's own. */
+	if (strncmp(real, pg->root, pg->root_len) != 0 ||
+	    real[pg->root_len] != '/' || real[pg->root_len + 1] == '.') {
+		emu_purge_add(pg, real, EMU_PURGE_KEPT);
+		return;
+	}
+
+	emu_purge_add(pg, real + pg->root_len + 1, EMU_PURGE_DISK);
+}
+
+/* Read a single config, and remember everything it owns. */
+static void emu_purge_collect(void *arg, size_t idx)
+{
+	struct emu_purge *pg;
+	const struct emu_conf_key *k;
+	struct emu_conf *cf;
+	const char *name, *key;
+	char machine[64], nvr[80];
+	size_t i, len;
+
+	pg = arg;
+	name = emu_scan_name(&pg->scan, idx);
+	len = pg->scan.ents[idx].name_len;
+
+	/* Disk images can be next to the configs, never map them. */
+	if (len < (size_t)4 || strcmp(name + len - 4, ".cfg") != 0)
+		return;
+
+	cf = emu_read_conf(pg->dirfd, name);
+	if (cf == NULL)
+		return;
+
+	/* Floppies and CD-ROMs are usually shared, only hard disks
+	   belong to a single config. */
+	for (i = 0; i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		key = cf->map + k->key_off;
+		if (k->val_len &&
+		    emu_conf_image(key, k->key_len) == EMU_IMAGE_HDD)
+			emu_purge_disk(pg, cf->map + k->val_off, k->val_len);
+	}
+
+	/* 86Box keeps the NVR of a machine in "nvr/<machine>.nvr", it's
+	   shared by every config of the same machine, but all of them
+	   are going away anyway. */
+	if (emu_conf_copy(cf, "Machine", "machine", machine,
+			  sizeof(machine)) &&
+	    machine[0] != '.' && strchr(machine, '/') == NULL) {
+		snprintf(nvr, sizeof(nvr), "nvr/%s.nvr", machine);
+		emu_purge_add(pg, nvr, EMU_PURGE_NVR);
+	}
+
+	emu_free_conf(cf);
+}
+
+/* Delete a single file, relative to the config directory. */
+static void emu_purge_unlink(struct emu_purge *pg, const char *path, int kind)
+{
+	struct stat st;
+	uint64_t sz;
+	int has_st;
+
+	/* The NVR of a machine that never ran, or a disk image that was
+	   next to the configs and is already gone. */
+	has_st = fstatat(pg->dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+	if (has_st == 0 && errno == ENOENT)
+		return;
+
+	if (unlinkat(pg->dirfd, path, 0) == -1) {
+		if (errno != ENOENT) {
+			warn("unlink: %s", path);
+			__atomic_fetch_add(&pg->failed, (size_t)1,
+					   __ATOMIC_RELAXED);
+		}
+		return;
+	}
+
+	/* Only the last link of a file frees anything, and what a file
+	   that couldn't be stat'ed frees isn't known. */
+	sz = has_st && st.st_nlink == 1 ? (uint64_t)st.st_blocks * 512ULL : 0;
+	__atomic_fetch_add(&pg->count[kind], (size_t)1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pg->freed, sz, __ATOMIC_RELAXED);
+	if (pg->verbose)
+		fprintf(stdout, "emubox: deleted: %s/%s\n", pg->root, path);
+}
+
+/* Workers of emu_pool_run(...), for the owned files and the configs. */
+static void emu_purge_file(void *arg, size_t idx)
+{
+	struct emu_purge *pg;
+
+	pg = arg;
+	if (pg->files[idx].kind != EMU_PURGE_KEPT)
+		emu_purge_unlink(pg, pg->files[idx].path,
+				 pg->files[idx].kind);
+}
+
+static void emu_purge_entry(void *arg, size_t idx)
+{
+	struct emu_purge *pg;
+
+	pg = arg;
+	emu_purge_unlink(pg, emu_scan_name(&pg->scan, idx), EMU_PURGE_CONFIG);
+}
+
+/* qsort's internal function, for the owned files. */
+static int emu_purge_compare(const void *s0, const void *s1)
+{
+	return (strcmp(((const struct emu_purge_file *)s0)->path,
+		       ((const struct emu_purge_file *)s1)->path));
+}
+
+/* Delete all configs. With reclaim, the disk images and the NVR files
+   they own are deleted as well. Deleting large disk images mostly
+   waits for the file system, so everything is deleted on a pool of
+   workers. Only a summary is shown, unless verbose is set. Returns
+   EXIT_FAILURE if anything couldn't be deleted. */
+static int emu_bulk_purge_configs(int reclaim, int verbose)
+{
+	struct emu_purge pg;
+	char *path, freed[32];
+	size_t i, j;
+	int ret;
+
+	path = emu_get_directory();
+	if (path == NULL)
+		return (EXIT_FAILURE);
+
+	memset(&pg, 0, sizeof(pg));
+	pg.reclaim = reclaim;
+	pg.verbose = verbose;
+	pg.dirfd = -1;
+	if (realpath(path, pg.root) != NULL)
+		pg.dirfd = open(pg.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+
+	/* Always look at the directory itself, not at the index. */
+	if (pg.dirfd == -1 || emu_scan_directory(&pg.scan, pg.dirfd) == -1) {
+	        fputs("emubox: missing config directory.\n",
+		      stderr);
+		if (pg.dirfd != -1)
+			close(pg.dirfd);
+		return (EXIT_FAILURE);
+	}
+
+	/* We don't have anything to purge. */
+	if (pg.scan.nents == 0) {
+		fputs("emubox: "
+		      "no config files are present to purge.\n",
+		      stderr);
+		emu_scan_free(&pg.scan);
+		close(pg.dirfd);
+		return (EXIT_SUCCESS);
+	}
+
+	pg.root_len = strlen(pg.root);
+	pthread_mutex_init(&pg.lock, NULL);
+	if (reclaim) {
+		emu_pool_run(pg.scan.nents, emu_purge_collect, &pg);
+
+		/* Configs can share a disk image, and a machine. */
+		qsort(pg.files, pg.nfiles, sizeof(struct emu_purge_file),
+		      emu_purge_compare);
+		for (i = j = 0; i < pg.nfiles; i++) {
+			if (j && strcmp(pg.files[j - 1].path,
+					pg.files[i].path) == 0) {
+				free(pg.files[i].path);
+				continue;
+			}
+			if (pg.files[i].kind == EMU_PURGE_KEPT) {
+				pg.count[EMU_PURGE_KEPT]++;
+				if (verbose)
+					fprintf(stdout, "emubox: kept: %s\n",
+						pg.files[i].path);
+			}
+			pg.files[j++] = pg.files[i];
+		}
+		pg.nfiles = j;
+
+		emu_pool_run(pg.nfiles, emu_purge_file, &pg);
+		/* Don't leave an empty "nvr" directory behind. */
+		(void)unlinkat(pg.dirfd, "nvr", AT_REMOVEDIR);
+	}
+	emu_pool_run(pg.scan.nents, emu_purge_entry, &pg);
+
+	emu_format_size(pg.freed, freed, sizeof(freed));
+	if (reclaim)
+		fprintf(stdout, "emubox: purged %zu config file(s), "
+			"%zu disk image(s) and %zu NVR file(s), %s freed",
+			pg.count[EMU_PURGE_CONFIG], pg.count[EMU_PURGE_DISK],
+			pg.count[EMU_PURGE_NVR], freed);
+	else
+		fprintf(stdout, "emubox: purged %zu config file(s), %s freed",
+			pg.count[EMU_PURGE_CONFIG], freed);
+	if (pg.count[EMU_PURGE_KEPT])
+		fprintf(stdout, ", kept %zu disk image(s) outside of %s",
+			pg.count[EMU_PURGE_KEPT], pg.root);
+	if (pg.failed)
+		fprintf(stdout, ", %zu failed", pg.failed);
+	fputs(".\n", stdout);
+
+	ret = pg.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+	for (i = 0; i < pg.nfiles; i++)
+		free(pg.files[i].path);
+	free(pg.files);
+	pthread_mutex_destroy(&pg.lock);
+	emu_scan_free(&pg.scan);
+	close(pg.dirfd);
+	return (ret);
+}
+
+/* Delete a single config, relative to the config directory. If the
+   index is still valid, the config is taken out of scan as well. */
+static int emu_purge_config(int dirfd, const char *name,
+			    struct emu_scan *scan)
+{
+	char buf[NAME_MAX + 1];
+	const char *p;
+	int ret;
+
+	if (emu_config_name(name, buf, sizeof(buf)) == -1) {
+		fprintf(stderr, "emubox: invalid config name: %s\n", name);
+		return (-1);
+	}
+
+	/* Check whether the name actually has
+	   a ".cfg" file extension. We can't do
+	   that for entire buffer as there might
+	   be users' whose name also contains ".cfg".
+	   Trying to delete it is as cheap as checking first. */
+	p = buf;
+	ret = unlinkat(dirfd, buf, 0);
+	if (ret == -1 && errno == ENOENT && strcmp(buf, name) != 0) {
+		p = name;
+		ret = unlinkat(dirfd, name, 0);
+	}
+
+	if (ret == -1) {
+		if (errno == ENOENT)
+			fprintf(stderr,
+				"emubox: unknown config file: %s\n",
+				name);
+		else
+			warn("unlink");
+
+		return (-1);
+	}
+
+	if (scan)
+		emu_scan_remove(scan, p);
+
+	fprintf(stdout, "emubox: deleted config: %s\n", p);
+	return (0);
+}
+
+/* Create a new emubox config, relative to the config directory, with
+   the text of a template (if there's one) in a single write. If the
+   index is still valid, the config is added to scan as well, it needs
+   to be sorted after all configs are created. */
+static int emu_create_new(int dirfd, const char *name,
+			  struct emu_scan *scan, const char *tmpl, size_t len)
+{
+	char buf[NAME_MAX + 1];
+	struct stat st;
+	int fd;
+
+	if (emu_config_name(name, buf, sizeof(buf)) == -1) {
+		fprintf(stderr, "emubox: invalid config name: %s\n", name);
+		return (-1);
+	}
+
+	/* Create it, only if it doesn't exist yet. */
+	fd = openat(dirfd, buf, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		    S_IRWXU);
+	if (fd == -1) {
+		if (errno == EEXIST)
+			fprintf(stderr,
+				"emubox: file \"%s\" already exists.\n",
+				buf);
+		else
+			warn("open");
+		return (-1);
+	}
+
+	if (len && write(fd, tmpl, len) != (ssize_t)len) {
+		warn("write: %s", buf);
+		close(fd);
+		unlinkat(dirfd, buf, 0);
+		return (-1);
+	}
+
+	/* Keep the index valid, so the next scan isn't needed. */
+	if (scan) {
+		emu_scan_push(scan, buf, strlen(buf));
+		if (fstat(fd, &st) == 0)
+			scan->ents[scan->nents - 1].mtime = st.st_mtim;
+	}
+
+	fprintf(stdout,
+		"emubox: done: created \"%s\".\n", buf);
+	close(fd);
+	return (0);
+}
+
+/* Find a preset by it's name, or NULL. */
+static const struct emu_template *emu_template_find(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(emu_templates) / sizeof(emu_templates[0]); i++)
+		if (strcmp(name, emu_templates[i].name) == 0)
+			return (&emu_templates[i]);
+
+	return (NULL);
+}
+
+/* Get the text of a template, by the name of a preset or the path of
+   a file. Returns NULL if there's no such template, the text of a file
+   has to be freed. */
+static char *emu_template_load(const char *name, size_t *len)
+{
+	const struct emu_template *t;
+	struct stat st;
+	char *text;
+	ssize_t n;
+	int fd;
+
+	t = emu_template_find(name);
+	if (t) {
+		*len = strlen(t->text);
+		return ((char *)t->text);
+	}
+
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		if (errno == ENOENT)
+			fprintf(stderr, "emubox: unknown template: %s\n", name);
+		else
+			warn("%s", name);
+		if (fd != -1)
+			close(fd);
+		return (NULL);
+	}
+
+	text = malloc((size_t)st.st_size + 1);
+	if (text == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	*len = 0;
+	while (*len < (size_t)st.st_size &&
+	       (n = read(fd, text + *len, (size_t)st.st_size - *len)) > 0)
+		*len += (size_t)n;
+	close(fd);
+	return (text);
+}
+
+/* Create (or delete) every config in argv. New ones are made from the
+   template tmpl, if there's one. The config directory is opened once
+   and the index is updated once for all of them. Returns EXIT_FAILURE
+   if any of them failed. */
+static int emu_batch_configs(int argc, char **argv, int is_delete,
+			     const char *tmpl)
+{
+	struct emu_scan scan;
+	char *text;
+	size_t len;
+	int i, dirfd, ifd, ret, added;
+
+	/* The template is read once, for all of them. */
+	text = NULL;
+	len = 0;
+	if (tmpl && (text = emu_template_load(tmpl, &len)) == NULL)
+		return (EXIT_FAILURE);
+
+	dirfd = emu_open_directory();
+	if (dirfd == -1)
+		exit(EXIT_FAILURE);
+
+	ret = EXIT_SUCCESS;
+	added = 0;
+	ifd = emu_index_begin(dirfd, &scan);
+	for (i = 0; i < argc; i++) {
+		switch (argv[i][0]) {
+		case '-':
+		case '/':
+		case '\\':
+			if (is_delete == 0)
+				fputs("emubox: "
+				      "an unexpected character was passed."
+				      " Ignored.\n",
+				      stderr);
+			continue;
+
+		default:
+			if (is_delete) {
+				if (emu_purge_config(dirfd, argv[i],
+				    ifd != -1 ? &scan : NULL) == -1)
+					ret = EXIT_FAILURE;
+			} else {
+				if (emu_create_new(dirfd, argv[i],
+				    ifd != -1 ? &scan : NULL, text, len) == -1)
+					ret = EXIT_FAILURE;
+				else
+					added = 1;
+			}
+		}
+	}
+
+	if (ifd != -1 && added)
+		emu_scan_sort(&scan);
+	emu_index_end(ifd, dirfd, &scan);
+	close(dirfd);
+	if (text && emu_template_find(tmpl) == NULL)
+		free(text);
+	return (ret);
+}
+
+/* Copy len bytes at off, with copy_file_range(2), so the kernel (or a
+   network file system) does the copy. Falls back to read and write
+   across file systems that can't. Returns -1 if the copy failed. */
+static int emu_clone_range(int in, int out, off_t off, off_t len)
+{
+	char *buf;
+	off_t o_in, o_out;
+	ssize_t n, w, k;
+
+	o_in = o_out = off;
+	while (len > 0) {
+		n = copy_file_range(in, &o_in, out, &o_out, (size_t)len, 0);
+		if (n == -1 && (errno == EXDEV || errno == ENOSYS ||
+		    errno == EOPNOTSUPP || errno == EINVAL))
+			break;
+		if (n <= 0)
+			return (n == 0 ? 0 : -1);
+		len -= n;
+	}
+	if (len == 0)
+		return (0);
+
+	buf = malloc((size_t)1 << 20);
+	if (buf == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	while (len > 0) {
+		n = pread(in, buf, len < ((off_t)1 << 20) ? (size_t)len :
+			  (size_t)1 << 20, o_in);
+		if (n <= 0)
+			break;
+		for (w = 0; w < n; w += k) {
+			k = pwrite(out, buf + w, (size_t)(n - w), o_out + w);
+			if (k == -1)
+				break;
+		}
+		if (w < n)
+			break;
+		o_in += n;
+		o_out += n;
+		len -= n;
+	}
+
+	free(buf);
+	return (len == 0 ? 0 : -1);
+}
+
+/* Copy a disk image. A reflink shares every block with the source,
+   so the copy is instant and takes no space, on the file systems that
+   can (btrfs, XFS). Otherwise only the data is copied, and holes stay
+   holes, disk images are mostly empty. Returns -1 if it failed. */
+static int emu_clone_file(struct emu_clone_disk *d)
+{
+	struct stat st;
+	off_t off, data, hole;
+	int in, out, ret;
+
+	in = open(d->src, O_RDONLY | O_CLOEXEC);
+	if (in == -1 || fstat(in, &st) == -1) {
+		warn("%s", d->src);
+		if (in != -1)
+			close(in);
+		return (-1);
+	}
+
+	out = open(d->dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		   st.st_mode & 0777);
+	if (out == -1) {
+		if (errno == EEXIST)
+			fprintf(stderr,
+				"emubox: file \"%s\" already exists.\n",
+				d->dst);
+		else
+			warn("%s", d->dst);
+		close(in);
+		return (-1);
+	}
+	d->created = 1;
+
+	ret = 0;
+	if (ioctl(out, FICLONE, in) == 0) {
+		d->reflinked = 1;
+		goto out;
+	}
+
+	for (off = 0; off < st.st_size && ret == 0; off = hole) {
+		data = lseek(in, off, SEEK_DATA);
+		if (data == -1 && errno == ENXIO)
+			break;
+		/* Without holes, everything is data. */
+		if (data == -1) {
+			data = off;
+			hole = st.st_size;
+		} else {
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole == -1)
+				hole = st.st_size;
+		}
+
+		ret = emu_clone_range(in, out, data, hole - data);
+		d->copied += (uint64_t)(hole - data);
+	}
+
+	/* The size, including a hole at the end. */
+	if (ret == 0 && ftruncate(out, st.st_size) == -1)
+		ret = -1;
+	if (ret == -1)
+		warn("copy: %s", d->dst);
+
+out:
+	close(out);
+	close(in);
+	return (ret);
+}
+
+/* Worker of emu_pool_run(...), for the disk images. */
+static void emu_clone_worker(void *arg, size_t idx)
+{
+	struct emu_clone_disk *d;
+
+	d = &((struct emu_clone_disk *)arg)[idx];
+	if (d->ret == -1 && d->dst[0])
+		d->ret = emu_clone_file(d);
+}
+
+/* Find the hard disk images of a config, with their keys and their
+   resolved paths. Relative paths are relative to the config
+   directory (root). Returns the amount of them, or -1 if an image is
+   missing (or it's path is too long). */
+static int emu_clone_disks(const struct emu_conf *cf, const char *root,
+			   size_t **keys, char ***reals)
+{
+	const struct emu_conf_key *k;
+	char path[PATH_MAX], real[PATH_MAX];
+	const char *key, *v;
+	size_t i;
+	int n, ret;
+
+	*keys = malloc((cf->nkeys + 1) * sizeof(size_t));
+	*reals = malloc((cf->nkeys + 1) * sizeof(char *));
+	if (*keys == NULL || *reals == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	n = 0;
+	for (i = 0; i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		key = cf->map + k->key_off;
+		v = cf->map + k->val_off;
+		if (k->val_len == 0 ||
+		    emu_conf_image(key, k->key_len) != EMU_IMAGE_HDD)
+			continue;
+
+		if (v[0] == '/')
+			ret = snprintf(path, sizeof(path), "%.*s",
+				       (int)k->val_len, v);
+		else
+			ret = snprintf(path, sizeof(path), "%s/%.*s", root,
+				       (int)k->val_len, v);
+		if (ret < 0 || (size_t)ret >= sizeof(path)) {
+			fprintf(stderr, "emubox: disk image %.*s: path is "
+				"too long.\n", (int)k->val_len, v);
+			goto fail;
+		}
+		if (realpath(path, real) == NULL) {
+			warn("disk image %s", path);
+			goto fail;
+		}
+
+		(*keys)[n] = i;
+		(*reals)[n] = strdup(real);
+		if ((*reals)[n] == NULL)
+			err(EXIT_FAILURE, "strdup");
+		n++;
+	}
+
+	return (n);
+
+fail:
+	while (n > 0)
+		free((*reals)[--n]);
+	free(*reals);
+	free(*keys);
+	return (-1);
+}
+
+/* Write a clone of a config, with the paths of it's own disk images.
+   Images inside of the config directory (root) are referred to
+   relative to it, like 86Box does. Returns -1 if it failed. */
+static int emu_clone_write(int fd, const struct emu_conf *cf,
+			   const struct emu_clone_disk *disks, size_t n,
+			   const char *root)
+{
+	const struct emu_conf_key *k;
+	const char *v;
+	size_t i, off, len, root_len;
+	ssize_t w;
+	char *buf;
+
+	len = cf->len;
+	for (i = 0; i < n; i++)
+		len += strlen(disks[i].dst);
+	buf = malloc(len + 1);
+	if (buf == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	/* The keys are in the order of the file, and so are the disks. */
+	root_len = strlen(root);
+	for (i = off = len = 0; i < n; i++) {
+		k = &cf->keys[disks[i].key];
+		memcpy(buf + len, cf->map + off, k->val_off - off);
+		len += k->val_off - off;
+		v = disks[i].dst;
+		if (strncmp(v, root, root_len) == 0 && v[root_len] == '/')
+			v += root_len + 1;
+		memcpy(buf + len, v, strlen(v));
+		len += strlen(v);
+		off = k->val_off + k->val_len;
+	}
+	memcpy(buf + len, cf->map + off, cf->len - off);
+	len += cf->len - off;
+
+	for (off = 0; off < len; off += (size_t)w) {
+		w = write(fd, buf + off, len - off);
+		if (w == -1) {
+			warn("write");
+			break;
+		}
+	}
+
+	free(buf);
+	return (off == len ? 0 : -1);
+}
+
+/* Clone the config argv[0] as every other config in argv. Every hard
+   disk image it has is copied next to itself, named after the new
+   config ("win98.img" of "win98" becomes "dos.img" for "dos", any
+   other name becomes "dos-<name>"), and the clones refer to their
+   own copies. All images of all clones are
+   copied at once, on a pool of workers. A clone is only kept if
+   every one of it's images could be copied. Returns EXIT_FAILURE if
+   any of them failed. */
+static int emu_clone_configs(int argc, char **argv)
+{
+	struct emu_clone_disk *disks, *d;
+	struct emu_conf *cf;
+	struct emu_scan scan;
+	char root[PATH_MAX], src[NAME_MAX + 1], **reals, *path;
+	char stem[NAME_MAX + 1], (*names)[NAME_MAX + 1], copied[32];
+	const char *base;
+	size_t *keys, i, j, ndisks, reflinked, slen, nlen;
+	struct stat st;
+	uint64_t bytes;
+	int *fds, n, dirfd, ifd, ret, ok, added;
+
+	if (argc < 2) {
+		fputs("emubox: --clone needs a config and "
+		      "one or more new config(s).\n", stderr);
+		return (EXIT_FAILURE);
+	}
+
+	path = emu_get_directory();
+	if (path == NULL)
+		return (EXIT_FAILURE);
+	dirfd = -1;
+	if (realpath(path, root) != NULL)
+		dirfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(path);
+	if (dirfd == -1) {
+		fputs("emubox: config directory wasn't found.\n", stderr);
+		return (EXIT_FAILURE);
+	}
+
+	/* Same rules as --delete, with or without ".cfg". */
+	cf = NULL;
+	if (emu_config_name(argv[0], src, sizeof(src)) == 0) {
+		cf = emu_read_conf(dirfd, src);
+		if (cf == NULL && errno == ENOENT &&
+		    strcmp(src, argv[0]) != 0 &&
+		    (cf = emu_read_conf(dirfd, argv[0])) != NULL)
+			snprintf(src, sizeof(src), "%s", argv[0]);
+	}
+	if (cf == NULL) {
+		fprintf(stderr, "emubox: unknown config file: %s\n", argv[0]);
+		close(dirfd);
+		return (EXIT_FAILURE);
+	}
+
+	n = emu_clone_disks(cf, root, &keys, &reals);
+	if (n == -1) {
+		emu_free_conf(cf);
+		close(dirfd);
+		return (EXIT_FAILURE);
+	}
+
+	slen = strlen(src);
+	if (slen >= 4 && strcmp(src + slen - 4, ".cfg") == 0)
+		slen -= 4;
+	snprintf(stem, sizeof(stem), "%.*s", (int)slen, src);
+
+	ndisks = (size_t)(argc - 1) * (size_t)n;
+	disks = calloc(ndisks + 1, sizeof(struct emu_clone_disk));
+	fds = malloc((size_t)argc * sizeof(int));
+	names = malloc((size_t)argc * sizeof(*names));
+	if (disks == NULL || fds == NULL || names == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	/* Take the name of every clone first, so two of them can't end
+	   up with the same images. */
+	ret = EXIT_SUCCESS;
+	ifd = emu_index_begin(dirfd, &scan);
+	for (i = 1; i < (size_t)argc; i++) {
+		fds[i] = -1;
+		if (emu_config_name(argv[i], names[i],
+				    sizeof(names[i])) == -1) {
+			fprintf(stderr, "emubox: invalid config name: %s\n",
+				argv[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		fds[i] = openat(dirfd, names[i], O_WRONLY | O_CREAT | O_EXCL |
+				O_CLOEXEC, S_IRWXU);
+		if (fds[i] == -1) {
+			if (errno == EEXIST)
+				fprintf(stderr,
+					"emubox: file \"%s\" already exists.\n",
+					names[i]);
+			else
+				warn("open");
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		/* A name with ".cfg" inside of it is taken as it is, only
+		   a ".cfg" at the end isn't part of the images' names. */
+		nlen = strlen(names[i]);
+		if (nlen >= 4 && strcmp(names[i] + nlen - 4, ".cfg") == 0)
+			nlen -= 4;
+
+		for (j = 0; j < (size_t)n; j++) {
+			d = &disks[(i - 1) * (size_t)n + j];
+			d->clone = i;
+			d->key = keys[j];
+			d->ret = -1;
+			snprintf(d->src, sizeof(d->src), "%s", reals[j]);
+
+			base = strrchr(reals[j], '/') + 1;
+			if (strncmp(base, stem, strlen(stem)) == 0)
+				snprintf(d->dst, sizeof(d->dst), "%.*s%.*s%s",
+					 (int)(base - reals[j]), reals[j],
+					 (int)nlen, names[i],
+					 base + strlen(stem));
+			else
+				snprintf(d->dst, sizeof(d->dst), "%.*s%.*s-%s",
+					 (int)(base - reals[j]), reals[j],
+					 (int)nlen, names[i], base);
+		}
+	}
+
+	emu_pool_run(ndisks, emu_clone_worker, disks);
+
+	added = 0;
+	for (i = 1; i < (size_t)argc; i++) {
+		if (fds[i] == -1)
+			continue;
+
+		ok = 1;
+		reflinked = 0;
+		bytes = 0;
+		for (j = 0; j < (size_t)n; j++) {
+			d = &disks[(i - 1) * (size_t)n + j];
+			ok &= d->ret == 0;
+			reflinked += (size_t)d->reflinked;
+			bytes += d->copied;
+		}
+		if (ok)
+			ok = emu_clone_write(fds[i], cf,
+					     &disks[(i - 1) * (size_t)n],
+					     (size_t)n, root) == 0;
+		if (fstat(fds[i], &st) == -1)
+			memset(&st, 0, sizeof(st));
+		close(fds[i]);
+
+		/* Leave nothing of a failed clone behind. */
+		if (ok == 0) {
+			for (j = 0; j < (size_t)n; j++) {
+				d = &disks[(i - 1) * (size_t)n + j];
+				if (d->created)
+					unlink(d->dst);
+			}
+			unlinkat(dirfd, names[i], 0);
+			fprintf(stderr, "emubox: couldn't clone \"%s\".\n",
+				names[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+
+		/* Keep the index valid, images may be next to the
+		   configs as well. */
+		if (ifd != -1) {
+			emu_scan_push(&scan, names[i], strlen(names[i]));
+			scan.ents[scan.nents - 1].mtime = st.st_mtim;
+			for (j = 0; j < (size_t)n; j++) {
+				d = &disks[(i - 1) * (size_t)n + j];
+				base = strrchr(d->dst, '/') + 1;
+				if ((size_t)(base - d->dst) != strlen(root) + 1 ||
+				    strncmp(d->dst, root, strlen(root)) != 0 ||
+				    base[0] == '.')
+					continue;
+				emu_scan_push(&scan, base, strlen(base));
+				if (stat(d->dst, &st) == 0)
+					scan.ents[scan.nents - 1].mtime =
+						st.st_mtim;
+			}
+		}
+		added = 1;
+
+		emu_format_size(bytes, copied, sizeof(copied));
+		fprintf(stdout, "emubox: done: cloned \"%s\" as \"%s\", "
+			"%d disk image(s), %zu reflinked, %s copied.\n",
+			src, names[i], n, reflinked, copied);
+	}
+
+	if (ifd != -1 && added)
+		emu_scan_sort(&scan);
+	emu_index_end(ifd, dirfd, &scan);
+
+	for (j = 0; j < (size_t)n; j++)
+		free(reals[j]);
+	free(reals);
+	free(keys);
+	free(names);
+	free(fds);
+	free(disks);
+	emu_free_conf(cf);
+	close(dirfd);
+	return (ret);
+}
+
+/* Worker of emu_pool_run(...), reads what's shown of an entry. */
+static void emu_list_worker(void *arg, size_t idx)
+{
+	struct emu_list_ent *e;
+	struct emu_list *ls;
+	struct emu_conf *cf;
+	size_t len;
+
+	ls = arg;
+	e = &ls->ents[idx];
+
+	/* Disk images can be next to the configs, never map them. */
+	memset(&e->meta, 0, sizeof(e->meta));
+	len = strlen(e->name);
+	if (ls->need_conf == 0 || len < (size_t)4 ||
+	    strcmp(e->name + len - 4, ".cfg") != 0)
+		return;
+
+	cf = emu_read_conf(ls->dirfd, e->name);
+	if (cf == NULL) {
+		e->meta.errnum = errno;
+		return;
+	}
+	emu_conf_meta(cf, &e->meta);
+	emu_free_conf(cf);
+}
+
+/* Write a value the way the format wants it. TSV has no quoting, a
+   backslash, a tab or a newline is written as "\\", "\t" or "\n". */
+static void emu_list_string(const struct emu_list *ls, const char *s)
+{
+	if (ls->format == EMU_LIST_JSON) {
+		emu_json_string(ls->out, s);
+		return;
+	}
+
+	for (; *s; s++) {
+		if (*s == '\\')
+			fputs("\\\\", ls->out);
+		else if (*s == '\t')
+			fputs("\\t", ls->out);
+		else if (*s == '\n')
+			fputs("\\n", ls->out);
+		else
+			putc_unlocked(*s, ls->out);
+	}
+}
+
+/* name of emu_statx_run(...), for emu_list_flush(...) */
+static const char *emu_list_stat_name(void *arg, size_t idx)
+{
+	return (((struct emu_list *)arg)->ents[idx].name);
+}
+
+/* done of emu_statx_run(...), for emu_list_flush(...) */
+static void emu_list_stat_done(void *arg, size_t idx, const struct statx *stx)
+{
+	struct emu_list_ent *e;
+
+	e = &((struct emu_list *)arg)->ents[idx];
+	e->mtime.tv_sec = stx->stx_mtime.tv_sec;
+	e->mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+	e->size = (uint64_t)stx->stx_size;
+}
+
+/* Read and write every entry of the current round. */
+static void emu_list_flush(struct emu_list *ls)
+{
+	const struct emu_list_ent *e;
+	struct emu_statx sx;
+	size_t i;
+	int j;
+
+	if (ls->need_stat) {
+		for (i = 0; i < ls->nents; i++) {
+			memset(&ls->ents[i].mtime, 0, sizeof(struct timespec));
+			ls->ents[i].size = 0;
+		}
+		sx.dirfd = ls->dirfd;
+		sx.mask = STATX_MTIME | STATX_SIZE;
+		sx.n = ls->nents;
+		sx.name = emu_list_stat_name;
+		sx.done = emu_list_stat_done;
+		sx.arg = ls;
+		emu_statx_run(&sx);
+	}
+	if (ls->need_conf)
+		emu_pool_run(ls->nents, emu_list_worker, ls);
+
+	for (i = 0; i < ls->nents; i++) {
+		e = &ls->ents[i];
+		if (ls->format == EMU_LIST_JSON)
+			putc_unlocked('{', ls->out);
+
+		for (j = 0; j < ls->nfields; j++) {
+			if (j)
+				putc_unlocked(ls->format == EMU_LIST_JSON ?
+					      ',' : '\t', ls->out);
+			if (ls->format == EMU_LIST_JSON)
+				fprintf(ls->out, "\"%s\":",
+					emu_list_names[ls->fields[j]]);
+
+			switch (ls->fields[j]) {
+			case EMU_FIELD_NAME:
+				emu_list_string(ls, e->name);
+				break;
+			case EMU_FIELD_MACHINE:
+				emu_list_string(ls, e->meta.machine);
+				break;
+			case EMU_FIELD_CPU:
+				emu_list_string(ls, e->meta.cpu);
+				break;
+			case EMU_FIELD_MEM:
+				emu_list_string(ls, e->meta.mem);
+				break;
+			case EMU_FIELD_MTIME:
+				fprintf(ls->out, "%lld.%09ld",
+					(long long)e->mtime.tv_sec,
+					e->mtime.tv_nsec);
+				break;
+			case EMU_FIELD_SIZE:
+				fprintf(ls->out, "%llu",
+					(unsigned long long)e->size);
+				break;
+			}
+		}
+
+		if (ls->format == EMU_LIST_JSON)
+			putc_unlocked('}', ls->out);
+		putc_unlocked('\n', ls->out);
+	}
+
+	ls->nents = 0;
+}
+
+/* flush of emu_scan_walk(...), a round at a time as well. */
+static int emu_list_collect(void *arg, struct emu_scan *found)
+{
+	struct emu_list *ls;
+	size_t i;
+
+	ls = arg;
+	for (i = 0; i < found->nents; i++) {
+		memcpy(ls->ents[ls->nents].name, emu_scan_name(found, i),
+		       found->ents[i].name_len + 1);
+		if (++ls->nents == EMU_LIST_BATCH)
+			emu_list_flush(ls);
+	}
+
+	return (0);
+}
+
+/* Parse the fields of --fields, like "name,machine". Returns -1 if
+   there's an unknown one. */
+static int emu_list_fields(struct emu_list *ls, const char *fields)
+{
+	const char *p, *end;
+	size_t len;
+	int i;
+
+	ls->nfields = 0;
+	for (p = fields; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
+		len = (size_t)(end - p);
+
+		for (i = 0; i < EMU_FIELDS; i++)
+			if (strlen(emu_list_names[i]) == len &&
+			    memcmp(emu_list_names[i], p, len) == 0)
+				break;
+		if (i == EMU_FIELDS || ls->nfields == EMU_FIELDS) {
+			fprintf(stderr, "emubox: unknown field: %.*s\n",
+				(int)len, p);
+			return (-1);
+		}
+
+		ls->fields[ls->nfields++] = i;
+		if (i == EMU_FIELD_MACHINE || i == EMU_FIELD_CPU ||
+		    i == EMU_FIELD_MEM)
+			ls->need_conf = 1;
+		if (i == EMU_FIELD_MTIME || i == EMU_FIELD_SIZE)
+			ls->need_stat = 1;
+		if (i == EMU_FIELD_SIZE)
+			ls->need_size = 1;
+	}
+
+	return (ls->nfields ? 0 : -1);
+}
+
+/* List every config, without the menu, as TSV or as JSON lines. With
+   emuboxd running, it's answer is the list. Without a sort order,
+   entries are written as they're read from the directory, a round at
+   a time, and nothing else is kept around. With one, the configs are
+   scanned (or come from the index) and sorted first. The configs of
+   a round are read on a pool of workers, and everything goes through
+   a large buffer. Returns EXIT_FAILURE if the directory couldn't be
+   listed. */
+static int emu_list_configs(int format, const char *fields, int sort)
+{
+	struct emu_list ls;
+	struct emu_scan scan, stamps;
+	struct dirent *den;
+	size_t *rank, *order, i;
+	const char *args[4];
+	char *buf, *path, fmt[16], order_by[16];
+	DIR *dir;
+	int fd, ret, type;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.format = format;
+	ls.out = stdout;
+	if (emu_list_fields(&ls, fields ? fields : "name") == -1)
+		return (EXIT_FAILURE);
+
+	/* emuboxd has all of it already, it's the same output. */
+	fd = emu_daemon_connect();
+	if (fd != -1) {
+		snprintf(fmt, sizeof(fmt), "%d", format);
+		snprintf(order_by, sizeof(order_by), "%d", sort);
+		args[0] = "list";
+		args[1] = fmt;
+		args[2] = fields ? fields : "name";
+		args[3] = order_by;
+		ret = emu_daemon_request(fd, args, 4) == 0 ?
+			emu_daemon_copy(fd) : -1;
+		close(fd);
+		if (ret == -1) {
+			warn("emuboxd");
+			return (EXIT_FAILURE);
+		}
+		return (EXIT_SUCCESS);
+	}
+
+	ls.dirfd = emu_open_directory();
+	if (ls.dirfd == -1)
+		return (EXIT_FAILURE);
+
+	ls.ents = malloc(EMU_LIST_BATCH * sizeof(struct emu_list_ent));
+	buf = malloc(EMU_LIST_BUFSZ);
+	if (ls.ents == NULL || buf == NULL)
+		err(EXIT_FAILURE, "malloc");
+	setvbuf(stdout, buf, _IOFBF, EMU_LIST_BUFSZ);
+
+	if (sort < 0) {
+		fd = openat(ls.dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		dir = fd != -1 ? fdopendir(fd) : NULL;
+		if (dir == NULL) {
+			warn("opendir");
+			if (fd != -1)
+				close(fd);
+			goto fail;
+		}
+
+		/* The same rules as the scanner. */
+		memset(&scan, 0, sizeof(scan));
+		while ((den = readdir(dir)) != NULL) {
+			if (den->d_name[0] == '.')
+				continue;
+			type = emu_scan_type(fd, den);
+			if (type == DT_DIR)
+				emu_scan_push(&scan, den->d_name,
+					      strlen(den->d_name));
+			if (type != DT_REG)
+				continue;
+			memcpy(ls.ents[ls.nents].name, den->d_name,
+			       strlen(den->d_name) + 1);
+			if (++ls.nents == EMU_LIST_BATCH)
+				emu_list_flush(&ls);
+		}
+		emu_list_flush(&ls);
+		closedir(dir);
+
+		/* The VMs below, in the order they're walked. */
+		memset(&stamps, 0, sizeof(stamps));
+		emu_scan_roots(ls.dirfd, &scan, &stamps);
+		emu_scan_walk(ls.dirfd, &scan, emu_list_collect, &ls);
+		emu_list_flush(&ls);
+		emu_scan_free(&stamps);
+		emu_scan_free(&scan);
+	} else {
+		path = emu_get_directory();
+		if (path == NULL || emu_scan_load(&scan, path, NULL) == -1) {
+			fputs("emubox: missing config directory.\n", stderr);
+			free(path);
+			goto fail;
+		}
+		free(path);
+
+		/* The rank is the position of every entry, invert it. */
+		rank = emu_scan_rank(&scan, ls.dirfd, sort);
+		order = malloc((scan.nents + 1) * sizeof(size_t));
+		if (order == NULL)
+			err(EXIT_FAILURE, "malloc");
+		for (i = 0; i < scan.nents; i++)
+			order[rank ? rank[i] : i] = i;
+
+		for (i = 0; i < scan.nents; i++) {
+			memcpy(ls.ents[ls.nents].name,
+			       emu_scan_name(&scan, order[i]),
+			       scan.ents[order[i]].name_len + 1);
+			if (++ls.nents == EMU_LIST_BATCH)
+				emu_list_flush(&ls);
+		}
+		emu_list_flush(&ls);
+
+		free(order);
+		free(rank);
+		emu_scan_free(&scan);
+	}
+
+	fflush(stdout);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	free(buf);
+	free(ls.ents);
+	close(ls.dirfd);
+	return (EXIT_SUCCESS);
+
+fail:
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	free(buf);
+	free(ls.ents);
+	close(ls.dirfd);
+	return (EXIT_FAILURE);
+}
+
+/* Path of a file of emuboxd, inside EMU_STATE_DIR. Binding (and
+   removing) the socket right in the config directory would change it,
+   and the index with it. Returns -1 if there's no $HOME, or if it
+   doesn't fit in buf. */
+static int emu_daemon_path(char *buf, size_t sz, const char *name)
+{
+	char *env;
+
+	env = getenv("HOME");
+	if (env == NULL ||
+	    snprintf(buf, sz, "%s/.emubox/" EMU_STATE_DIR "/%s", env,
+		     name) >= (int)sz)
+		return (-1);
+
+	return (0);
+}
+
+/* Connect to emuboxd, without a word if it's not there. Returns the
+   socket, or -1 if it isn't running. */
+static int emu_daemon_connect(void)
+{
+	struct sockaddr_un sa;
+	int fd;
 
-	env = getenv("HOME");
-	if (env == NULL) {
-	        fputs("emubox: "
-		      "$HOME environment variable is not set.\n",
-		      stderr);
-		exit(EXIT_FAILURE);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (emu_daemon_path(sa.sun_path, sizeof(sa.sun_path),
+			    EMU_DAEMON_SOCK) == -1)
+		return (-1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return (-1);
+
+	if (connect(fd, (const struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		close(fd);
+		return (-1);
 	}
 
-	/* Length of $HOME and "/.emubox". */ 
-	sz = strlen(env) + (size_t)9;
-	p = calloc(sz, sizeof(char));
-	if (p == NULL)
-		err(EXIT_FAILURE, "calloc");
+	return (fd);
+}
 
-	snprintf(p, sz, "%s/.emubox", env);
+/* Write all of buf, a peer that went away is an error and not a
+   SIGPIPE. Returns -1 if it couldn't be written. */
+static int emu_daemon_send(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
 
-	if (mkdir(p, 0700) == -1) {
-		if (errno == EEXIST)
-		        fputs("emubox: "
-			      "emubox config directory already exists.\n",
-			      stderr);
-		else
-		        warn("mkdir");
-		free(p);
-		exit(EXIT_FAILURE);
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+
+		buf += n;
+		len -= (size_t)n;
 	}
 
-	fputs("emubox: done: "
-	      "emubox directory has been created.\n",
-	      stdout);
-	free(p);
+	return (0);
 }
 
-/* Get the absolute path of ".emubox" directory. */
-static char *emu_get_directory(void)
+/* Send a request to emuboxd. A request is it's arguments, one after
+   the other and each one NUL terminated, which ends where the client
+   stops writing. Everything up to EOF is the answer. */
+static int emu_daemon_request(int fd, const char *const *args, size_t n)
 {
-	char *env, *p;
-	struct stat st;
-	size_t sz;
+	size_t i;
 
-	env = getenv("HOME");
-	if (env == NULL) {
-	        fputs("emubox: "
-		      "$HOME environment variable is not set.\n",
-		      stderr);
-	        return (NULL);
+	for (i = 0; i < n; i++)
+		if (emu_daemon_send(fd, args[i], strlen(args[i]) + 1) == -1)
+			return (-1);
+
+	return (shutdown(fd, SHUT_WR));
+}
+
+/* Read everything up to EOF, no more than max bytes of it. The buffer
+   is NUL terminated. Returns NULL if it couldn't be read. */
+static char *emu_daemon_recv(int fd, size_t max, size_t *len)
+{
+	size_t cap;
+	ssize_t n;
+	char *buf, *p;
+
+	cap = 4096;
+	buf = malloc(cap);
+	if (buf == NULL)
+		err(EXIT_FAILURE, "malloc");
+
+	*len = 0;
+	for (;;) {
+		if (*len + (size_t)1 == cap) {
+			if (cap > max) {
+				free(buf);
+				errno = EMSGSIZE;
+				return (NULL);
+			}
+
+			cap *= (size_t)2;
+			p = realloc(buf, cap);
+			if (p == NULL)
+				err(EXIT_FAILURE, "realloc");
+			buf = p;
+		}
+
+		n = read(fd, buf + *len, cap - *len - (size_t)1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return (NULL);
+		}
+		if (n == 0)
+			break;
+		*len += (size_t)n;
 	}
 
-	/* Length of $HOME and "/.emubox". */ 
-	sz = strlen(env) + (size_t)9;
-	p = calloc(sz, sizeof(char));
-	if (p == NULL)
-	        err(EXIT_FAILURE, "calloc");
+	buf[*len] = '\0';
+	return (buf);
+}
 
-	snprintf(p, sz, "%s/.emubox/", env);
-	if (stat(p, &st) == -1) {
-		fputs("emubox: config directory wasn't found.\n",
-		      stderr);
-		free(p);
-		return (NULL);
+/* Copy the answer of emuboxd to stdout, as it comes. Returns -1 if
+   it couldn't be read or written. */
+static int emu_daemon_copy(int fd)
+{
+	char buf[65536];
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+
+		if (fwrite(buf, 1, (size_t)n, stdout) != (size_t)n)
+			return (-1);
 	}
 
-        return (p);
+	return (fflush(stdout) == EOF ? -1 : 0);
 }
 
-/* Retrieve information about the file name, column,
-   and largest rows length. */
-static void emu_content_len(struct content_len_info *clinfo)
+/* Get the entry table of --select from emuboxd, it's names come in
+   order already. Returns -1 if it isn't running. */
+static int emu_daemon_names(struct emu_scan *scan)
 {
-	char *path;
-	DIR *dir;
-	struct dirent *den;
-        size_t tsz;
+	static const char *args[] = { "names" };
+	size_t len;
+	char *buf, *p;
+	int fd;
 
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
-	
-        dir = opendir(path);
-	if (dir == NULL) {
-		free(path);
-		err(EXIT_FAILURE, "opendir");
+	fd = emu_daemon_connect();
+	if (fd == -1)
+		return (-1);
+
+	buf = NULL;
+	if (emu_daemon_request(fd, args, 1) == 0)
+		buf = emu_daemon_recv(fd, SIZE_MAX, &len);
+	close(fd);
+	if (buf == NULL)
+		return (-1);
+
+	memset(scan, 0, sizeof(struct emu_scan));
+	for (p = buf; p < buf + len; p += strlen(p) + 1)
+		emu_scan_push(scan, p, strlen(p));
+
+	free(buf);
+	return (0);
+}
+
+/* Have emuboxd start the VMs of names, it looks after them once
+   emubox is gone. Returns EXIT_FAILURE if any of them couldn't be
+   started, or -1 if emuboxd isn't running (anymore). */
+static int emu_daemon_start(const char **names, size_t n, const char *lang,
+			    int is_fullscreen)
+{
+	const char **args;
+	size_t i, len;
+	char *buf, *p, *end;
+	long pid;
+	int fd, status;
+
+	fd = emu_daemon_connect();
+	if (fd == -1)
+		return (-1);
+
+	args = malloc((n + (size_t)3) * sizeof(char *));
+	if (args == NULL)
+		err(EXIT_FAILURE, "malloc");
+	args[0] = "launch";
+	args[1] = is_fullscreen ? "1" : "0";
+	args[2] = lang ? lang : "";
+	for (i = 0; i < n; i++)
+		args[i + 3] = names[i];
+
+	buf = NULL;
+	if (emu_daemon_request(fd, args, n + (size_t)3) == 0)
+		buf = emu_daemon_recv(fd, SIZE_MAX, &len);
+	close(fd);
+	free(args);
+	if (buf == NULL || len == 0) {
+		fputs("emubox: emuboxd didn't answer.\n", stderr);
+		free(buf);
+		return (EXIT_FAILURE);
 	}
 
-        tsz = clinfo->name_sz = clinfo->column_sz = clinfo->row_sz = (size_t)0;
-	while ((den = readdir(dir)) != NULL) {
-		if (strcmp(den->d_name, ".") == 0 ||
-		    strcmp(den->d_name, "..") == 0)
+	/* A "<pid>\t<config>" line for every one of them. */
+	status = EXIT_SUCCESS;
+	for (p = buf; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, '\n');
+		if (end == NULL)
+			end = p + strlen(p);
+		*end = '\0';
+
+		pid = strtol(p, &p, 10);
+		if (*p == '\t')
+			p++;
+		if (pid > 0) {
+			fprintf(stdout, "emubox: using config: %s "
+				"(pid %ld, watched by emuboxd)\n", p, pid);
+		} else {
+			fprintf(stderr, "emubox: config \"%s\" couldn't be "
+				"started by emuboxd.\n", p);
+			status = EXIT_FAILURE;
+		}
+	}
+
+	free(buf);
+	return (status);
+}
+
+/* List the VMs emuboxd is looking after, with their pid and when
+   they were started, like --list does. Returns EXIT_FAILURE if it
+   isn't running. */
+static int emu_daemon_vms(int format)
+{
+	const char *args[2];
+	char fmt[16];
+	int fd, ret;
+
+	fd = emu_daemon_connect();
+	if (fd == -1) {
+		fputs("emubox: emuboxd isn't running.\n", stderr);
+		return (EXIT_FAILURE);
+	}
+
+	snprintf(fmt, sizeof(fmt), "%d", format);
+	args[0] = "vms";
+	args[1] = fmt;
+	ret = emu_daemon_request(fd, args, 2) == 0 ? emu_daemon_copy(fd) : -1;
+	close(fd);
+	if (ret == -1) {
+		warn("emuboxd");
+		return (EXIT_FAILURE);
+	}
+
+	return (EXIT_SUCCESS);
+}
+
+/* Keep what's been read of a round of entries, idx tells where every
+   one of them is in the entry table. */
+static void emu_daemon_store(struct emu_daemon *d, struct emu_list *ls,
+			     const size_t *idx)
+{
+	const struct emu_meta *m;
+	size_t i, l0, l1, l2;
+	char *p;
+
+	emu_pool_run(ls->nents, emu_list_worker, ls);
+	for (i = 0; i < ls->nents; i++) {
+		m = &ls->ents[i].meta;
+		l0 = strlen(m->machine) + (size_t)1;
+		l1 = strlen(m->cpu) + (size_t)1;
+		l2 = strlen(m->mem) + (size_t)1;
+		p = malloc(l0 + l1 + l2);
+		if (p == NULL)
+			err(EXIT_FAILURE, "malloc");
+
+		memcpy(p, m->machine, l0);
+		memcpy(p + l0, m->cpu, l1);
+		memcpy(p + l0 + l1, m->mem, l2);
+		d->meta[idx[i]] = p;
+	}
+
+	ls->nents = 0;
+}
+
+/* Read every entry that hasn't been read yet, a round at a time on
+   the pool, the same way --list does. */
+static void emu_daemon_read(struct emu_daemon *d)
+{
+	size_t idx[EMU_LIST_BATCH], i;
+	struct emu_list ls;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.dirfd = d->dirfd;
+	ls.need_conf = 1;
+	ls.ents = d->batch;
+	for (i = 0; i < d->scan.nents; i++) {
+		if (d->meta[i])
 			continue;
 
-		/* Only normal files are allowed. */
-		if (den->d_type == DT_REG) {
-			tsz = strlen(den->d_name);
-			if (tsz > clinfo->row_sz)
-				clinfo->row_sz = tsz;
-
-			clinfo->name_sz += tsz;
-		        /* Column size, no bigger than 10 and
-			   only increase it's value if it's
-			   smaller than that. */
-			if (clinfo->column_sz < (size_t)10)
-				clinfo->column_sz += (size_t)1;
-		}
-        }
+		memcpy(ls.ents[ls.nents].name, emu_scan_name(&d->scan, i),
+		       d->scan.ents[i].name_len + 1);
+		idx[ls.nents] = i;
+		if (++ls.nents == EMU_LIST_BATCH)
+			emu_daemon_store(d, &ls, idx);
+	}
 
-	clinfo->column_sz += (size_t)5;
-	clinfo->row_sz += (size_t)13;
-        closedir(dir);
-	free(path);
+	if (ls.nents)
+		emu_daemon_store(d, &ls, idx);
 }
 
-/* Creates a (n)curses based menu to select the choice. */
-static void emu_select_list(const char *lang, int is_fullscreen, int is_settings)
+/* Apply a single change of the config directory. The metadata moves
+   along with the entries, a config that has been written to is read
+   again later. */
+static void emu_daemon_change(struct emu_daemon *d, const char *name,
+			      uint32_t mask)
 {
-	DIR *dir;
-	struct dirent *den;
-	char *path, **arr, *base, *p;
-	int pre_idx, new_idx, run_idx,
-		tmp_idx, ch, end_page,
-		xs, xw;
-	size_t sz, isz;
-	WINDOW *win;
-	struct content_len_info clinfo;
 	struct stat st;
+	size_t pos, cap;
+	char **p;
+	int found;
+
+	found = emu_scan_find(&d->scan, name, &pos);
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		if (found == 0)
+			return;
+
+		free(d->meta[pos]);
+		memmove(&d->meta[pos], &d->meta[pos + 1],
+			(d->scan.nents - pos - 1) * sizeof(char *));
+		emu_scan_remove(&d->scan, name);
+		return;
+	}
 
-	tmp_idx = -1;
-	pre_idx = new_idx = run_idx = 0;
+	if (fstatat(d->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+	    !S_ISREG(st.st_mode))
+		return;
 
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
+	if (found) {
+		d->scan.ents[pos].mtime = st.st_mtim;
+		if ((mask & IN_ATTRIB) == 0) {
+			free(d->meta[pos]);
+			d->meta[pos] = NULL;
+		}
+		return;
+	}
 
-	dir = opendir(path);
-	if (dir == NULL) {
-	        fputs("emubox: missing config directory.\n",
-		      stderr);
-		free(path);
-	        exit(EXIT_FAILURE);
+	if (d->scan.nents + (size_t)1 >= d->meta_cap) {
+		cap = d->meta_cap * (size_t)2;
+		p = realloc(d->meta, cap * sizeof(char *));
+		if (p == NULL)
+			err(EXIT_FAILURE, "realloc");
+		d->meta = p;
+		d->meta_cap = cap;
 	}
-        emu_content_len(&clinfo);
 
-        arr = calloc((size_t)clinfo.name_sz + 1, sizeof(char *));
-	if (arr == NULL) {
-	        free(path);
-		closedir(dir);
+	emu_scan_insert(&d->scan, name, &st.st_mtim);
+	memmove(&d->meta[pos + 1], &d->meta[pos],
+		(d->scan.nents - pos - 1) * sizeof(char *));
+	d->meta[pos] = NULL;
+}
+
+/* Take every VM below the directory dir out, that's gone. */
+static void emu_daemon_gone(struct emu_daemon *d, const char *dir)
+{
+	size_t i, j, len;
+	const char *name;
+
+	len = strlen(dir);
+	for (i = 0, j = 0; i < d->scan.nents; i++) {
+		name = emu_scan_name(&d->scan, i);
+		if (d->scan.ents[i].name_len > len && name[len] == '/' &&
+		    memcmp(name, dir, len) == 0) {
+			free(d->meta[i]);
+			continue;
+		}
+		d->meta[j++] = d->meta[i];
+	}
+	emu_scan_remove_below(&d->scan, dir);
+}
+
+/* Scan and read everything again. */
+static void emu_daemon_rescan(struct emu_daemon *d)
+{
+	struct emu_scan scan;
+	size_t i;
+	char **meta;
+
+	if (emu_scan_tree(&scan, d->dirfd) == -1)
+		return;
+	emu_scan_sort(&scan);
+	emu_scan_stamp(&scan, d->dirfd);
+
+	meta = calloc(scan.nents + (size_t)1, sizeof(char *));
+	if (meta == NULL)
 		err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < d->scan.nents; i++)
+		free(d->meta[i]);
+	free(d->meta);
+	d->meta = meta;
+	d->meta_cap = scan.nents + (size_t)1;
+	emu_scan_free(&d->scan);
+	d->scan = scan;
+	emu_watch_dirs(&d->watch, &d->scan);
+}
+
+/* Follow the changes of the config directory, like the menu does. If
+   the kernel had to drop events (or the roots have changed),
+   everything is scanned and read again. Removed names are left in
+   the arena, until most of it is garbage. */
+static void emu_daemon_watch(struct emu_daemon *d)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char name[PATH_MAX];
+	const struct inotify_event *ev;
+	struct emu_scan scan;
+	size_t i;
+	ssize_t n;
+	char *p;
+	int rescan;
+
+	rescan = 0;
+	while ((n = read(d->watch.fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + n;
+		     p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			switch (emu_watch_event(&d->watch, ev, name)) {
+			case EMU_WATCH_RESCAN:
+				rescan = 1;
+				break;
+
+			case EMU_WATCH_DIR:
+				if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					emu_daemon_gone(d, name);
+					break;
+				}
+				emu_watch_walk(&d->watch, d->dirfd, name,
+					       &scan);
+				for (i = 0; i < scan.nents; i++)
+					emu_daemon_change(d,
+							  emu_scan_name(&scan, i),
+							  IN_CREATE);
+				emu_scan_free(&scan);
+				break;
+
+			case EMU_WATCH_ENTRY:
+				emu_daemon_change(d, name, ev->mask);
+				break;
+			}
+		}
 	}
 
-	while ((den = readdir(dir)) != NULL) {
-		if (strcmp(den->d_name, ".") == 0 ||
-		    strcmp(den->d_name, "..") == 0)
+	if (rescan)
+		emu_daemon_rescan(d);
+
+	if (d->scan.arena_sz > (size_t)65536 &&
+	    d->scan.arena_sz > (d->scan.name_sz + d->scan.nents) * (size_t)2) {
+		memset(&scan, 0, sizeof(scan));
+		for (i = 0; i < d->scan.nents; i++) {
+			emu_scan_push(&scan, emu_scan_name(&d->scan, i),
+				      d->scan.ents[i].name_len);
+			scan.ents[i].mtime = d->scan.ents[i].mtime;
+		}
+		emu_scan_free(&d->scan);
+		d->scan = scan;
+	}
+
+	emu_daemon_read(d);
+}
+
+/* Answer a list request, the same as --list would write. Nothing is
+   read, except for the history when it's sorted by the launches, and
+   the sizes, which aren't kept, when they're asked for. */
+static void emu_daemon_list(struct emu_daemon *d, FILE *out, int format,
+			    const char *fields, int sort)
+{
+	struct emu_list_ent *e;
+	struct emu_list ls;
+	size_t *rank, *order, i, k;
+	const char *m;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.format = format == EMU_LIST_JSON ? EMU_LIST_JSON : EMU_LIST_TSV;
+	ls.out = out;
+	if (emu_list_fields(&ls, fields) == -1)
+		return;
+	ls.dirfd = d->dirfd;
+	ls.need_conf = 0;
+	ls.need_stat = ls.need_size;
+	ls.ents = d->batch;
+
+	if (sort < 0 || sort >= EMU_SORT_MODES)
+		sort = EMU_SORT_NAME;
+	rank = emu_scan_rank(&d->scan, sort == EMU_SORT_LAUNCHED ||
+			     sort == EMU_SORT_FRECENCY ? d->dirfd : -1, sort);
+	order = malloc((d->scan.nents + 1) * sizeof(size_t));
+	if (order == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (i = 0; i < d->scan.nents; i++)
+		order[rank ? rank[i] : i] = i;
+
+	for (i = 0; i < d->scan.nents; i++) {
+		k = order[i];
+		e = &ls.ents[ls.nents];
+		memcpy(e->name, emu_scan_name(&d->scan, k),
+		       d->scan.ents[k].name_len + 1);
+		e->mtime = d->scan.ents[k].mtime;
+
+		m = d->meta[k] ? d->meta[k] : "\0\0";
+		snprintf(e->meta.machine, sizeof(e->meta.machine), "%s", m);
+		m += strlen(m) + 1;
+		snprintf(e->meta.cpu, sizeof(e->meta.cpu), "%s", m);
+		m += strlen(m) + 1;
+		snprintf(e->meta.mem, sizeof(e->meta.mem), "%s", m);
+
+		if (++ls.nents == EMU_LIST_BATCH)
+			emu_list_flush(&ls);
+	}
+	emu_list_flush(&ls);
+
+	free(order);
+	free(rank);
+}
+
+/* Start the configs of a launch request, the way --select does (with
+   their launch properties). args is the fullscreen flag, the language
+   (or nothing) and the configs. Every one of them is answered with
+   the pid of it's VM, or -1 if it couldn't be started. */
+static void emu_daemon_launch(struct emu_daemon *d, FILE *out, char **args,
+			      size_t n)
+{
+	struct emu_props *props;
+	struct emu_emulators reg;
+	struct epoll_event ev;
+	struct emu_vm *vm;
+	const char *lang, *bin;
+	char p[PATH_MAX];
+	size_t i, m, pos;
+	int is_fullscreen, log;
+	pid_t pid;
+
+	if (n < (size_t)2)
+		return;
+	is_fullscreen = strcmp(args[0], "1") == 0;
+	lang = args[1][0] ? args[1] : NULL;
+
+	/* Only configs it knows of, the VMs below the directory and the
+	   roots included, and none that's anywhere else. */
+	for (i = 2, m = 2; i < n; i++) {
+		if (emu_scan_find(&d->scan, args[i], &pos)) {
+			args[m++] = args[i];
 			continue;
+		}
 
-		/* Only normal files are allowed. */
-		if (den->d_type == DT_REG) {			
-			sz = strlen(den->d_name);
-			arr[pre_idx] = calloc(sz + 1, sizeof(char));
-			if (arr[pre_idx] == NULL) {
-			        free(path);
-				free(arr);
-				closedir(dir);
-			        err(EXIT_FAILURE, "calloc");
-			}
+		fprintf(stderr, "emubox: config \"%s\" does not exists.\n",
+			args[i]);
+		fprintf(out, "-1\t%s\n", args[i]);
+	}
 
-			/* Append to the array. */
-			memcpy(arr[pre_idx] + strlen(arr[pre_idx]),
-			       den->d_name, sz);
-		        pre_idx++;
+	props = calloc(m, sizeof(struct emu_props));
+	if (props == NULL)
+		err(EXIT_FAILURE, "calloc");
+	for (i = 2; i < m; i++)
+		emu_props_load(d->path, args[i], &props[i - 2]);
+	emu_props_assign(props, m - 2);
+
+	memset(&reg, 0, sizeof(reg));
+	for (i = 2; i < m; i++) {
+		/* Read again for every request, a build may have been
+		   added since. That's the cache unless it's stale. */
+		bin = d->bin;
+		if (props[i - 2].emulator[0]) {
+			if (reg.ents == NULL)
+				emu_emulators_load(&reg, 0);
+			bin = emu_emulator_bin(&reg, args[i],
+					       props[i - 2].emulator, d->bin);
 		}
-        }
 
-	/* There are no config files to list. */
-	if (pre_idx == 0) {
-		fputs("emubox: no configs are available.\n",
-		      stderr);
-		goto out_cleanup;
-        }
+		emu_config_path(d->path, args[i], p, sizeof(p));
+		log = -1;
+		pid = bin ? emu_launch_box(bin, p, lang, is_fullscreen,
+					   &props[i - 2], &log) : (pid_t)-1;
+		fprintf(out, "%d\t%s\n", (int)pid, args[i]);
+		if (pid == (pid_t)-1)
+			continue;
 
-	/* Sort the array. */
-	qsort(arr, pre_idx, sizeof(char *), qsort_compare);
+		if (d->nvms == d->vms_cap) {
+			d->vms_cap = d->vms_cap ? d->vms_cap * (size_t)2 :
+				(size_t)16;
+			vm = realloc(d->vms, d->vms_cap * sizeof(struct emu_vm));
+			if (vm == NULL)
+				err(EXIT_FAILURE, "realloc");
+			d->vms = vm;
+		}
 
-	/* Initialize ncurses and setup the window. */
-	initscr();
-        raw();
-	noecho();
-	keypad(stdscr, TRUE);
-	curs_set(FALSE);
-        win = newwin(clinfo.column_sz, clinfo.row_sz, 0, 0);
-        wrefresh(win);
-	keypad(win, TRUE);
+		vm = &d->vms[d->nvms++];
+		memset(vm, 0, sizeof(struct emu_vm));
+		snprintf(vm->name, sizeof(vm->name), "%s", args[i]);
+		vm->pid = pid;
+		vm->pidfd = -1;
+		vm->cgroup = -1;
+		vm->started = time(NULL);
+		vm->log.fd = log;
+
+#ifdef SYS_pidfd_open
+		vm->pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+		ev.events = EPOLLIN;
+		ev.data.u64 = (uint64_t)pid;
+		if (vm->pidfd != -1 &&
+		    epoll_ctl(d->ep, EPOLL_CTL_ADD, vm->pidfd, &ev) == -1) {
+			close(vm->pidfd);
+			vm->pidfd = -1;
+		}
+		ev.data.u64 = EMU_DAEMON_LOG | (uint64_t)pid;
+		if (vm->log.fd != -1 &&
+		    epoll_ctl(d->ep, EPOLL_CTL_ADD, vm->log.fd, &ev) == -1)
+			emu_log_close(&vm->log);
+
+		emu_history_add(d->path, vm->name);
+		fprintf(stdout, "emubox: %s: started as pid %d\n",
+			vm->name, (int)pid);
+	}
+
+	emu_emulators_free(&reg);
+	free(props);
+}
+
+/* Answer a vms request, the table of running VMs. */
+static void emu_daemon_table(struct emu_daemon *d, FILE *out, int format)
+{
+	struct emu_list ls;
+	size_t i;
+
+	memset(&ls, 0, sizeof(ls));
+	ls.format = format == EMU_LIST_JSON ? EMU_LIST_JSON : EMU_LIST_TSV;
+	ls.out = out;
+	for (i = 0; i < d->nvms; i++) {
+		if (ls.format == EMU_LIST_JSON)
+			fputs("{\"name\":", out);
+		emu_list_string(&ls, d->vms[i].name);
+		fprintf(out, ls.format == EMU_LIST_JSON ?
+			",\"pid\":%d,\"started\":%lld}\n" : "\t%d\t%lld\n",
+			(int)d->vms[i].pid, (long long)d->vms[i].started);
+	}
+}
+
+/* Save the output of a VM that went away, tell how it did, and forget
+   about it. */
+static void emu_daemon_reap(struct emu_daemon *d, size_t i, int status)
+{
+	emu_log_read(&d->vms[i].log);
+	emu_log_save(&d->vms[i], 1, status);
+	emu_log_close(&d->vms[i].log);
+	(void)emu_supervise_report(&d->vms[i], status);
+	if (d->vms[i].pidfd != -1)
+		close(d->vms[i].pidfd);
+
+	d->nvms--;
+	memmove(&d->vms[i], &d->vms[i + 1],
+		(d->nvms - i) * sizeof(struct emu_vm));
+}
+
+/* Answer a single client. Clients are answered one at a time, every
+   answer is made in memory first and only then sent, and none of them
+   can hold emuboxd up for more than a few seconds. */
+static void emu_daemon_client(struct emu_daemon *d, int fd)
+{
+	struct timeval tv;
+	struct ucred cred;
+	socklen_t len;
+	size_t reqlen, sz, i, n;
+	char *req, *buf, *p, **args;
+	FILE *out;
+
+	/* The directory keeps everyone else out already. */
+	len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+	    cred.uid != geteuid())
+		return;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	tv.tv_sec = 5;
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	req = emu_daemon_recv(fd, EMU_DAEMON_REQ_MAX, &reqlen);
+	if (req == NULL || reqlen == 0 || req[reqlen - 1] != '\0') {
+		free(req);
+		return;
+	}
+
+	for (i = 0, n = 0; i < reqlen; i++)
+		if (req[i] == '\0')
+			n++;
+	args = malloc(n * sizeof(char *));
+	if (args == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (p = req, n = 0; p < req + reqlen; p += strlen(p) + 1)
+		args[n++] = p;
+
+	buf = NULL;
+	sz = 0;
+	out = open_memstream(&buf, &sz);
+	if (out == NULL) {
+		warn("open_memstream");
+		goto out_free;
+	}
+
+	if (strcmp(args[0], "list") == 0 && n == 4) {
+		emu_daemon_list(d, out, (int)strtol(args[1], NULL, 10),
+				args[2], (int)strtol(args[3], NULL, 10));
+	} else if (strcmp(args[0], "names") == 0) {
+		for (i = 0; i < d->scan.nents; i++)
+			fwrite(emu_scan_name(&d->scan, i), 1,
+			       d->scan.ents[i].name_len + 1, out);
+	} else if (strcmp(args[0], "launch") == 0) {
+		emu_daemon_launch(d, out, args + 1, n - 1);
+	} else if (strcmp(args[0], "vms") == 0 && n == 2) {
+		emu_daemon_table(d, out, (int)strtol(args[1], NULL, 10));
+	} else {
+		fprintf(stderr, "emubox: unknown request: %s\n", args[0]);
+	}
+
+	if (fclose(out) == 0 && emu_daemon_send(fd, buf, sz) == -1)
+		warn("emuboxd: send");
+	free(buf);
+
+out_free:
+	free(args);
+	free(req);
+}
+
+/* Run emuboxd in the foreground, until it gets a signal. It holds the
+   sorted entry table, what --list shows of every config and the VMs
+   it has started, so --select, --list and --vms are answered with a
+   single round trip over it's socket, without any of them looking at
+   the config directory. The VMs are left running when it goes away.
+   Returns EXIT_FAILURE if it couldn't be started. */
+static int emu_daemon_run(const char *bin)
+{
+	struct epoll_event ev, evs[16];
+	struct emu_daemon d;
+	struct sockaddr_un sa;
+	struct sigaction sig;
+	char lock[PATH_MAX];
+	size_t i;
+	pid_t pid;
+	int lockfd, wake[2], ret, nev, j, fd, status, timeout;
+	memset(&d, 0, sizeof(d));
+	d.dirfd = d.watch.fd = d.lfd = d.ep = -1;
+	d.bin = bin;
+	d.path = emu_get_directory();
+	if (d.path == NULL)
+		return (EXIT_FAILURE);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (emu_daemon_path(sa.sun_path, sizeof(sa.sun_path),
+			    EMU_DAEMON_SOCK) == -1 ||
+	    emu_daemon_path(lock, sizeof(lock), EMU_DAEMON_LOCK) == -1) {
+		fputs("emubox: $HOME is too long for the socket.\n", stderr);
+		free(d.path);
+		return (EXIT_FAILURE);
+	}
+
+	/* The state directory is created before the scan, the index
+	   it reads is never changed by emuboxd itself. */
+	d.dirfd = open(d.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	fd = d.dirfd != -1 ? emu_state_open(d.dirfd, 1) : -1;
+	if (fd != -1)
+		close(fd);
+
+	/* A single emuboxd at a time, the lock goes away with it. */
+	lockfd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (lockfd == -1 || flock(lockfd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK)
+			fputs("emubox: emuboxd is already running.\n", stderr);
+		else
+			warn("%s", lock);
+		if (lockfd != -1)
+			close(lockfd);
+		if (d.dirfd != -1)
+			close(d.dirfd);
+		free(d.path);
+		return (EXIT_FAILURE);
+	}
 
-	/* Temporary variables we need in the loop. */
-        xs = xw = 0;
-        end_page = 0;
-	tmp_idx = pre_idx;
+	ret = EXIT_FAILURE;
+	wake[0] = wake[1] = -1;
+	d.ep = epoll_create1(EPOLL_CLOEXEC);
+	if (d.dirfd == -1 || d.ep == -1 ||
+	    pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1) {
+		warn("emuboxd");
+		goto out_close;
+	}
+
+	/* Watch it before the scan, so nothing that changes in between
+	   is missed (and something seen twice is no harm). */
+	if (emu_watch_open(&d.watch, d.path, IN_CREATE | IN_DELETE |
+			   IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+			   IN_ATTRIB) == -1) {
+		warn("inotify_add_watch");
+		goto out_close;
+	}
+	if (emu_scan_load(&d.scan, d.path, NULL) == -1) {
+		fputs("emubox: missing config directory.\n", stderr);
+		goto out_close;
+	}
+
+	/* From here on the watch keeps the mtimes, not from before. */
+	if (d.scan.indexed)
+		emu_scan_stamp(&d.scan, d.dirfd);
+	emu_watch_dirs(&d.watch, &d.scan);
+
+	d.meta_cap = d.scan.nents + (size_t)1;
+	d.meta = calloc(d.meta_cap, sizeof(char *));
+	d.batch = malloc(EMU_LIST_BATCH * sizeof(struct emu_list_ent));
+	if (d.meta == NULL || d.batch == NULL)
+		err(EXIT_FAILURE, "malloc");
+	emu_daemon_read(&d);
+
+	/* The lock is ours, a socket that's still there is stale. */
+	(void)unlink(sa.sun_path);
+	d.lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (d.lfd == -1 ||
+	    bind(d.lfd, (const struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+	    listen(d.lfd, 64) == -1) {
+		warn("%s", sa.sun_path);
+		goto out_close;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = EMU_DAEMON_LISTEN;
+	if (epoll_ctl(d.ep, EPOLL_CTL_ADD, d.lfd, &ev) == -1)
+		goto out_epoll;
+	ev.data.u64 = EMU_DAEMON_INOTIFY;
+	if (epoll_ctl(d.ep, EPOLL_CTL_ADD, d.watch.fd, &ev) == -1)
+		goto out_epoll;
+	ev.data.u64 = EMU_DAEMON_WAKE;
+	if (epoll_ctl(d.ep, EPOLL_CTL_ADD, wake[0], &ev) == -1)
+		goto out_epoll;
+
+	/* The handlers go away with exec, unlike a blocked signal or an
+	   ignored one, so 86box starts with it's signals untouched (but
+	   for SIGPIPE, see emu_spawn_box). SIGUSR1 saves the logs. */
+	emu_wake = wake[1];
+	memset(&sig, 0, sizeof(sig));
+	sig.sa_handler = emu_wake_signal;
+	sigemptyset(&sig.sa_mask);
+	sigaction(SIGINT, &sig, NULL);
+	sigaction(SIGTERM, &sig, NULL);
+	sigaction(SIGHUP, &sig, NULL);
+	sigaction(SIGUSR1, &sig, NULL);
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	fprintf(stdout, "emubox: emuboxd: %zu configs, listening on %s\n",
+		d.scan.nents, sa.sun_path);
 
 	for (;;) {
-		wclear(win);
-		wrefresh(win);
-	        mvwprintw(win, 1, 2, "Select a config");
-		for (isz = 0; isz < clinfo.row_sz; isz++)
-			mvwprintw(win, 2, isz, "\u2500");
-	        box(win, 0, 0);
-		move(0, 0);
-
-		for (new_idx = xs; new_idx < (xs + 10); new_idx++, xw++) {
-			if (new_idx == run_idx)
-				wattron(win, A_REVERSE);
-
-			/* Check the current index'd array, whether it has a member
-			   or not. */
-			if (arr[new_idx] == NULL) {
-				end_page = 1;
-				break;
+		/* VMs without a pidfd (before Linux 5.3) are looked
+		   after once a second. */
+		timeout = -1;
+		for (i = 0; i < d.nvms;) {
+			if (d.vms[i].pidfd == -1) {
+				timeout = 1000;
+				if (waitpid(d.vms[i].pid, &status, WNOHANG) ==
+				    d.vms[i].pid) {
+					emu_daemon_reap(&d, i, status);
+					continue;
+				}
 			}
+			i++;
+		}
 
-			/* HACK: Did we exceed row size of index numbers?
-			   If yes, increase it slightly. */
+		nev = epoll_wait(d.ep, evs, 16, timeout);
+		if (nev == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("epoll_wait");
+			goto out_close;
+		}
 
-			/* If the index is below or equal to 9 (e.g. 1 to 9). */
-			if ((new_idx + 1) <= 9) {
-				mvwprintw(win, xw + 3, 4, "%d. ", new_idx + 1);
-				mvwprintw(win, xw + 3, 7, "%s", arr[new_idx]);
-			}
+		for (j = 0; j < nev; j++) {
+			switch (evs[j].data.u64) {
+			case EMU_DAEMON_LISTEN:
+				while ((fd = accept4(d.lfd, NULL, NULL,
+						     SOCK_CLOEXEC)) != -1) {
+					emu_daemon_client(&d, fd);
+					close(fd);
+				}
+				break;
+
+			case EMU_DAEMON_INOTIFY:
+				emu_daemon_watch(&d);
+				break;
+
+			case EMU_DAEMON_WAKE:
+				/* SIGUSR1 only asks for the logs. */
+				if (emu_wake_take(wake[0]) == EMU_WAKE_USR1) {
+					emu_log_save_all(d.vms, d.nvms);
+					break;
+				}
+				ret = EXIT_SUCCESS;
+				goto out_close;
 
-			/* If the index is higher than 9 (e.g. 9 to n). */
-			if ((new_idx + 1) > 9) {
-				mvwprintw(win, xw + 3, 3, "%d. ", new_idx + 1);
-			        mvwprintw(win, xw + 3, 7, "%s", arr[new_idx]);
+			default:
+				if (evs[j].data.u64 & EMU_DAEMON_LOG) {
+					pid = (pid_t)(evs[j].data.u64 &
+						      ~EMU_DAEMON_LOG);
+					for (i = 0; i < d.nvms; i++)
+						if (d.vms[i].pid == pid)
+							emu_log_read(&d.vms[i].log);
+					break;
+				}
+
+				/* Readable means gone, this never blocks. */
+				pid = (pid_t)evs[j].data.u64;
+				for (i = 0; i < d.nvms; i++)
+					if (d.vms[i].pid == pid)
+						break;
+				if (i < d.nvms &&
+				    waitpid(pid, &status, 0) == pid)
+					emu_daemon_reap(&d, i, status);
+				break;
 			}
+		}
+	}
+
+out_epoll:
+	warn("epoll_ctl");
+
+out_close:
+	if (d.lfd != -1) {
+		close(d.lfd);
+		(void)unlink(sa.sun_path);
+	}
+	if (ret == EXIT_SUCCESS)
+		fprintf(stdout, "emubox: emuboxd: leaving %zu VMs running\n",
+			d.nvms);
+	/* The VMs that are left running keep going without their
+	   output, what they've had so far is saved. */
+	emu_log_save_all(d.vms, d.nvms);
+	for (i = 0; i < d.nvms; i++) {
+		emu_log_close(&d.vms[i].log);
+		if (d.vms[i].pidfd != -1)
+			close(d.vms[i].pidfd);
+	}
+	for (i = 0; d.meta && i < d.scan.nents; i++)
+		free(d.meta[i]);
+	emu_wake = -1;
+	if (wake[0] != -1) {
+		close(wake[0]);
+		close(wake[1]);
+	}
+	if (d.ep != -1)
+		close(d.ep);
+	emu_watch_close(&d.watch);
+	if (d.dirfd != -1)
+		close(d.dirfd);
+	emu_scan_free(&d.scan);
+	free(d.vms);
+	free(d.batch);
+	free(d.meta);
+	free(d.path);
+	close(lockfd);
+	return (ret);
+}
 
-			/* If the index is higher than 99 (e.g. 100 to n).
-			   It also adds limits for the previous one (e.g. 9 to 99). */
-		        if ((new_idx + 1) > 99) {
-			        mvwprintw(win, xw + 3, 2, "%d. ", new_idx + 1);
-			        mvwprintw(win, xw + 3, 7, "%s", arr[new_idx]);
-			}
+/* Whether key matches one of the space separated patterns of pats, a
+   pattern ending in "*" matches anything starting with the rest. */
+static int emu_check_match(const char *pats, const char *key, size_t len)
+{
+	const char *p, *end;
+	size_t n;
+
+	for (p = pats; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, ' ');
+		if (end == NULL)
+			end = p + strlen(p);
+		n = (size_t)(end - p);
+
+		if (n && p[n - 1] == '*') {
+			if (len >= n - 1 && memcmp(key, p, n - 1) == 0)
+				return (1);
+		} else if (len == n && memcmp(key, p, n) == 0) {
+			return (1);
+		}
+	}
 
-			/* If the index is higher than 999 (e.g. 999 to n).
-			   It adds limits to the previous one (e.g. 100 to 999). */
-			if ((new_idx + 1) > 999) {
-				mvwprintw(win, xw + 3, 1, "%d. ", new_idx + 1);
-			        mvwprintw(win, xw + 3, 7, "%s", arr[new_idx]);
-			}
+	return (0);
+}
 
-			/* It will be very slow to iterate more than 9999 files.
-			   As it's also doing a qsort(), I don't think it's a
-			   viable choice to keep a space for other numbersd to
-			   fit in here. */
-			if ((new_idx + 1) > 9999) {
-				endwin();
-				fputs("emubox: out of range.\n", stderr);
-				goto out_cleanup;
-			}
+/* Add a line to the report of a config. */
+static void emu_check_say(struct emu_check_ent *e, const char *name,
+			  int is_error, const char *fmt, ...)
+{
+	va_list ap;
 
-			/* Disable selection color for others. */ 
-			if (new_idx == run_idx)
-				wattroff(win, A_REVERSE);
+	if (e->out == NULL) {
+		e->out = open_memstream(&e->report, &e->len);
+		if (e->out == NULL)
+			err(EXIT_FAILURE, "open_memstream");
+	}
 
-			/* Check the next index'd array, whether it has a member
-			   or not. */
-			if (arr[new_idx + 1] == NULL) {
-				end_page = 1;
-				break;
-			}
-		}
+	fprintf(e->out, "%s: %s: ", name, is_error ? "error" : "warning");
+	va_start(ap, fmt);
+	vfprintf(e->out, fmt, ap);
+	va_end(ap);
+	fputc('\n', e->out);
 
-		/* Reset the counter */
-		xw = 0;
+	if (is_error)
+		e->errors++;
+	else
+		e->warnings++;
+}
 
-		ch = wgetch(win);
-		switch (ch) {
-		case KEY_UP:
-			/* Decrease the index and check the limit of it. */
-			run_idx--;
-			if (run_idx < 0)
-				run_idx = 0;
-			break;
+/* Compare the extension of path, without minding the case. */
+static int emu_check_ext(const char *path, const char *ext)
+{
+	const char *p;
 
-		case KEY_DOWN:
-			/* Increase the index and check the limit of it. */
-		        run_idx++;
-			if (run_idx >= pre_idx)
-				run_idx = pre_idx - 1;
-			break;
+	p = strrchr(path, '.');
+	return (p && strcasecmp(p, ext) == 0);
+}
 
-		case KEY_RIGHT:
-			/* Go every 10 step forward. */
+/* Check a single image of a config, that it's there and that it's
+   size makes sense for what it is. Every writable image is kept, to
+   find the ones shared by more than a single VM later on. */
+static void emu_check_image(struct emu_check *c, struct emu_check_ent *e,
+			    int base, const struct emu_conf *cf,
+			    const struct emu_conf_key *k, int kind)
+{
+	static const uint64_t floppies[] = {
+		160, 180, 320, 360, 720, 1200, 1440, 1680, 1720, 2880,
+	};
+	struct emu_check_disk *d;
+	struct statx stx;
+	const char *name, *key;
+	char path[PATH_MAX], sec[64], pkey[32], v[64];
+	unsigned long spt, hpc, cyl;
+	uint64_t sz, want;
+	size_t i, plen;
+
+	name = emu_scan_name(&c->scan, (size_t)(e - c->ents));
+	key = cf->map + k->key_off;
+	if (k->val_len >= sizeof(path)) {
+		emu_check_say(e, name, 1, "%.*s: path is too long",
+			      (int)k->key_len, key);
+		return;
+	}
+	memcpy(path, cf->map + k->val_off, k->val_len);
+	path[k->val_len] = '\0';
+
+	/* A drive of the host, not an image. */
+	if (strncmp(path, "ioctl", 5) == 0)
+		return;
+
+	/* Relative to the directory of the config, like 86box has it. */
+	if (statx(base, path, AT_STATX_DONT_SYNC,
+		  STATX_TYPE | STATX_SIZE | STATX_INO, &stx) == -1) {
+		emu_check_say(e, name, 1, "%.*s: %s: %s", (int)k->key_len,
+			      key, path, strerror(errno));
+		return;
+	}
 
-			/* Do we have reached the end of the page? */
-		        if (end_page == 0) {
-				wclear(win);
-				wrefresh(win);
-			        move(0, 0);
-				/* Increase page size. (next page) */
-				xs += 10;
-				/* Set the selection as it's the
-				   first member in that list (next). */
-			        run_idx = xs;	
-			}
-			break;
+	if (S_ISBLK(stx.stx_mode) && kind == EMU_IMAGE_CDROM)
+		return;
+	if (!S_ISREG(stx.stx_mode)) {
+		emu_check_say(e, name, 1, "%.*s: %s: not a regular file",
+			      (int)k->key_len, key, path);
+		return;
+	}
 
-		case KEY_LEFT:
-			/* Go every 10 step back. */
+	sz = stx.stx_size;
+	if (sz == 0) {
+		emu_check_say(e, name, 1, "%.*s: %s: empty image",
+			      (int)k->key_len, key, path);
+		return;
+	}
 
-			/* Are we bigger than xs? (such as xs != 0) */ 
-			if (xs > 0) {
-				wclear(win);
-				wrefresh(win);
-			        move(0, 0);
-				/* Decrease page size. (previous page) */
-				xs -= 10;
-				/* Set the selection as it's the
-				   first member in that list (previous). */
-				run_idx = xs;
-			        end_page = 0;
-			}
+	/* The settings of the drive are under the same "<type>_<nn>_". */
+	plen = (size_t)(strchr(strchr(key, '_') + 1, '_') - key) + 1;
+	snprintf(sec, sizeof(sec), "%.*s", (int)k->sec_len,
+		 cf->map + k->sec_off);
+
+	switch (kind) {
+	case EMU_IMAGE_HDD:
+		if (emu_check_ext(path, ".vhd")) {
+			if (sz < (uint64_t)512)
+				emu_check_say(e, name, 1, "%.*s: %s: too small "
+					      "for a VHD", (int)k->key_len,
+					      key, path);
 			break;
-
-		case KEY_BACKSPACE:
-			/* Exit from the selection loop and do some
-			   after cleanup. */
-		        endwin();
-			for (; tmp_idx >= 0; tmp_idx--)
-				free(arr[tmp_idx]);
-		        free(arr);
-			free(path);
-			closedir(dir);
-			_Exit(EXIT_SUCCESS);
+		}
+		if (emu_check_ext(path, ".hdi") || emu_check_ext(path, ".hdx"))
 			break;
 
-		default:
-			break;
+		/* A raw image, "<sectors>, <heads>, <cylinders>, ...". */
+		snprintf(pkey, sizeof(pkey), "%.*sparameters", (int)plen, key);
+		if (emu_conf_copy(cf, sec, pkey, v, sizeof(v)) &&
+		    sscanf(v, "%lu , %lu , %lu", &spt, &hpc, &cyl) == 3) {
+			want = (uint64_t)spt * hpc * cyl * 512;
+			if (sz < want)
+				emu_check_say(e, name, 1, "%.*s: %s: %llu "
+					      "bytes, the geometry needs %llu",
+					      (int)k->key_len, key, path,
+					      (unsigned long long)sz,
+					      (unsigned long long)want);
 		}
+		break;
 
-		/* Break if this is a a new line or a new line is created.
-		   Apperently KEY_ENTER in ncurses is described as send.
-		   See: https://invisible-island.net/ncurses/man/curs_getch.3x.html#h2-NOTES */
-		if (ch == 10)
+	case EMU_IMAGE_FDD:
+		if (!emu_check_ext(path, ".img") && !emu_check_ext(path, ".ima") &&
+		    !emu_check_ext(path, ".flp") && !emu_check_ext(path, ".vfd") &&
+		    !emu_check_ext(path, ".dsk"))
 			break;
-	}
-	refresh();
-        endwin();
-
-	free(path);
-	path = emu_get_directory();
-	if (path == NULL) {
-		/* Free our allocated resources. */
-		for (; tmp_idx >= 0; tmp_idx--)
-			free(arr[tmp_idx]);
-		free(arr);
-	        exit(EXIT_FAILURE);
+		for (i = 0; i < sizeof(floppies) / sizeof(floppies[0]); i++)
+			if (sz == floppies[i] * 1024)
+				break;
+		if (i == sizeof(floppies) / sizeof(floppies[0]))
+			emu_check_say(e, name, 0, "%.*s: %s: %llu bytes isn't "
+				      "the size of any floppy", (int)k->key_len,
+				      key, path, (unsigned long long)sz);
+		break;
+
+	case EMU_IMAGE_CDROM:
+		if (emu_check_ext(path, ".iso") && sz % 2048 != 0)
+			emu_check_say(e, name, 0, "%.*s: %s: not made of 2048 "
+				      "byte sectors", (int)k->key_len, key,
+				      path);
+		/* Read-only, it can be shared. */
+		return;
 	}
 
-	sz = strlen(path) + strlen(arr[run_idx]) + (size_t)3;
-	p = calloc(sz, sizeof(char));
-	if (p == NULL)
-		goto out_cleanup;
+	snprintf(pkey, sizeof(pkey), "%.*swriteprot", (int)plen, key);
+	if (emu_conf_copy(cf, sec, pkey, v, sizeof(v)) && strcmp(v, "1") == 0)
+		return;
+
+	d = realloc(e->disks, (e->ndisks + 1) * sizeof(struct emu_check_disk));
+	if (d == NULL)
+		err(EXIT_FAILURE, "realloc");
+	e->disks = d;
+	d = &e->disks[e->ndisks++];
+	d->dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+	d->ino = stx.stx_ino;
+	d->cfg = (size_t)(e - c->ents);
+	d->path = strdup(path);
+	if (d->path == NULL)
+		err(EXIT_FAILURE, "strdup");
+}
 
-	snprintf(p, sz, "%s/%s", path, arr[run_idx]);
-	base = emu_basename(p);
-	if (stat(p, &st) == -1) {
-		if (errno == ENOENT)
-			fprintf(stderr,
-				"emubox: config \"%s\" does not exists.\n",
-				base);
-		else
-			warn("stat");
-		free(p);
-		goto out_cleanup;	
+/* Worker of emu_pool_run(...), checks a single config. */
+static void emu_check_worker(void *arg, size_t idx)
+{
+	const struct emu_check_sec *s;
+	const struct emu_conf_key *k;
+	struct emu_check_ent *e;
+	struct emu_check *c;
+	struct emu_conf *cf;
+	const char *name, *key, *sec;
+	char v[2], dir[PATH_MAX], *p;
+	size_t i;
+	int kind, base;
+
+	c = arg;
+	e = &c->ents[idx];
+	name = emu_scan_name(&c->scan, idx);
+	cf = emu_read_conf(c->dirfd, name);
+	if (cf == NULL) {
+		emu_check_say(e, name, 1, "%s", strerror(errno));
+		goto out;
 	}
 
-	fprintf(stdout, "emubox: using config: %s\n", base);
-	if (is_settings)
-		emu_launch_settings(p);
-	else
-		emu_launch_box(p, lang, is_fullscreen);
-	free(p);
+	/* A VM in a directory of it's own has it's images in there. */
+	base = c->dirfd;
+	p = strrchr(name, '/');
+	if (p != NULL) {
+		snprintf(dir, sizeof(dir), "%.*s", p == name ? 1 :
+			 (int)(p - name), name);
+		base = openat(c->dirfd, dir, O_RDONLY | O_DIRECTORY |
+			      O_CLOEXEC);
+		if (base == -1) {
+			emu_check_say(e, name, 1, "%s", strerror(errno));
+			emu_free_conf(cf);
+			goto out;
+		}
+	}
 
-/* Free our older allocated resources. */
-out_cleanup:
-        for (; tmp_idx >= 0; tmp_idx--)
-		free(arr[tmp_idx]);
-	free(arr);
-	free(path);
-	closedir(dir);
-}
+	if (emu_conf_copy(cf, "Machine", "machine", v, sizeof(v)) == 0)
+		emu_check_say(e, name, 0, "no machine, 86box picks one");
 
-/* Initialize the emubox directory. */
-static void emu_init_emubox(void)
-{
-	char *path;
+	for (i = 0; i < cf->nkeys; i++) {
+		k = &cf->keys[i];
+		key = cf->map + k->key_off;
+		sec = cf->map + k->sec_off;
 
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
+		/* Sections of devices have keys of their own, only the
+		   sections of 86box itself are known. */
+		for (s = emu_check_secs; s->name; s++)
+			if (strlen(s->name) == k->sec_len &&
+			    memcmp(s->name, sec, k->sec_len) == 0)
+				break;
+		if (s->name && !emu_check_match(s->keys, key, k->key_len))
+			emu_check_say(e, name, 0, "unknown key \"%.*s\" in "
+				      "[%s]", (int)k->key_len, key, s->name);
 
-	if (mkdir(path, 0700) == -1) {
-		if (errno == EEXIST)
-			fputs("emubox: "
-			      "config directory: already exists.\n",
-			      stderr);
-		else
-			warn("mkdir");
-		free(path);
-		exit(EXIT_FAILURE);
+		kind = emu_conf_image(key, k->key_len);
+		if (kind != -1 && k->val_len)
+			emu_check_image(c, e, base, cf, k, kind);
 	}
+	emu_free_conf(cf);
+	if (base != c->dirfd)
+		close(base);
+
+out:
+	if (e->out && fclose(e->out) == EOF)
+		err(EXIT_FAILURE, "fclose");
+	e->out = NULL;
+}
 
-	free(path);
+/* qsort's internal function, the images by their inode, then by the
+   config they're in. */
+static int emu_check_compare(const void *s0, const void *s1)
+{
+	const struct emu_check_disk *a, *b;
+
+	a = s0;
+	b = s1;
+	if (a->dev != b->dev)
+		return (a->dev < b->dev ? -1 : 1);
+	if (a->ino != b->ino)
+		return (a->ino < b->ino ? -1 : 1);
+	return (a->cfg < b->cfg ? -1 : a->cfg > b->cfg);
 }
 
-/* Delete all configs. */
-static void emu_bulk_purge_configs(void)
+/* Check the configs of names (or every one of them), before they're
+   launched and 86box goes away without a word. Every config is read
+   on the pool, and it's images are looked up to find the missing, the
+   empty and the ones too small for their geometry, along with keys
+   86box doesn't know of. Writable images used by more than a single
+   drive are told at the end. The report is in the order of the names.
+   Returns EXIT_FAILURE if anything is broken. */
+static int emu_check_configs(int argc, char **argv, int verbose)
 {
-	char *path, *p;
-        DIR *dir;
-	size_t sz, tsz;
-	struct dirent *den;
+	struct emu_check_disk *all, *d;
+	struct emu_check c;
+	char name[PATH_MAX], *path;
+	size_t i, j, n, len, errors, warnings, shared;
+	int ret;
 
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
+	memset(&c, 0, sizeof(c));
+	c.dirfd = emu_open_directory();
+	if (c.dirfd == -1)
+		return (EXIT_FAILURE);
+
+	ret = EXIT_SUCCESS;
+	if (argc > 0) {
+		path = emu_get_directory();
+		if (path == NULL) {
+			close(c.dirfd);
+			return (EXIT_FAILURE);
+		}
+		for (i = 0; i < (size_t)argc; i++) {
+			if (emu_config_resolve(path, argv[i], name,
+					       sizeof(name)) == -1) {
+				fprintf(stderr, "emubox: config \"%s\" does "
+					"not exists.\n", argv[i]);
+				ret = EXIT_FAILURE;
+				continue;
+			}
+			emu_scan_push(&c.scan, name, strlen(name));
+		}
+		free(path);
+		emu_scan_sort(&c.scan);
+	} else {
+		path = emu_get_directory();
+		if (path == NULL || emu_scan_load(&c.scan, path, NULL) == -1) {
+			fputs("emubox: missing config directory.\n", stderr);
+			free(path);
+			close(c.dirfd);
+			return (EXIT_FAILURE);
+		}
+		free(path);
 
-        dir = opendir(path);
-	if (dir == NULL) {
-	        fputs("emubox: missing config directory.\n",
-		      stderr);
-	        free(path);
-		exit(EXIT_FAILURE);
+		/* Disk images can be next to the configs, never map them. */
+		for (i = 0, j = 0; i < c.scan.nents; i++) {
+			len = c.scan.ents[i].name_len;
+			if (len >= (size_t)4 && strcmp(emu_scan_name(&c.scan, i) +
+						      len - 4, ".cfg") == 0)
+				c.scan.ents[j++] = c.scan.ents[i];
+		}
+		c.scan.nents = j;
 	}
 
-	sz = (size_t)0;
-	/* Size of /home/<user>/.emubox */
-        tsz = strlen(path);
-	while ((den = readdir(dir)) != NULL) {
-		if (strcmp(den->d_name, ".") == 0 ||
-		    strcmp(den->d_name, "..") == 0)
+	c.ents = calloc(c.scan.nents + 1, sizeof(struct emu_check_ent));
+	if (c.ents == NULL)
+		err(EXIT_FAILURE, "calloc");
+	emu_pool_run(c.scan.nents, emu_check_worker, &c);
+
+	errors = warnings = n = 0;
+	for (i = 0; i < c.scan.nents; i++) {
+		if (c.ents[i].report)
+			fwrite(c.ents[i].report, 1, c.ents[i].len, stdout);
+		else if (verbose)
+			fprintf(stdout, "%s: ok\n", emu_scan_name(&c.scan, i));
+		errors += c.ents[i].errors;
+		warnings += c.ents[i].warnings;
+		n += c.ents[i].ndisks;
+	}
+
+	all = malloc((n + 1) * sizeof(struct emu_check_disk));
+	if (all == NULL)
+		err(EXIT_FAILURE, "malloc");
+	for (i = 0, n = 0; i < c.scan.nents; i++) {
+		memcpy(all + n, c.ents[i].disks,
+		       c.ents[i].ndisks * sizeof(struct emu_check_disk));
+		n += c.ents[i].ndisks;
+	}
+	qsort(all, n, sizeof(struct emu_check_disk), emu_check_compare);
+
+	/* The same inode twice in a row, written through both. */
+	for (i = 0, shared = 0; i < n; i = j) {
+		for (j = i + 1; j < n && all[j].dev == all[i].dev &&
+		     all[j].ino == all[i].ino; j++)
+			;
+		if (j - i == 1)
 			continue;
 
-		if (den->d_type == DT_REG) {
-		        sz = strlen(den->d_name) + tsz + (size_t)4;
-			p = calloc(sz, sizeof(char));
-			if (p == NULL) {
-				closedir(dir);
-				free(path);
-			        err(EXIT_FAILURE, "calloc");
-			}
-			snprintf(p, sz, "%s/%s", path, den->d_name);
-		        fprintf(stdout, "emubox: deleted: %s\n", p);
-			if (unlink(p) == -1)
-				/* We can ignore other things here. */
-				warn("unlink");
-			free(p);
-		}
+		fprintf(stdout, "%s: error: %s is written by",
+			emu_scan_name(&c.scan, all[i].cfg), all[i].path);
+		for (d = all + i; d < all + j; d++)
+			fprintf(stdout, " %s%s", emu_scan_name(&c.scan, d->cfg),
+				d + 1 < all + j ? "," : "\n");
+		shared++;
 	}
+	errors += shared;
+
+	fprintf(stdout, "emubox: checked %zu configs, %zu errors, "
+		"%zu warnings\n", c.scan.nents, errors, warnings);
+	if (errors)
+		ret = EXIT_FAILURE;
+
+	for (i = 0; i < n; i++)
+		free(all[i].path);
+	free(all);
+	for (i = 0; i < c.scan.nents; i++) {
+		free(c.ents[i].report);
+		free(c.ents[i].disks);
+	}
+	free(c.ents);
+	emu_scan_free(&c.scan);
+	close(c.dirfd);
+	return (ret);
+}
 
-	/* We didn't purge anything. Assuming there's
-	   nothing to purge. */
-	if (sz == (size_t)0)
-		fputs("emubox: "
-		      "no config files are present to purge.\n",
-		      stderr);
+#ifdef EMUBOX_BENCH
+/* A xorshift generator, the benchmarks only need to be repeatable. */
+static uint64_t emu_bench_rand(uint64_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return (*seed);
+}
 
-	closedir(dir);
-        free(path);
+/* qsort's internal function, for the samples. */
+static int emu_bench_compare(const void *s0, const void *s1)
+{
+	uint64_t a, b;
+
+	a = *(const uint64_t *)s0;
+	b = *(const uint64_t *)s1;
+	return (a < b ? -1 : a > b);
 }
 
-/* Delete a single config. */
-static void emu_purge_config(const char *name)
+/* Show a single measurement, as a JSON line. Every sample handled
+   items of unit, that's where the throughput comes from. */
+static void emu_bench_report(const char *name, size_t nents, uint64_t *ns,
+			     size_t n, size_t items, const char *unit)
 {
-	char *path, *p;
-	size_t sz, lsz;
-	struct stat st;
+	uint64_t total;
+	size_t i;
+
+	qsort(ns, n, sizeof(uint64_t), emu_bench_compare);
+	for (i = 0, total = 0; i < n; i++)
+		total += ns[i];
+
+	fprintf(stdout, "{\"bench\":\"%s\",\"entries\":%zu,\"samples\":%zu,"
+		"\"p50_ms\":%.4f,\"p99_ms\":%.4f,\"throughput\":%.0f,"
+		"\"unit\":\"%s/s\"}\n", name, nents, n,
+		(double)ns[n / 2] / 1e6, (double)ns[(n * 99) / 100] / 1e6,
+		total ? (double)items * (double)n * 1e9 / (double)total : 0.0,
+		unit);
+	fflush(stdout);
+}
 
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
+/* Fill an empty directory with n configs, the names start with a
+   random part, so they aren't in order. */
+static int emu_bench_generate(int dirfd, size_t n, uint64_t *seed)
+{
+	char name[64];
+	size_t i;
+	int fd;
 
-	sz = strlen(path) + strlen(name) + (size_t)7;
-	p = calloc(sz, sizeof(char));
-	if (p == NULL) {
-		free(path);
-	        err(EXIT_FAILURE, "calloc");
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "%08x-win98-%zu.cfg",
+			 (unsigned int)emu_bench_rand(seed), i);
+		fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL |
+			    O_CLOEXEC, S_IRUSR | S_IWUSR);
+		if (fd == -1) {
+			warn("open: %s", name);
+			return (-1);
+		}
+		close(fd);
 	}
 
-	snprintf(p, sz, "%s/%s", path, name);
+	return (0);
+}
 
-	/* Check whether the name actually has
-	   a ".cfg" file extension. We can't do
-	   that for entire buffer as there might
-	   be users' whose name also contains ".cfg". */
-	if (strstr(name, ".cfg") == NULL) {
-	        lsz = strlen(p);
-		memcpy(p + lsz, ".cfg", (size_t)4);
-		if (stat(p, &st) == -1)
-			if (errno == ENOENT)
-				p[lsz] = '\0';
+/* Render frames of the menu on a dummy terminal, always an xterm
+   going nowhere, so the results are comparable. The first frame is a
+   whole page, every other one is a single step, or a jump to some
+   other page from time to time, like a user would do. */
+static int emu_bench_render(struct emu_scan *scan, uint64_t *ns, size_t n,
+			    uint64_t *seed)
+{
+	struct content_len_info clinfo;
+	struct emu_menu menu;
+	SCREEN *scr;
+	FILE *out, *in;
+	uint64_t t, r;
+	size_t i, idx;
+
+	out = fopen("/dev/null", "w");
+	in = fopen("/dev/null", "r");
+	scr = out && in ? newterm("xterm", out, in) : NULL;
+	if (scr == NULL) {
+		fputs("emubox: bench: couldn't set up a dummy terminal.\n",
+		      stderr);
+		if (out)
+			fclose(out);
+		if (in)
+			fclose(in);
+		return (-1);
 	}
-
-	if (unlink(p) == -1) {
-		if (errno == ENOENT)
-			fprintf(stderr,
-				"emubox: unknown config file: %s\n",
-				name);
+	set_term(scr);
+
+	emu_content_len(scan, &clinfo);
+	memset(&menu, 0, sizeof(menu));
+	menu.scan = scan;
+	menu.dirfd = -1;
+	menu.watch.fd = -1;
+	menu.num_w = (int)clinfo.num_sz;
+	menu.rows = (int)clinfo.column_sz;
+	menu.cols = (int)clinfo.row_sz;
+	if (menu.cols > COLS)
+		menu.cols = COLS;
+	menu.win = newwin(menu.rows, menu.cols, 0, 0);
+	menu.nview = scan->nents;
+	menu.dir = 1;
+
+	t = emu_stats_now();
+	emu_menu_frame(&menu);
+	emu_menu_page(&menu);
+	wnoutrefresh(menu.win);
+	doupdate();
+	ns[0] = emu_stats_now() - t;
+
+	for (i = 1; i < n; i++) {
+		r = emu_bench_rand(seed);
+		if (r % 16 == 0)
+			idx = (size_t)(r >> 8) % menu.nview;
+		else if (r % 4 == 0 && menu.run_idx > 0)
+			idx = menu.run_idx - (size_t)1;
 		else
-			warn("unlink");
+			idx = (menu.run_idx + (size_t)1) % menu.nview;
 
-		exit(EXIT_FAILURE);
+		t = emu_stats_now();
+		emu_menu_move(&menu, idx);
+		wnoutrefresh(menu.win);
+		doupdate();
+		ns[i] = emu_stats_now() - t;
 	}
 
-	fprintf(stdout, "emubox: deleted config: %s\n",
-		emu_basename(p));
-	free(p);
-	free(path);
+	delwin(menu.win);
+	endwin();
+	delscreen(scr);
+	fclose(out);
+	fclose(in);
+	return (0);
 }
 
-/* Create a new emubox config. */
-static void emu_create_new(const char *name)
+/* Benchmark a directory of n configs, inside of rootfd. */
+static int emu_bench_size(int rootfd, size_t n, uint64_t *seed)
 {
-	int fd;
-	size_t sz;
-	char *path, *fmt, *p;
-	struct stat st;
-
-	path = emu_get_directory();
-	if (path == NULL)
-		exit(EXIT_FAILURE);
-
-	sz = strlen(path) + strlen(name) + (size_t)10;
-	p = calloc(sz, sizeof(char));
-	if (p == NULL) {
-		free(path);
-	        err(EXIT_FAILURE, "calloc");
+	uint64_t ns[EMU_BENCH_RUNS], *frames, t;
+	struct content_len_info clinfo;
+	struct emu_scan scan, tmp;
+	struct emu_entry ent;
+	char name[32];
+	size_t runs, r, i, j;
+	int dirfd, fd, ret;
+
+	snprintf(name, sizeof(name), "n%zu", n);
+	if (mkdirat(rootfd, name, 0700) == -1 ||
+	    (dirfd = openat(rootfd, name, O_RDONLY | O_DIRECTORY |
+			    O_CLOEXEC)) == -1) {
+		warn("mkdir: %s", name);
+		return (-1);
 	}
 
-	if (strstr(name, ".cfg") == NULL)
-		fmt = "%s/%s.cfg";
-	else
-		fmt = "%s/%s";
+	fprintf(stderr, "emubox: bench: generating %zu configs\n", n);
+	if (emu_bench_generate(dirfd, n, seed) == -1) {
+		close(dirfd);
+		return (-1);
+	}
 
-	snprintf(p, sz, fmt, path, name);
+	/* Large directories take long enough to be stable. */
+	runs = (size_t)2000000 / n;
+	if (runs < (size_t)3)
+		runs = 3;
+	if (runs > (size_t)EMU_BENCH_RUNS)
+		runs = EMU_BENCH_RUNS;
+
+	/* The readdir loop, and the layout of the menu. */
+	memset(&scan, 0, sizeof(scan));
+	for (r = 0; r < runs; r++) {
+		emu_scan_free(&scan);
+		t = emu_stats_now();
+		emu_scan_directory(&scan, dirfd);
+		emu_content_len(&scan, &clinfo);
+		ns[r] = emu_stats_now() - t;
+	}
+	emu_bench_report("scan", n, ns, runs, n, "entries");
+
+	/* The sort, on an entry table shuffled every time. */
+	for (r = 0; r < runs; r++) {
+		for (i = scan.nents; i > (size_t)1; i--) {
+			j = (size_t)emu_bench_rand(seed) % i;
+			ent = scan.ents[i - 1];
+			scan.ents[i - 1] = scan.ents[j];
+			scan.ents[j] = ent;
+		}
 
-	/* Check whether the file already exists. */
-	if (stat(p, &st) == 0) {
-	        fprintf(stderr,
-			"emubox: file \"%s\" already exists.\n",
-			emu_basename(p));
-		goto out_last_cleanup;
+		t = emu_stats_now();
+		emu_scan_sort(&scan);
+		ns[r] = emu_stats_now() - t;
 	}
+	emu_bench_report("sort", n, ns, runs, n, "entries");
 
-	/* If the file doesn't exist, create one. */
-	fd = open(p, O_CREAT, S_IRWXU);
-	if (fd == -1) {
-	        warn("open");
-		goto out_last_cleanup;
+	/* The modification times, which a rebuilt index needs. */
+	for (r = 0; r < runs; r++) {
+		t = emu_stats_now();
+		emu_scan_stamp(&scan, dirfd);
+		ns[r] = emu_stats_now() - t;
+	}
+	emu_bench_report("stamp", n, ns, runs, n, "entries");
+
+	/* Loading the index, which is what a launch usually does. Creating
+	   it has just changed the directory, an index written within a
+	   tick of that isn't trusted, it's written again a second later. */
+	fd = emu_index_open(dirfd);
+	if (fd != -1) {
+		emu_index_write(fd, dirfd, &scan);
+		ret = emu_index_read(fd, dirfd, &tmp);
+		if (ret == -1) {
+			sleep(1);
+			emu_index_write(fd, dirfd, &scan);
+			ret = emu_index_read(fd, dirfd, &tmp);
+		}
+		if (ret == 0)
+			emu_scan_free(&tmp);
+
+		for (r = 0; ret == 0 && r < runs; r++) {
+			t = emu_stats_now();
+			ret = emu_index_read(fd, dirfd, &tmp);
+			ns[r] = emu_stats_now() - t;
+			if (ret == 0)
+				emu_scan_free(&tmp);
+		}
+		close(fd);
+		if (ret == 0)
+			emu_bench_report("index", n, ns, runs, n, "entries");
+		else
+			fputs("emubox: bench: the index isn't read back, "
+			      "skipped.\n", stderr);
+		ret = 0;
 	}
 
-	fprintf(stdout,
-		"emubox: done: created \"%s\".\n",
-		emu_basename(p));
-	close(fd);
+	frames = malloc(EMU_BENCH_FRAMES * sizeof(uint64_t));
+	if (frames == NULL)
+		err(EXIT_FAILURE, "malloc");
+	ret = emu_bench_render(&scan, frames, EMU_BENCH_FRAMES, seed);
+	if (ret == 0)
+		emu_bench_report("render", n, frames, EMU_BENCH_FRAMES,
+				 1, "frames");
+
+	free(frames);
+	emu_scan_free(&scan);
+	close(dirfd);
+	return (ret);
+}
 
-out_last_cleanup:
-	free(p);
-	free(path);
+/* Benchmark the scan, the sort, the index and the menu, on generated
+   directories of every size in sizes (a comma separated list). Every
+   result is a JSON line, to be kept track of over time. */
+static int emu_bench(const char *sizes)
+{
+	char root[PATH_MAX], *end;
+	const char *tmpdir, *p;
+	unsigned long long n;
+	uint64_t seed;
+	int rootfd, ret;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(root, sizeof(root), "%s/emubox-bench.XXXXXX",
+		 tmpdir ? tmpdir : "/tmp");
+	if (mkdtemp(root) == NULL ||
+	    (rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		err(EXIT_FAILURE, "mkdtemp");
+
+	ret = EXIT_SUCCESS;
+	seed = 0x9e3779b97f4a7c15ULL;
+	for (p = sizes ? sizes : EMU_BENCH_SIZES; *p; p = end) {
+		n = strtoull(p, &end, 10);
+		if (end == p || n == 0 || (*end != ',' && *end != '\0')) {
+			fprintf(stderr, "emubox: bench: invalid size: %s\n",
+				p);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		if (*end == ',')
+			end++;
+
+		if (emu_bench_size(rootfd, (size_t)n, &seed) == -1)
+			ret = EXIT_FAILURE;
+	}
+
+	close(rootfd);
+	emu_remove_tree(root);
+	return (ret);
 }
+#endif /* EMUBOX_BENCH */
 
 /* Show the usage. */
 static void usage(int status)
@@ -828,32 +11074,85 @@ static void usage(int status)
 		"emubox\n"
 		"   --init\t- Initialize emubox directory\n"
 		"   --new\t- Create one or more new configuration file(s)\n"
+		"   --template\t- Fill the new configuration file(s) from a preset\n"
+		"          \t  (486-dos, p2-win98) or from a file\n"
 		"   --delete\t- Delete one or more existing configuration file(s)\n"
+		"   --clone\t- Clone a configuration and it's disk images, as\n"
+		"          \t  --clone <config> <new config(s)>\n"
 		"   --purge\t- Purge all configuration file(s)\n"
+		"   --reclaim\t- Also purge their disk images and NVR files\n"
 		"   --select\t- Select a configuration from a ncurses driven menu\n"
+		"   --launch\t- Launch a configuration (or VM folder) by it's\n"
+		"          \t  name, without the menu, as --launch <name>\n"
 		"   --settings\t- Open 86box settings panel\n"
 		"   --fullscreen\t- Enable fullscreen before launching 86box\n"
 		"   --fsr\t- Alias of --fullscreen\n"
 		"   --language\t- Set a language before launching 86box\n"
-		"   --help\t- Show this menu\n",
-		status == EXIT_FAILURE ? stderr : stdout);
+		"   --extract\t- Run 86box from a cached extraction of the AppImage\n"
+		"   --cgroup\t- Run every VM in a cgroup of it's own, and show\n"
+		"          \t  it's usage every N seconds with --cgroup=N\n"
+		"   --monitor\t- Show the CPU, memory and I/O of the launched VMs\n"
+		"          \t  live, every N seconds with --monitor=N\n"
+		"   --stats\t- Show how long every phase of a launch took,\n"
+		"          \t  as JSON lines with --stats=json\n"
+		"   --list\t- List every configuration, without the menu\n"
+		"   --format\t- Output of --list, tsv (default) or json\n"
+		"   --fields\t- Fields of --list, any of name (default),\n"
+		"          \t  machine, cpu, mem and mtime, like name,cpu\n"
+		"   --sort\t- Order the menu (or --list) by name, mtime,\n"
+		"          \t  launched or frecency (most used lately first),\n"
+		"          \t  Tab changes it in the menu\n"
+		"   --daemon\t- Run emuboxd, which keeps the configs and the VMs\n"
+		"          \t  it starts in memory, for --select, --list and --vms\n"
+		"   --vms\t- List the VMs running under emuboxd (--format)\n"
+		"   --check\t- Check configuration file(s) and their disk images,\n"
+		"          \t  every one of them unless they're named\n"
+		"   --emulators\t- List the 86box builds a VM can run with, as\n"
+		"          \t  emulator = <name> of it's .props (--format)\n"
+		"   --verbose\t- Show every purged (or checked) file\n"
+		"   --help\t- Show this menu\n"
+#ifdef EMUBOX_BENCH
+		"   --bench\t- Benchmark the menu on generated directories,\n"
+		"          \t  --bench=1000,10000 for other sizes\n"
+#endif
+		, status == EXIT_FAILURE ? stderr : stdout);
 	exit(status);
 }
 
 int main(int argc, char **argv)
 {
-	int opt, i;
-	char *lang;
+	int opt;
+	long n;
+	char *lang, *end, *first, extracted[PATH_MAX];
+	const char *bin;
+	struct emu_stats stats;
 	struct option long_options[] = {
 		{ "init",        no_argument,        NULL, OPT_INIT },
 		{ "new",         required_argument,  NULL, OPT_NEW },
 		{ "delete",      required_argument,  NULL, OPT_DELETE },
+		{ "clone",       required_argument,  NULL, OPT_CLONE },
+		{ "template",    required_argument,  NULL, OPT_TEMPLATE },
+		{ "list",        no_argument,        NULL, OPT_LIST },
+		{ "format",      required_argument,  NULL, OPT_FORMAT },
+		{ "fields",      required_argument,  NULL, OPT_FIELDS },
 		{ "purge",       no_argument,        NULL, OPT_PURGE },
 		{ "select",      no_argument,        NULL, OPT_SELECT },
 		{ "settings",    no_argument,        NULL, OPT_SETTINGS },
 		{ "fsr",         no_argument,        NULL, OPT_FULLSCREEN },
 		{ "fullscreen",  no_argument,        NULL, OPT_FULLSCREEN },
 		{ "language",    required_argument,  NULL, OPT_LANGUAGE },
+		{ "reclaim",     no_argument,        NULL, OPT_RECLAIM },
+		{ "verbose",     no_argument,        NULL, OPT_VERBOSE },
+		{ "extract",     no_argument,        NULL, OPT_EXTRACT },
+		{ "stats",       optional_argument,  NULL, OPT_STATS },
+		{ "sort",        required_argument,  NULL, OPT_SORT },
+		{ "cgroup",      optional_argument,  NULL, OPT_CGROUP },
+		{ "daemon",      no_argument,        NULL, OPT_DAEMON },
+		{ "vms",         no_argument,        NULL, OPT_VMS },
+		{ "check",       no_argument,        NULL, OPT_CHECK },
+		{ "monitor",     optional_argument,  NULL, OPT_MONITOR },
+		{ "emulators",   no_argument,        NULL, OPT_EMULATORS },
+		{ "launch",      required_argument,  NULL, OPT_LAUNCH },
 		{ "help",        no_argument,        NULL, OPT_HELP },
 		{ NULL,          0,                  NULL, 0 },
 	};
@@ -864,12 +11163,21 @@ int main(int argc, char **argv)
 	    strcmp(argv[1], "--") == 0)
 		usage(EXIT_FAILURE);
 
+	/* Everything --stats shows is relative to this. */
+	memset(&stats, 0, sizeof(stats));
+	stats.start = emu_stats_now();
+
 	/* Set no default locale. */
 	setlocale(LC_ALL, "");
-	/* Check if 86box exists in specified path. */
-	emu_is_86box();
-
+#ifdef EMUBOX_BENCH
+	/* --bench[=sizes] needs neither 86box nor the config directory. */
+	if (strncmp(argv[1], "--bench", 7) == 0 &&
+	    (argv[1][7] == '\0' || argv[1][7] == '='))
+		exit(emu_bench(argv[1][7] == '=' ? argv[1] + 8 : NULL));
+#endif
 	lang = NULL;
+	first = NULL;
+	opts.sort_opt = -1;
         while ((opt = getopt_long(
 			argc, argv, "", long_options, NULL)) != -1) {
 
@@ -880,12 +11188,40 @@ int main(int argc, char **argv)
 
 		case OPT_NEW:
 			opts.new_opt = 1;
+			first = optarg;
 			break;
 
 		case OPT_DELETE:
 			opts.delete_opt = 1;
+			first = optarg;
 		        break;
 
+		case OPT_CLONE:
+			opts.clone_opt = 1;
+			first = optarg;
+			break;
+
+		case OPT_TEMPLATE:
+			opts.template_opt = optarg;
+			break;
+
+		case OPT_LIST:
+			opts.list_opt = 1;
+			break;
+
+		case OPT_FORMAT:
+			if (strcmp(optarg, "tsv") == 0)
+				opts.format_opt = EMU_LIST_TSV;
+			else if (strcmp(optarg, "json") == 0)
+				opts.format_opt = EMU_LIST_JSON;
+			else
+				usage(EXIT_FAILURE);
+			break;
+
+		case OPT_FIELDS:
+			opts.fields_opt = optarg;
+			break;
+
 		case OPT_PURGE:
 			opts.purge_opt = 1;
 		        break;
@@ -906,6 +11242,83 @@ int main(int argc, char **argv)
 			lang = optarg;
 			break;
 
+		case OPT_RECLAIM:
+			opts.reclaim_opt = 1;
+			break;
+
+		case OPT_VERBOSE:
+			opts.verbose_opt = 1;
+			break;
+
+		case OPT_EXTRACT:
+			opts.extract_opt = 1;
+			break;
+
+		case OPT_STATS:
+			if (optarg == NULL)
+				opts.stats_opt = EMU_STATS_TEXT;
+			else if (strcmp(optarg, "json") == 0)
+				opts.stats_opt = EMU_STATS_JSON;
+			else
+				usage(EXIT_FAILURE);
+			break;
+
+		case OPT_SORT:
+			if (strcmp(optarg, "name") == 0)
+				opts.sort_opt = EMU_SORT_NAME;
+			else if (strcmp(optarg, "mtime") == 0)
+				opts.sort_opt = EMU_SORT_MTIME;
+			else if (strcmp(optarg, "launched") == 0)
+				opts.sort_opt = EMU_SORT_LAUNCHED;
+			else if (strcmp(optarg, "frecency") == 0)
+				opts.sort_opt = EMU_SORT_FRECENCY;
+			else
+				usage(EXIT_FAILURE);
+			break;
+
+		case OPT_CGROUP:
+			opts.cgroup_opt = 1;
+			if (optarg) {
+				n = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || n < 1 ||
+				    n > 86400)
+					usage(EXIT_FAILURE);
+				opts.cgroup_period = (int)n;
+			}
+			break;
+
+		case OPT_DAEMON:
+			opts.daemon_opt = 1;
+			break;
+
+		case OPT_VMS:
+			opts.vms_opt = 1;
+			break;
+
+		case OPT_CHECK:
+			opts.check_opt = 1;
+			break;
+
+		case OPT_EMULATORS:
+			opts.emulators_opt = 1;
+			break;
+
+		case OPT_LAUNCH:
+			opts.launch_opt = optarg;
+			break;
+
+		case OPT_MONITOR:
+			opts.monitor_opt = 1;
+			opts.monitor_period = EMU_MONITOR_PERIOD;
+			if (optarg) {
+				n = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || n < 1 ||
+				    n > 3600)
+					usage(EXIT_FAILURE);
+				opts.monitor_period = (int)n;
+			}
+			break;
+
 		case OPT_HELP:
 			usage(EXIT_SUCCESS);
 			/* FALLTHROUGH */
@@ -915,10 +11328,22 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* The argument of --new, --delete or --clone goes in front of
+	   the others, which getopt has moved after every option. */
 	optind--;
+	if (first)
+		argv[optind] = first;
 	argc -= optind;
 	argv += optind;
 
+	/* Check if 86box exists in specified path, --list and --vms
+	   can be answered by emuboxd without looking at anything, and
+	   --check only reads the configs. --emulators tells about the
+	   missing ones itself. */
+	if (opts.list_opt == 0 && opts.vms_opt == 0 && opts.check_opt == 0 &&
+	    opts.emulators_opt == 0)
+		emu_is_86box();
+
 	/* --init */
 	if (opts.init_opt) {
 	        emu_init_directory();
@@ -926,59 +11351,76 @@ int main(int argc, char **argv)
 	}
 
 	/* --new */
-	if (opts.new_opt) {
-		for (i = 0; i < argc; i++) {
-			switch (argv[i][0]) {
-			case '-':
-			case '/':
-			case '\\':
-				fputs("emubox: "
-				      "an unexpected character was passed."
-				      " Ignored.\n",
-				      stderr);
-				continue;
-
-			default:
-				emu_create_new(argv[i]);
-			}
-	        }
-		goto out_ok;
-	}
+	if (opts.new_opt)
+		exit(emu_batch_configs(argc, argv, 0, opts.template_opt));
 
 	/* --delete */
-	if (opts.delete_opt) {
-		for (i = 0; i < argc; i++) {
-			switch (argv[i][0]) {
-			case '-':
-			case '/':
-			case '\\':
-				continue;
+	if (opts.delete_opt)
+		exit(emu_batch_configs(argc, argv, 1, NULL));
 
-			default:
-				emu_purge_config(argv[i]);
-			}
-		}
-		goto out_ok;
-	}
+	/* --clone */
+	if (opts.clone_opt)
+		exit(emu_clone_configs(argc, argv));
+
+	/* --list */
+	if (opts.list_opt)
+		exit(emu_list_configs(opts.format_opt, opts.fields_opt,
+				      opts.sort_opt));
+
+	/* --vms */
+	if (opts.vms_opt)
+		exit(emu_daemon_vms(opts.format_opt));
+
+	/* --emulators */
+	if (opts.emulators_opt)
+		exit(emu_emulators_list(opts.format_opt));
+
+	/* --check, every name after the options. */
+	if (opts.check_opt)
+		exit(emu_check_configs(argc - 1, argv + 1, opts.verbose_opt));
 
 	/* --purge */
-	if (opts.purge_opt) {
-		emu_bulk_purge_configs();
-		goto out_ok;
-	}
+	if (opts.purge_opt)
+		exit(emu_bulk_purge_configs(opts.reclaim_opt,
+					    opts.verbose_opt));
+
+	stats.format = opts.stats_opt;
+
+	/* --extract, falls back to the AppImage itself. */
+	bin = PATH_86BOX;
+	if ((opts.select_opt || opts.settings_opt || opts.daemon_opt ||
+	     opts.launch_opt) && opts.extract_opt &&
+	    emu_appimage_cache(extracted, sizeof(extracted)) == 0)
+		bin = extracted;
+
+	/* --daemon */
+	if (opts.daemon_opt)
+		exit(emu_daemon_run(bin));
+
+	/* --launch, before --select, it's what a script asks for. */
+	if (opts.launch_opt)
+		exit(emu_launch_name(bin, opts.launch_opt, lang,
+				     opts.fullscreen_opt,
+				     opts.cgroup_opt ? opts.cgroup_period : -1,
+				     opts.monitor_opt ? opts.monitor_period : 0));
 
 	/* --select */
-	if (opts.select_opt) {
-	        emu_select_list(lang ? lang : NULL, opts.fullscreen_opt, 0);
-		goto out_ok;
-	}
+	if (opts.select_opt)
+	        exit(emu_select_list(bin, lang ? lang : NULL,
+				     opts.fullscreen_opt, 0,
+				     opts.sort_opt < 0 ? EMU_SORT_NAME :
+				     opts.sort_opt,
+				     opts.cgroup_opt ? opts.cgroup_period : -1,
+				     opts.monitor_opt ? opts.monitor_period : 0,
+				     opts.stats_opt ? &stats : NULL));
 
 	/* --settings */
-	if (opts.settings_opt) {
-		/* All other arguments, except settings, are ignored here. */
-		emu_select_list(NULL, 0, opts.settings_opt);
-		goto out_ok;
-	}
+	/* All other arguments, except settings, are ignored here. */
+	if (opts.settings_opt)
+		exit(emu_select_list(bin, NULL, 0, opts.settings_opt,
+				     opts.sort_opt < 0 ? EMU_SORT_NAME :
+				     opts.sort_opt, -1, 0,
+				     opts.stats_opt ? &stats : NULL));
 
 out_ok:
         exit(EXIT_SUCCESS);